@@ -30,6 +30,8 @@
 #define CHAR_DEVICE_WRITE_TO_TIMEOUT 100
 #define RED_CHAR_DEVICE_WAIT_TOKENS_TIMEOUT 30000
 #define MAX_POOL_SIZE (10 * 64 * 1024)
+/* the most buffers handed to the device in a single writev() */
+#define CHAR_DEVICE_WRITEV_MAX_BUFS 16
 
 typedef enum {
     WRITE_BUFFER_ORIGIN_NONE,
@@ -71,6 +73,7 @@ struct RedCharDevicePrivate {
     RedCharDeviceWriteBuffer *cur_write_buf;
     uint8_t *cur_write_buf_pos;
     SpiceTimer *write_to_dev_timer;
+    SpiceWatch *write_watch; /* for the devices telling the fd they write to */
     uint64_t num_self_tokens;
 
     GList *clients; /* list of RedCharDeviceClient */
@@ -82,6 +85,14 @@ struct RedCharDevicePrivate {
     int during_write_to_device;
 
     SpiceServer *reds;
+
+    /* set up for the first instance attached, see
+     * red_char_device_init_device_instance() */
+    bool stat_initialized;
+    RedStatNode stat;
+    RedStatCounter write_bytes_counter;
+    RedStatCounter writes_counter;
+    RedStatCounter short_writes_counter;
 };
 
 G_DEFINE_TYPE(RedCharDevice, red_char_device, G_TYPE_OBJECT)
@@ -98,6 +109,7 @@ enum {
 
 static void red_char_device_write_buffer_unref(RedCharDeviceWriteBuffer *write_buf);
 static void red_char_device_write_retry(void *opaque);
+static void red_char_device_write_ready(int fd, int event, void *opaque);
 
 static RedPipeItem *
 red_char_device_read_one_msg_from_device(RedCharDevice *dev)
@@ -454,9 +466,90 @@ static void red_char_device_client_tokens_add(RedCharDevice *dev,
     }
 }
 
+/* Gathers the current write buffer, from the write position, and the buffers
+ * queued after it. Returns the number of buffers, their size in @write_len. */
+static int red_char_device_get_write_iov(RedCharDevice *dev, struct iovec *iov,
+                                         RedCharDeviceWriteBuffer **bufs, uint32_t *write_len)
+{
+    RedCharDeviceWriteBuffer *buf = dev->priv->cur_write_buf;
+    GList *l;
+    int iovcnt = 0;
+
+    iov[0].iov_base = dev->priv->cur_write_buf_pos;
+    iov[0].iov_len = buf->buf + buf->buf_used - dev->priv->cur_write_buf_pos;
+    bufs[iovcnt++] = buf;
+    *write_len = iov[0].iov_len;
+
+    /* the queue is consumed from its tail */
+    for (l = g_queue_peek_tail_link(&dev->priv->write_queue);
+         l && iovcnt < CHAR_DEVICE_WRITEV_MAX_BUFS; l = l->prev) {
+        buf = l->data;
+        iov[iovcnt].iov_base = buf->buf;
+        iov[iovcnt].iov_len = buf->buf_used;
+        bufs[iovcnt++] = buf;
+        *write_len += buf->buf_used;
+    }
+
+    return iovcnt;
+}
+
+/* Moves the write position @n bytes further, releasing the buffers that
+ * were written entirely. @bufs are the buffers the bytes were taken from. */
+static void red_char_device_write_consume(RedCharDevice *dev, uint32_t n,
+                                          RedCharDeviceWriteBuffer **bufs, int nbufs)
+{
+    int i = 0;
+
+    for (;;) {
+        RedCharDeviceWriteBuffer *buf = dev->priv->cur_write_buf;
+        uint32_t left = buf->buf + buf->buf_used - dev->priv->cur_write_buf_pos;
+
+        if (n < left) {
+            dev->priv->cur_write_buf_pos += n;
+            return;
+        }
+        n -= left;
+        red_char_device_write_buffer_release(dev, &dev->priv->cur_write_buf);
+        if (!n) {
+            return;
+        }
+
+        /* the queue only grows at its head while the buffers are released,
+         * the next written buffer is still at its tail */
+        i++;
+        spice_assert(i < nbufs);
+        dev->priv->cur_write_buf = g_queue_pop_tail(&dev->priv->write_queue);
+        spice_assert(dev->priv->cur_write_buf == bufs[i]);
+        dev->priv->cur_write_buf_pos = dev->priv->cur_write_buf->buf;
+    }
+}
+
+/* waits for the device to accept more data */
+static void red_char_device_write_wait(RedCharDevice *dev)
+{
+    if (dev->priv->write_watch) {
+        reds_core_watch_update_mask(dev->priv->reds, dev->priv->write_watch,
+                                    SPICE_WATCH_EVENT_WRITE);
+    } else if (dev->priv->write_to_dev_timer) {
+        reds_core_timer_start(dev->priv->reds, dev->priv->write_to_dev_timer,
+                              CHAR_DEVICE_WRITE_TO_TIMEOUT);
+    }
+}
+
+static void red_char_device_write_wait_cancel(RedCharDevice *dev)
+{
+    if (dev->priv->write_watch) {
+        reds_core_watch_update_mask(dev->priv->reds, dev->priv->write_watch, 0);
+    }
+    if (dev->priv->write_to_dev_timer) {
+        reds_core_timer_cancel(dev->priv->reds, dev->priv->write_to_dev_timer);
+    }
+}
+
 static int red_char_device_write_to_device(RedCharDevice *dev)
 {
     SpiceCharDeviceInterface *sif;
+    bool use_writev;
     int total = 0;
     int n;
 
@@ -471,13 +564,15 @@ static int red_char_device_write_to_device(RedCharDevice *dev)
 
     g_object_ref(dev);
 
-    if (dev->priv->write_to_dev_timer) {
-        reds_core_timer_cancel(dev->priv->reds, dev->priv->write_to_dev_timer);
-    }
+    red_char_device_write_wait_cancel(dev);
 
     sif = spice_char_device_get_interface(dev->priv->sin);
+    use_writev = sif->base.minor_version >= 4 && sif->writev;
     while (dev->priv->running) {
+        struct iovec iov[CHAR_DEVICE_WRITEV_MAX_BUFS];
+        RedCharDeviceWriteBuffer *bufs[CHAR_DEVICE_WRITEV_MAX_BUFS];
         uint32_t write_len;
+        int nbufs = 1;
 
         if (!dev->priv->cur_write_buf) {
             dev->priv->cur_write_buf = g_queue_pop_tail(&dev->priv->write_queue);
@@ -486,9 +581,15 @@ static int red_char_device_write_to_device(RedCharDevice *dev)
             dev->priv->cur_write_buf_pos = dev->priv->cur_write_buf->buf;
         }
 
-        write_len = dev->priv->cur_write_buf->buf + dev->priv->cur_write_buf->buf_used -
-                    dev->priv->cur_write_buf_pos;
-        n = sif->write(dev->priv->sin, dev->priv->cur_write_buf_pos, write_len);
+        if (use_writev) {
+            nbufs = red_char_device_get_write_iov(dev, iov, bufs, &write_len);
+            n = sif->writev(dev->priv->sin, iov, nbufs);
+        } else {
+            bufs[0] = dev->priv->cur_write_buf;
+            write_len = dev->priv->cur_write_buf->buf + dev->priv->cur_write_buf->buf_used -
+                        dev->priv->cur_write_buf_pos;
+            n = sif->write(dev->priv->sin, dev->priv->cur_write_buf_pos, write_len);
+        }
         if (n <= 0) {
             if (dev->priv->during_write_to_device > 1) {
                 dev->priv->during_write_to_device = 1;
@@ -498,20 +599,17 @@ static int red_char_device_write_to_device(RedCharDevice *dev)
             break;
         }
         total += n;
-        write_len -= n;
-        if (!write_len) {
-            red_char_device_write_buffer_release(dev, &dev->priv->cur_write_buf);
-            continue;
+        stat_inc_counter(dev->priv->writes_counter, 1);
+        stat_inc_counter(dev->priv->write_bytes_counter, n);
+        if ((uint32_t)n < write_len) {
+            stat_inc_counter(dev->priv->short_writes_counter, 1);
         }
-        dev->priv->cur_write_buf_pos += n;
+        red_char_device_write_consume(dev, n, bufs, nbufs);
     }
     /* retry writing as long as the write queue is not empty */
     if (dev->priv->running) {
         if (dev->priv->cur_write_buf) {
-            if (dev->priv->write_to_dev_timer) {
-                reds_core_timer_start(dev->priv->reds, dev->priv->write_to_dev_timer,
-                                      CHAR_DEVICE_WRITE_TO_TIMEOUT);
-            }
+            red_char_device_write_wait(dev);
         } else {
             spice_assert(g_queue_is_empty(&dev->priv->write_queue));
         }
@@ -532,6 +630,14 @@ static void red_char_device_write_retry(void *opaque)
     red_char_device_write_to_device(dev);
 }
 
+static void red_char_device_write_ready(int fd, int event, void *opaque)
+{
+    RedCharDevice *dev = opaque;
+
+    reds_core_watch_update_mask(dev->priv->reds, dev->priv->write_watch, 0);
+    red_char_device_write_to_device(dev);
+}
+
 static RedCharDeviceWriteBuffer *__red_char_device_write_buffer_get(
     RedCharDevice *dev, RedClient *client,
     int size, WriteBufferOrigin origin, int migrated_data_tokens)
@@ -813,9 +919,7 @@ void red_char_device_stop(RedCharDevice *dev)
     spice_debug("char device %p", dev);
     dev->priv->running = FALSE;
     dev->priv->active = FALSE;
-    if (dev->priv->write_to_dev_timer) {
-        reds_core_timer_cancel(dev->priv->reds, dev->priv->write_to_dev_timer);
-    }
+    red_char_device_write_wait_cancel(dev);
 }
 
 void red_char_device_reset(RedCharDevice *dev)
@@ -1003,14 +1107,29 @@ static void red_char_device_init_device_instance(RedCharDevice *self)
 
     reds_core_timer_remove(self->priv->reds, self->priv->write_to_dev_timer);
     self->priv->write_to_dev_timer = NULL;
+    if (self->priv->write_watch) {
+        reds_core_watch_remove(self->priv->reds, self->priv->write_watch);
+        self->priv->write_watch = NULL;
+    }
 
     if (self->priv->sin == NULL) {
        return;
     }
 
     sif = spice_char_device_get_interface(self->priv->sin);
-    if (sif->base.minor_version <= 2 ||
-        !(sif->flags & SPICE_CHAR_DEVICE_NOTIFY_WRITABLE)) {
+    if (sif->base.minor_version >= 4 && sif->get_write_fd) {
+        int fd = sif->get_write_fd(self->priv->sin);
+
+        /* armed only while some data waits for the device */
+        if (fd >= 0) {
+            self->priv->write_watch = reds_core_watch_add(self->priv->reds, fd, 0,
+                                                          red_char_device_write_ready,
+                                                          self);
+        }
+    }
+    if (!self->priv->write_watch &&
+        (sif->base.minor_version <= 2 ||
+         !(sif->flags & SPICE_CHAR_DEVICE_NOTIFY_WRITABLE))) {
         self->priv->write_to_dev_timer = reds_core_timer_add(self->priv->reds,
                                                              red_char_device_write_retry,
                                                              self);
@@ -1019,6 +1138,22 @@ static void red_char_device_init_device_instance(RedCharDevice *self)
         }
     }
 
+    /* the counters stay with the device when its instance is replaced */
+    if (self->priv->sin->subtype && !self->priv->stat_initialized) {
+        static unsigned int stat_id;
+        char *name = g_strdup_printf("chardev_%s_%u", self->priv->sin->subtype, stat_id++);
+
+        self->priv->stat_initialized = TRUE;
+        stat_init_node(&self->priv->stat, self->priv->reds, NULL, name, TRUE);
+        g_free(name);
+        stat_init_counter(&self->priv->write_bytes_counter, self->priv->reds,
+                          &self->priv->stat, "write_bytes", TRUE);
+        stat_init_counter(&self->priv->writes_counter, self->priv->reds,
+                          &self->priv->stat, "writes", TRUE);
+        stat_init_counter(&self->priv->short_writes_counter, self->priv->reds,
+                          &self->priv->stat, "short_writes", TRUE);
+    }
+
     self->priv->sin->st = self;
 }
 
@@ -1093,6 +1228,17 @@ red_char_device_finalize(GObject *object)
 
     reds_core_timer_remove(self->priv->reds, self->priv->write_to_dev_timer);
     self->priv->write_to_dev_timer = NULL;
+    if (self->priv->write_watch) {
+        reds_core_watch_remove(self->priv->reds, self->priv->write_watch);
+        self->priv->write_watch = NULL;
+    }
+
+    if (self->priv->stat_initialized) {
+        stat_remove_counter(self->priv->reds, &self->priv->write_bytes_counter);
+        stat_remove_counter(self->priv->reds, &self->priv->writes_counter);
+        stat_remove_counter(self->priv->reds, &self->priv->short_writes_counter);
+        stat_remove_node(self->priv->reds, &self->priv->stat);
+    }
 
     write_buffers_queue_free(&self->priv->write_queue);
     write_buffers_queue_free(&self->priv->write_bufs_pool);
@@ -0,0 +1,50 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+
+#include "compress-bypass.h"
+
+void compress_bypass_reset(CompressBypass *bypass)
+{
+    bypass->length = 0;
+    bypass->left = 0;
+}
+
+bool compress_bypass_skip(CompressBypass *bypass)
+{
+    if (!bypass->left) {
+        return FALSE;
+    }
+    bypass->left--;
+    return TRUE;
+}
+
+void compress_bypass_update(CompressBypass *bypass, int size, int compressed_size)
+{
+    if (compressed_size > 0 &&
+        compressed_size <= size - size / COMPRESS_BYPASS_MIN_GAIN) {
+        bypass->length = 0;
+        return;
+    }
+    bypass->length = MIN(MAX(bypass->length * 2, 1), COMPRESS_BYPASS_MAX);
+    bypass->left = bypass->length;
+}
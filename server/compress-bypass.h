@@ -0,0 +1,49 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef COMPRESS_BYPASS_H_
+#define COMPRESS_BYPASS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Skips compressing the data that follows a poorly compressed one, which
+ * costs as much as compressing well. The data is likely to be compressed
+ * already, so twice as many are skipped after each new poor result, up to
+ * COMPRESS_BYPASS_MAX, until a good result starts over. The data is poorly
+ * compressed when less than 1/COMPRESS_BYPASS_MIN_GAIN of it is saved.
+ */
+
+#define COMPRESS_BYPASS_MIN_GAIN 8
+#define COMPRESS_BYPASS_MAX 64
+
+typedef struct CompressBypass {
+    uint32_t length; /* data to skip after the next poor result */
+    uint32_t left;
+} CompressBypass;
+
+void compress_bypass_reset(CompressBypass *bypass);
+
+/* Whether to send the next data as it is, counting it as skipped */
+bool compress_bypass_skip(CompressBypass *bypass);
+
+/* Records compressing @size bytes to @compressed_size, which is 0 or
+ * negative if it failed */
+void compress_bypass_update(CompressBypass *bypass, int size, int compressed_size);
+
+#endif /* COMPRESS_BYPASS_H_ */
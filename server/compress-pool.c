@@ -0,0 +1,364 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "compress-pool.h"
+
+typedef struct CompressPoolThread {
+    CompressPool *pool;
+    pthread_t thread;
+    ImageEncoders encoders;
+    /* not shared with the display channel, stats are updated without locking */
+    ImageEncoderSharedData shared_data;
+} CompressPoolThread;
+
+struct CompressPool {
+    pthread_mutex_t lock;
+    pthread_cond_t job_cond;    // signaled when a job is queued or on quit
+    pthread_cond_t done_cond;   // signaled when a job completes
+    Ring jobs;                  // pending jobs, oldest at the tail
+    Ring cancelled;             // cancelled jobs that are done
+    unsigned int n_cancelled;   // cancelled jobs, running or done
+    int wakeup_fd;              // eventfd written when a cancelled job is done
+    bool quit;
+
+    unsigned int n_threads;
+    CompressPoolThread *threads;
+};
+
+static bool compress_job_run(ImageEncoders *enc, CompressJob *job)
+{
+    switch (job->image_compression) {
+    case SPICE_IMAGE_COMPRESSION_QUIC:
+        if (job->use_jpeg) {
+            enc->jpeg_quality = job->jpeg_quality;
+            return image_encoders_compress_jpeg(enc, &job->dest, job->src, &job->comp_data);
+        }
+        return image_encoders_compress_quic(enc, &job->dest, job->src, &job->comp_data);
+#ifdef USE_LZ4
+    case SPICE_IMAGE_COMPRESSION_LZ4:
+        return image_encoders_compress_lz4(enc, &job->dest, job->src, &job->comp_data);
+#endif
+    case SPICE_IMAGE_COMPRESSION_LZ:
+        return image_encoders_compress_lz(enc, &job->dest, job->src, &job->comp_data);
+    default:
+        spice_warn_if_reached();
+        return false;
+    }
+}
+
+static void compress_pool_wakeup(CompressPool *pool)
+{
+    uint64_t one = 1;
+
+    while (write(pool->wakeup_fd, &one, sizeof(one)) == -1) {
+        if (errno == EINTR) {
+            continue;
+        }
+        /* EAGAIN means the counter is about to overflow, the worker
+         * is awake anyway */
+        if (errno != EAGAIN) {
+            spice_printerr("error waking up the worker: %d", errno);
+        }
+        break;
+    }
+}
+
+static void *compress_pool_thread_main(void *arg)
+{
+    CompressPoolThread *thread = arg;
+    CompressPool *pool = thread->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        RingItem *item;
+        CompressJob *job;
+        bool success;
+
+        while (!pool->quit && (item = ring_get_tail(&pool->jobs)) == NULL) {
+            pthread_cond_wait(&pool->job_cond, &pool->lock);
+        }
+        if (pool->quit) {
+            break;
+        }
+        job = SPICE_CONTAINEROF(item, CompressJob, link);
+        ring_remove(&job->link);
+        job->state = COMPRESS_JOB_RUNNING;
+        pthread_mutex_unlock(&pool->lock);
+
+        success = compress_job_run(&thread->encoders, job);
+        if (success && job->tile) {
+            stat_compress_add(&thread->shared_data.tile_stat, job->submit_time,
+                              job->src->y * job->src->stride, job->comp_data.comp_buf_size);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        job->success = success;
+        job->state = COMPRESS_JOB_DONE;
+        if (job->cancelled) {
+            ring_add(&pool->cancelled, &job->link);
+            compress_pool_wakeup(pool);
+        }
+        pthread_cond_broadcast(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+CompressPool *compress_pool_new(unsigned int n_threads)
+{
+    CompressPool *pool;
+    sigset_t thread_sig_mask;
+    sigset_t curr_sig_mask;
+    unsigned int i;
+
+    spice_return_val_if_fail(n_threads > 0, NULL);
+
+    n_threads = MIN(n_threads, COMPRESS_POOL_MAX_THREADS);
+    pool = spice_new0(CompressPool, 1);
+    pool->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->wakeup_fd == -1) {
+        spice_warning("eventfd failed %s", strerror(errno));
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->job_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    ring_init(&pool->jobs);
+    ring_init(&pool->cancelled);
+    pool->threads = spice_new0(CompressPoolThread, n_threads);
+
+    /* same signal mask as the worker thread */
+    sigfillset(&thread_sig_mask);
+    sigdelset(&thread_sig_mask, SIGILL);
+    sigdelset(&thread_sig_mask, SIGFPE);
+    sigdelset(&thread_sig_mask, SIGSEGV);
+    pthread_sigmask(SIG_SETMASK, &thread_sig_mask, &curr_sig_mask);
+    for (i = 0; i < n_threads; i++) {
+        CompressPoolThread *thread = &pool->threads[i];
+        int r;
+
+        thread->pool = pool;
+        image_encoder_shared_init(&thread->shared_data);
+        image_encoders_init(&thread->encoders, &thread->shared_data);
+        if ((r = pthread_create(&thread->thread, NULL, compress_pool_thread_main, thread))) {
+            spice_warning("create compression thread failed %d", r);
+            image_encoders_free(&thread->encoders);
+            image_encoder_shared_free(&thread->shared_data);
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &curr_sig_mask, NULL);
+
+    pool->n_threads = i;
+    if (pool->n_threads == 0) {
+        compress_pool_free(pool);
+        return NULL;
+    }
+    spice_debug("started %u compression threads", pool->n_threads);
+
+    return pool;
+}
+
+void compress_pool_free(CompressPool *pool)
+{
+    unsigned int i;
+
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    spice_warn_if_fail(ring_is_empty(&pool->jobs));
+    spice_warn_if_fail(pool->n_cancelled == 0);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->job_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->n_threads; i++) {
+        pthread_join(pool->threads[i].thread, NULL);
+        image_encoders_free(&pool->threads[i].encoders);
+        image_encoder_shared_free(&pool->threads[i].shared_data);
+    }
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->job_cond);
+    pthread_mutex_destroy(&pool->lock);
+    close(pool->wakeup_fd);
+    free(pool->threads);
+    free(pool);
+}
+
+unsigned int compress_pool_get_n_threads(const CompressPool *pool)
+{
+    return pool->n_threads;
+}
+
+int compress_pool_get_wakeup_fd(const CompressPool *pool)
+{
+    return pool->wakeup_fd;
+}
+
+void compress_pool_stat_reset(CompressPool *pool)
+{
+    unsigned int i;
+
+    for (i = 0; i < pool->n_threads; i++) {
+        image_encoder_shared_stat_reset(&pool->threads[i].shared_data);
+    }
+}
+
+void compress_pool_stat_print(const CompressPool *pool)
+{
+#ifdef COMPRESS_STAT
+    unsigned int i;
+
+    for (i = 0; i < pool->n_threads; i++) {
+        spice_info("==> Compression thread %u", i);
+        image_encoder_shared_stat_print(&pool->threads[i].shared_data);
+    }
+#endif
+}
+
+CompressJob *compress_pool_submit(CompressPool *pool, SpiceBitmap *src,
+                                  SpiceImageCompression image_compression,
+                                  bool use_jpeg, int jpeg_quality, bool tile)
+{
+    CompressJob *job = spice_new0(CompressJob, 1);
+
+    job->pool = pool;
+    job->state = COMPRESS_JOB_PENDING;
+    job->src = src;
+    job->image_compression = image_compression;
+    job->use_jpeg = use_jpeg;
+    job->jpeg_quality = jpeg_quality;
+    job->tile = tile;
+    /* all the threads use the same wall clock for tile_stat */
+    stat_start_time_init(&job->submit_time, &pool->threads[0].shared_data.tile_stat);
+    ring_item_init(&job->link);
+
+    pthread_mutex_lock(&pool->lock);
+    ring_add(&pool->jobs, &job->link);
+    pthread_cond_signal(&pool->job_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return job;
+}
+
+static void compress_job_wait(CompressJob *job)
+{
+    CompressPool *pool = job->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    while (job->state != COMPRESS_JOB_DONE) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+bool compress_job_finish(CompressJob *job, SpiceImage *dest,
+                         compress_send_data_t *o_comp_data)
+{
+    compress_job_wait(job);
+
+    if (!job->success) {
+        return false;
+    }
+    spice_return_val_if_fail(job->comp_data.comp_buf != NULL, false);
+
+    dest->descriptor.type = job->dest.descriptor.type;
+    dest->u = job->dest.u;
+    *o_comp_data = job->comp_data;
+    job->comp_data.comp_buf = NULL;
+
+    return true;
+}
+
+static void compress_job_destroy(CompressJob *job)
+{
+    if (job->success) {
+        compress_send_data_free(&job->comp_data);
+    }
+    free(job);
+}
+
+void compress_job_free(CompressJob *job, CompressJobReleaseFunc release, void *opaque)
+{
+    CompressPool *pool = job->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    if (job->state == COMPRESS_JOB_PENDING) {
+        ring_remove(&job->link);
+        job->state = COMPRESS_JOB_DONE;
+    }
+    if (job->state == COMPRESS_JOB_RUNNING) {
+        /* the thread still reads the source, it is released when done */
+        job->cancelled = true;
+        job->release = release;
+        job->release_opaque = opaque;
+        pool->n_cancelled++;
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    compress_job_destroy(job);
+    release(opaque);
+}
+
+void compress_pool_release_cancelled(CompressPool *pool, bool wait)
+{
+    RingItem *item;
+    uint64_t count;
+
+    pthread_mutex_lock(&pool->lock);
+    /* the jobs done after this are signalled again */
+    while (read(pool->wakeup_fd, &count, sizeof(count)) == -1 && errno == EINTR) {
+    }
+    for (;;) {
+        CompressJob *job;
+
+        while ((item = ring_get_tail(&pool->cancelled)) == NULL &&
+               wait && pool->n_cancelled > 0) {
+            pthread_cond_wait(&pool->done_cond, &pool->lock);
+        }
+        if (item == NULL) {
+            break;
+        }
+        job = SPICE_CONTAINEROF(item, CompressJob, link);
+        ring_remove(&job->link);
+        pool->n_cancelled--;
+        pthread_mutex_unlock(&pool->lock);
+
+        job->release(job->release_opaque);
+        compress_job_destroy(job);
+
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,120 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef COMPRESS_POOL_H_
+#define COMPRESS_POOL_H_
+
+#include <common/ring.h>
+
+#include "image-encoders.h"
+
+/* Pool of threads compressing bitmaps ahead of marshalling.
+ *
+ * Each thread owns its own ImageEncoders context, so only encoders without
+ * state shared with the client (QUIC, JPEG, LZ and LZ4) can be used: GLZ
+ * images must still be encoded by the display channel client in the order
+ * they are sent.
+ *
+ * Jobs are submitted by the worker thread when a drawable is added to a
+ * client pipe and picked up again by the same thread when the pipe item is
+ * marshalled, which keeps the messages in pipe order. The encoder is chosen
+ * with the client settings at submission, the display channel client checks
+ * they did not change before using the result.
+ *
+ * A job freed while it runs is cancelled rather than waited for, what its
+ * source bitmap belongs to is released from the worker thread once it is
+ * done, see compress_pool_release_cancelled(). The pool wakes the worker up
+ * for it through the fd returned by compress_pool_get_wakeup_fd().
+ */
+
+/* bitmaps smaller than this are cheaper to compress inline */
+#define COMPRESS_POOL_MIN_IMAGE_SIZE (64 * 1024)
+#define COMPRESS_POOL_MAX_THREADS 16
+
+/* Large primary surface images are split in horizontal bands which are
+ * compressed concurrently and sent as separate draws. The threshold is in
+ * pixels and can be changed with SPICE_IMAGE_TILE_THRESHOLD (0 disables). */
+#define COMPRESS_POOL_DEFAULT_TILE_THRESHOLD (1920 * 1080)
+#define COMPRESS_POOL_MIN_TILE_HEIGHT 64
+#define COMPRESS_POOL_TILES_PER_THREAD 2
+
+typedef struct CompressPool CompressPool;
+typedef struct CompressJob CompressJob;
+
+/* Releases what the source bitmap of a job belongs to */
+typedef void (*CompressJobReleaseFunc)(void *opaque);
+
+typedef enum {
+    COMPRESS_JOB_PENDING,
+    COMPRESS_JOB_RUNNING,
+    COMPRESS_JOB_DONE,
+} CompressJobState;
+
+struct CompressJob {
+    RingItem link;
+    CompressPool *pool;
+    CompressJobState state;
+
+    /* input, must stay valid until the job is freed */
+    SpiceBitmap *src;
+    SpiceImageCompression image_compression;
+    bool use_jpeg;
+    int jpeg_quality;
+    /* value of can_lossy and the client settings the encoder was chosen for */
+    int can_lossy;
+    SpiceImageCompression preferred_compression;
+    bool enable_jpeg;
+    /* band of a tiled image, its latency is accounted in tile_stat */
+    bool tile;
+    stat_start_time_t submit_time;
+
+    /* output */
+    bool success;
+    SpiceImage dest;
+    compress_send_data_t comp_data;
+
+    /* set when the job is freed while it runs */
+    bool cancelled;
+    CompressJobReleaseFunc release;
+    void *release_opaque;
+};
+
+CompressPool *compress_pool_new(unsigned int n_threads);
+void compress_pool_free(CompressPool *pool);
+unsigned int compress_pool_get_n_threads(const CompressPool *pool);
+/* Readable when cancelled jobs are done */
+int compress_pool_get_wakeup_fd(const CompressPool *pool);
+void compress_pool_stat_reset(CompressPool *pool);
+void compress_pool_stat_print(const CompressPool *pool);
+/* Releases the sources of the cancelled jobs that are done, or waits for all
+ * of them if @wait is set. Must be called from the worker thread. */
+void compress_pool_release_cancelled(CompressPool *pool, bool wait);
+
+CompressJob *compress_pool_submit(CompressPool *pool, SpiceBitmap *src,
+                                  SpiceImageCompression image_compression,
+                                  bool use_jpeg, int jpeg_quality, bool tile);
+/* Waits for @job and moves the compressed data to @dest/@o_comp_data.
+ * Can only be called once per job. */
+bool compress_job_finish(CompressJob *job, SpiceImage *dest,
+                         compress_send_data_t *o_comp_data);
+/* Frees @job and any compressed data that was not consumed, then calls
+ * @release with @opaque. If @job is running it is cancelled instead and
+ * @release is called by compress_pool_release_cancelled() once it is done. */
+void compress_job_free(CompressJob *job, CompressJobReleaseFunc release, void *opaque);
+
+#endif /* COMPRESS_POOL_H_ */
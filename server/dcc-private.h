@@ -24,6 +24,13 @@
 #include "image-encoders.h"
 #include "stream.h"
 #include "red-channel-client.h"
+#include "sparse-array.h"
+
+/* What the client knows of a surface */
+typedef struct DccSurface {
+    bool created;
+    QRegion lossy_region;
+} DccSurface;
 
 typedef struct DisplayChannelClientPrivate DisplayChannelClientPrivate;
 struct DisplayChannelClientPrivate
@@ -50,6 +57,7 @@ struct DisplayChannelClientPrivate
         FreeList free_list;
         uint64_t pixmap_cache_items[MAX_DRAWABLE_PIXMAP_CACHE_ITEMS];
         int num_pixmap_cache_items;
+        CompressJob *compress_job;
     } send_data;
 
     /* Host preferred video-codec order sorted with client preferred */
@@ -58,8 +66,9 @@ struct DisplayChannelClientPrivate
      * preference order (index) as value */
     GArray *client_preferred_video_codecs;
 
-    uint8_t surface_client_created[NUM_SURFACES];
-    QRegion surface_client_lossy_region[NUM_SURFACES];
+    /* DccSurface for each surface of the display channel, see
+     * dcc_get_surface() */
+    SparseArray *surfaces;
 
     StreamAgent stream_agents[NUM_STREAMS];
     uint32_t streams_max_latency;
@@ -67,4 +76,15 @@ struct DisplayChannelClientPrivate
     bool gl_draw_ongoing;
 };
 
+static inline DccSurface *dcc_get_surface(DisplayChannelClient *dcc, uint32_t surface_id)
+{
+    return sparse_array_get(dcc->priv->surfaces, surface_id);
+}
+
+/* Returns NULL if the surface was never sent to the client */
+static inline DccSurface *dcc_lookup_surface(DisplayChannelClient *dcc, uint32_t surface_id)
+{
+    return sparse_array_lookup(dcc->priv->surfaces, surface_id);
+}
+
 #endif /* DCC_PRIVATE_H_ */
@@ -95,8 +95,8 @@ static bool is_surface_area_lossy(DisplayChannelClient *dcc, uint32_t surface_id
 
     spice_return_val_if_fail(display_channel_validate_surface(display, surface_id), FALSE);
 
-    surface = &display->priv->surfaces[surface_id];
-    surface_lossy_region = &dcc->priv->surface_client_lossy_region[surface_id];
+    surface = display_channel_get_surface(display, surface_id);
+    surface_lossy_region = &dcc_get_surface(dcc, surface_id)->lossy_region;
 
     if (!area) {
         if (region_is_empty(surface_lossy_region)) {
@@ -335,7 +335,7 @@ static void marshaller_add_compressed(SpiceMarshaller *m,
     size_t now;
     do {
         spice_return_if_fail(comp_buf);
-        now = MIN(sizeof(comp_buf->buf), max);
+        now = MIN(comp_buf->size, max);
         max -= now;
         spice_marshaller_add_by_ref_full(m, comp_buf->buf.bytes, now,
                                          marshaller_compress_buf_free, comp_buf);
@@ -416,7 +416,7 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
             return FILL_BITS_TYPE_SURFACE;
         }
 
-        surface = &display->priv->surfaces[surface_id];
+        surface = display_channel_get_surface(display, surface_id);
         image.descriptor.type = SPICE_IMAGE_TYPE_SURFACE;
         image.descriptor.flags = 0;
         image.descriptor.width = surface->context.width;
@@ -579,7 +579,7 @@ static void surface_lossy_region_update(DisplayChannelClient *dcc,
         return;
     }
 
-    surface_lossy_region = &dcc->priv->surface_client_lossy_region[item->surface_id];
+    surface_lossy_region = &dcc_get_surface(dcc, item->surface_id)->lossy_region;
     drawable = item->red_drawable;
 
     if (drawable->clip.type == SPICE_CLIP_TYPE_RECTS ) {
@@ -1682,15 +1682,16 @@ static void red_release_video_encoder_buffer(uint8_t *data, void *opaque)
 
 static bool red_marshall_stream_data(RedChannelClient *rcc,
                                      SpiceMarshaller *base_marshaller,
-                                     Drawable *drawable)
+                                     RedDrawablePipeItem *dpi)
 {
     DisplayChannelClient *dcc = DISPLAY_CHANNEL_CLIENT(rcc);
     DisplayChannel *display = DCC_TO_DC(dcc);
+    Drawable *drawable = dpi->drawable;
     Stream *stream = drawable->stream;
     SpiceCopy *copy;
     uint32_t frame_mm_time;
     int is_sized;
-    int ret;
+    int ret = VIDEO_ENCODER_FRAME_UNSUPPORTED;
 
     spice_assert(drawable->red_drawable->type == QXL_DRAW_COPY);
 
@@ -1699,9 +1700,7 @@ static bool red_marshall_stream_data(RedChannelClient *rcc,
         return FALSE;
     }
 
-    is_sized = (copy->src_area.right - copy->src_area.left != stream->width) ||
-               (copy->src_area.bottom - copy->src_area.top != stream->height) ||
-               !rect_is_equal(&drawable->red_drawable->bbox, &stream->dest_area);
+    is_sized = stream_frame_is_sized(stream, drawable);
 
     if (is_sized &&
         !red_channel_client_test_remote_cap(rcc, SPICE_DISPLAY_CAP_SIZED_STREAM)) {
@@ -1710,17 +1709,32 @@ static bool red_marshall_stream_data(RedChannelClient *rcc,
 
     StreamAgent *agent = &dcc->priv->stream_agents[display_channel_get_stream_id(display, stream)];
     VideoBuffer *outbuf;
-    /* workaround for vga streams */
-    frame_mm_time =  drawable->red_drawable->mm_time ?
-                        drawable->red_drawable->mm_time :
-                        reds_get_mm_time();
-    ret = !agent->video_encoder ? VIDEO_ENCODER_FRAME_UNSUPPORTED :
-          agent->video_encoder->encode_frame(agent->video_encoder,
-                                             frame_mm_time,
-                                             &copy->src_bitmap->u.bitmap,
-                                             &copy->src_area, stream->top_down,
-                                             drawable->red_drawable,
-                                             &outbuf);
+    if (dpi->video_frame) {
+        /* compressed in the background, see dcc_submit_video_frame() */
+        VideoEncoderFrame *video_frame = dpi->video_frame;
+
+        dpi->video_frame = NULL;
+        frame_mm_time = dpi->video_frame_mm_time;
+        ret = video_frame->finish(video_frame, &outbuf);
+    } else {
+        /* workaround for vga streams */
+        frame_mm_time =  drawable->red_drawable->mm_time ?
+                            drawable->red_drawable->mm_time :
+                            reds_get_mm_time();
+    }
+    if (ret != VIDEO_ENCODER_FRAME_ENCODE_DONE) {
+        /* the frame can only be skipped if a newer one is on its way, the
+         * last frame of the stream must be sent */
+        const QRegion *damage = stream->current != drawable ? &agent->damage : NULL;
+
+        ret = !agent->video_encoder ? VIDEO_ENCODER_FRAME_UNSUPPORTED :
+              agent->video_encoder->encode_frame(agent->video_encoder,
+                                                 frame_mm_time,
+                                                 &copy->src_bitmap->u.bitmap,
+                                                 &copy->src_area, stream->top_down,
+                                                 damage, drawable->red_drawable,
+                                                 &outbuf);
+    }
     switch (ret) {
     case VIDEO_ENCODER_FRAME_DROP:
 #ifdef STREAM_STATS
@@ -1730,6 +1744,7 @@ static bool red_marshall_stream_data(RedChannelClient *rcc,
     case VIDEO_ENCODER_FRAME_UNSUPPORTED:
         return FALSE;
     case VIDEO_ENCODER_FRAME_ENCODE_DONE:
+        region_clear(&agent->damage);
         break;
     default:
         spice_error("bad return value (%d) from VideoEncoder::encode_frame", ret);
@@ -1796,10 +1811,11 @@ static void display_channel_marshall_migrate_data_surfaces(DisplayChannelClient
 
     num_surfaces_created = (uint32_t *)spice_marshaller_reserve_space(m2, sizeof(uint32_t));
     *num_surfaces_created = 0;
-    for (i = 0; i < NUM_SURFACES; i++) {
+    for (i = 0; i < sparse_array_get_size(dcc->priv->surfaces); i++) {
+        DccSurface *surface = dcc_lookup_surface(dcc, i);
         SpiceRect lossy_rect;
 
-        if (!dcc->priv->surface_client_created[i]) {
+        if (!surface || !surface->created) {
             continue;
         }
         spice_marshaller_add_uint32(m2, i);
@@ -1808,7 +1824,7 @@ static void display_channel_marshall_migrate_data_surfaces(DisplayChannelClient
         if (!lossy) {
             continue;
         }
-        region_extents(&dcc->priv->surface_client_lossy_region[i], &lossy_rect);
+        region_extents(&surface->lossy_region, &lossy_rect);
         spice_marshaller_add_int32(m2, lossy_rect.left);
         spice_marshaller_add_int32(m2, lossy_rect.top);
         spice_marshaller_add_int32(m2, lossy_rect.right);
@@ -1925,8 +1941,7 @@ static void red_marshall_image(RedChannelClient *rcc,
     DisplayChannelClient *dcc = DISPLAY_CHANNEL_CLIENT(rcc);
     DisplayChannel *display = DCC_TO_DC(dcc);
     SpiceImage red_image;
-    SpiceBitmap bitmap;
-    SpiceChunks *chunks;
+    SpiceBitmap *bitmap = &item->bitmap;
     QRegion *surface_lossy_region;
     SpiceMsgDisplayDrawCopy copy;
     SpiceMarshaller *src_bitmap_out, *mask_bitmap_out;
@@ -1940,33 +1955,19 @@ static void red_marshall_image(RedChannelClient *rcc,
     red_image.descriptor.width = item->width;
     red_image.descriptor.height = item->height;
 
-    bitmap.format = item->image_format;
-    bitmap.flags = 0;
-    if (item->top_down) {
-        bitmap.flags |= SPICE_BITMAP_FLAGS_TOP_DOWN;
-    }
-    bitmap.x = item->width;
-    bitmap.y = item->height;
-    bitmap.stride = item->stride;
-    bitmap.palette = 0;
-    bitmap.palette_id = 0;
-
-    chunks = spice_chunks_new_linear(item->data, bitmap.stride * bitmap.y);
-    bitmap.data = chunks;
-
     red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_DRAW_COPY);
 
     copy.base.surface_id = item->surface_id;
     copy.base.box.left = item->pos.x;
     copy.base.box.top = item->pos.y;
-    copy.base.box.right = item->pos.x + bitmap.x;
-    copy.base.box.bottom = item->pos.y + bitmap.y;
+    copy.base.box.right = item->pos.x + item->width;
+    copy.base.box.bottom = item->pos.y + item->height;
     copy.base.clip.type = SPICE_CLIP_TYPE_NONE;
     copy.data.rop_descriptor = SPICE_ROPD_OP_PUT;
     copy.data.src_area.left = 0;
     copy.data.src_area.top = 0;
-    copy.data.src_area.right = bitmap.x;
-    copy.data.src_area.bottom = bitmap.y;
+    copy.data.src_area.right = item->width;
+    copy.data.src_area.bottom = item->height;
     copy.data.scale_mode = 0;
     copy.data.src_bitmap = 0;
     copy.data.mask.flags = 0;
@@ -1980,9 +1981,9 @@ static void red_marshall_image(RedChannelClient *rcc,
 
     compress_send_data_t comp_send_data = {0};
 
-    int comp_succeeded = dcc_compress_image(dcc, &red_image, &bitmap, NULL, item->can_lossy, &comp_send_data);
+    int comp_succeeded = dcc_compress_image(dcc, &red_image, bitmap, NULL, item->can_lossy, &comp_send_data);
 
-    surface_lossy_region = &dcc->priv->surface_client_lossy_region[item->surface_id];
+    surface_lossy_region = &dcc_get_surface(dcc, item->surface_id)->lossy_region;
     if (comp_succeeded) {
         spice_marshall_Image(src_bitmap_out, &red_image,
                              &bitmap_palette_out, &lzplt_palette_out);
@@ -2000,18 +2001,19 @@ static void red_marshall_image(RedChannelClient *rcc,
             region_remove(surface_lossy_region, &copy.base.box);
         }
     } else {
+        /* the surface may be drawn on before the pixels are written out */
+        red_image_item_copy_surface(item);
         red_image.descriptor.type = SPICE_IMAGE_TYPE_BITMAP;
-        red_image.u.bitmap = bitmap;
+        red_image.u.bitmap = *bitmap;
 
         spice_marshall_Image(src_bitmap_out, &red_image,
                              &bitmap_palette_out, &lzplt_palette_out);
         red_pipe_item_ref(&item->base);
-        spice_marshaller_add_by_ref_full(src_bitmap_out, item->data,
-                                         bitmap.y * bitmap.stride,
+        spice_marshaller_add_by_ref_full(src_bitmap_out, bitmap->data->chunk[0].data,
+                                         bitmap->y * bitmap->stride,
                                          marshaller_unref_pipe_item, item);
         region_remove(surface_lossy_region, &copy.base.box);
     }
-    spice_chunks_destroy(chunks);
 }
 
 static void marshall_lossy_qxl_drawable(RedChannelClient *rcc,
@@ -2135,7 +2137,7 @@ static void marshall_qxl_drawable(RedChannelClient *rcc,
     spice_return_if_fail(display);
     /* allow sized frames to be streamed, even if they where replaced by another frame, since
      * newer frames might not cover sized frames completely if they are bigger */
-    if (item->stream && red_marshall_stream_data(rcc, m, item)) {
+    if (item->stream && red_marshall_stream_data(rcc, m, dpi)) {
         return;
     }
     if (display->priv->enable_jpeg)
@@ -2173,6 +2175,9 @@ static void marshall_stream_start(RedChannelClient *rcc,
     if (stream->current) {
         RedDrawable *red_drawable = stream->current->red_drawable;
         stream_create.clip = red_drawable->clip;
+    } else if (stream->gl_scanout) {
+        /* the scanout covers everything drawn on the primary surface */
+        stream_create.clip.type = SPICE_CLIP_TYPE_NONE;
     } else {
         stream_create.clip.type = SPICE_CLIP_TYPE_RECTS;
         clip_rects.num_rects = 0;
@@ -2250,7 +2255,7 @@ static void marshall_surface_create(RedChannelClient *rcc,
 {
     DisplayChannelClient *dcc = DISPLAY_CHANNEL_CLIENT(rcc);
 
-    region_init(&dcc->priv->surface_client_lossy_region[surface_create->surface_id]);
+    region_init(&dcc_get_surface(dcc, surface_create->surface_id)->lossy_region);
     red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_SURFACE_CREATE);
 
     spice_marshall_msg_display_surface_create(base_marshaller, surface_create);
@@ -2262,7 +2267,7 @@ static void marshall_surface_destroy(RedChannelClient *rcc,
     DisplayChannelClient *dcc = DISPLAY_CHANNEL_CLIENT(rcc);
     SpiceMsgSurfaceDestroy surface_destroy;
 
-    region_destroy(&dcc->priv->surface_client_lossy_region[surface_id]);
+    region_destroy(&dcc_get_surface(dcc, surface_id)->lossy_region);
     red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_SURFACE_DESTROY);
 
     surface_destroy.surface_id = surface_id;
@@ -2339,6 +2344,89 @@ static void marshall_gl_draw(RedChannelClient *rcc,
     spice_marshall_msg_display_gl_draw(m, &p->draw);
 }
 
+static void marshall_gl_stream_frame(RedChannelClient *rcc,
+                                     SpiceMarshaller *m,
+                                     RedGlStreamFrameItem *item)
+{
+    DisplayChannelClient *dcc = DISPLAY_CHANNEL_CLIENT(rcc);
+    StreamAgent *agent = item->agent;
+    Stream *stream = agent->stream;
+    GlReadbackFrame *frame = item->frame;
+    SpiceRect src = {
+        .right = frame->bitmap.x,
+        .bottom = frame->bitmap.y,
+    };
+    VideoBuffer *outbuf;
+    int is_sized;
+    int ret;
+
+    if (!agent->video_encoder) {
+        /* Without a video encoder nothing will be streamed */
+        return;
+    }
+    is_sized = !rect_is_equal(&frame->area, &stream->dest_area);
+    if (is_sized && !red_channel_client_test_remote_cap(rcc, SPICE_DISPLAY_CAP_SIZED_STREAM)) {
+        gl_stream_agent_frame_lost(agent, &frame->area);
+        return;
+    }
+
+    /* a newer frame replaces this one in the pipe rather than following
+     * it, so none can follow yet and the frame must not be skipped */
+    ret = agent->video_encoder->encode_frame(agent->video_encoder, item->mm_time,
+                                             &frame->bitmap, &src,
+                                             !!(frame->bitmap.flags & SPICE_BITMAP_FLAGS_TOP_DOWN),
+                                             NULL, frame, &outbuf);
+    switch (ret) {
+    case VIDEO_ENCODER_FRAME_DROP:
+#ifdef STREAM_STATS
+        agent->stats.num_drops_fps++;
+#endif
+        gl_stream_agent_frame_lost(agent, &frame->area);
+        return;
+    case VIDEO_ENCODER_FRAME_UNSUPPORTED:
+        gl_stream_agent_frame_lost(agent, &frame->area);
+        return;
+    case VIDEO_ENCODER_FRAME_ENCODE_DONE:
+        region_clear(&agent->damage);
+        break;
+    default:
+        spice_error("bad return value (%d) from VideoEncoder::encode_frame", ret);
+        return;
+    }
+
+    if (!is_sized) {
+        SpiceMsgDisplayStreamData stream_data;
+
+        red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_STREAM_DATA);
+
+        stream_data.base.id = display_channel_get_stream_id(DCC_TO_DC(dcc), stream);
+        stream_data.base.multi_media_time = item->mm_time;
+        stream_data.data_size = outbuf->size;
+
+        spice_marshall_msg_display_stream_data(m, &stream_data);
+    } else {
+        SpiceMsgDisplayStreamDataSized stream_data;
+
+        red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_STREAM_DATA_SIZED);
+
+        stream_data.base.id = display_channel_get_stream_id(DCC_TO_DC(dcc), stream);
+        stream_data.base.multi_media_time = item->mm_time;
+        stream_data.data_size = outbuf->size;
+        stream_data.width = frame->bitmap.x;
+        stream_data.height = frame->bitmap.y;
+        stream_data.dest = frame->area;
+
+        spice_marshall_msg_display_stream_data_sized(m, &stream_data);
+    }
+    spice_marshaller_add_by_ref_full(m, outbuf->data, outbuf->size,
+                                     &red_release_video_encoder_buffer, outbuf);
+#ifdef STREAM_STATS
+    agent->stats.num_frames_sent++;
+    agent->stats.size_sent += outbuf->size;
+    agent->stats.end = item->mm_time;
+#endif
+}
+
 
 static void begin_send_message(RedChannelClient *rcc)
 {
@@ -2371,6 +2459,7 @@ static void reset_send_data(DisplayChannelClient *dcc)
 {
     dcc->priv->send_data.free_list.res->count = 0;
     dcc->priv->send_data.num_pixmap_cache_items = 0;
+    dcc->priv->send_data.compress_job = NULL;
     memset(dcc->priv->send_data.free_list.sync, 0,
            sizeof(dcc->priv->send_data.free_list.sync));
 }
@@ -2379,12 +2468,16 @@ void dcc_send_item(RedChannelClient *rcc, RedPipeItem *pipe_item)
 {
     DisplayChannelClient *dcc = DISPLAY_CHANNEL_CLIENT(rcc);
     SpiceMarshaller *m = red_channel_client_get_marshaller(rcc);
+    RedStatTimer timer;
 
+    stat_timer_start(&timer);
     reset_send_data(dcc);
     switch (pipe_item->type) {
     case RED_PIPE_ITEM_TYPE_DRAW: {
         RedDrawablePipeItem *dpi = SPICE_CONTAINEROF(pipe_item, RedDrawablePipeItem, dpi_pipe_item);
+        dcc->priv->send_data.compress_job = dpi->compress_job;
         marshall_qxl_drawable(rcc, m, dpi);
+        dcc->priv->send_data.compress_job = NULL;
         break;
     }
     case RED_PIPE_ITEM_TYPE_INVAL_ONE:
@@ -2409,9 +2502,13 @@ void dcc_send_item(RedChannelClient *rcc, RedPipeItem *pipe_item)
     case RED_PIPE_ITEM_TYPE_MIGRATE_DATA:
         display_channel_marshall_migrate_data(rcc, m);
         break;
-    case RED_PIPE_ITEM_TYPE_IMAGE:
-        red_marshall_image(rcc, m, SPICE_UPCAST(RedImageItem, pipe_item));
+    case RED_PIPE_ITEM_TYPE_IMAGE: {
+        RedImageItem *image = SPICE_UPCAST(RedImageItem, pipe_item);
+        dcc->priv->send_data.compress_job = image->compress_job;
+        red_marshall_image(rcc, m, image);
+        dcc->priv->send_data.compress_job = NULL;
         break;
+    }
     case RED_PIPE_ITEM_TYPE_PIXMAP_SYNC:
         display_channel_marshall_pixmap_sync(rcc, m);
         break;
@@ -2454,9 +2551,14 @@ void dcc_send_item(RedChannelClient *rcc, RedPipeItem *pipe_item)
     case RED_PIPE_ITEM_TYPE_GL_DRAW:
         marshall_gl_draw(rcc, m, pipe_item);
         break;
+    case RED_PIPE_ITEM_TYPE_GL_STREAM_FRAME:
+        marshall_gl_stream_frame(rcc, m, SPICE_UPCAST(RedGlStreamFrameItem, pipe_item));
+        break;
     default:
         spice_warn_if_reached();
     }
+    /* includes the images compressed while marshalling */
+    stat_timer_add(DCC_TO_DC(dcc)->priv->marshal_time_counter, &timer);
 
     // a message is pending
     if (red_channel_client_send_message_pending(rcc)) {
@@ -100,6 +100,8 @@ display_channel_client_constructed(GObject *object)
 
     G_OBJECT_CLASS(display_channel_client_parent_class)->constructed(object);
 
+    self->priv->surfaces = sparse_array_new(sizeof(DccSurface),
+                                            DCC_TO_DC(self)->priv->n_surfaces);
     dcc_init_stream_agents(self);
 
     image_encoders_init(&self->priv->encoders, &DCC_TO_DC(self)->priv->encoder_shared_data);
@@ -116,6 +118,7 @@ display_channel_client_finalize(GObject *object)
     g_signal_handlers_disconnect_by_func(DCC_TO_DC(self), on_display_video_codecs_update, self);
     g_clear_pointer(&self->priv->preferred_video_codecs, g_array_unref);
     g_clear_pointer(&self->priv->client_preferred_video_codecs, g_array_unref);
+    sparse_array_free(self->priv->surfaces);
     g_free(self->priv);
 
     G_OBJECT_CLASS(display_channel_client_parent_class)->finalize(object);
@@ -302,27 +305,167 @@ void dcc_create_surface(DisplayChannelClient *dcc, int surface_id)
     /* don't send redundant create surface commands to client */
     if (!dcc ||
         common_graphics_channel_get_during_target_migrate(COMMON_GRAPHICS_CHANNEL(display)) ||
-        dcc->priv->surface_client_created[surface_id]) {
+        dcc_get_surface(dcc, surface_id)->created) {
         return;
     }
-    surface = &display->priv->surfaces[surface_id];
+    surface = display_channel_get_surface(display, surface_id);
     create = red_surface_create_item_new(RED_CHANNEL(display),
                                          surface_id, surface->context.width,
                                          surface->context.height,
                                          surface->context.format, flags);
-    dcc->priv->surface_client_created[surface_id] = TRUE;
+    dcc_get_surface(dcc, surface_id)->created = TRUE;
     red_channel_client_pipe_add(RED_CHANNEL_CLIENT(dcc), &create->pipe_item);
 }
 
-// adding the pipe item after pos. If pos == NULL, adding to head.
-RedImageItem *dcc_add_surface_area_image(DisplayChannelClient *dcc,
-                                         int surface_id,
-                                         SpiceRect *area,
-                                         GList *pipe_item_pos,
-                                         int can_lossy)
+static SpiceImageCompression dcc_get_image_compression(DisplayChannelClient *dcc,
+                                                       SpiceBitmap *src, Drawable *drawable,
+                                                       int can_lossy, int *use_jpeg);
+
+/* Returns NULL if @src must be compressed by dcc_compress_image() itself */
+static CompressJob *dcc_submit_compress_job(DisplayChannelClient *dcc, SpiceBitmap *src,
+                                            Drawable *drawable, int can_lossy, bool tile)
 {
     DisplayChannel *display = DCC_TO_DC(dcc);
-    RedSurface *surface = &display->priv->surfaces[surface_id];
+    SpiceImageCompression image_compression;
+    CompressJob *job;
+    int use_jpeg;
+
+    image_compression = dcc_get_image_compression(dcc, src, drawable, can_lossy, &use_jpeg);
+    switch (image_compression) {
+    case SPICE_IMAGE_COMPRESSION_QUIC:
+    case SPICE_IMAGE_COMPRESSION_LZ:
+    case SPICE_IMAGE_COMPRESSION_LZ4:
+        break;
+    default:
+        /* GLZ shares its dictionary with the client, images must be
+         * encoded in the order they are sent */
+        return NULL;
+    }
+
+    job = compress_pool_submit(display->priv->compress_pool, src, image_compression, use_jpeg,
+                               dcc->priv->encoders.jpeg_quality, tile);
+    job->can_lossy = can_lossy;
+    job->preferred_compression = dcc->priv->image_compression;
+    job->enable_jpeg = display->priv->enable_jpeg;
+
+    return job;
+}
+
+static void red_image_item_release(void *opaque)
+{
+    RedImageItem *item = opaque;
+
+    spice_chunks_destroy(item->bitmap.data);
+    free(item);
+}
+
+static void red_image_item_free(RedPipeItem *base)
+{
+    RedImageItem *item = SPICE_UPCAST(RedImageItem, base);
+
+    if (ring_item_is_linked(&item->surface_link)) {
+        ring_remove(&item->surface_link);
+    }
+    if (item->compress_job) {
+        compress_job_free(item->compress_job, red_image_item_release, item);
+        return;
+    }
+    red_image_item_release(item);
+}
+
+/* Gives @item a copy of the pixels it reads in the surface memory, which is
+ * about to change */
+void red_image_item_copy_surface(RedImageItem *item)
+{
+    size_t size = (size_t)item->height * item->stride;
+    uint8_t *data;
+
+    if (!ring_item_is_linked(&item->surface_link)) {
+        return;
+    }
+    data = spice_malloc(size);
+    memcpy(data, item->bitmap.data->chunk[0].data, size);
+    spice_chunks_destroy(item->bitmap.data);
+    item->bitmap.data = spice_chunks_new_linear(data, size);
+    item->bitmap.data->flags |= SPICE_CHUNKS_FLAGS_FREE;
+    ring_remove(&item->surface_link);
+}
+
+/* Copies the pixels of the @items reading @area of their surface, or of all
+ * of them if @area is NULL. Called before drawing on the surface. */
+void red_image_items_copy_surface_area(Ring *items, const SpiceRect *area)
+{
+    RingItem *link, *next;
+
+    RING_FOREACH_SAFE(link, next, items) {
+        RedImageItem *item = SPICE_CONTAINEROF(link, RedImageItem, surface_link);
+        SpiceRect item_area = {
+            .left = item->pos.x,
+            .top = item->pos.y,
+            .right = item->pos.x + item->width,
+            .bottom = item->pos.y + item->height,
+        };
+
+        if (area == NULL || rect_intersects(&item_area, area)) {
+            red_image_item_copy_surface(item);
+        }
+    }
+}
+
+/*
+ * Points the bitmap of @item at @area in the memory of a primary surface so
+ * it is compressed from there when it is sent, saving the copy of the
+ * pixels. This is only possible when the area lines are contiguous in
+ * memory, and the item gets its copy if the surface is drawn on before it
+ * is sent.
+ */
+static bool dcc_use_surface_area(DisplayChannelClient *dcc, RedImageItem *item,
+                                 RedSurface *surface, const SpiceRect *area)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    int32_t stride = surface->context.stride;
+    uint8_t *data;
+
+    /* the compression threads would read the surface while it is drawn on */
+    if (!display->priv->use_zero_copy_images || display->priv->compress_pool ||
+        !is_primary_surface(display, item->surface_id) ||
+        area->left != 0 || area->right != surface->context.width ||
+        ABS(stride) != item->stride) {
+        return false;
+    }
+    /* bitmaps are sent uncompressed over unix sockets, see red_marshall_image() */
+    if (reds_stream_get_family(red_channel_client_get_stream(RED_CHANNEL_CLIENT(dcc))) == AF_UNIX) {
+        return false;
+    }
+
+    if (stride > 0) {
+        data = (uint8_t *)surface->context.line_0 + area->top * stride;
+        item->bitmap.flags = SPICE_BITMAP_FLAGS_TOP_DOWN;
+    } else {
+        /* the last line comes first in memory */
+        data = (uint8_t *)surface->context.line_0 + (area->bottom - 1) * stride;
+        item->bitmap.flags = 0;
+    }
+    item->bitmap.format = item->image_format;
+    item->bitmap.x = item->width;
+    item->bitmap.y = item->height;
+    item->bitmap.stride = item->stride;
+    item->bitmap.palette = NULL;
+    item->bitmap.palette_id = 0;
+    item->bitmap.data = spice_chunks_new_linear(data, item->stride * item->height);
+    ring_add(&surface->zero_copy_images, &item->surface_link);
+    return true;
+}
+
+static RedImageItem *dcc_add_surface_band_image(DisplayChannelClient *dcc,
+                                                int surface_id,
+                                                SpiceRect *area,
+                                                GList *pipe_item_pos,
+                                                int can_lossy,
+                                                bool tile)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    RedSurface *surface = display_channel_get_surface(display, surface_id);
     SpiceCanvas *canvas = surface->context.canvas;
     RedImageItem *item;
     int stride;
@@ -338,9 +481,9 @@ RedImageItem *dcc_add_surface_area_image(DisplayChannelClient *dcc,
     bpp = SPICE_SURFACE_FMT_DEPTH(surface->context.format) / 8;
     stride = width * bpp;
 
-    item = (RedImageItem *)spice_malloc_n_m(height, stride, sizeof(RedImageItem));
+    item = spice_new0(RedImageItem, 1);
 
-    red_pipe_item_init(&item->base, RED_PIPE_ITEM_TYPE_IMAGE);
+    red_pipe_item_init_full(&item->base, RED_PIPE_ITEM_TYPE_IMAGE, red_image_item_free);
 
     item->surface_id = surface_id;
     item->image_format =
@@ -353,7 +496,14 @@ RedImageItem *dcc_add_surface_area_image(DisplayChannelClient *dcc,
     item->stride = stride;
     item->top_down = surface->context.top_down;
     item->can_lossy = can_lossy;
+    item->compress_job = NULL;
+    ring_item_init(&item->surface_link);
+
+    if (dcc_use_surface_area(dcc, item, surface, area)) {
+        goto add;
+    }
 
+    item = spice_realloc(item, sizeof(RedImageItem) + (size_t)height * stride);
     canvas->ops->read_bits(canvas, item->data, stride, area);
 
     /* For 32bit non-primary surfaces we need to keep any non-zero
@@ -368,6 +518,22 @@ RedImageItem *dcc_add_surface_area_image(DisplayChannelClient *dcc,
         }
     }
 
+    item->bitmap.format = item->image_format;
+    item->bitmap.flags = item->top_down ? SPICE_BITMAP_FLAGS_TOP_DOWN : 0;
+    item->bitmap.x = width;
+    item->bitmap.y = height;
+    item->bitmap.stride = stride;
+    item->bitmap.palette = NULL;
+    item->bitmap.palette_id = 0;
+    item->bitmap.data = spice_chunks_new_linear(item->data, stride * height);
+
+    if (display->priv->compress_pool &&
+        stride * (uint64_t)height >= COMPRESS_POOL_MIN_IMAGE_SIZE &&
+        reds_stream_get_family(red_channel_client_get_stream(RED_CHANNEL_CLIENT(dcc))) != AF_UNIX) {
+        item->compress_job = dcc_submit_compress_job(dcc, &item->bitmap, NULL, can_lossy, tile);
+    }
+
+add:
     if (pipe_item_pos) {
         red_channel_client_pipe_add_after_pos(RED_CHANNEL_CLIENT(dcc), &item->base, pipe_item_pos);
     } else {
@@ -377,6 +543,72 @@ RedImageItem *dcc_add_surface_area_image(DisplayChannelClient *dcc,
     return item;
 }
 
+/* Returns the height of the bands @area should be split in so they can be
+ * compressed concurrently, or the height of @area to send it in one piece */
+static int dcc_get_image_band_height(DisplayChannelClient *dcc, int surface_id,
+                                     const SpiceRect *area)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    CompressPool *pool = display->priv->compress_pool;
+    int width = area->right - area->left;
+    int height = area->bottom - area->top;
+    unsigned int n_bands;
+
+    /* the alpha detection of other surfaces must be done on the whole image */
+    if (!pool || !is_primary_surface(display, surface_id) ||
+        display->priv->image_tile_threshold == 0 ||
+        width * (uint64_t)height < display->priv->image_tile_threshold) {
+        return height;
+    }
+    if (reds_stream_get_family(red_channel_client_get_stream(RED_CHANNEL_CLIENT(dcc))) == AF_UNIX) {
+        return height;
+    }
+
+    n_bands = MIN(compress_pool_get_n_threads(pool) * COMPRESS_POOL_TILES_PER_THREAD,
+                  height / COMPRESS_POOL_MIN_TILE_HEIGHT);
+    if (n_bands <= 1) {
+        return height;
+    }
+
+    return (height + n_bands - 1) / n_bands;
+}
+
+// adding the pipe item after pos. If pos == NULL, adding to head.
+// Large images are split in several items, the first one is returned.
+RedImageItem *dcc_add_surface_area_image(DisplayChannelClient *dcc,
+                                         int surface_id,
+                                         SpiceRect *area,
+                                         GList *pipe_item_pos,
+                                         int can_lossy)
+{
+    RedImageItem *item = NULL;
+    SpiceRect band;
+    int band_height;
+
+    spice_assert(area);
+
+    band_height = dcc_get_image_band_height(dcc, surface_id, area);
+    if (band_height == area->bottom - area->top) {
+        return dcc_add_surface_band_image(dcc, surface_id, area, pipe_item_pos, can_lossy, false);
+    }
+
+    /* bands don't overlap and are drawn with OP_PUT so their order
+     * in the pipe does not matter */
+    band = *area;
+    for (band.top = area->top; band.top < area->bottom; band.top = band.bottom) {
+        RedImageItem *band_item;
+
+        band.bottom = MIN(band.top + band_height, area->bottom);
+        band_item = dcc_add_surface_band_image(dcc, surface_id, &band, pipe_item_pos,
+                                               can_lossy, true);
+        if (!item) {
+            item = band_item;
+        }
+    }
+
+    return item;
+}
+
 void dcc_push_surface_image(DisplayChannelClient *dcc, int surface_id)
 {
     DisplayChannel *display;
@@ -388,7 +620,7 @@ void dcc_push_surface_image(DisplayChannelClient *dcc, int surface_id)
     }
 
     display = DCC_TO_DC(dcc);
-    surface = &display->priv->surfaces[surface_id];
+    surface = display_channel_get_surface(display, surface_id);
     if (!surface->context.canvas) {
         return;
     }
@@ -412,7 +644,7 @@ static void add_drawable_surface_images(DisplayChannelClient *dcc, Drawable *dra
 
         surface_id = drawable->surface_deps[x];
         if (surface_id != -1) {
-            if (dcc->priv->surface_client_created[surface_id]) {
+            if (dcc_get_surface(dcc, surface_id)->created) {
                 continue;
             }
             dcc_create_surface(dcc, surface_id);
@@ -421,7 +653,7 @@ static void add_drawable_surface_images(DisplayChannelClient *dcc, Drawable *dra
         }
     }
 
-    if (dcc->priv->surface_client_created[drawable->surface_id]) {
+    if (dcc_get_surface(dcc, drawable->surface_id)->created) {
         return;
     }
 
@@ -430,15 +662,125 @@ static void add_drawable_surface_images(DisplayChannelClient *dcc, Drawable *dra
     dcc_push_surface_image(dcc, drawable->surface_id);
 }
 
+static void red_drawable_pipe_item_release(void *opaque)
+{
+    RedDrawablePipeItem *dpi = opaque;
+
+    drawable_unref(dpi->drawable);
+    free(dpi);
+}
+
 static void red_drawable_pipe_item_free(RedPipeItem *item)
 {
     RedDrawablePipeItem *dpi = SPICE_CONTAINEROF(item, RedDrawablePipeItem,
                                                  dpi_pipe_item);
     spice_assert(item->refcount == 0);
 
+    if (dpi->video_frame) {
+        dpi->video_frame->release(dpi->video_frame);
+    }
     dpi->drawable->pipes = g_list_remove(dpi->drawable->pipes, dpi);
-    drawable_unref(dpi->drawable);
-    free(dpi);
+    if (dpi->compress_job) {
+        compress_job_free(dpi->compress_job, red_drawable_pipe_item_release, dpi);
+        return;
+    }
+    red_drawable_pipe_item_release(dpi);
+}
+
+/* Hands the source bitmap of @dpi to the compression threads so that it is
+ * ready by the time the pipe item is marshalled (see dcc_compress_image) */
+static void dcc_precompress_drawable(DisplayChannelClient *dcc, RedDrawablePipeItem *dpi)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    CompressPool *pool = display->priv->compress_pool;
+    Drawable *drawable = dpi->drawable;
+    RedDrawable *red_drawable = drawable->red_drawable;
+    SpiceImage *simage;
+    SpiceBitmap *src;
+    int can_lossy;
+
+    if (!pool || drawable->stream) {
+        return;
+    }
+    /* bitmaps are sent uncompressed over unix sockets, see fill_bits() */
+    if (reds_stream_get_family(red_channel_client_get_stream(RED_CHANNEL_CLIENT(dcc))) == AF_UNIX) {
+        return;
+    }
+
+    /* can_lossy must match what dcc-send.c passes to fill_bits() */
+    switch (red_drawable->type) {
+    case QXL_DRAW_COPY:
+        simage = red_drawable->u.copy.src_bitmap;
+        can_lossy = display->priv->enable_jpeg;
+        break;
+    case QXL_DRAW_OPAQUE: {
+        int rop = red_drawable->u.opaque.rop_descriptor;
+
+        simage = red_drawable->u.opaque.src_bitmap;
+        can_lossy = display->priv->enable_jpeg &&
+                    !((rop & SPICE_ROPD_OP_OR) ||
+                      (rop & SPICE_ROPD_OP_AND) ||
+                      (rop & SPICE_ROPD_OP_XOR));
+        break;
+    }
+    default:
+        return;
+    }
+
+    if (simage == NULL || simage->descriptor.type != SPICE_IMAGE_TYPE_BITMAP) {
+        return;
+    }
+    src = &simage->u.bitmap;
+    /* unstable chunks get linearized in place by the encoders, which is not
+     * safe if several clients compress the same drawable */
+    if (src->y * (uint64_t)src->stride < COMPRESS_POOL_MIN_IMAGE_SIZE ||
+        (src->data->flags & SPICE_CHUNKS_FLAGS_UNSTABLE)) {
+        return;
+    }
+
+    dpi->compress_job = dcc_submit_compress_job(dcc, src, drawable, can_lossy, false);
+}
+
+/* Lets the stream's video encoder start on the frame of @dpi so that it is
+ * ready by the time the pipe item is marshalled (see red_marshall_stream_data) */
+static void dcc_submit_video_frame(DisplayChannelClient *dcc, RedDrawablePipeItem *dpi)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+    Drawable *drawable = dpi->drawable;
+    RedDrawable *red_drawable = drawable->red_drawable;
+    Stream *stream = drawable->stream;
+    StreamAgent *agent;
+    SpiceCopy *copy;
+
+    if (!stream || red_drawable->type != QXL_DRAW_COPY) {
+        return;
+    }
+    agent = &dcc->priv->stream_agents[display_channel_get_stream_id(display, stream)];
+    if (!agent->video_encoder || !agent->video_encoder->submit_frame) {
+        return;
+    }
+    copy = &red_drawable->u.copy;
+    if (copy->src_bitmap->descriptor.type != SPICE_IMAGE_TYPE_BITMAP) {
+        return;
+    }
+    if (stream_frame_is_sized(stream, drawable) &&
+        !red_channel_client_test_remote_cap(RED_CHANNEL_CLIENT(dcc),
+                                            SPICE_DISPLAY_CAP_SIZED_STREAM)) {
+        return;
+    }
+
+    /* workaround for vga streams */
+    dpi->video_frame_mm_time = red_drawable->mm_time ?
+                                   red_drawable->mm_time :
+                                   reds_get_mm_time();
+    dpi->video_frame = agent->video_encoder->submit_frame(agent->video_encoder,
+                                                          dpi->video_frame_mm_time,
+                                                          &copy->src_bitmap->u.bitmap,
+                                                          &copy->src_area, stream->top_down,
+                                                          NULL, red_drawable);
+    if (dpi->video_frame) {
+        region_clear(&agent->damage);
+    }
 }
 
 static RedDrawablePipeItem *red_drawable_pipe_item_new(DisplayChannelClient *dcc,
@@ -453,6 +795,8 @@ static RedDrawablePipeItem *red_drawable_pipe_item_new(DisplayChannelClient *dcc
     red_pipe_item_init_full(&dpi->dpi_pipe_item, RED_PIPE_ITEM_TYPE_DRAW,
                             red_drawable_pipe_item_free);
     drawable->refs++;
+    dcc_precompress_drawable(dcc, dpi);
+    dcc_submit_video_frame(dcc, dpi);
     return dpi;
 }
 
@@ -490,6 +834,7 @@ static void dcc_init_stream_agents(DisplayChannelClient *dcc)
         agent->stream = display_channel_get_nth_stream(display, i);
         region_init(&agent->vis_region);
         region_init(&agent->clip);
+        region_init(&agent->damage);
     }
 }
 
@@ -576,7 +921,7 @@ void dcc_start(DisplayChannelClient *dcc)
         return;
 
     red_channel_client_ack_zero_messages_window(rcc);
-    if (display->priv->surfaces[0].context.canvas) {
+    if (display_channel_get_surface(display, 0)->context.canvas) {
         display_channel_current_flush(display, 0);
         red_channel_client_pipe_add_type(rcc, RED_PIPE_ITEM_TYPE_INVAL_PALETTE_CACHE);
         dcc_create_surface(dcc, 0);
@@ -584,10 +929,10 @@ void dcc_start(DisplayChannelClient *dcc)
         dcc_push_monitors_config(dcc);
         red_channel_client_pipe_add_empty_msg(rcc, SPICE_MSG_DISPLAY_MARK);
         dcc_create_all_streams(dcc);
+        dcc_create_gl_stream(dcc);
     }
 
-    if (reds_stream_is_plain_unix(red_channel_client_get_stream(rcc)) &&
-        red_channel_client_test_remote_cap(rcc, SPICE_DISPLAY_CAP_GL_SCANOUT)) {
+    if (!dcc_gl_scanout_is_streamed(dcc)) {
         red_channel_client_pipe_add(rcc, dcc_gl_scanout_item_new(rcc, NULL, 0));
         dcc_push_monitors_config(dcc);
     }
@@ -601,6 +946,7 @@ static void dcc_destroy_stream_agents(DisplayChannelClient *dcc)
         StreamAgent *agent = &dcc->priv->stream_agents[i];
         region_destroy(&agent->vis_region);
         region_destroy(&agent->clip);
+        region_destroy(&agent->damage);
         if (agent->video_encoder) {
             agent->video_encoder->destroy(agent->video_encoder);
             agent->video_encoder = NULL;
@@ -694,15 +1040,20 @@ static RedSurfaceDestroyItem *red_surface_destroy_item_new(RedChannel *channel,
     return destroy;
 }
 
+bool dcc_gl_scanout_is_streamed(DisplayChannelClient *dcc)
+{
+    RedChannelClient *rcc = RED_CHANNEL_CLIENT(dcc);
+
+    /* the dmabuf can only be passed over a local socket */
+    return !reds_stream_is_plain_unix(red_channel_client_get_stream(rcc)) ||
+           !red_channel_client_test_remote_cap(rcc, SPICE_DISPLAY_CAP_GL_SCANOUT);
+}
+
 RedPipeItem *dcc_gl_scanout_item_new(RedChannelClient *rcc, void *data, int num)
 {
     RedGlScanoutUnixItem *item;
 
-    /* FIXME: on !unix peer, start streaming with a video codec */
-    if (!reds_stream_is_plain_unix(red_channel_client_get_stream(rcc)) ||
-        !red_channel_client_test_remote_cap(rcc, SPICE_DISPLAY_CAP_GL_SCANOUT)) {
-        spice_printerr("FIXME: client does not support GL scanout");
-        red_channel_client_disconnect(rcc);
+    if (dcc_gl_scanout_is_streamed(DISPLAY_CHANNEL_CLIENT(rcc))) {
         return NULL;
     }
 
@@ -718,10 +1069,8 @@ RedPipeItem *dcc_gl_draw_item_new(RedChannelClient *rcc, void *data, int num)
     const SpiceMsgDisplayGlDraw *draw = data;
     RedGlDrawItem *item;
 
-    if (!reds_stream_is_plain_unix(red_channel_client_get_stream(rcc)) ||
-        !red_channel_client_test_remote_cap(rcc, SPICE_DISPLAY_CAP_GL_SCANOUT)) {
-        spice_printerr("FIXME: client does not support GL scanout");
-        red_channel_client_disconnect(rcc);
+    /* streamed clients are not waited for, see gl_stream_draw() */
+    if (dcc_gl_scanout_is_streamed(dcc)) {
         return NULL;
     }
 
@@ -747,11 +1096,11 @@ void dcc_destroy_surface(DisplayChannelClient *dcc, uint32_t surface_id)
     channel = RED_CHANNEL(display);
 
     if (common_graphics_channel_get_during_target_migrate(COMMON_GRAPHICS_CHANNEL(display)) ||
-        !dcc->priv->surface_client_created[surface_id]) {
+        !dcc_get_surface(dcc, surface_id)->created) {
         return;
     }
 
-    dcc->priv->surface_client_created[surface_id] = FALSE;
+    dcc_get_surface(dcc, surface_id)->created = FALSE;
     destroy = red_surface_destroy_item_new(channel, surface_id);
     red_channel_client_pipe_add(RED_CHANNEL_CLIENT(dcc), &destroy->pipe_item);
 }
@@ -840,25 +1189,71 @@ static SpiceImageCompression get_compression_for_bitmap(SpiceBitmap *bitmap,
     return SPICE_IMAGE_COMPRESSION_INVALID;
 }
 
+/* Resolves the encoder to use for @src: JPEG is reported as
+ * SPICE_IMAGE_COMPRESSION_QUIC with @use_jpeg set, and LZ4 is replaced by LZ
+ * when the client can't decode it */
+static SpiceImageCompression dcc_get_image_compression(DisplayChannelClient *dcc,
+                                                       SpiceBitmap *src, Drawable *drawable,
+                                                       int can_lossy, int *use_jpeg)
+{
+    DisplayChannel *display_channel = DCC_TO_DC(dcc);
+    SpiceImageCompression image_compression;
+
+    *use_jpeg = FALSE;
+    image_compression = get_compression_for_bitmap(src, dcc->priv->image_compression, drawable);
+    switch (image_compression) {
+    case SPICE_IMAGE_COMPRESSION_QUIC:
+        *use_jpeg = can_lossy && display_channel->priv->enable_jpeg &&
+                    (src->format != SPICE_BITMAP_FMT_RGBA || !bitmap_has_extra_stride(src));
+        break;
+    case SPICE_IMAGE_COMPRESSION_LZ4:
+#ifdef USE_LZ4
+        if (red_channel_client_test_remote_cap(RED_CHANNEL_CLIENT(dcc),
+                                               SPICE_DISPLAY_CAP_LZ4_COMPRESSION)) {
+            break;
+        }
+#endif
+        image_compression = SPICE_IMAGE_COMPRESSION_LZ;
+        break;
+    default:
+        break;
+    }
+
+    return image_compression;
+}
+
 int dcc_compress_image(DisplayChannelClient *dcc,
                        SpiceImage *dest, SpiceBitmap *src, Drawable *drawable,
                        int can_lossy,
                        compress_send_data_t* o_comp_data)
 {
     DisplayChannel *display_channel = DCC_TO_DC(dcc);
+    CompressJob *job = dcc->priv->send_data.compress_job;
     SpiceImageCompression image_compression;
     stat_start_time_t start_time;
+    RedStatTimer timer;
+    int use_jpeg;
     int success = FALSE;
 
     stat_start_time_init(&start_time, &display_channel->priv->encoder_shared_data.off_stat);
+    stat_timer_start(&timer);
+
+    /* already compressed by the compression threads, unless the client
+     * settings changed meanwhile. The job is then freed with its pipe item. */
+    if (job && job->src == src && job->can_lossy == can_lossy &&
+        job->preferred_compression == dcc->priv->image_compression &&
+        job->enable_jpeg == display_channel->priv->enable_jpeg) {
+        dcc->priv->send_data.compress_job = NULL;
+        success = compress_job_finish(job, dest, o_comp_data);
+        goto done;
+    }
 
-    image_compression = get_compression_for_bitmap(src, dcc->priv->image_compression, drawable);
+    image_compression = dcc_get_image_compression(dcc, src, drawable, can_lossy, &use_jpeg);
     switch (image_compression) {
     case SPICE_IMAGE_COMPRESSION_OFF:
         break;
     case SPICE_IMAGE_COMPRESSION_QUIC:
-        if (can_lossy && display_channel->priv->enable_jpeg &&
-            (src->format != SPICE_BITMAP_FMT_RGBA || !bitmap_has_extra_stride(src))) {
+        if (use_jpeg) {
             success = image_encoders_compress_jpeg(&dcc->priv->encoders, dest, src, o_comp_data);
             break;
         }
@@ -875,28 +1270,26 @@ int dcc_compress_image(DisplayChannelClient *dcc,
         goto lz_compress;
 #ifdef USE_LZ4
     case SPICE_IMAGE_COMPRESSION_LZ4:
-        if (red_channel_client_test_remote_cap(RED_CHANNEL_CLIENT(dcc),
-                                               SPICE_DISPLAY_CAP_LZ4_COMPRESSION)) {
-            success = image_encoders_compress_lz4(&dcc->priv->encoders, dest, src, o_comp_data);
-            break;
-        }
+        success = image_encoders_compress_lz4(&dcc->priv->encoders, dest, src, o_comp_data);
+        break;
 #endif
-        /* fall through */
     case SPICE_IMAGE_COMPRESSION_LZ:
 lz_compress:
         success = image_encoders_compress_lz(&dcc->priv->encoders, dest, src, o_comp_data);
-        if (success && !bitmap_fmt_is_rgb(src->format)) {
-            dcc_palette_cache_palette(dcc, dest->u.lz_plt.palette, &(dest->u.lz_plt.flags));
-        }
         break;
     default:
         spice_error("invalid image compression type %u", image_compression);
     }
 
+done:
+    if (success && dest->descriptor.type == SPICE_IMAGE_TYPE_LZ_PLT) {
+        dcc_palette_cache_palette(dcc, dest->u.lz_plt.palette, &(dest->u.lz_plt.flags));
+    }
     if (!success) {
         uint64_t image_size = src->stride * (uint64_t)src->y;
         stat_compress_add(&display_channel->priv->encoder_shared_data.off_stat, start_time, image_size, image_size);
     }
+    stat_timer_add(display_channel->priv->compress_time_counter, &timer);
 
     return success;
 }
@@ -1263,13 +1656,17 @@ static int dcc_handle_migrate_glz_dictionary(DisplayChannelClient *dcc,
 
 static bool restore_surface(DisplayChannelClient *dcc, uint32_t surface_id)
 {
+    if (surface_id >= sparse_array_get_size(dcc->priv->surfaces)) {
+        spice_warning("invalid surface_id %u", surface_id);
+        return FALSE;
+    }
     /* we don't process commands till we receive the migration data, thus,
      * we should have not sent any surface to the client. */
-    if (dcc->priv->surface_client_created[surface_id]) {
+    if (dcc_get_surface(dcc, surface_id)->created) {
         spice_warning("surface %u is already marked as client_created", surface_id);
         return FALSE;
     }
-    dcc->priv->surface_client_created[surface_id] = TRUE;
+    dcc_get_surface(dcc, surface_id)->created = TRUE;
     return TRUE;
 }
 
@@ -1298,6 +1695,7 @@ static bool restore_surfaces_lossy(DisplayChannelClient *dcc,
         uint32_t surface_id = mig_surfaces->surfaces[i].id;
         SpiceMigrateDataRect *mig_lossy_rect;
         SpiceRect lossy_rect;
+        DccSurface *surface;
 
         if (!restore_surface(dcc, surface_id))
             return FALSE;
@@ -1307,8 +1705,9 @@ static bool restore_surfaces_lossy(DisplayChannelClient *dcc,
         lossy_rect.top = mig_lossy_rect->top;
         lossy_rect.right = mig_lossy_rect->right;
         lossy_rect.bottom = mig_lossy_rect->bottom;
-        region_init(&dcc->priv->surface_client_lossy_region[surface_id]);
-        region_add(&dcc->priv->surface_client_lossy_region[surface_id], &lossy_rect);
+        surface = dcc_get_surface(dcc, surface_id);
+        region_init(&surface->lossy_region);
+        region_add(&surface->lossy_region, &lossy_rect);
     }
     return TRUE;
 }
@@ -1427,6 +1826,11 @@ static bool dcc_config_socket(RedChannelClient *rcc)
     MainChannelClient *mcc = red_client_get_main(client);
 
     DISPLAY_CHANNEL_CLIENT(rcc)->is_low_bandwidth = main_channel_client_is_low_bandwidth(mcc);
+    /* MSG_ZEROCOPY only pays off on fast networks */
+    if (spice_env_get_bool("SPICE_ZEROCOPY", FALSE) &&
+        !reds_stream_enable_zerocopy(red_channel_client_get_stream(rcc))) {
+        spice_debug("zero-copy writes are not available for this client");
+    }
 
     return common_channel_client_config_socket(rcc);
 }
@@ -22,9 +22,11 @@
 #include <glib-object.h>
 
 #include "image-encoders.h"
+#include "compress-pool.h"
 #include "image-cache.h"
 #include "pixmap-cache.h"
 #include "display-limits.h"
+#include "video-encoder.h"
 #include "common-graphics-channel.h"
 
 G_BEGIN_DECLS
@@ -120,6 +122,11 @@ typedef struct RedImageItem {
     int image_format;
     uint32_t image_flags;
     int can_lossy;
+    SpiceBitmap bitmap; /* wraps data for the image encoders */
+    CompressJob *compress_job;
+    /* linked while bitmap reads the pixels in the surface memory rather than
+     * data, see red_image_items_copy_surface_area() */
+    RingItem surface_link;
     uint8_t data[0];
 } RedImageItem;
 
@@ -127,6 +134,9 @@ typedef struct RedDrawablePipeItem {
     RedPipeItem dpi_pipe_item; /* link for the client's pipe itself */
     Drawable *drawable;
     DisplayChannelClient *dcc;
+    CompressJob *compress_job; /* source bitmap being compressed ahead of sending */
+    VideoEncoderFrame *video_frame; /* stream frame being encoded ahead of sending */
+    uint32_t video_frame_mm_time;
 } RedDrawablePipeItem;
 
 DisplayChannelClient*      dcc_new                                   (DisplayChannel *display,
@@ -151,6 +161,7 @@ void                       dcc_stream_agent_clip                     (DisplayCha
                                                                       StreamAgent *agent);
 void                       dcc_create_stream                         (DisplayChannelClient *dcc,
                                                                       Stream *stream);
+void                       dcc_create_gl_stream                      (DisplayChannelClient *dcc);
 void                       dcc_create_surface                        (DisplayChannelClient *dcc,
                                                                       int surface_id);
 void                       dcc_push_surface_image                    (DisplayChannelClient *dcc,
@@ -160,6 +171,9 @@ RedImageItem *             dcc_add_surface_area_image                (DisplayCha
                                                                       SpiceRect *area,
                                                                       GList *pipe_item_pos,
                                                                       int can_lossy);
+void                       red_image_item_copy_surface               (RedImageItem *item);
+void                       red_image_items_copy_surface_area         (Ring *items,
+                                                                      const SpiceRect *area);
 void                       dcc_palette_cache_reset                   (DisplayChannelClient *dcc);
 void                       dcc_palette_cache_palette                 (DisplayChannelClient *dcc,
                                                                       SpicePalette *palette,
@@ -180,6 +194,9 @@ bool                       dcc_clear_surface_drawables_from_pipe     (DisplayCha
                                                                       int wait_if_used);
 bool                       dcc_drawable_is_in_pipe                   (DisplayChannelClient *dcc,
                                                                       Drawable *drawable);
+/* Whether the client gets the GL scanout as a video stream rather than as a
+ * dmabuf */
+bool                       dcc_gl_scanout_is_streamed                (DisplayChannelClient *dcc);
 RedPipeItem *              dcc_gl_scanout_item_new                   (RedChannelClient *rcc,
                                                                       void *data, int num);
 RedPipeItem *              dcc_gl_draw_item_new                      (RedChannelClient *rcc,
@@ -24,7 +24,7 @@
 #include <string.h>
 #include <pthread.h>
 #include <fcntl.h>
-#include <poll.h>
+#include <sys/eventfd.h>
 
 #include <common/mem.h>
 #include <common/spice_common.h>
@@ -42,13 +42,46 @@ G_DEFINE_TYPE(Dispatcher, dispatcher, G_TYPE_OBJECT)
 
 #define DISPATCHER_PRIVATE(o) (G_TYPE_INSTANCE_GET_PRIVATE ((o), TYPE_DISPATCHER, DispatcherPrivate))
 
+/*
+ * Messages are copied into a bounded lock-free ring shared by all the
+ * senders (multiple producers) and the receiving thread (single consumer),
+ * see http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ *
+ * Each slot holds the message type followed by the payload. A slot is free
+ * for the producer at position pos when its sequence is pos, and ready for
+ * the consumer when its sequence is pos + 1.
+ */
+#define DISPATCHER_RING_SIZE 256
+
+typedef struct DispatcherSlot {
+    unsigned int sequence;
+    uint32_t message_type;
+    int *ack_done; /* set by the receiver for DISPATCHER_ACK messages */
+    uint64_t payload[0];
+} DispatcherSlot;
+
 struct DispatcherPrivate {
+    /* eventfd, only written to wake up the receiver when it may be idle */
     int recv_fd;
-    int send_fd;
     pthread_t thread_id;
+    /* only used on slow paths: waiting for an ack or for a free slot */
     pthread_mutex_t lock;
+    pthread_cond_t ack_cond;
+    pthread_cond_t space_cond;
+    int space_waiters;
+
+    uint8_t *slots;
+    size_t slot_size;
+    unsigned int enqueue_pos;
+    unsigned int dequeue_pos;
+    /* messages queued minus messages handled, the sender moving it from 0
+     * wakes up the receiver */
+    int pending;
+    /* set by the receiver when it leaves queued messages it could not read
+     * yet, the next sender done with its slot wakes it up */
+    int recv_stalled;
+
     DispatcherMessage *messages;
-    int stage;  /* message parser stage - sender has no stages */
     guint max_message_type;
     void *payload; /* allocated as max of message sizes */
     size_t payload_size; /* used to track realloc calls */
@@ -110,31 +143,49 @@ dispatcher_finalize(GObject *object)
 {
     Dispatcher *self = DISPATCHER(object);
     g_free(self->priv->messages);
-    close(self->priv->send_fd);
     close(self->priv->recv_fd);
+    pthread_cond_destroy(&self->priv->space_cond);
+    pthread_cond_destroy(&self->priv->ack_cond);
     pthread_mutex_destroy(&self->priv->lock);
+    free(self->priv->slots);
     free(self->priv->payload);
     G_OBJECT_CLASS(dispatcher_parent_class)->finalize(object);
 }
 
+static void dispatcher_ring_alloc(DispatcherPrivate *priv, size_t payload_size)
+{
+    unsigned int i;
+
+    free(priv->slots);
+    /* keep the payloads 8 bytes aligned */
+    priv->slot_size = sizeof(DispatcherSlot) + SPICE_ALIGN(payload_size, sizeof(uint64_t));
+    priv->slots = spice_malloc_n(DISPATCHER_RING_SIZE, priv->slot_size);
+    for (i = 0; i < DISPATCHER_RING_SIZE; i++) {
+        DispatcherSlot *slot = (DispatcherSlot *)(priv->slots + i * priv->slot_size);
+        slot->sequence = priv->enqueue_pos + i;
+    }
+    priv->dequeue_pos = priv->enqueue_pos;
+}
+
 static void dispatcher_constructed(GObject *object)
 {
     Dispatcher *self = DISPATCHER(object);
-    int channels[2];
 
     G_OBJECT_CLASS(dispatcher_parent_class)->constructed(object);
 
 #ifdef DEBUG_DISPATCHER
     setup_dummy_signal_handler();
 #endif
-    if (socketpair(AF_LOCAL, SOCK_STREAM, 0, channels) == -1) {
-        spice_error("socketpair failed %s", strerror(errno));
+    self->priv->recv_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (self->priv->recv_fd == -1) {
+        spice_error("eventfd failed %s", strerror(errno));
         return;
     }
     pthread_mutex_init(&self->priv->lock, NULL);
-    self->priv->recv_fd = channels[0];
-    self->priv->send_fd = channels[1];
+    pthread_cond_init(&self->priv->ack_cond, NULL);
+    pthread_cond_init(&self->priv->space_cond, NULL);
     self->priv->thread_id = pthread_self();
+    dispatcher_ring_alloc(self->priv, 0);
 
     self->priv->messages = g_new0(DispatcherMessage,
                                   self->priv->max_message_type);
@@ -188,164 +239,215 @@ dispatcher_new(size_t max_message_type, void *opaque)
 }
 
 
-#define ACK 0xffffffff
+static inline DispatcherSlot *dispatcher_get_slot(DispatcherPrivate *priv, unsigned int pos)
+{
+    return (DispatcherSlot *)(priv->slots + (pos % DISPATCHER_RING_SIZE) * priv->slot_size);
+}
 
 /*
- * read_safe
- * helper. reads until size bytes accumulated in buf, if an error other then
- * EINTR is encountered returns -1, otherwise returns 0.
- * @block if 1 the read will block (the fd is always blocking).
- *        if 0 poll first, return immediately if no bytes available, otherwise
- *         read size in blocking mode.
+ * dispatcher_ring_push
+ * Can be called concurrently from any number of threads.
+ * @return FALSE if the ring is full
  */
-static int read_safe(int fd, uint8_t *buf, size_t size, int block)
+static int dispatcher_ring_push(DispatcherPrivate *priv, uint32_t message_type,
+                                void *payload, size_t size, int *ack_done)
 {
-    int read_size = 0;
-    int ret;
-    struct pollfd pollfd = {.fd = fd, .events = POLLIN, .revents = 0};
-
-    if (size == 0) {
-        return 0;
-    }
-
-    if (!block) {
-        while ((ret = poll(&pollfd, 1, 0)) == -1) {
-            if (errno == EINTR) {
-                spice_debug("EINTR in poll");
-                continue;
+    DispatcherSlot *slot;
+    unsigned int pos = __atomic_load_n(&priv->enqueue_pos, __ATOMIC_RELAXED);
+
+    for (;;) {
+        int diff;
+
+        slot = dispatcher_get_slot(priv, pos);
+        diff = (int)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&priv->enqueue_pos, &pos, pos + 1, TRUE,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
             }
-            spice_error("poll failed");
-            return -1;
+            /* pos was updated by the failed exchange */
+        } else if (diff < 0) {
+            return FALSE;
+        } else {
+            pos = __atomic_load_n(&priv->enqueue_pos, __ATOMIC_RELAXED);
         }
-        if (!(pollfd.revents & POLLIN)) {
-            return 0;
-        }
-    }
-    while (read_size < size) {
-        ret = read(fd, buf + read_size, size - read_size);
-        if (ret == -1) {
-            if (errno == EINTR) {
-                spice_debug("EINTR in read");
-                continue;
-            }
-            return -1;
-        }
-        if (ret == 0) {
-            spice_error("broken pipe on read");
-            return -1;
-        }
-        read_size += ret;
     }
-    return read_size;
+
+    slot->message_type = message_type;
+    slot->ack_done = ack_done;
+    memcpy(slot->payload, payload, size);
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+
+    return TRUE;
 }
 
 /*
- * write_safe
- * @return -1 for error, otherwise number of written bytes. may be zero.
+ * dispatcher_ring_pop
+ * Only called from the receiving thread. The payload is copied to
+ * priv->payload so the slot is released before the handler runs.
+ * @return FALSE if the ring is empty
  */
-static int write_safe(int fd, uint8_t *buf, size_t size)
+static int dispatcher_ring_is_ready(DispatcherPrivate *priv)
 {
-    int written_size = 0;
-    int ret;
-
-    while (written_size < size) {
-        ret = write(fd, buf + written_size, size - written_size);
-        if (ret == -1) {
-            if (errno != EINTR) {
-                return -1;
-            }
-            spice_debug("EINTR in write");
+    unsigned int pos = priv->dequeue_pos;
+    DispatcherSlot *slot = dispatcher_get_slot(priv, pos);
+
+    return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+static int dispatcher_ring_pop(DispatcherPrivate *priv, uint32_t *message_type, int **ack_done)
+{
+    unsigned int pos = priv->dequeue_pos;
+    DispatcherSlot *slot = dispatcher_get_slot(priv, pos);
+
+    if (!dispatcher_ring_is_ready(priv)) {
+        return FALSE;
+    }
+
+    *message_type = slot->message_type;
+    *ack_done = slot->ack_done;
+    memcpy(priv->payload, slot->payload, priv->messages[*message_type].size);
+    priv->dequeue_pos = pos + 1;
+    __atomic_store_n(&slot->sequence, pos + DISPATCHER_RING_SIZE, __ATOMIC_RELEASE);
+
+    /* the slot release must be visible before space_waiters is read */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&priv->space_waiters, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&priv->lock);
+        pthread_cond_broadcast(&priv->space_cond);
+        pthread_mutex_unlock(&priv->lock);
+    }
+    return TRUE;
+}
+
+static void dispatcher_wakeup(DispatcherPrivate *priv)
+{
+    uint64_t one = 1;
+
+    while (write(priv->recv_fd, &one, sizeof(one)) == -1) {
+        if (errno == EINTR) {
             continue;
         }
-        written_size += ret;
+        /* EAGAIN means the counter is about to overflow, the receiver
+         * is awake anyway */
+        if (errno != EAGAIN) {
+            spice_printerr("error waking up dispatcher: %d", errno);
+        }
+        break;
     }
-    return written_size;
 }
 
 static int dispatcher_handle_single_read(Dispatcher *dispatcher)
 {
-    int ret;
+    DispatcherPrivate *priv = dispatcher->priv;
     uint32_t type;
     DispatcherMessage *msg = NULL;
-    uint8_t *payload = dispatcher->priv->payload;
-    uint32_t ack = ACK;
+    uint8_t *payload = priv->payload;
+    int *ack_done;
 
-    if ((ret = read_safe(dispatcher->priv->recv_fd, (uint8_t*)&type, sizeof(type), 0)) == -1) {
-        spice_printerr("error reading from dispatcher: %d", errno);
-        return 0;
-    }
-    if (ret == 0) {
+    if (!dispatcher_ring_pop(priv, &type, &ack_done)) {
         /* no messsage */
         return 0;
     }
-    msg = &dispatcher->priv->messages[type];
-    if (read_safe(dispatcher->priv->recv_fd, payload, msg->size, 1) == -1) {
-        spice_printerr("error reading from dispatcher: %d", errno);
-        /* TODO: close socketpair? */
-        return 0;
-    }
-    if (dispatcher->priv->any_handler) {
-        dispatcher->priv->any_handler(dispatcher->priv->opaque, type, payload);
+    __atomic_sub_fetch(&priv->pending, 1, __ATOMIC_SEQ_CST);
+
+    msg = &priv->messages[type];
+    if (priv->any_handler) {
+        priv->any_handler(priv->opaque, type, payload);
     }
     if (msg->handler) {
-        msg->handler(dispatcher->priv->opaque, payload);
+        msg->handler(priv->opaque, payload);
     } else {
         spice_printerr("error: no handler for message type %d", type);
     }
     if (msg->ack == DISPATCHER_ACK) {
-        if (write_safe(dispatcher->priv->recv_fd,
-                       (uint8_t*)&ack, sizeof(ack)) == -1) {
-            spice_printerr("error writing ack for message %d", type);
-            /* TODO: close socketpair? */
-        }
-    } else if (msg->ack == DISPATCHER_ASYNC && dispatcher->priv->handle_async_done) {
-        dispatcher->priv->handle_async_done(dispatcher->priv->opaque, type, payload);
+        pthread_mutex_lock(&priv->lock);
+        *ack_done = TRUE;
+        pthread_cond_broadcast(&priv->ack_cond);
+        pthread_mutex_unlock(&priv->lock);
+    } else if (msg->ack == DISPATCHER_ASYNC && priv->handle_async_done) {
+        priv->handle_async_done(priv->opaque, type, payload);
     }
     return 1;
 }
 
 /*
  * dispatcher_handle_recv_read
- * doesn't handle being in the middle of a message. all reads are blocking.
+ * handles all the queued messages.
  */
 void dispatcher_handle_recv_read(Dispatcher *dispatcher)
 {
-    while (dispatcher_handle_single_read(dispatcher)) {
+    DispatcherPrivate *priv = dispatcher->priv;
+    uint64_t count;
+
+    /* clear the wakeup before looking at the ring so that a message queued
+     * after the ring was found empty triggers a new wakeup */
+    while (read(priv->recv_fd, &count, sizeof(count)) == -1 && errno == EINTR) {
     }
+    for (;;) {
+        while (dispatcher_handle_single_read(dispatcher)) {
+        }
+        if (__atomic_load_n(&priv->pending, __ATOMIC_SEQ_CST) <= 0) {
+            break;
+        }
+        /* Messages were queued but could not be read: a sender reserved an
+         * earlier slot and is still copying its payload. It won't do the
+         * wakeup as the counter is not 0, so ask for it. The slot is checked
+         * again in case it was filled before the sender could see the flag. */
+        __atomic_store_n(&priv->recv_stalled, TRUE, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!dispatcher_ring_is_ready(priv)) {
+            break;
+        }
+    }
+}
+
+int dispatcher_has_pending_messages(Dispatcher *dispatcher)
+{
+    return __atomic_load_n(&dispatcher->priv->pending, __ATOMIC_SEQ_CST) > 0;
 }
 
 void dispatcher_send_message(Dispatcher *dispatcher, uint32_t message_type,
                              void *payload)
 {
+    DispatcherPrivate *priv = dispatcher->priv;
     DispatcherMessage *msg;
-    uint32_t ack;
-    int send_fd = dispatcher->priv->send_fd;
-
-    assert(dispatcher->priv->max_message_type > message_type);
-    assert(dispatcher->priv->messages[message_type].handler);
-    msg = &dispatcher->priv->messages[message_type];
-    pthread_mutex_lock(&dispatcher->priv->lock);
-    if (write_safe(send_fd, (uint8_t*)&message_type, sizeof(message_type)) == -1) {
-        spice_printerr("error: failed to send message type for message %d",
-                   message_type);
-        goto unlock;
+    int ack_done = FALSE;
+
+    assert(priv->max_message_type > message_type);
+    assert(priv->messages[message_type].handler);
+    msg = &priv->messages[message_type];
+
+    if (!dispatcher_ring_push(priv, message_type, payload, msg->size, &ack_done)) {
+        /* ring full, wait for the receiver to make room */
+        pthread_mutex_lock(&priv->lock);
+        __atomic_add_fetch(&priv->space_waiters, 1, __ATOMIC_SEQ_CST);
+        while (!dispatcher_ring_push(priv, message_type, payload, msg->size, &ack_done)) {
+            pthread_cond_wait(&priv->space_cond, &priv->lock);
+        }
+        __atomic_sub_fetch(&priv->space_waiters, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&priv->lock);
     }
-    if (write_safe(send_fd, payload, msg->size) == -1) {
-        spice_printerr("error: failed to send message body for message %d",
-                   message_type);
-        goto unlock;
+
+    /* if the receiver already handled messages which were not counted yet
+     * the counter is negative and their senders will do the wakeup */
+    if (__atomic_fetch_add(&priv->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        dispatcher_wakeup(priv);
+    } else {
+        /* the slot must be visible before recv_stalled is read */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_exchange_n(&priv->recv_stalled, FALSE, __ATOMIC_SEQ_CST)) {
+            dispatcher_wakeup(priv);
+        }
     }
+
     if (msg->ack == DISPATCHER_ACK) {
-        if (read_safe(send_fd, (uint8_t*)&ack, sizeof(ack), 1) == -1) {
-            spice_printerr("error: failed to read ack");
-        } else if (ack != ACK) {
-            spice_printerr("error: got wrong ack value in dispatcher "
-                       "for message %d\n", message_type);
-            /* TODO handling error? */
+        pthread_mutex_lock(&priv->lock);
+        while (!ack_done) {
+            pthread_cond_wait(&priv->ack_cond, &priv->lock);
         }
+        pthread_mutex_unlock(&priv->lock);
     }
-unlock:
-    pthread_mutex_unlock(&dispatcher->priv->lock);
 }
 
 void dispatcher_register_async_done_callback(
@@ -369,8 +471,11 @@ void dispatcher_register_handler(Dispatcher *dispatcher, uint32_t message_type,
     msg->size = size;
     msg->ack = ack;
     if (msg->size > dispatcher->priv->payload_size) {
+        /* handlers are registered before any message is sent */
+        assert(dispatcher->priv->dequeue_pos == dispatcher->priv->enqueue_pos);
         dispatcher->priv->payload = realloc(dispatcher->priv->payload, msg->size);
         dispatcher->priv->payload_size = msg->size;
+        dispatcher_ring_alloc(dispatcher->priv, msg->size);
     }
 }
 
@@ -125,9 +125,17 @@ void dispatcher_register_universal_handler(Dispatcher *dispatcher,
  */
 void dispatcher_handle_recv_read(Dispatcher *);
 
+/*
+ *  dispatcher_has_pending_messages
+ *  @return: TRUE if messages are waiting to be handled. Can be called from
+ *           the receiving thread to let them preempt a long operation.
+ */
+int dispatcher_has_pending_messages(Dispatcher *dispatcher);
+
 /*
  *  dispatcher_get_recv_fd
- *  @return: receive file descriptor of the dispatcher
+ *  @return: file descriptor of the dispatcher, readable when messages
+ *           are waiting to be handled
  */
 int dispatcher_get_recv_fd(Dispatcher *);
 
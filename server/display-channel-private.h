@@ -19,14 +19,31 @@
 #define DISPLAY_CHANNEL_PRIVATE_H_
 
 #include "display-channel.h"
+#include "sparse-array.h"
+#include "scroll-detect.h"
 
+/* Default soft limit on the number of drawables, see
+ * display_channel_drawable_try_new() */
 #define NUM_DRAWABLES 1000
+#define MAX_DRAWABLES_LIMIT (1024 * 1024)
+/* Drawables are allocated by blocks of this size as needed, and the blocks
+ * are released once they are unused */
+#define DRAWABLES_BLOCK_SIZE 128
+typedef struct DrawablesBlock DrawablesBlock;
 typedef struct _Drawable _Drawable;
 struct _Drawable {
     union {
         Drawable drawable;
         _Drawable *next;
     } u;
+    DrawablesBlock *block;
+};
+
+struct DrawablesBlock {
+    RingItem link;
+    _Drawable *free_drawables;
+    uint32_t num_free;
+    _Drawable drawables[DRAWABLES_BLOCK_SIZE];
 };
 
 struct DisplayChannelPrivate
@@ -48,8 +65,14 @@ struct DisplayChannelPrivate
     Ring current_list;
 
     uint32_t drawable_count;
-    _Drawable drawables[NUM_DRAWABLES];
-    _Drawable *free_drawables;
+    uint32_t drawable_count_peak;
+    /* Above the soft limit each new drawable renders an old one. The
+     * drawables referenced by the pipes may take the number of drawables up
+     * to twice the soft limit before new ones must wait for them. */
+    uint32_t drawables_soft_limit;
+    uint32_t drawables_allocated;
+    /* the blocks with free drawables come first */
+    Ring drawables_blocks;
 
     int stream_video;
     GArray *video_codecs;
@@ -61,13 +84,19 @@ struct DisplayChannelPrivate
     uint32_t next_item_trace;
     uint64_t streams_size_total;
 
-    RedSurface surfaces[NUM_SURFACES];
+    /* n_surfaces RedSurface, see display_channel_get_surface() */
+    SparseArray *surfaces;
     uint32_t n_surfaces;
     SpiceImageSurfaces image_surfaces;
 
     ImageCache image_cache;
 
     int gl_draw_async_count;
+    /* the GL scanout as seen by the clients that cannot import it */
+    GlReadback *gl_readback;
+    bool gl_readback_failed;
+    Stream *gl_stream;
+    bool gl_stream_full_frame;
 
 /* TODO: some day unify this, make it more runtime.. */
     stat_info_t add_stat;
@@ -80,7 +109,40 @@ struct DisplayChannelPrivate
     RedStatCounter cache_hits_counter;
     RedStatCounter add_to_cache_counter;
     RedStatCounter non_cache_counter;
+    RedStatCounter drawables_forced_render_counter;
+    RedStatCounter compress_time_counter;
+    RedStatCounter marshal_time_counter;
+    RedStatCounter scroll_copy_bits_counter;
+    RedStatCounter scroll_copied_pixels_counter;
     ImageEncoderSharedData encoder_shared_data;
+    CompressPool *compress_pool;
+    SpiceWatch *compress_watch;
+    uint64_t image_tile_threshold;
+    /* the spatial index only pays off with many drawables on screen */
+    bool use_tree_index;
+    /* each repaint is hashed along with the content it replaces */
+    bool use_scroll_detection;
+    /* the last repaint that could have been a scroll, see scroll_process_draw() */
+    SpiceRect scroll_area;
+    ScrollDetectHashes scroll_hashes;
+    /* the images of the primary surface read its memory until it is drawn on */
+    bool use_zero_copy_images;
 };
 
+/* @surface_id must be below n_surfaces, see
+ * display_channel_validate_surface(). The surfaces are allocated as the
+ * guest uses them. */
+static inline RedSurface *display_channel_get_surface(DisplayChannel *display,
+                                                      uint32_t surface_id)
+{
+    return sparse_array_get(display->priv->surfaces, surface_id);
+}
+
+/* Returns NULL for the surfaces that were never used */
+static inline RedSurface *display_channel_lookup_surface(DisplayChannel *display,
+                                                         uint32_t surface_id)
+{
+    return sparse_array_lookup(display->priv->surfaces, surface_id);
+}
+
 #endif /* DISPLAY_CHANNEL_PRIVATE_H_ */
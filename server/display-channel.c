@@ -22,6 +22,7 @@
 
 #include "display-channel-private.h"
 #include "glib-compat.h"
+#include "tree-index.h"
 
 G_DEFINE_TYPE(DisplayChannel, display_channel, TYPE_COMMON_GRAPHICS_CHANNEL)
 
@@ -73,14 +74,27 @@ display_channel_set_property(GObject *object,
     }
 }
 
+static void drawables_free(DisplayChannel *display);
+
 static void
 display_channel_finalize(GObject *object)
 {
     DisplayChannel *self = DISPLAY_CHANNEL(object);
 
     display_channel_destroy_surfaces(self);
+    display_channel_release_compress_jobs(self, TRUE);
+    if (self->priv->compress_watch) {
+        SpiceCoreInterfaceInternal *core = red_channel_get_core_interface(RED_CHANNEL(self));
+        core->watch_remove(core, self->priv->compress_watch);
+    }
+    sparse_array_free(self->priv->surfaces);
+    drawables_free(self);
+    compress_pool_free(self->priv->compress_pool);
+    image_encoder_shared_free(&self->priv->encoder_shared_data);
     image_cache_reset(&self->priv->image_cache);
     monitors_config_unref(self->priv->monitors_config);
+    gl_readback_free(self->priv->gl_readback);
+    scroll_detect_hashes_clear(&self->priv->scroll_hashes);
     g_array_unref(self->priv->video_codecs);
     g_free(self->priv);
 
@@ -106,6 +120,9 @@ void display_channel_compress_stats_reset(DisplayChannel *display)
     spice_return_if_fail(display);
 
     image_encoder_shared_stat_reset(&display->priv->encoder_shared_data);
+    if (display->priv->compress_pool) {
+        compress_pool_stat_reset(display->priv->compress_pool);
+    }
 }
 
 void display_channel_compress_stats_print(DisplayChannel *display_channel)
@@ -119,6 +136,9 @@ void display_channel_compress_stats_print(DisplayChannel *display_channel)
 
     spice_info("==> Compression stats for display %u", id);
     image_encoder_shared_stat_print(&display_channel->priv->encoder_shared_data);
+    if (display_channel->priv->compress_pool) {
+        compress_pool_stat_print(display_channel->priv->compress_pool);
+    }
 #endif
 }
 
@@ -246,6 +266,7 @@ static void stop_streams(DisplayChannel *display)
             spice_debug("attached stream");
         }
     }
+    gl_stream_stop(display);
 
     display->priv->next_item_trace = 0;
     memset(display->priv->items_trace, 0, sizeof(display->priv->items_trace));
@@ -253,7 +274,7 @@ static void stop_streams(DisplayChannel *display)
 
 void display_channel_surface_unref(DisplayChannel *display, uint32_t surface_id)
 {
-    RedSurface *surface = &display->priv->surfaces[surface_id];
+    RedSurface *surface = display_channel_get_surface(display, surface_id);
     QXLInstance *qxl = common_graphics_channel_get_qxl(COMMON_GRAPHICS_CHANNEL(display));
     DisplayChannelClient *dcc;
     GListIter iter;
@@ -268,6 +289,7 @@ void display_channel_surface_unref(DisplayChannel *display, uint32_t surface_id)
     }
     spice_assert(surface->context.canvas);
 
+    red_image_items_copy_surface_area(&surface->zero_copy_images, NULL);
     surface->context.canvas->ops->destroy(surface->context.canvas);
     if (surface->create.info) {
         red_qxl_release_resource(qxl, surface->create);
@@ -277,6 +299,8 @@ void display_channel_surface_unref(DisplayChannel *display, uint32_t surface_id)
     }
 
     region_destroy(&surface->draw_dirty_region);
+    tree_index_free(surface->tree_index);
+    surface->tree_index = NULL;
     surface->context.canvas = NULL;
     FOREACH_DCC(display, iter, dcc) {
         dcc_destroy_surface(dcc, surface_id);
@@ -289,7 +313,9 @@ void display_channel_surface_unref(DisplayChannel *display, uint32_t surface_id)
 gboolean display_channel_surface_has_canvas(DisplayChannel *display,
                                             uint32_t surface_id)
 {
-    return display->priv->surfaces[surface_id].context.canvas != NULL;
+    RedSurface *surface = display_channel_lookup_surface(display, surface_id);
+
+    return surface && surface->context.canvas != NULL;
 }
 
 static void streams_update_visible_region(DisplayChannel *display, Drawable *drawable)
@@ -389,8 +415,17 @@ static void current_add_drawable(DisplayChannel *display,
     RedSurface *surface;
     uint32_t surface_id = drawable->surface_id;
 
-    surface = &display->priv->surfaces[surface_id];
+    surface = display_channel_get_surface(display, surface_id);
     ring_add_after(&drawable->tree_item.base.siblings_link, pos);
+    if (surface->tree_index && !drawable->tree_item.base.container) {
+        if (pos == &surface->current) {
+            tree_index_add_head(surface->tree_index, &drawable->tree_item.base);
+        } else {
+            /* the drawable replaces an equivalent item, see current_add_equal() */
+            tree_index_replace(SPICE_CONTAINEROF(pos, TreeItem, siblings_link),
+                               &drawable->tree_item.base);
+        }
+    }
     ring_add(&display->priv->current_list, &drawable->list_link);
     ring_add(&surface->current_list, &drawable->surface_list_link);
     drawable->refs++;
@@ -403,6 +438,7 @@ static void current_remove_drawable(DisplayChannel *display, Drawable *item)
     /* todo: move all to unref? */
     stream_trace_add_drawable(display, item);
     draw_item_remove_shadow(&item->tree_item);
+    tree_index_remove(&item->tree_item.base);
     ring_remove(&item->tree_item.base.siblings_link);
     ring_remove(&item->list_link);
     ring_remove(&item->surface_list_link);
@@ -480,7 +516,7 @@ static void current_remove(DisplayChannel *display, TreeItem *item)
 
 static void current_remove_all(DisplayChannel *display, int surface_id)
 {
-    Ring *ring = &display->priv->surfaces[surface_id].current;
+    Ring *ring = &display_channel_get_surface(display, surface_id)->current;
     RingItem *ring_item;
 
     while ((ring_item = ring_get_head(ring))) {
@@ -811,6 +847,16 @@ static void exclude_region(DisplayChannel *display, Ring *ring, RingItem *ring_i
                 stat_add(&display->priv->exclude_stat, start_time);
                 return;
             }
+        } else if (ring == top_ring && !last && now->index_pos.index) {
+            /* jump over the items of the root which cannot intersect 'rgn' */
+            TreeItem *next = tree_index_next(now, &rgn->extents);
+
+            if (!next) {
+                stat_add(&display->priv->exclude_stat, start_time);
+                return;
+            }
+            ring_item = &next->siblings_link;
+            continue;
         }
 
         SPICE_VERIFY(SPICE_OFFSETOF(TreeItem, siblings_link) == 0);
@@ -862,6 +908,10 @@ static bool current_add_with_shadow(DisplayChannel *display, Ring *ring, Drawabl
 
     /* Prepend the shadow to the beginning of the current ring */
     ring_add(ring, &shadow->base.siblings_link);
+    TreeIndex *tree_index = display_channel_get_surface(display, item->surface_id)->tree_index;
+    if (tree_index) {
+        tree_index_add_head(tree_index, &shadow->base);
+    }
     /* Prepend the draw item to the beginning of the current ring. NOTE: this
      * means that the drawable is placed *before* its associated shadow in the
      * tree. Changing this order will violate several unstated assumptions */
@@ -885,6 +935,19 @@ static bool current_add_with_shadow(DisplayChannel *display, Ring *ring, Drawabl
     return TRUE;
 }
 
+/* Returns the item following @now in @ring, skipping the items of the root of
+ * the tree which cannot intersect @rgn when the surface has a spatial index */
+static RingItem *ring_next_intersecting(Ring *ring, RingItem *now, QRegion *rgn)
+{
+    TreeItem *item = SPICE_CONTAINEROF(now, TreeItem, siblings_link);
+
+    if (item->index_pos.index) {
+        item = tree_index_next(item, &rgn->extents);
+        return item ? &item->siblings_link : NULL;
+    }
+    return ring_next(ring, now);
+}
+
 /* Add a @drawable (without a shadow) to the current ring.
  * The return value indicates whether the new item should be added to the pipe */
 static bool current_add(DisplayChannel *display, Ring *ring, Drawable *drawable)
@@ -908,7 +971,7 @@ static bool current_add(DisplayChannel *display, Ring *ring, Drawable *drawable)
         if (!region_bounds_intersects(&item->base.rgn, &sibling->rgn)) {
             /* the bounds of the two items are totally disjoint, so no need to
              * check further. check the next item */
-            now = ring_next(ring, now);
+            now = ring_next_intersecting(ring, now, &item->base.rgn);
             continue;
         }
         /* bounds overlap, but check whether the regions actually overlap */
@@ -916,7 +979,7 @@ static bool current_add(DisplayChannel *display, Ring *ring, Drawable *drawable)
         if (!(test_res & REGION_TEST_SHARED)) {
             /* there's no overlap of the regions between these two items. Move
              * on to the next one. */
-            now = ring_next(ring, now);
+            now = ring_next_intersecting(ring, now, &item->base.rgn);
             continue;
         } else if (sibling->type != TREE_ITEM_TYPE_SHADOW) {
             /* there is an overlap between the two regions */
@@ -1144,6 +1207,21 @@ static void display_channel_print_stats(DisplayChannel *display)
     stat_reset(&display->priv->add_stat);
     stat_reset(&display->priv->exclude_stat);
     stat_reset(&display->priv->__exclude_stat);
+
+    spice_debug("drawables: %u in use, %u peak, %u allocated, soft limit %u",
+                display->priv->drawable_count, display->priv->drawable_count_peak,
+                display->priv->drawables_allocated, display->priv->drawables_soft_limit);
+
+    TreeIndex *tree_index = display_channel_get_surface(display, 0)->tree_index;
+    if (tree_index) {
+        TreeIndexStat index_stat;
+
+        tree_index_stat_get(tree_index, &index_stat);
+        spice_debug("tree index: %u items, %" PRIu64 " queries, %.1f cell entries per query",
+                    index_stat.n_items, index_stat.queries,
+                    index_stat.queries ? (double)index_stat.visited / index_stat.queries : 0.0);
+        tree_index_stat_reset(tree_index);
+    }
 }
 #endif
 
@@ -1158,7 +1236,7 @@ static void drawable_ref_surface_deps(DisplayChannel *display, Drawable *drawabl
         if (surface_id == -1) {
             continue;
         }
-        surface = &display->priv->surfaces[surface_id];
+        surface = display_channel_get_surface(display, surface_id);
         surface->refs++;
     }
 }
@@ -1167,7 +1245,7 @@ static void surface_read_bits(DisplayChannel *display, int surface_id,
                               const SpiceRect *area, uint8_t *dest, int dest_stride)
 {
     SpiceCanvas *canvas;
-    RedSurface *surface = &display->priv->surfaces[surface_id];
+    RedSurface *surface = display_channel_get_surface(display, surface_id);
 
     canvas = surface->context.canvas;
     canvas->ops->read_bits(canvas, dest, dest_stride, area);
@@ -1185,7 +1263,7 @@ static void handle_self_bitmap(DisplayChannel *display, Drawable *drawable)
     int bpp;
     int all_set;
 
-    surface = &display->priv->surfaces[drawable->surface_id];
+    surface = display_channel_get_surface(display, drawable->surface_id);
 
     bpp = SPICE_SURFACE_FMT_DEPTH(surface->context.format) / 8;
     width = red_drawable->self_bitmap_area.right - red_drawable->self_bitmap_area.left;
@@ -1237,7 +1315,7 @@ static void surface_add_reverse_dependency(DisplayChannel *display, int surface_
         return;
     }
 
-    surface = &display->priv->surfaces[surface_id];
+    surface = display_channel_get_surface(display, surface_id);
 
     depend_item->drawable = drawable;
     ring_add(&surface->depend_on_me, &depend_item->ring_item);
@@ -1271,7 +1349,7 @@ static void draw_depend_on_me(DisplayChannel *display, uint32_t surface_id)
     RedSurface *surface;
     RingItem *ring_item;
 
-    surface = &display->priv->surfaces[surface_id];
+    surface = display_channel_get_surface(display, surface_id);
 
     while ((ring_item = ring_get_tail(&surface->depend_on_me))) {
         Drawable *drawable;
@@ -1292,7 +1370,7 @@ static bool validate_drawable_bbox(DisplayChannel *display, RedDrawable *drawabl
         if (!display_channel_validate_surface(display, drawable->surface_id)) {
             return FALSE;
         }
-        context = &display->priv->surfaces[surface_id].context;
+        context = &display_channel_get_surface(display, surface_id)->context;
 
         if (drawable->bbox.top < 0)
                 return FALSE;
@@ -1314,6 +1392,8 @@ static bool validate_drawable_bbox(DisplayChannel *display, RedDrawable *drawabl
  * @brief Get a new Drawable
  *
  * The Drawable returned is fully initialized.
+ * The bbox of @red_drawable must have been checked with
+ * validate_drawable_bbox().
  *
  * @return initialized Drawable or NULL on failure
  */
@@ -1327,9 +1407,6 @@ static Drawable *display_channel_get_drawable(DisplayChannel *display, uint8_t e
     /* Validate all surface ids before updating counters
      * to avoid invalid updates if we find an invalid id.
      */
-    if (!validate_drawable_bbox(display, red_drawable)) {
-        return NULL;
-    }
     for (x = 0; x < 3; ++x) {
         if (red_drawable->surface_deps[x] != -1
             && !display_channel_validate_surface(display, red_drawable->surface_deps[x])) {
@@ -1346,7 +1423,7 @@ static Drawable *display_channel_get_drawable(DisplayChannel *display, uint8_t e
     drawable->red_drawable = red_drawable_ref(red_drawable);
 
     drawable->surface_id = red_drawable->surface_id;
-    display->priv->surfaces[drawable->surface_id].refs++;
+    display_channel_get_surface(display, drawable->surface_id)->refs++;
 
     memcpy(drawable->surface_deps, red_drawable->surface_deps, sizeof(drawable->surface_deps));
     /*
@@ -1396,7 +1473,7 @@ static void display_channel_add_drawable(DisplayChannel *display, Drawable *draw
         return;
     }
 
-    Ring *ring = &display->priv->surfaces[surface_id].current;
+    Ring *ring = &display_channel_get_surface(display, surface_id)->current;
     int add_to_pipe;
     if (has_shadow(red_drawable)) {
         add_to_pipe = current_add_with_shadow(display, ring, drawable);
@@ -1414,13 +1491,246 @@ static void display_channel_add_drawable(DisplayChannel *display, Drawable *draw
 #endif
 }
 
+/* the repaints smaller than that are cheap enough to send as they are */
+#define SCROLL_DETECT_MIN_AREA (256 * 64)
+
+/* The content of a repaint, if it is a plain bitmap of the format of the
+ * surface covering the whole drawable. @line_0 points to the top line. */
+static bool scroll_get_repaint(DisplayChannel *display, RedDrawable *red_drawable,
+                               const uint8_t **line_0, int32_t *stride)
+{
+    const SpiceCopy *copy = &red_drawable->u.copy;
+    const SpiceRect *bbox = &red_drawable->bbox;
+    const SpiceBitmap *bitmap;
+    RedSurface *surface;
+    int32_t first_line;
+
+    if (red_drawable->type != QXL_DRAW_COPY || red_drawable->effect != QXL_EFFECT_OPAQUE ||
+        red_drawable->self_bitmap || red_drawable->clip.type != SPICE_CLIP_TYPE_NONE ||
+        copy->rop_descriptor != SPICE_ROPD_OP_PUT || copy->mask.bitmap ||
+        !copy->src_bitmap || copy->src_bitmap->descriptor.type != SPICE_IMAGE_TYPE_BITMAP) {
+        return FALSE;
+    }
+    if (!is_primary_surface(display, red_drawable->surface_id)) {
+        return FALSE;
+    }
+    surface = display_channel_get_surface(display, red_drawable->surface_id);
+    if (surface->context.format != SPICE_SURFACE_FMT_32_xRGB) {
+        return FALSE;
+    }
+
+    bitmap = &copy->src_bitmap->u.bitmap;
+    if (bitmap->format != SPICE_BITMAP_FMT_32BIT || bitmap->data->num_chunks != 1 ||
+        copy->src_area.right - copy->src_area.left != bbox->right - bbox->left ||
+        copy->src_area.bottom - copy->src_area.top != bbox->bottom - bbox->top ||
+        (bbox->right - bbox->left) * (bbox->bottom - bbox->top) < SCROLL_DETECT_MIN_AREA) {
+        return FALSE;
+    }
+
+    if (bitmap->flags & SPICE_BITMAP_FLAGS_TOP_DOWN) {
+        first_line = copy->src_area.top;
+        *stride = bitmap->stride;
+    } else {
+        first_line = bitmap->y - 1 - copy->src_area.top;
+        *stride = -(int32_t)bitmap->stride;
+    }
+    *line_0 = bitmap->data->chunk[0].data + (size_t)first_line * bitmap->stride +
+              copy->src_area.left * sizeof(uint32_t);
+    return TRUE;
+}
+
+/* A drawable of the server, made up out of one of the guest. Its bbox is
+ * within the one of the guest drawable, so it needs no validation. It has
+ * no release info: red_drawable_unref() only releases the guest resources
+ * of the drawables that have some. */
+static RedDrawable *scroll_red_drawable_new(RedDrawable *red_drawable, uint8_t type,
+                                            const SpiceRect *bbox)
+{
+    RedDrawable *derived = spice_new0(RedDrawable, 1);
+
+    derived->refs = 1;
+    derived->qxl = red_drawable->qxl;
+    derived->surface_id = red_drawable->surface_id;
+    derived->effect = red_drawable->effect;
+    derived->type = type;
+    derived->bbox = *bbox;
+    derived->clip.type = SPICE_CLIP_TYPE_NONE;
+    derived->surface_deps[0] = -1;
+    derived->surface_deps[1] = -1;
+    derived->surface_deps[2] = -1;
+
+    return derived;
+}
+
+/* The part of the repaint that is not a move: a copy of the lines of @area
+ * starting at @line_0 into an image of its own */
+static RedDrawable *scroll_residual_new(DisplayChannel *display, RedDrawable *red_drawable,
+                                        const SpiceRect *area,
+                                        const uint8_t *line_0, int32_t stride)
+{
+    RedDrawable *residual = scroll_red_drawable_new(red_drawable, QXL_DRAW_COPY, area);
+    int32_t width = area->right - area->left;
+    int32_t height = area->bottom - area->top;
+    int dest_stride = width * sizeof(uint32_t);
+    SpiceImage *image;
+    uint8_t *dest;
+    int y;
+
+    image = spice_new0(SpiceImage, 1);
+    image->descriptor.type = SPICE_IMAGE_TYPE_BITMAP;
+    image->descriptor.flags = 0;
+
+    QXL_SET_IMAGE_ID(image, QXL_IMAGE_GROUP_RED, display_channel_generate_uid(display));
+    image->u.bitmap.flags = SPICE_BITMAP_FLAGS_TOP_DOWN;
+    image->u.bitmap.format = SPICE_BITMAP_FMT_32BIT;
+    image->u.bitmap.stride = dest_stride;
+    image->descriptor.width = image->u.bitmap.x = width;
+    image->descriptor.height = image->u.bitmap.y = height;
+    image->u.bitmap.palette = NULL;
+
+    dest = (uint8_t *)spice_malloc_n(height, dest_stride);
+    image->u.bitmap.data = spice_chunks_new_linear(dest, height * dest_stride);
+    image->u.bitmap.data->flags |= SPICE_CHUNKS_FLAGS_FREE;
+    for (y = 0; y < height; y++) {
+        memcpy(dest + y * dest_stride, line_0 + (ptrdiff_t)y * stride, dest_stride);
+    }
+
+    residual->u.copy.src_bitmap = image;
+    residual->u.copy.src_area.right = width;
+    residual->u.copy.src_area.bottom = height;
+    residual->u.copy.rop_descriptor = SPICE_ROPD_OP_PUT;
+    residual->u.copy.scale_mode = SPICE_IMAGE_SCALE_MODE_NEAREST;
+
+    return residual;
+}
+
+/* Turns a repaint of an area with its own content moved, as scrolling does,
+ * into a COPY_BITS of the moved part and copies of the parts around it.
+ * Returns FALSE if the repaint is to be added as it is. */
+static bool scroll_process_draw(DisplayChannel *display, RedDrawable *red_drawable,
+                                uint32_t process_commands_generation)
+{
+    const SpiceRect *bbox = &red_drawable->bbox;
+    RedDrawable *red_drawables[3];
+    Drawable *drawables[3];
+    const uint8_t *new_line_0, *old_line_0;
+    int32_t new_stride, old_stride;
+    ScrollDetectMove move;
+    SpiceRect dest, residuals[2];
+    DrawContext *context;
+    RingItem *item;
+    int n_drawables, i;
+    bool same_area;
+
+    if (!scroll_get_repaint(display, red_drawable, &new_line_0, &new_stride)) {
+        return FALSE;
+    }
+    /* the frames of the videos are not moves and are dropped unsent when
+     * another one replaces them, rendering them to compare would defeat it */
+    RING_FOREACH(item, &display->priv->streams) {
+        Stream *stream = SPICE_CONTAINEROF(item, Stream, link);
+
+        if (rect_intersects(&stream->dest_area, bbox)) {
+            return FALSE;
+        }
+    }
+    /* Rendering the surface to compare forces the pending drawables to be
+     * drawn, defeating the lossy ones and the drops of the pipes. Scrolling
+     * repaints the same area again and again, so only do it when the
+     * repaint has lines of the previous repaint of the area elsewhere. */
+    same_area = rect_is_equal(&display->priv->scroll_area, bbox);
+    display->priv->scroll_area = *bbox;
+    if (!scroll_detect_hashes_update(&display->priv->scroll_hashes, new_line_0, new_stride,
+                                     bbox->right - bbox->left, bbox->bottom - bbox->top) ||
+        !same_area) {
+        return FALSE;
+    }
+
+    display_channel_draw(display, bbox, red_drawable->surface_id);
+    context = &display_channel_get_surface(display, red_drawable->surface_id)->context;
+    old_stride = context->stride;
+    old_line_0 = (const uint8_t *)context->line_0 + (ptrdiff_t)bbox->top * old_stride +
+                 bbox->left * sizeof(uint32_t);
+    if (!scroll_detect(old_line_0, old_stride, new_line_0, new_stride,
+                       bbox->right - bbox->left, bbox->bottom - bbox->top, &move)) {
+        return FALSE;
+    }
+
+    dest = move.dest;
+    rect_offset(&dest, bbox->left, bbox->top);
+    red_drawables[0] = scroll_red_drawable_new(red_drawable, QXL_DRAW_COPY_BITS, &dest);
+    red_drawables[0]->u.copy_bits.src_pos.x = bbox->left + move.src.x;
+    red_drawables[0]->u.copy_bits.src_pos.y = bbox->top + move.src.y;
+    n_drawables = 1;
+
+    /* the parts before and after the moved one */
+    residuals[0] = residuals[1] = *bbox;
+    if (move.dest.left == 0 && move.dest.right == bbox->right - bbox->left) {
+        residuals[0].bottom = dest.top;
+        residuals[1].top = dest.bottom;
+    } else {
+        residuals[0].right = dest.left;
+        residuals[1].left = dest.right;
+    }
+    for (i = 0; i < 2; i++) {
+        if (rect_is_empty(&residuals[i])) {
+            continue;
+        }
+        red_drawables[n_drawables++] =
+            scroll_residual_new(display, red_drawable, &residuals[i],
+                                new_line_0 +
+                                (ptrdiff_t)(residuals[i].top - bbox->top) * new_stride +
+                                (residuals[i].left - bbox->left) * sizeof(uint32_t),
+                                new_stride);
+    }
+
+    /* all or nothing, the moved content must not be left half drawn */
+    for (i = 0; i < n_drawables; i++) {
+        drawables[i] = display_channel_get_drawable(display, red_drawables[i]->effect,
+                                                    red_drawables[i],
+                                                    process_commands_generation);
+        if (!drawables[i]) {
+            break;
+        }
+    }
+    if (i < n_drawables) {
+        while (i--) {
+            drawable_unref(drawables[i]);
+        }
+        for (i = 0; i < n_drawables; i++) {
+            red_drawable_unref(red_drawables[i]);
+        }
+        return FALSE;
+    }
+
+    /* the COPY_BITS reads the parts the copies then overwrite */
+    for (i = 0; i < n_drawables; i++) {
+        display_channel_add_drawable(display, drawables[i]);
+        drawable_unref(drawables[i]);
+        red_drawable_unref(red_drawables[i]);
+    }
+    stat_inc_counter(display->priv->scroll_copy_bits_counter, 1);
+    stat_inc_counter(display->priv->scroll_copied_pixels_counter,
+                     (dest.right - dest.left) * (dest.bottom - dest.top));
+
+    return TRUE;
+}
+
 void display_channel_process_draw(DisplayChannel *display, RedDrawable *red_drawable,
                                   uint32_t process_commands_generation)
 {
-    Drawable *drawable =
-        display_channel_get_drawable(display, red_drawable->effect, red_drawable,
-                                     process_commands_generation);
+    Drawable *drawable;
+
+    if (!validate_drawable_bbox(display, red_drawable)) {
+        return;
+    }
+    if (display->priv->use_scroll_detection &&
+        scroll_process_draw(display, red_drawable, process_commands_generation)) {
+        return;
+    }
 
+    drawable = display_channel_get_drawable(display, red_drawable->effect, red_drawable,
+                                            process_commands_generation);
     if (!drawable) {
         return;
     }
@@ -1470,10 +1780,12 @@ bool display_channel_wait_for_migrate_data(DisplayChannel *display)
 
 void display_channel_flush_all_surfaces(DisplayChannel *display)
 {
-    int x;
+    uint32_t x;
+
+    for (x = 0; x < display->priv->n_surfaces; ++x) {
+        RedSurface *surface = display_channel_lookup_surface(display, x);
 
-    for (x = 0; x < NUM_SURFACES; ++x) {
-        if (display->priv->surfaces[x].context.canvas) {
+        if (surface && surface->context.canvas) {
             display_channel_current_flush(display, x);
         }
     }
@@ -1527,74 +1839,142 @@ static bool free_one_drawable(DisplayChannel *display, int force_glz_free)
 
 void display_channel_current_flush(DisplayChannel *display, int surface_id)
 {
-    while (!ring_is_empty(&display->priv->surfaces[surface_id].current_list)) {
+    while (!ring_is_empty(&display_channel_get_surface(display, surface_id)->current_list)) {
         free_one_drawable(display, FALSE);
     }
     current_remove_all(display, surface_id);
 }
 
+/* Releases the pipe items whose compression was cancelled while it ran,
+ * see compress_job_free() */
+void display_channel_release_compress_jobs(DisplayChannel *display, bool wait)
+{
+    if (display->priv->compress_pool) {
+        compress_pool_release_cancelled(display->priv->compress_pool, wait);
+    }
+}
+
 void display_channel_free_some(DisplayChannel *display)
 {
     int n = 0;
     DisplayChannelClient *dcc;
     GListIter iter;
 
+    display_channel_release_compress_jobs(display, TRUE);
+
     spice_debug("#draw=%d, #glz_draw=%d", display->priv->drawable_count,
                 display->priv->encoder_shared_data.glz_drawable_count);
+    // the display channels of other workers sharing the dictionaries can keep
+    // encoding meanwhile, the images they may read are released afterwards
     FOREACH_DCC(display, iter, dcc) {
-        ImageEncoders *encoders = dcc_get_encoders(dcc);
-
-        // encoding using the dictionary is prevented since the following operations might
-        // change the dictionary
-        if (image_encoders_glz_encode_lock(encoders)) {
-            n = image_encoders_free_some_independent_glz_drawables(encoders);
-        }
+        n = image_encoders_free_some_independent_glz_drawables(dcc_get_encoders(dcc));
     }
 
     while (!ring_is_empty(&display->priv->current_list) && n++ < RED_RELEASE_BUNCH_SIZE) {
         free_one_drawable(display, TRUE);
     }
-
-    FOREACH_DCC(display, iter, dcc) {
-        ImageEncoders *encoders = dcc_get_encoders(dcc);
-
-        image_encoders_glz_encode_unlock(encoders);
-    }
 }
 
 static Drawable* drawable_try_new(DisplayChannel *display)
 {
-    Drawable *drawable;
+    RingItem *ring_item = ring_get_head(&display->priv->drawables_blocks);
+    DrawablesBlock *block;
+    _Drawable *drawable;
 
-    if (!display->priv->free_drawables)
+    if (!ring_item) {
         return NULL;
+    }
+    block = SPICE_CONTAINEROF(ring_item, DrawablesBlock, link);
+    if (block->num_free == 0) {
+        return NULL;
+    }
 
-    drawable = &display->priv->free_drawables->u.drawable;
-    display->priv->free_drawables = display->priv->free_drawables->u.next;
+    drawable = block->free_drawables;
+    block->free_drawables = drawable->u.next;
+    if (--block->num_free == 0) {
+        ring_remove(&block->link);
+        ring_add_before(&block->link, &display->priv->drawables_blocks);
+    }
     display->priv->drawable_count++;
+    display->priv->drawable_count_peak = MAX(display->priv->drawable_count_peak,
+                                             display->priv->drawable_count);
 
-    return drawable;
+    return &drawable->u.drawable;
+}
+
+static void drawables_block_free(DisplayChannel *display, DrawablesBlock *block)
+{
+    ring_remove(&block->link);
+    display->priv->drawables_allocated -= DRAWABLES_BLOCK_SIZE;
+    free(block);
 }
 
+/* The unused blocks are released as long as a block worth of free drawables
+ * remains, so a burst of drawables does not keep its memory */
 static void drawable_free(DisplayChannel *display, Drawable *drawable)
 {
-    ((_Drawable *)drawable)->u.next = display->priv->free_drawables;
-    display->priv->free_drawables = (_Drawable *)drawable;
+    _Drawable *_drawable = (_Drawable *)drawable;
+    DrawablesBlock *block = _drawable->block;
+
+    _drawable->u.next = block->free_drawables;
+    block->free_drawables = _drawable;
+    if (block->num_free++ == 0) {
+        ring_remove(&block->link);
+        ring_add(&display->priv->drawables_blocks, &block->link);
+    }
+    if (block->num_free == DRAWABLES_BLOCK_SIZE &&
+        display->priv->drawables_allocated - display->priv->drawable_count >=
+        2 * DRAWABLES_BLOCK_SIZE) {
+        drawables_block_free(display, block);
+    }
 }
 
-static void drawables_init(DisplayChannel *display)
+static bool drawables_grow(DisplayChannel *display)
 {
+    DrawablesBlock *block;
     int i;
 
-    display->priv->free_drawables = NULL;
-    for (i = 0; i < NUM_DRAWABLES; i++) {
-        drawable_free(display, &display->priv->drawables[i].u.drawable);
+    if (display->priv->drawables_allocated >= display->priv->drawables_soft_limit * 2) {
+        return FALSE;
+    }
+
+    block = spice_new(DrawablesBlock, 1);
+    block->free_drawables = NULL;
+    for (i = DRAWABLES_BLOCK_SIZE - 1; i >= 0; i--) {
+        block->drawables[i].block = block;
+        block->drawables[i].u.next = block->free_drawables;
+        block->free_drawables = &block->drawables[i];
+    }
+    block->num_free = DRAWABLES_BLOCK_SIZE;
+    ring_add(&display->priv->drawables_blocks, &block->link);
+    display->priv->drawables_allocated += DRAWABLES_BLOCK_SIZE;
+
+    return TRUE;
+}
+
+static void drawables_init(DisplayChannel *display)
+{
+    ring_init(&display->priv->drawables_blocks);
+    display->priv->drawables_allocated = 0;
+}
+
+static void drawables_free(DisplayChannel *display)
+{
+    RingItem *ring_item;
+
+    while ((ring_item = ring_get_head(&display->priv->drawables_blocks))) {
+        drawables_block_free(display, SPICE_CONTAINEROF(ring_item, DrawablesBlock, link));
     }
 }
 
 /**
  * Allocate a Drawable
  *
+ * Past the soft limit, the oldest drawable of the tree is rendered to make
+ * room for the new one. The drawables only referenced by the pipes are
+ * released as they are sent, so when rendering frees none, more drawables
+ * are allocated instead as long as there are less than twice the soft limit.
+ *
  * @return pointer to uninitialized Drawable or NULL on failure
  */
 static Drawable *display_channel_drawable_try_new(DisplayChannel *display,
@@ -1602,9 +1982,18 @@ static Drawable *display_channel_drawable_try_new(DisplayChannel *display,
 {
     Drawable *drawable;
 
+    if (display->priv->drawable_count == display->priv->drawables_allocated &&
+        display->priv->drawable_count >= display->priv->drawables_soft_limit &&
+        free_one_drawable(display, FALSE)) {
+        stat_inc_counter(display->priv->drawables_forced_render_counter, 1);
+    }
     while (!(drawable = drawable_try_new(display))) {
+        if (drawables_grow(display)) {
+            continue;
+        }
         if (!free_one_drawable(display, FALSE))
             return NULL;
+        stat_inc_counter(display->priv->drawables_forced_render_counter, 1);
     }
 
     bzero(drawable, sizeof(Drawable));
@@ -1685,8 +2074,8 @@ void drawable_unref(Drawable *drawable)
     if (drawable->red_drawable) {
         red_drawable_unref(drawable->red_drawable);
     }
-    drawable_free(display, drawable);
     display->priv->drawable_count--;
+    drawable_free(display, drawable);
 }
 
 static void drawable_deps_draw(DisplayChannel *display, Drawable *drawable)
@@ -1711,12 +2100,13 @@ static void drawable_draw(DisplayChannel *display, Drawable *drawable)
 
     drawable_deps_draw(display, drawable);
 
-    surface = &display->priv->surfaces[drawable->surface_id];
+    surface = display_channel_get_surface(display, drawable->surface_id);
     canvas = surface->context.canvas;
     spice_return_if_fail(canvas);
 
     image_cache_aging(&display->priv->image_cache);
 
+    red_image_items_copy_surface_area(&surface->zero_copy_images, &drawable->red_drawable->bbox);
     region_add(&surface->draw_dirty_region, &drawable->red_drawable->bbox);
 
     switch (drawable->red_drawable->type) {
@@ -1932,7 +2322,7 @@ void display_channel_draw_until(DisplayChannel *display, const SpiceRect *area,
     spice_return_if_fail(last);
     spice_return_if_fail(ring_item_is_linked(&last->list_link));
 
-    surface = &display->priv->surfaces[surface_id];
+    surface = display_channel_get_surface(display, surface_id);
 
     if (surface_id != last->surface_id) {
         // find the nearest older drawable from the appropriate surface
@@ -1972,12 +2362,12 @@ void display_channel_draw(DisplayChannel *display, const SpiceRect *area, int su
     spice_debug("surface %d: area ==>", surface_id);
     rect_debug(area);
 
-    spice_return_if_fail(surface_id >= 0 && surface_id < NUM_SURFACES);
+    spice_return_if_fail(surface_id >= 0 && surface_id < (int)display->priv->n_surfaces);
     spice_return_if_fail(area);
     spice_return_if_fail(area->left >= 0 && area->top >= 0 &&
                          area->left < area->right && area->top < area->bottom);
 
-    surface = &display->priv->surfaces[surface_id];
+    surface = display_channel_get_surface(display, surface_id);
 
     last = current_find_intersects_rect(&surface->current_list, NULL, area);
     if (last)
@@ -2014,7 +2404,7 @@ void display_channel_update(DisplayChannel *display,
     red_get_rect_ptr(&rect, area);
     display_channel_draw(display, &rect, surface_id);
 
-    surface = &display->priv->surfaces[surface_id];
+    surface = display_channel_get_surface(display, surface_id);
     if (*qxl_dirty_rects == NULL) {
         *num_dirty_rects = pixman_region32_n_rects(&surface->draw_dirty_region);
         *qxl_dirty_rects = spice_new0(QXLRect, *num_dirty_rects);
@@ -2054,7 +2444,7 @@ void display_channel_destroy_surface_wait(DisplayChannel *display, uint32_t surf
 {
     if (!display_channel_validate_surface(display, surface_id))
         return;
-    if (!display->priv->surfaces[surface_id].context.canvas)
+    if (!display_channel_get_surface(display, surface_id)->context.canvas)
         return;
 
     draw_depend_on_me(display, surface_id);
@@ -2063,23 +2453,27 @@ void display_channel_destroy_surface_wait(DisplayChannel *display, uint32_t surf
        current_remove_all will remove them from the pipe. */
     current_remove_all(display, surface_id);
     clear_surface_drawables_from_pipes(display, surface_id, TRUE);
+    /* the drawables of the cancelled compressions hold the surface too */
+    display_channel_release_compress_jobs(display, TRUE);
 }
 
 /* called upon device reset */
 /* TODO: split me*/
 void display_channel_destroy_surfaces(DisplayChannel *display)
 {
-    int i;
+    uint32_t i;
 
     spice_debug("trace");
     //to handle better
-    for (i = 0; i < NUM_SURFACES; ++i) {
-        if (display->priv->surfaces[i].context.canvas) {
+    for (i = 0; i < display->priv->n_surfaces; ++i) {
+        RedSurface *surface = display_channel_lookup_surface(display, i);
+
+        if (surface && surface->context.canvas) {
             display_channel_destroy_surface_wait(display, i);
-            if (display->priv->surfaces[i].context.canvas) {
+            if (surface->context.canvas) {
                 display_channel_surface_unref(display, i);
             }
-            spice_assert(!display->priv->surfaces[i].context.canvas);
+            spice_assert(!surface->context.canvas);
         }
     }
     spice_warn_if_fail(ring_is_empty(&display->priv->streams));
@@ -2129,7 +2523,7 @@ void display_channel_create_surface(DisplayChannel *display, uint32_t surface_id
                                     uint32_t height, int32_t stride, uint32_t format,
                                     void *line_0, int data_is_valid, int send_client)
 {
-    RedSurface *surface = &display->priv->surfaces[surface_id];
+    RedSurface *surface = display_channel_get_surface(display, surface_id);
 
     spice_warn_if_fail(!surface->context.canvas);
 
@@ -2152,6 +2546,10 @@ void display_channel_create_surface(DisplayChannel *display, uint32_t surface_id
     ring_init(&surface->current_list);
     ring_init(&surface->depend_on_me);
     region_init(&surface->draw_dirty_region);
+    ring_init(&surface->zero_copy_images);
+    if (display->priv->use_tree_index) {
+        surface->tree_index = tree_index_new(width, height);
+    }
     surface->refs = 1;
 
     if (display->priv->renderer == RED_RENDERER_INVALID) {
@@ -2224,7 +2622,7 @@ static SpiceCanvas *image_surfaces_get(SpiceImageSurfaces *surfaces, uint32_t su
 
     spice_return_val_if_fail(display_channel_validate_surface(display, surface_id), NULL);
 
-    return p->surfaces[surface_id].context.canvas;
+    return display_channel_get_surface(display, surface_id)->context.canvas;
 }
 
 DisplayChannel* display_channel_new(RedsState *reds,
@@ -2274,24 +2672,39 @@ display_channel_init(DisplayChannel *self)
 
     ring_init(&self->priv->current_list);
     drawables_init(self);
+    self->priv->drawables_soft_limit = spice_env_get_uint("SPICE_MAX_DRAWABLES", NUM_DRAWABLES,
+                                                          DRAWABLES_BLOCK_SIZE,
+                                                          MAX_DRAWABLES_LIMIT);
     self->priv->image_surfaces.ops = &image_surfaces_ops;
 }
 
+static void compress_jobs_wakeup(int fd, int event, void *opaque)
+{
+    DisplayChannel *display = opaque;
+
+    display_channel_release_compress_jobs(display, FALSE);
+}
+
 static void
 display_channel_constructed(GObject *object)
 {
     DisplayChannel *self = DISPLAY_CHANNEL(object);
     RedChannel *channel = RED_CHANNEL(self);
+    unsigned int n_compress_threads;
 
     G_OBJECT_CLASS(display_channel_parent_class)->constructed(object);
 
     spice_assert(self->priv->video_codecs);
+    self->priv->surfaces = sparse_array_new(sizeof(RedSurface), self->priv->n_surfaces);
 
     self->priv->renderer = RED_RENDERER_INVALID;
 
     stat_init(&self->priv->add_stat, "add", CLOCK_THREAD_CPUTIME_ID);
     stat_init(&self->priv->exclude_stat, "exclude", CLOCK_THREAD_CPUTIME_ID);
     stat_init(&self->priv->__exclude_stat, "__exclude", CLOCK_THREAD_CPUTIME_ID);
+    self->priv->use_tree_index = spice_env_get_bool("SPICE_TREE_INDEX", FALSE);
+    self->priv->use_scroll_detection = spice_env_get_bool("SPICE_SCROLL_DETECTION", FALSE);
+    self->priv->use_zero_copy_images = spice_env_get_bool("SPICE_IMAGE_ZEROCOPY", FALSE);
     RedsState *reds = red_channel_get_server(RED_CHANNEL(self));
     const RedStatNode *stat = red_channel_get_stat_node(channel);
     stat_init_counter(&self->priv->cache_hits_counter, reds, stat,
@@ -2300,7 +2713,33 @@ display_channel_constructed(GObject *object)
                       "add_to_cache", TRUE);
     stat_init_counter(&self->priv->non_cache_counter, reds, stat,
                       "non_cache", TRUE);
+    stat_init_counter(&self->priv->drawables_forced_render_counter, reds, stat,
+                      "drawables_forced_render", TRUE);
+    stat_init_counter(&self->priv->compress_time_counter, reds, stat,
+                      "compress_ns", TRUE);
+    stat_init_counter(&self->priv->marshal_time_counter, reds, stat,
+                      "marshal_ns", TRUE);
+    stat_init_counter(&self->priv->scroll_copy_bits_counter, reds, stat,
+                      "scroll_copy_bits", TRUE);
+    stat_init_counter(&self->priv->scroll_copied_pixels_counter, reds, stat,
+                      "scroll_copied_pixels", TRUE);
     image_cache_init(&self->priv->image_cache);
+    /* 0 compresses everything from the worker thread */
+    n_compress_threads = spice_env_get_uint("SPICE_COMPRESS_THREADS", 0,
+                                            0, COMPRESS_POOL_MAX_THREADS);
+    if (n_compress_threads > 0) {
+        self->priv->compress_pool = compress_pool_new(n_compress_threads);
+        self->priv->image_tile_threshold =
+            spice_env_get_uint("SPICE_IMAGE_TILE_THRESHOLD", COMPRESS_POOL_DEFAULT_TILE_THRESHOLD,
+                               0, UINT64_MAX);
+    }
+    if (self->priv->compress_pool) {
+        SpiceCoreInterfaceInternal *core = red_channel_get_core_interface(channel);
+
+        self->priv->compress_watch =
+            core->watch_add(core, compress_pool_get_wakeup_fd(self->priv->compress_pool),
+                            SPICE_WATCH_EVENT_READ, compress_jobs_wakeup, self);
+    }
     self->priv->stream_video = SPICE_STREAM_VIDEO_OFF;
     display_channel_init_streams(self);
 
@@ -2323,7 +2762,7 @@ void display_channel_process_surface_cmd(DisplayChannel *display,
         return;
     }
 
-    surface = &display->priv->surfaces[surface_id];
+    surface = display_channel_get_surface(display, surface_id);
 
     switch (surface_cmd->type) {
     case QXL_SURFACE_CMD_CREATE: {
@@ -2382,9 +2821,59 @@ void display_channel_update_compression(DisplayChannel *display, DisplayChannelC
 
 void display_channel_gl_scanout(DisplayChannel *display)
 {
+    QXLInstance *qxl = common_graphics_channel_get_qxl(COMMON_GRAPHICS_CHANNEL(display));
+    SpiceMsgDisplayGlScanoutUnix *scanout;
+
+    /* the new buffer is mapped by the next draw */
+    gl_readback_free(display->priv->gl_readback);
+    display->priv->gl_readback = NULL;
+    display->priv->gl_readback_failed = FALSE;
+
+    scanout = red_qxl_get_gl_scanout(qxl);
+    if (!scanout) {
+        gl_stream_stop(display);
+    }
+    red_qxl_put_gl_scanout(qxl, scanout);
+
     red_channel_pipes_new_add_push(RED_CHANNEL(display), dcc_gl_scanout_item_new, NULL);
 }
 
+static bool display_channel_has_streamed_gl_clients(DisplayChannel *display)
+{
+    DisplayChannelClient *dcc;
+    GListIter iter;
+
+    FOREACH_DCC(display, iter, dcc) {
+        if (dcc_gl_scanout_is_streamed(dcc)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static GlReadback *display_channel_get_gl_readback(DisplayChannel *display)
+{
+    QXLInstance *qxl = common_graphics_channel_get_qxl(COMMON_GRAPHICS_CHANNEL(display));
+    SpiceMsgDisplayGlScanoutUnix *scanout;
+
+    if (display->priv->gl_readback || display->priv->gl_readback_failed) {
+        return display->priv->gl_readback;
+    }
+
+    scanout = red_qxl_get_gl_scanout(qxl);
+    if (scanout) {
+        display->priv->gl_readback =
+            gl_readback_new(scanout->drm_dma_buf_fd, scanout->width, scanout->height,
+                            scanout->stride, scanout->drm_fourcc_format,
+                            scanout->flags & SPICE_GL_SCANOUT_FLAGS_Y0TOP);
+    }
+    red_qxl_put_gl_scanout(qxl, scanout);
+    /* do not retry until the next scanout */
+    display->priv->gl_readback_failed = !display->priv->gl_readback;
+
+    return display->priv->gl_readback;
+}
+
 static void set_gl_draw_async_count(DisplayChannel *display, int num)
 {
     QXLInstance *qxl = common_graphics_channel_get_qxl(COMMON_GRAPHICS_CHANNEL(display));
@@ -2398,10 +2887,17 @@ static void set_gl_draw_async_count(DisplayChannel *display, int num)
 
 void display_channel_gl_draw(DisplayChannel *display, SpiceMsgDisplayGlDraw *draw)
 {
+    GlReadback *readback;
     int num;
 
     spice_return_if_fail(display->priv->gl_draw_async_count == 0);
 
+    /* the clients that cannot import the scanout get a copy of the damaged
+     * area, so they do not delay the completion of the draw */
+    if (display_channel_has_streamed_gl_clients(display) &&
+        (readback = display_channel_get_gl_readback(display))) {
+        gl_stream_draw(display, readback, draw);
+    }
     num = red_channel_pipes_new_add_push(RED_CHANNEL(display), dcc_gl_draw_item_new, draw);
     set_gl_draw_async_count(display, num);
 }
@@ -2423,13 +2919,16 @@ Stream *display_channel_get_nth_stream(DisplayChannel *display, gint i)
 
 gboolean display_channel_validate_surface(DisplayChannel *display, uint32_t surface_id)
 {
+    RedSurface *surface;
+
     if SPICE_UNLIKELY(surface_id >= display->priv->n_surfaces) {
         spice_warning("invalid surface_id %u", surface_id);
         return FALSE;
     }
-    if (!display->priv->surfaces[surface_id].context.canvas) {
+    surface = display_channel_lookup_surface(display, surface_id);
+    if (!surface || !surface->context.canvas) {
         spice_warning("canvas address is %p for %d (and is NULL)\n",
-                   &(display->priv->surfaces[surface_id].context.canvas), surface_id);
+                   surface ? &surface->context.canvas : NULL, surface_id);
         spice_warning("failed on %d", surface_id);
         return FALSE;
     }
@@ -2450,11 +2949,11 @@ void display_channel_update_monitors_config(DisplayChannel *display,
 
 void display_channel_set_monitors_config_to_primary(DisplayChannel *display)
 {
-    DrawContext *context = &display->priv->surfaces[0].context;
+    DrawContext *context = &display_channel_get_surface(display, 0)->context;
     QXLHead head = { 0, };
     uint16_t old_max = 1;
 
-    spice_return_if_fail(display->priv->surfaces[0].context.canvas);
+    spice_return_if_fail(display_channel_get_surface(display, 0)->context.canvas);
 
     if (display->priv->monitors_config) {
         old_max = display->priv->monitors_config->max_allowed;
@@ -2516,9 +3015,10 @@ void display_channel_debug_oom(DisplayChannel *display, const char *msg)
 {
     RedChannel *channel = RED_CHANNEL(display);
 
-    spice_debug("%s #draw=%u, #glz_draw=%u current %u pipes %u",
+    spice_debug("%s #draw=%u/%u, #glz_draw=%u current %u pipes %u",
                 msg,
                 display->priv->drawable_count,
+                display->priv->drawables_allocated,
                 display->priv->encoder_shared_data.glz_drawable_count,
                 ring_get_length(&display->priv->current_list),
                 red_channel_sum_pipes_size(channel));
@@ -127,6 +127,7 @@ enum {
     RED_PIPE_ITEM_TYPE_STREAM_ACTIVATE_REPORT,
     RED_PIPE_ITEM_TYPE_GL_SCANOUT,
     RED_PIPE_ITEM_TYPE_GL_DRAW,
+    RED_PIPE_ITEM_TYPE_GL_STREAM_FRAME,
 };
 
 typedef struct MonitorsConfig {
@@ -170,10 +171,15 @@ typedef struct RedSurface {
      * actually used for drawing. The ring is maintained in order of age, the
      * tail being the oldest drawable. */
     Ring current_list;
+    /* Optional spatial index of the root of the 'current' tree */
+    TreeIndex *tree_index;
     DrawContext context;
 
     Ring depend_on_me;
     QRegion draw_dirty_region;
+    /* the RedImageItem reading their pixels in the surface memory, they get
+     * a copy of them before the surface is drawn on */
+    Ring zero_copy_images;
 
     //fix me - better handling here
     QXLReleaseInfoExt create, destroy;
@@ -240,6 +246,8 @@ bool                       display_channel_wait_for_migrate_data     (DisplayCha
 void                       display_channel_flush_all_surfaces        (DisplayChannel *display);
 void                       display_channel_free_glz_drawables_to_free(DisplayChannel *display);
 void                       display_channel_free_glz_drawables        (DisplayChannel *display);
+void                       display_channel_release_compress_jobs     (DisplayChannel *display,
+                                                                      bool wait);
 void                       display_channel_destroy_surface_wait      (DisplayChannel *display,
                                                                       uint32_t surface_id);
 void                       display_channel_destroy_surfaces          (DisplayChannel *display);
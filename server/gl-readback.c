@@ -0,0 +1,187 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef HAVE_LINUX_DMA_BUF_H
+#include <linux/dma-buf.h>
+#endif
+#include <common/mem.h>
+#include <common/log.h>
+
+#include "gl-readback.h"
+
+/* the DRM formats QEMU uses for its scanouts, see drm_fourcc.h */
+#define GL_READBACK_FOURCC(a, b, c, d) \
+    ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+#define GL_READBACK_FORMAT_XRGB8888 GL_READBACK_FOURCC('X', 'R', '2', '4')
+#define GL_READBACK_FORMAT_ARGB8888 GL_READBACK_FOURCC('A', 'R', '2', '4')
+
+struct GlReadback {
+    int fd;
+    uint8_t *data;
+    size_t size;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    bool y0_top;
+};
+
+GlReadback *gl_readback_new(int fd, uint32_t width, uint32_t height,
+                            uint32_t stride, uint32_t fourcc, bool y0_top)
+{
+    GlReadback *readback;
+    void *data;
+    size_t size;
+
+    if (fourcc != GL_READBACK_FORMAT_XRGB8888 && fourcc != GL_READBACK_FORMAT_ARGB8888) {
+        spice_warning("unsupported GL scanout format 0x%08x", fourcc);
+        return NULL;
+    }
+    if (width == 0 || height == 0 || stride < width * 4) {
+        spice_warning("invalid GL scanout %ux%u stride %u", width, height, stride);
+        return NULL;
+    }
+
+    size = (size_t)stride * height;
+    data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        spice_warning("failed to map the GL scanout: %s", strerror(errno));
+        return NULL;
+    }
+
+    readback = spice_new0(GlReadback, 1);
+    /* only used to bracket the CPU accesses, the mapping holds the buffer */
+    readback->fd = dup(fd);
+    readback->data = data;
+    readback->size = size;
+    readback->width = width;
+    readback->height = height;
+    readback->stride = stride;
+    readback->y0_top = y0_top;
+
+    return readback;
+}
+
+void gl_readback_free(GlReadback *readback)
+{
+    if (!readback) {
+        return;
+    }
+
+    munmap(readback->data, readback->size);
+    if (readback->fd >= 0) {
+        close(readback->fd);
+    }
+    free(readback);
+}
+
+void gl_readback_get_area(const GlReadback *readback, SpiceRect *area)
+{
+    area->left = 0;
+    area->top = 0;
+    area->right = readback->width;
+    area->bottom = readback->height;
+}
+
+bool gl_readback_is_top_down(const GlReadback *readback)
+{
+    return readback->y0_top;
+}
+
+/* Tells the exporter that the CPU reads the buffer, so it can flush the GPU
+ * caches. Plain memory, for instance a memfd, does not need it. */
+static void gl_readback_sync(GlReadback *readback, bool start)
+{
+#if defined(HAVE_LINUX_DMA_BUF_H) && defined(DMA_BUF_IOCTL_SYNC)
+    struct dma_buf_sync sync = {
+        .flags = (start ? DMA_BUF_SYNC_START : DMA_BUF_SYNC_END) | DMA_BUF_SYNC_READ,
+    };
+
+    while (ioctl(readback->fd, DMA_BUF_IOCTL_SYNC, &sync) == -1 && errno == EINTR) {
+        continue;
+    }
+#endif
+}
+
+GlReadbackFrame *gl_readback_read(GlReadback *readback, const SpiceRect *area)
+{
+    GlReadbackFrame *frame;
+    uint32_t width, height, line_size, first_line, i;
+    uint8_t *data;
+
+    SpiceRect clipped = {
+        .left = MAX(area->left, 0),
+        .top = MAX(area->top, 0),
+        .right = MIN(area->right, (int32_t)readback->width),
+        .bottom = MIN(area->bottom, (int32_t)readback->height),
+    };
+    if (clipped.left >= clipped.right || clipped.top >= clipped.bottom) {
+        return NULL;
+    }
+
+    width = clipped.right - clipped.left;
+    height = clipped.bottom - clipped.top;
+    line_size = width * 4;
+    /* without Y0TOP the first line of the buffer is the bottom one */
+    first_line = readback->y0_top ? clipped.top : readback->height - clipped.bottom;
+
+    data = spice_malloc_n(height, line_size);
+    gl_readback_sync(readback, true);
+    for (i = 0; i < height; i++) {
+        memcpy(data + i * line_size,
+               readback->data + (size_t)(first_line + i) * readback->stride + clipped.left * 4,
+               line_size);
+    }
+    gl_readback_sync(readback, false);
+
+    frame = spice_new0(GlReadbackFrame, 1);
+    frame->refs = 1;
+    frame->area = clipped;
+    frame->bitmap.format = SPICE_BITMAP_FMT_32BIT;
+    frame->bitmap.flags = readback->y0_top ? SPICE_BITMAP_FLAGS_TOP_DOWN : 0;
+    frame->bitmap.x = width;
+    frame->bitmap.y = height;
+    frame->bitmap.stride = line_size;
+    frame->bitmap.data = spice_chunks_new_linear(data, height * line_size);
+    frame->bitmap.data->flags |= SPICE_CHUNKS_FLAGS_FREE;
+
+    return frame;
+}
+
+GlReadbackFrame *gl_readback_frame_ref(GlReadbackFrame *frame)
+{
+    g_atomic_int_inc(&frame->refs);
+    return frame;
+}
+
+/* the video encoders may drop their references from their own threads */
+void gl_readback_frame_unref(GlReadbackFrame *frame)
+{
+    if (!g_atomic_int_dec_and_test(&frame->refs)) {
+        return;
+    }
+    spice_chunks_destroy(frame->bitmap.data);
+    free(frame);
+}
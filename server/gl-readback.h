@@ -0,0 +1,62 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef GL_READBACK_H_
+#define GL_READBACK_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <glib.h>
+#include <spice/enums.h>
+#include <common/draw.h>
+
+/* CPU access to a GL scanout, for the clients that cannot import its dmabuf.
+ *
+ * The scanout buffer is mapped read-only once and the areas damaged by
+ * spice_qxl_gl_draw_async() are copied out of it before the draw is
+ * completed, so the guest is free to render the next frame into the buffer
+ * while the copies are encoded and sent.
+ */
+
+typedef struct GlReadback GlReadback;
+
+/* A copy of an area of the scanout, suitable for a VideoEncoder */
+typedef struct GlReadbackFrame {
+    gint refs;
+    /* the area of the scanout, with the origin at the top-left corner */
+    SpiceRect area;
+    /* the copied lines are in the order of the scanout, see
+     * SPICE_BITMAP_FLAGS_TOP_DOWN */
+    SpiceBitmap bitmap;
+} GlReadbackFrame;
+
+/* Returns NULL if the format is not supported or the buffer cannot be
+ * mapped. @fd stays owned by the caller and may be closed afterwards. */
+GlReadback *gl_readback_new(int fd, uint32_t width, uint32_t height,
+                            uint32_t stride, uint32_t fourcc, bool y0_top);
+void gl_readback_free(GlReadback *readback);
+/* The area covered by the scanout */
+void gl_readback_get_area(const GlReadback *readback, SpiceRect *area);
+bool gl_readback_is_top_down(const GlReadback *readback);
+
+/* Copies @area, clipped to the scanout. Returns NULL if it is empty. */
+GlReadbackFrame *gl_readback_read(GlReadback *readback, const SpiceRect *area);
+GlReadbackFrame *gl_readback_frame_ref(GlReadbackFrame *frame);
+void gl_readback_frame_unref(GlReadbackFrame *frame);
+
+#endif /* GL_READBACK_H_ */
@@ -197,8 +197,8 @@ static inline size_t FNAME(do_match)(SharedDictionary *dict,
         *o_pix_distance = PIXEL_DIST(ip, ip_seg, ref, ref_seg, pix_per_byte);
     } else { // the ref is at different image - encode offset from the image start
         *o_pix_distance = PIXEL_DIST(ref, ref_seg,
-                                     (PIXEL *)(dict->window.segs[ref_seg->image->first_seg].lines),
-                                     &dict->window.segs[ref_seg->image->first_seg],
+                                     (PIXEL *)(WINDOW_SEG(dict, ref_seg->image->first_seg)->lines),
+                                     WINDOW_SEG(dict, ref_seg->image->first_seg),
                                      pix_per_byte);
     }
 
@@ -246,7 +246,7 @@ static inline size_t FNAME(do_match)(SharedDictionary *dict,
 */
 static void FNAME(compress_seg)(Encoder *encoder, uint32_t seg_idx, PIXEL *from, int copied)
 {
-    WindowImageSegment *seg = &encoder->dict->window.segs[seg_idx];
+    WindowImageSegment *seg = WINDOW_SEG(encoder->dict, seg_idx);
     const PIXEL *ip = from;
     const PIXEL *ip_bound = (PIXEL *)(seg->lines_end) - BOUND_OFFSET;
     const PIXEL *ip_limit = (PIXEL *)(seg->lines_end) - LIMIT_OFFSET;
@@ -271,7 +271,7 @@ static void FNAME(compress_seg)(Encoder *encoder, uint32_t seg_idx, PIXEL *from,
         const PIXEL            *ref;
         const PIXEL            *ref_limit;
         WindowImageSegment     *ref_seg;
-        uint32_t ref_seg_idx;
+        HashEntry ref_entry;
         size_t pix_dist;
         size_t image_dist;
         /* minimum match length */
@@ -321,18 +321,14 @@ static void FNAME(compress_seg)(Encoder *encoder, uint32_t seg_idx, PIXEL *from,
 
 #ifdef CHAINED_HASH
         for (hash_id = 0; hash_id < HASH_CHAIN_SIZE; hash_id++) {
-            ref_seg_idx = encoder->dict->htab[hval][hash_id].image_seg_idx;
+            ref_entry = LOAD_HASH_ENTRY(&encoder->dict->htab[hval][hash_id]);
 #else
-        ref_seg_idx = encoder->dict->htab[hval].image_seg_idx;
+        ref_entry = LOAD_HASH_ENTRY(&encoder->dict->htab[hval]);
 #endif
-            ref_seg = encoder->dict->window.segs + ref_seg_idx;
+            ref_seg = WINDOW_SEG(encoder->dict, HASH_ENTRY_SEG(ref_entry));
             if (REF_SEG_IS_VALID(encoder->dict, encoder->id,
                                  ref_seg, seg)) {
-#ifdef CHAINED_HASH
-                ref = ((PIXEL *)ref_seg->lines) + encoder->dict->htab[hval][hash_id].ref_pix_idx;
-#else
-                ref = ((PIXEL *)ref_seg->lines) + encoder->dict->htab[hval].ref_pix_idx;
-#endif
+                ref = ((PIXEL *)ref_seg->lines) + HASH_ENTRY_PIX(ref_entry);
                 ref_limit = (PIXEL *)ref_seg->lines_end;
 
                 len = FNAME(do_match)(encoder->dict, ref_seg, ref, ref_limit, seg, ip, ip_bound,
@@ -478,30 +474,30 @@ static void FNAME(compress)(Encoder *encoder)
 
     // fetch the first image segment that is not too small
     while ((seg_id != NULL_IMAGE_SEG_ID) &&
-           (dict->window.segs[seg_id].image->id == encoder->cur_image.id) &&
-           ((((PIXEL *)dict->window.segs[seg_id].lines_end) -
-             ((PIXEL *)dict->window.segs[seg_id].lines)) < 4)) {
+           (WINDOW_SEG(dict, seg_id)->image->id == encoder->cur_image.id) &&
+           ((((PIXEL *)WINDOW_SEG(dict, seg_id)->lines_end) -
+             ((PIXEL *)WINDOW_SEG(dict, seg_id)->lines)) < 4)) {
         // coping the segment
-        if (dict->window.segs[seg_id].lines != dict->window.segs[seg_id].lines_end) {
-            ip = (PIXEL *)dict->window.segs[seg_id].lines;
+        if (WINDOW_SEG(dict, seg_id)->lines != WINDOW_SEG(dict, seg_id)->lines_end) {
+            ip = (PIXEL *)WINDOW_SEG(dict, seg_id)->lines;
             // Note: we assume MAX_COPY > 3
             encode_copy_count(encoder, (uint8_t)(
-                                  (((PIXEL *)dict->window.segs[seg_id].lines_end) -
-                                   ((PIXEL *)dict->window.segs[seg_id].lines)) - 1));
-            while (ip < (PIXEL *)dict->window.segs[seg_id].lines_end) {
+                                  (((PIXEL *)WINDOW_SEG(dict, seg_id)->lines_end) -
+                                   ((PIXEL *)WINDOW_SEG(dict, seg_id)->lines)) - 1));
+            while (ip < (PIXEL *)WINDOW_SEG(dict, seg_id)->lines_end) {
                 ENCODE_PIXEL(encoder, *ip);
                 ip++;
             }
         }
-        seg_id = dict->window.segs[seg_id].next;
+        seg_id = LOAD_SEG_NEXT(WINDOW_SEG(dict, seg_id));
     }
 
     if ((seg_id == NULL_IMAGE_SEG_ID) ||
-        (dict->window.segs[seg_id].image->id != encoder->cur_image.id)) {
+        (WINDOW_SEG(dict, seg_id)->image->id != encoder->cur_image.id)) {
         return;
     }
 
-    ip = (PIXEL *)dict->window.segs[seg_id].lines;
+    ip = (PIXEL *)WINDOW_SEG(dict, seg_id)->lines;
 
 
     encode_copy_count(encoder, MAX_COPY - 1);
@@ -520,11 +516,11 @@ static void FNAME(compress)(Encoder *encoder)
     FNAME(compress_seg)(encoder, seg_id, ip, 2);
 
     // compressing the next segments
-    for (seg_id = dict->window.segs[seg_id].next;
+    for (seg_id = LOAD_SEG_NEXT(WINDOW_SEG(dict, seg_id));
         seg_id != NULL_IMAGE_SEG_ID && (
-        dict->window.segs[seg_id].image->id == encoder->cur_image.id);
-        seg_id = dict->window.segs[seg_id].next) {
-        FNAME(compress_seg)(encoder, seg_id, (PIXEL *)dict->window.segs[seg_id].lines, 0);
+        WINDOW_SEG(dict, seg_id)->image->id == encoder->cur_image.id);
+        seg_id = LOAD_SEG_NEXT(WINDOW_SEG(dict, seg_id))) {
+        FNAME(compress_seg)(encoder, seg_id, (PIXEL *)WINDOW_SEG(dict, seg_id)->lines, 0);
     }
 }
 
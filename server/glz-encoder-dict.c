@@ -27,6 +27,7 @@
 #include "glz-encoder-priv.h"
 
 static void glz_enc_dictionary_reset(GlzEncDictContext *opaque_dict, GlzEncoderUsrContext *usr);
+static void glz_dictionary_window_destroy(SharedDictionary *dict);
 
 /* turning all used images to free ones. If they are alive, calling the free_image callback for
    each one */
@@ -47,6 +48,39 @@ static inline void __glz_dictionary_window_reset_images(SharedDictionary *dict)
     dict->window.used_images_tail = NULL;
 }
 
+/* adds a chunk of free segments at the end of the segments storage, linked
+   to each other but not to the free list */
+static bool glz_dictionary_window_alloc_segs_chunk(SharedDictionary *dict)
+{
+    uint32_t chunk = dict->window.segs_quota >> SEGS_CHUNK_SIZE_LOG;
+    WindowImageSegment *seg;
+    uint32_t i;
+
+    if (chunk == MAX_SEGS_CHUNKS) {
+        return FALSE;
+    }
+
+    seg = (WindowImageSegment *)dict->cur_usr->malloc(dict->cur_usr,
+                                                      sizeof(WindowImageSegment) * SEGS_CHUNK_SIZE);
+    if (!seg) {
+        return FALSE;
+    }
+
+    for (i = dict->window.segs_quota; i < dict->window.segs_quota + SEGS_CHUNK_SIZE; i++, seg++) {
+        seg->image = NULL;
+        seg->lines = NULL;
+        seg->lines_end = NULL;
+        seg->pixels_num = 0;
+        seg->pixels_so_far = 0;
+        seg->next = i + 1;
+    }
+    (seg - 1)->next = NULL_IMAGE_SEG_ID;
+
+    STORE_SEGS_CHUNK(dict, chunk, seg - SEGS_CHUNK_SIZE);
+    dict->window.segs_quota += SEGS_CHUNK_SIZE;
+    return TRUE;
+}
+
 /* allocate window fields (no reset)*/
 static bool glz_dictionary_window_create(SharedDictionary *dict, uint32_t size)
 {
@@ -55,20 +89,21 @@ static bool glz_dictionary_window_create(SharedDictionary *dict, uint32_t size)
     }
 
     dict->window.size_limit = size;
-    dict->window.segs = (WindowImageSegment *)(
-            dict->cur_usr->malloc(dict->cur_usr, sizeof(WindowImageSegment) * INIT_IMAGE_SEGS_NUM));
+    memset(dict->window.segs_chunks, 0, sizeof(dict->window.segs_chunks));
+    dict->window.segs_quota = 0;
+    dict->window.encoders_epochs = NULL;
 
-    if (!dict->window.segs) {
+    if (!glz_dictionary_window_alloc_segs_chunk(dict)) {
         return FALSE;
     }
 
-    dict->window.segs_quota = INIT_IMAGE_SEGS_NUM;
-
     dict->window.encoders_heads = (uint32_t *)dict->cur_usr->malloc(dict->cur_usr,
                                                             sizeof(uint32_t) * dict->max_encoders);
+    dict->window.encoders_epochs = (uint64_t *)dict->cur_usr->malloc(dict->cur_usr,
+                                                            sizeof(uint64_t) * dict->max_encoders);
 
-    if (!dict->window.encoders_heads) {
-        dict->cur_usr->free(dict->cur_usr, dict->window.segs);
+    if (!dict->window.encoders_heads || !dict->window.encoders_epochs) {
+        glz_dictionary_window_destroy(dict);
         return FALSE;
     }
 
@@ -85,12 +120,12 @@ static bool glz_dictionary_window_create(SharedDictionary *dict, uint32_t size)
 static void glz_dictionary_window_reset(SharedDictionary *dict)
 {
     uint32_t i;
-    WindowImageSegment *seg, *last_seg;
+    WindowImageSegment *seg;
 
-    last_seg = dict->window.segs + dict->window.segs_quota;
     /* reset free segs list */
     dict->window.free_segs_head = 0;
-    for (seg = dict->window.segs, i = 0; seg < last_seg; seg++, i++) {
+    for (i = 0; i < dict->window.segs_quota; i++) {
+        seg = WINDOW_SEG(dict, i);
         seg->next = i + 1;
         seg->image = NULL;
         seg->lines = NULL;
@@ -98,7 +133,7 @@ static void glz_dictionary_window_reset(SharedDictionary *dict)
         seg->pixels_num = 0;
         seg->pixels_so_far = 0;
     }
-    dict->window.segs[dict->window.segs_quota - 1].next = NULL_IMAGE_SEG_ID;
+    WINDOW_SEG(dict, dict->window.segs_quota - 1)->next = NULL_IMAGE_SEG_ID;
 
     dict->window.used_segs_head = NULL_IMAGE_SEG_ID;
     dict->window.used_segs_tail = NULL_IMAGE_SEG_ID;
@@ -106,6 +141,7 @@ static void glz_dictionary_window_reset(SharedDictionary *dict)
     // reset encoders heads
     for (i = 0; i < dict->max_encoders; i++) {
         dict->window.encoders_heads[i] = NULL_IMAGE_SEG_ID;
+        dict->window.encoders_epochs[i] = 0;
     }
 
     __glz_dictionary_window_reset_images(dict);
@@ -119,14 +155,17 @@ static inline void glz_dictionary_reset_hash(SharedDictionary *dict)
 #endif
 }
 
-static inline void glz_dictionary_window_destroy(SharedDictionary *dict)
+static void glz_dictionary_window_destroy(SharedDictionary *dict)
 {
+    uint32_t i;
+
     __glz_dictionary_window_reset_images(dict);
 
-    if (dict->window.segs) {
-        dict->cur_usr->free(dict->cur_usr, dict->window.segs);
-        dict->window.segs = NULL;
+    for (i = 0; i < dict->window.segs_quota >> SEGS_CHUNK_SIZE_LOG; i++) {
+        dict->cur_usr->free(dict->cur_usr, dict->window.segs_chunks[i]);
+        dict->window.segs_chunks[i] = NULL;
     }
+    dict->window.segs_quota = 0;
 
     while (dict->window.free_images) {
         WindowImage *tmp = dict->window.free_images;
@@ -139,6 +178,11 @@ static inline void glz_dictionary_window_destroy(SharedDictionary *dict)
         dict->cur_usr->free(dict->cur_usr, dict->window.encoders_heads);
         dict->window.encoders_heads = NULL;
     }
+
+    if (dict->window.encoders_epochs) {
+        dict->cur_usr->free(dict->cur_usr, dict->window.encoders_epochs);
+        dict->window.encoders_epochs = NULL;
+    }
 }
 
 /* logic removal only */
@@ -160,11 +204,11 @@ GlzEncDictContext *glz_enc_dictionary_create(uint32_t size, uint32_t max_encoder
     dict->cur_usr = usr;
     dict->last_image_id = 0;
     dict->max_encoders = max_encoders;
-
-    pthread_mutex_init(&dict->lock, NULL);
-    pthread_rwlock_init(&dict->rw_alloc_lock, NULL);
+    dict->epoch = 0;
 
     dict->window.encoders_heads = NULL;
+    dict->window.used_images_head = NULL;
+    dict->window.free_images = NULL;
 
     // alloc window fields and reset
     if (!glz_dictionary_window_create(dict, size)) {
@@ -172,6 +216,8 @@ GlzEncDictContext *glz_enc_dictionary_create(uint32_t size, uint32_t max_encoder
         return NULL;
     }
 
+    pthread_mutex_init(&dict->lock, NULL);
+
     // reset window and hash
     glz_enc_dictionary_reset((GlzEncDictContext *)dict, usr);
 
@@ -227,7 +273,6 @@ void glz_enc_dictionary_destroy(GlzEncDictContext *opaque_dict, GlzEncoderUsrCon
     glz_dictionary_window_destroy(dict);
 
     pthread_mutex_destroy(&dict->lock);
-    pthread_rwlock_destroy(&dict->rw_alloc_lock);
 
     dict->cur_usr->free(dict->cur_usr, dict);
 }
@@ -243,16 +288,47 @@ uint32_t glz_enc_dictionary_get_size(GlzEncDictContext *opaque_dict)
 }
 
 /* doesn't call the remove image callback */
-void glz_enc_dictionary_remove_image(GlzEncDictContext *opaque_dict,
-                                     GlzEncDictImageContext *opaque_image,
-                                     GlzEncoderUsrContext *usr)
+uint64_t glz_enc_dictionary_remove_image(GlzEncDictContext *opaque_dict,
+                                         GlzEncDictImageContext *opaque_image,
+                                         GlzUsrImageContext *usr_image,
+                                         GlzEncoderUsrContext *usr)
 {
     SharedDictionary *dict = (SharedDictionary *)opaque_dict;
     WindowImage *image = (WindowImage *)opaque_image;
+    uint64_t epoch;
+
+    pthread_mutex_lock(&dict->lock);
     dict->cur_usr = usr;
     GLZ_ASSERT(dict->cur_usr, opaque_image && opaque_dict);
 
-    glz_dictionary_window_kill_image(dict, image);
+    // the image may have left the window and been reused for another one
+    if (image->usr_context == usr_image) {
+        glz_dictionary_window_kill_image(dict, image);
+    }
+    epoch = dict->epoch;
+    pthread_mutex_unlock(&dict->lock);
+
+    return epoch;
+}
+
+bool glz_enc_dictionary_epoch_done(GlzEncDictContext *opaque_dict, uint64_t epoch)
+{
+    SharedDictionary *dict = (SharedDictionary *)opaque_dict;
+    bool done = TRUE;
+    uint32_t i;
+
+    pthread_mutex_lock(&dict->lock);
+    for (i = 0; i < dict->max_encoders; i++) {
+        uint64_t encoder_epoch = dict->window.encoders_epochs[i];
+
+        if (encoder_epoch != 0 && encoder_epoch <= epoch) {
+            done = FALSE;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&dict->lock);
+
+    return done;
 }
 
 /***********************************************************************************
@@ -268,48 +344,18 @@ static inline int __get_pixels_num(LzImageType image_type, unsigned int num_line
     }
 }
 
-static void __glz_dictionary_window_segs_realloc(SharedDictionary *dict)
+/* The existing segments don't move, so the encoders can keep using them
+   meanwhile */
+static void __glz_dictionary_window_segs_grow(SharedDictionary *dict)
 {
-    WindowImageSegment *new_segs;
-    uint32_t new_quota = (MAX_IMAGE_SEGS_NUM < (dict->window.segs_quota * 2)) ?
-        MAX_IMAGE_SEGS_NUM : (dict->window.segs_quota * 2);
-    WindowImageSegment *seg;
-    uint32_t i;
+    uint32_t first_new_seg = dict->window.segs_quota;
 
-    pthread_rwlock_wrlock(&dict->rw_alloc_lock);
-
-    if (dict->window.segs_quota == MAX_IMAGE_SEGS_NUM) {
+    if (!glz_dictionary_window_alloc_segs_chunk(dict)) {
         dict->cur_usr->error(dict->cur_usr, "overflow in image segments window\n");
     }
 
-    new_segs = (WindowImageSegment*)dict->cur_usr->malloc(
-            dict->cur_usr, sizeof(WindowImageSegment) * new_quota);
-
-    if (!new_segs) {
-        dict->cur_usr->error(dict->cur_usr,
-                             "realloc of dictionary window failed\n");
-    }
-
-    memcpy(new_segs, dict->window.segs,
-           sizeof(WindowImageSegment) * dict->window.segs_quota);
-
-    // resetting the new elements
-    for (i = dict->window.segs_quota, seg = new_segs + i; i < new_quota; i++, seg++) {
-        seg->image = NULL;
-        seg->lines = NULL;
-        seg->lines_end = NULL;
-        seg->pixels_num = 0;
-        seg->pixels_so_far = 0;
-        seg->next = i + 1;
-    }
-    new_segs[new_quota - 1].next = dict->window.free_segs_head;
-    dict->window.free_segs_head = dict->window.segs_quota;
-
-    dict->cur_usr->free(dict->cur_usr, dict->window.segs);
-    dict->window.segs = new_segs;
-    dict->window.segs_quota = new_quota;
-
-    pthread_rwlock_unlock(&dict->rw_alloc_lock);
+    WINDOW_SEG(dict, dict->window.segs_quota - 1)->next = dict->window.free_segs_head;
+    dict->window.free_segs_head = first_new_seg;
 }
 
 /* NOTE - it also updates the used_images_list*/
@@ -347,13 +393,13 @@ static uint32_t __glz_dictionary_window_alloc_image_seg(SharedDictionary *dict)
 
     // TODO: when is it best to realloc? when full or when half full?
     if (dict->window.free_segs_head == NULL_IMAGE_SEG_ID) {
-        __glz_dictionary_window_segs_realloc(dict);
+        __glz_dictionary_window_segs_grow(dict);
     }
 
     GLZ_ASSERT(dict->cur_usr, dict->window.free_segs_head != NULL_IMAGE_SEG_ID);
 
     seg_id = dict->window.free_segs_head;
-    seg = dict->window.segs + seg_id;
+    seg = WINDOW_SEG(dict, seg_id);
     dict->window.free_segs_head = seg->next;
 
     return seg_id;
@@ -381,13 +427,13 @@ static inline void __glz_dictionary_window_free_image_segs(SharedDictionary *dic
     dict->window.free_segs_head = image->first_seg;
 
     // retrieving the last segment of the image
-    for (seg_id = image->first_seg, next_seg_id = dict->window.segs[seg_id].next;
-         (next_seg_id != NULL_IMAGE_SEG_ID) && (dict->window.segs[next_seg_id].image == image);
-         seg_id = next_seg_id, next_seg_id = dict->window.segs[seg_id].next) {
+    for (seg_id = image->first_seg, next_seg_id = WINDOW_SEG(dict, seg_id)->next;
+         (next_seg_id != NULL_IMAGE_SEG_ID) && (WINDOW_SEG(dict, next_seg_id)->image == image);
+         seg_id = next_seg_id, next_seg_id = WINDOW_SEG(dict, seg_id)->next) {
     }
 
     // concatenate the free list
-    dict->window.segs[seg_id].next = old_free_head;
+    WINDOW_SEG(dict, seg_id)->next = old_free_head;
 }
 
 /* Returns the logical head of the window after we add an image with the give size to its tail.
@@ -413,10 +459,10 @@ static WindowImage *glz_dictionary_window_get_new_head(SharedDictionary *dict, i
     GLZ_ASSERT(dict->cur_usr, dict->window.used_segs_tail != NULL_IMAGE_SEG_ID);
 
     // used_segs_head is the latest logical head (the physical head may preceed it)
-    cur_head = dict->window.segs[dict->window.used_segs_head].image;
-    cur_win_size = dict->window.segs[dict->window.used_segs_tail].pixels_num +
-        dict->window.segs[dict->window.used_segs_tail].pixels_so_far -
-        dict->window.segs[dict->window.used_segs_head].pixels_so_far;
+    cur_head = WINDOW_SEG(dict, dict->window.used_segs_head)->image;
+    cur_win_size = WINDOW_SEG(dict, dict->window.used_segs_tail)->pixels_num +
+        WINDOW_SEG(dict, dict->window.used_segs_tail)->pixels_so_far -
+        WINDOW_SEG(dict, dict->window.used_segs_head)->pixels_so_far;
 
     while ((cur_win_size + new_image_size) > dict->window.size_limit) {
         GLZ_ASSERT(dict->cur_usr, cur_head);
@@ -467,7 +513,7 @@ static uint32_t glz_dictionary_window_alloc_image_seg(SharedDictionary *dict, Wi
                                                       uint8_t *lines, unsigned int num_lines)
 {
     uint32_t seg_id = __glz_dictionary_window_alloc_image_seg(dict);
-    WindowImageSegment *seg = &dict->window.segs[seg_id];
+    WindowImageSegment *seg = WINDOW_SEG(dict, seg_id);
 
     seg->image = image;
     seg->lines = lines;
@@ -513,7 +559,7 @@ static WindowImage *glz_dictionary_window_add_image(SharedDictionary *dict, LzIm
         if (row == 0) {
             image->first_seg = seg_id;
         } else {
-            dict->window.segs[prev_seg_id].next = seg_id;
+            WINDOW_SEG(dict, prev_seg_id)->next = seg_id;
         }
 
         row += num_lines;
@@ -538,12 +584,11 @@ static WindowImage *glz_dictionary_window_add_image(SharedDictionary *dict, LzIm
         // (read-only use - when going over the segs of an image,
         // see glz_encode_tmpl::compress).
         // Thus, the 'next' field of the list's tail can be accessed only
-        // after all the new tail's data was set. Note that we are relying on
-        // an atomic assignment (32 bit variable).
+        // after all the new tail's data was set, which the release store ensures.
         // For the other thread that may read 'next' of the old tail, NULL_IMAGE_SEG_ID
         // is equivalent to a segment with an image id that is different
         // from the image id of the tail, so we don't need to further protect this field.
-        dict->window.segs[prev_tail].next = image->first_seg;
+        STORE_SEG_NEXT(WINDOW_SEG(dict, prev_tail), image->first_seg);
         dict->window.used_segs_tail = seg_id;
     }
     image->is_alive = TRUE;
@@ -586,11 +631,11 @@ WindowImage *glz_dictionary_pre_encode(uint32_t encoder_id, GlzEncoderUsrContext
         dict->window.encoders_heads[encoder_id] = ret->first_seg;
         *image_head_dist = 0;
     }
+    dict->window.encoders_epochs[encoder_id] = ++dict->epoch;
 
 
     // update encoders head  (the other heads were already updated)
     pthread_mutex_unlock(&dict->lock);
-    pthread_rwlock_rdlock(&dict->rw_alloc_lock);
     return ret;
 }
 
@@ -601,7 +646,6 @@ void glz_dictionary_post_encode(uint32_t encoder_id, GlzEncoderUsrContext *usr,
     uint32_t early_head_seg = NULL_IMAGE_SEG_ID;
     uint32_t this_encoder_head_seg;
 
-    pthread_rwlock_unlock(&dict->rw_alloc_lock);
     pthread_mutex_lock(&dict->lock);
     dict->cur_usr = usr;
 
@@ -628,10 +672,11 @@ void glz_dictionary_post_encode(uint32_t encoder_id, GlzEncoderUsrContext *usr,
         GLZ_ASSERT(dict->cur_usr,
                    this_encoder_head_seg == dict->window.used_images_head->first_seg);
         glz_dictionary_window_remove_head(dict, encoder_id,
-                                          dict->window.segs[early_head_seg].image);
+                                          WINDOW_SEG(dict, early_head_seg)->image);
     }
 
 
     dict->window.encoders_heads[encoder_id] = NULL_IMAGE_SEG_ID;
+    dict->window.encoders_epochs[encoder_id] = 0;
     pthread_mutex_unlock(&dict->lock);
 }
@@ -18,6 +18,7 @@
 #ifndef GLZ_ENCODER_DICT_H_
 #define GLZ_ENCODER_DICT_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 
 /*
@@ -60,9 +61,16 @@ void glz_enc_dictionary_get_restore_data(GlzEncDictContext *opaque_dict,
 GlzEncDictContext *glz_enc_dictionary_restore(GlzEncDictRestoreData *restore_data,
                                               GlzEncoderUsrContext *usr);
 
-/* image: the context returned by the encoder when the image was encoded.
-   NOTE - you should use this routine only when no encoder uses the dictionary.*/
-void glz_enc_dictionary_remove_image(GlzEncDictContext *opaque_dict,
-                                     GlzEncDictImageContext *image, GlzEncoderUsrContext *usr);
+/* image    : the context returned by the encoder when the image was encoded.
+   usr_image: the context given to the encoder with the image.
+   Encoders that are running may still read the lines of the image. Returns the
+   epoch to give to glz_enc_dictionary_epoch_done() to know when they finished. */
+uint64_t glz_enc_dictionary_remove_image(GlzEncDictContext *opaque_dict,
+                                         GlzEncDictImageContext *image,
+                                         GlzUsrImageContext *usr_image,
+                                         GlzEncoderUsrContext *usr);
+
+/* returns TRUE when all the encoders that started up to the epoch are finished */
+bool glz_enc_dictionary_epoch_done(GlzEncDictContext *opaque_dict, uint64_t epoch);
 
 #endif /* GLZ_ENCODER_DICT_H_ */
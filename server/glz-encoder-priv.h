@@ -43,8 +43,6 @@ typedef struct WindowImageSegment WindowImageSegment;
 #define HASH_SIZE (1 << HASH_SIZE_LOG)
 #define HASH_MASK (HASH_SIZE - 1)
 
-typedef struct HashEntry HashEntry;
-
 typedef struct SharedDictionary SharedDictionary;
 
 struct WindowImage {
@@ -59,7 +57,13 @@ struct WindowImage {
 
 #define MAX_IMAGE_SEGS_NUM (0xffffffff)
 #define NULL_IMAGE_SEG_ID MAX_IMAGE_SEGS_NUM
-#define INIT_IMAGE_SEGS_NUM 1000
+
+/* The segments are allocated in chunks that never move, so that encoders can
+   keep reading them while another encoder adds segments to the window */
+#define SEGS_CHUNK_SIZE_LOG 10
+#define SEGS_CHUNK_SIZE (1 << SEGS_CHUNK_SIZE_LOG)
+#define SEGS_CHUNK_MASK (SEGS_CHUNK_SIZE - 1)
+#define MAX_SEGS_CHUNKS (1 << 14)
 
 /* Images can be separated into several chunks. The basic unit of the
    dictionary window is one image segment. Each segment is encoded separately.
@@ -76,18 +80,20 @@ struct WindowImageSegment {
 };
 
 
-struct  __attribute__ ((__packed__)) HashEntry {
-    uint32_t image_seg_idx;
-    uint32_t ref_pix_idx;
-};
+/* The segment index is in the low 32 bits and the pixel index in the high ones,
+   so that an entry is always read and written at once */
+typedef uint64_t HashEntry;
+
+#define HASH_ENTRY_SEG(entry) ((uint32_t)(entry))
+#define HASH_ENTRY_PIX(entry) ((uint32_t)((entry) >> 32))
 
 
 struct SharedDictionary {
     struct {
-        /* The segments storage. A dynamic array.
+        /* The segments storage, see WINDOW_SEG.
            By referring to a segment by its index, instead of address,
            we save space in the hash entries (32bit instead of 64bit) */
-        WindowImageSegment  *segs;
+        WindowImageSegment  *segs_chunks[MAX_SEGS_CHUNKS];
         uint32_t segs_quota;
 
         /* The window is manged as a linked list rather than as a cyclic
@@ -103,6 +109,8 @@ struct SharedDictionary {
                                              // it started the encoding.
                                              // The head is NULL_IMAGE_SEG_ID when the encoder is
                                              // not encoding.
+        uint64_t            *encoders_epochs; // Holds for each encoder the epoch when it started
+                                              // the encoding, 0 when it is not encoding.
 
         /* the window in a resolution of images. But here the head contains the oldest head*/
         WindowImage*        used_images_tail;
@@ -113,9 +121,9 @@ struct SharedDictionary {
         uint32_t size_limit;                 // max number of pixels in a window (per encoder)
     } window;
 
-    /* Concurrency issues: the reading/writing of each entry field should be atomic.
-       It is allowed that the reading/writing of the whole entry won't be atomic,
-       since before we access a reference we check its validity*/
+    /* Concurrency issues: the entries are updated by the encoders without locking.
+       Each entry is read and written atomically, and before we access a reference
+       we check its validity*/
 #ifdef CHAINED_HASH
     HashEntry htab[HASH_SIZE][HASH_CHAIN_SIZE];
     uint8_t htab_counter[HASH_SIZE];  //cyclic counter for the next entry in a chain to be assigned
@@ -125,8 +133,8 @@ struct SharedDictionary {
 
     uint64_t last_image_id;
     uint32_t max_encoders;
+    uint64_t epoch;                   // incremented each time an encoder starts
     pthread_mutex_t lock;
-    pthread_rwlock_t rw_alloc_lock;
     GlzEncoderUsrContext       *cur_usr; // each encoder has other context.
 };
 
@@ -155,24 +163,43 @@ WindowImage *glz_dictionary_pre_encode(uint32_t encoder_id, GlzEncoderUsrContext
 void glz_dictionary_post_encode(uint32_t encoder_id, GlzEncoderUsrContext *usr,
                                 SharedDictionary *dict);
 
+/* The chunks are published by the encoder that adds them under the lock,
+ * while the others read them without it */
+#define LOAD_SEGS_CHUNK(dict, chunk) \
+    __atomic_load_n(&(dict)->window.segs_chunks[chunk], __ATOMIC_ACQUIRE)
+#define STORE_SEGS_CHUNK(dict, chunk, segs) \
+    __atomic_store_n(&(dict)->window.segs_chunks[chunk], segs, __ATOMIC_RELEASE)
+
+#define WINDOW_SEG(dict, seg_id) \
+    (&LOAD_SEGS_CHUNK(dict, (seg_id) >> SEGS_CHUNK_SIZE_LOG)[(seg_id) & SEGS_CHUNK_MASK])
+
+/* The segment following the window tail is set while the other encoders may be
+ * going over the segments of their image */
+#define LOAD_SEG_NEXT(seg) __atomic_load_n(&(seg)->next, __ATOMIC_ACQUIRE)
+#define STORE_SEG_NEXT(seg, next_seg) __atomic_store_n(&(seg)->next, next_seg, __ATOMIC_RELEASE)
+
 #define IMAGE_SEG_IS_EARLIER(dict, dst_seg, src_seg) (                     \
     ((src_seg) == NULL_IMAGE_SEG_ID) || (((dst_seg) != NULL_IMAGE_SEG_ID)  \
-    && ((dict)->window.segs[(dst_seg)].pixels_so_far <                     \
-       (dict)->window.segs[(src_seg)].pixels_so_far)))
+    && (WINDOW_SEG(dict, dst_seg)->pixels_so_far <                         \
+        WINDOW_SEG(dict, src_seg)->pixels_so_far)))
+
 
+/* An entry stored by an encoder makes the segment it points to, filled by
+ * that encoder, visible to the encoders loading it */
+#define LOAD_HASH_ENTRY(entry_ptr) __atomic_load_n(entry_ptr, __ATOMIC_ACQUIRE)
+#define STORE_HASH_ENTRY(entry_ptr, seg, pix) \
+    __atomic_store_n(entry_ptr, ((uint64_t)(pix) << 32) | (uint32_t)(seg), __ATOMIC_RELEASE)
 
 #ifdef CHAINED_HASH
-#define UPDATE_HASH(dict, hval, seg, pix) {                \
-    uint8_t tmp_count = (dict)->htab_counter[hval];        \
-    (dict)->htab[hval][tmp_count].image_seg_idx = seg;     \
-    (dict)->htab[hval][tmp_count].ref_pix_idx = pix;       \
-    tmp_count = ((tmp_count) + 1) & (HASH_CHAIN_SIZE - 1); \
-    dict->htab_counter[hval] = tmp_count;                  \
+#define UPDATE_HASH(dict, hval, seg, pix) {                     \
+    uint8_t tmp_count = (dict)->htab_counter[hval];             \
+    STORE_HASH_ENTRY(&(dict)->htab[hval][tmp_count], seg, pix); \
+    tmp_count = ((tmp_count) + 1) & (HASH_CHAIN_SIZE - 1);      \
+    dict->htab_counter[hval] = tmp_count;                       \
 }
 #else
-#define UPDATE_HASH(dict, hval, seg, pix) { \
-    (dict)->htab[hval].image_seg_idx = seg; \
-    (dict)->htab[hval].ref_pix_idx = pix;   \
+#define UPDATE_HASH(dict, hval, seg, pix) {          \
+    STORE_HASH_ENTRY(&(dict)->htab[hval], seg, pix); \
 }
 #endif
 
@@ -184,8 +211,7 @@ void glz_dictionary_post_encode(uint32_t encoder_id, GlzEncoderUsrContext *usr,
      (ref_seg)->image->is_alive &&                         \
      (src_seg->image->type == ref_seg->image->type) &&     \
      (ref_seg->pixels_so_far <= src_seg->pixels_so_far) && \
-     ((dict)->window.segs[                                 \
-        (dict)->window.encoders_heads[enc_id]].pixels_so_far <= \
+     (WINDOW_SEG(dict, (dict)->window.encoders_heads[enc_id])->pixels_so_far <= \
         ref_seg->pixels_so_far)))
 
 #ifdef DEBUG
@@ -79,13 +79,46 @@ typedef struct {
     uint64_t duration;
 } SpiceGstFrameInformation;
 
+typedef struct SpiceGstEncoder SpiceGstEncoder;
+
+/* A frame pushed into the pipeline, see push_frame() */
+typedef struct SpiceGstFrame {
+    VideoEncoderFrame base;
+    SpiceGstEncoder *encoder;
+
+    /* One reference for the caller and one while the frame is queued.
+     * Only changed by the main thread.
+     */
+    int refs;
+
+    /* TRUE while the frame is in the pending_frames or done_frames queue,
+     * and thus not yet accounted for in the statistics.
+     */
+    gboolean queued;
+
+    /* TRUE once the caller finished or released the frame, in which case
+     * it no longer counts in the statistics.
+     */
+    gboolean released;
+
+    uint32_t seq;
+    uint32_t mm_time;
+    uint64_t start;
+
+    /* Set by new_sample() with outbuf_mutex held. The buffer has no data if
+     * the frame could not be compressed.
+     */
+    uint64_t duration;
+    VideoBuffer *outbuf;
+} SpiceGstFrame;
+
 typedef enum SpiceGstBitRateStatus {
     SPICE_GST_BITRATE_DECREASING,
     SPICE_GST_BITRATE_INCREASING,
     SPICE_GST_BITRATE_STABLE,
 } SpiceGstBitRateStatus;
 
-typedef struct SpiceGstEncoder {
+struct SpiceGstEncoder {
     VideoEncoder base;
 
     /* Callbacks to adjust the refcount of the bitmap being encoded. */
@@ -131,12 +164,57 @@ typedef struct SpiceGstEncoder {
 #   define SPICE_GST_VIDEO_PIPELINE_STATE    0x1
 #   define SPICE_GST_VIDEO_PIPELINE_BITRATE  0x2
 #   define SPICE_GST_VIDEO_PIPELINE_CAPS     0x4
+    /* Start over from a key frame */
+#   define SPICE_GST_VIDEO_PIPELINE_RESTART  0x8
     uint32_t set_pipeline;
 
-    /* Output buffer */
+
+    /* ---------- Frames being encoded ---------- */
+
+    /* Protects the frame queues and the frames outbuf field. */
     pthread_mutex_t outbuf_mutex;
     pthread_cond_t outbuf_cond;
-    VideoBuffer *outbuf;
+
+    /* The frames pushed into the pipeline waiting for new_sample(), and the
+     * compressed frames the main thread has not accounted for yet. In the
+     * order they were pushed.
+     */
+    GQueue pending_frames;
+    GQueue done_frames;
+
+    /* When the last frame came out of the pipeline. */
+    uint64_t last_output_time;
+
+    /* The number of frames in the above queues. Main thread only. */
+    uint32_t frames_in_flight;
+
+    /* How many frames submit_frame() can keep in flight while the worker
+     * goes on, 0 if disabled. This is only reached if encoding a frame takes
+     * longer than the frame period, see get_max_frames_in_flight().
+     */
+    uint32_t max_frames_in_flight;
+#   define SPICE_GST_MAX_FRAMES_IN_FLIGHT 8
+
+    /* The frames are decoded by the client in the order they reach it, so
+     * each frame must be sent in the order it was encoded. These are the
+     * sequence numbers of the last frame pushed into the pipeline and of the
+     * last one sent or, after a restart, skipped.
+     */
+    uint32_t frame_seq;
+    uint32_t sent_seq;
+
+    /* After a frame gets lost submit_frame() lets the next ones be encoded
+     * synchronously when sent, rather than restart the encoder again and
+     * again while the pipe is congested.
+     */
+    uint32_t async_backoff;
+#   define SPICE_GST_ASYNC_BACKOFF_FRAMES 60
+
+    /* The number of SpiceGstFrame referencing the encoder, and whether the
+     * encoder must be freed with the last one.
+     */
+    uint32_t n_frames;
+    gboolean destroyed;
 
     /* The video bit rate. */
     uint64_t video_bit_rate;
@@ -299,7 +377,7 @@ typedef struct SpiceGstEncoder {
 
     /* How many frames were dropped by the server since the last encoded frame. */
     uint32_t server_drops;
-} SpiceGstEncoder;
+};
 
 
 /* ---------- The SpiceGstVideoBuffer implementation ---------- */
@@ -352,6 +430,21 @@ static void set_pipeline_changes(SpiceGstEncoder *encoder, uint32_t flags)
     encoder->set_pipeline |= flags;
 }
 
+/* Unblocks the main thread when no more frames will come out of the
+ * pipeline */
+static void fail_pending_frames(SpiceGstEncoder *encoder)
+{
+    SpiceGstFrame *frame;
+
+    pthread_mutex_lock(&encoder->outbuf_mutex);
+    while ((frame = g_queue_pop_head(&encoder->pending_frames))) {
+        frame->outbuf = (VideoBuffer*)create_gst_video_buffer();
+        g_queue_push_tail(&encoder->done_frames, frame);
+    }
+    pthread_cond_broadcast(&encoder->outbuf_cond);
+    pthread_mutex_unlock(&encoder->outbuf_mutex);
+}
+
 static void free_pipeline(SpiceGstEncoder *encoder)
 {
     if (encoder->src_caps) {
@@ -366,6 +459,7 @@ static void free_pipeline(SpiceGstEncoder *encoder)
         gst_object_unref(encoder->pipeline);
         encoder->pipeline = NULL;
     }
+    fail_pending_frames(encoder);
 }
 
 
@@ -835,10 +929,7 @@ static GstBusSyncReply handle_pipeline_message(GstBus *bus, GstMessage *msg, gpo
         g_clear_error(&err);
 
         /* Unblock the main thread */
-        pthread_mutex_lock(&encoder->outbuf_mutex);
-        encoder->outbuf = (VideoBuffer*)create_gst_video_buffer();
-        pthread_cond_signal(&encoder->outbuf_cond);
-        pthread_mutex_unlock(&encoder->outbuf_mutex);
+        fail_pending_frames(encoder);
     }
     return GST_BUS_PASS;
 }
@@ -867,12 +958,26 @@ static GstFlowReturn new_sample(GstAppSink *gstappsink, gpointer video_encoder)
     }
 #endif
 
-    /* Notify the main thread that the output buffer is ready */
+    /* Notify the main thread that the output buffer is ready. The pipeline
+     * outputs the frames in the order they were pushed.
+     */
+    uint64_t now = spice_get_monotonic_time_ns();
     pthread_mutex_lock(&encoder->outbuf_mutex);
-    encoder->outbuf = (VideoBuffer*)outbuf;
-    pthread_cond_signal(&encoder->outbuf_cond);
+    SpiceGstFrame *frame = g_queue_pop_head(&encoder->pending_frames);
+    if (frame) {
+        /* Don't count the time spent waiting for the previous frames */
+        frame->duration = now - MAX(frame->start, encoder->last_output_time);
+        encoder->last_output_time = now;
+        frame->outbuf = (VideoBuffer*)outbuf;
+        g_queue_push_tail(&encoder->done_frames, frame);
+        pthread_cond_broadcast(&encoder->outbuf_cond);
+    }
     pthread_mutex_unlock(&encoder->outbuf_mutex);
 
+    if (!frame) {
+        /* The frame was already failed by an error */
+        outbuf->base.free((VideoBuffer*)outbuf);
+    }
     return GST_FLOW_OK;
 }
 
@@ -1097,9 +1202,12 @@ static gboolean configure_pipeline(SpiceGstEncoder *encoder)
 
     /* If the pipeline state does not need to be changed it's because it is
      * already in the PLAYING state. So first set it to the NULL state so it
-     * can be (re)configured.
+     * can be (re)configured or restarted.
      */
     if (!(encoder->set_pipeline & SPICE_GST_VIDEO_PIPELINE_STATE) &&
+        (encoder->set_pipeline & (SPICE_GST_VIDEO_PIPELINE_BITRATE |
+                                  SPICE_GST_VIDEO_PIPELINE_CAPS |
+                                  SPICE_GST_VIDEO_PIPELINE_RESTART)) &&
         gst_element_set_state(encoder->pipeline, GST_STATE_NULL) == GST_STATE_CHANGE_FAILURE) {
         spice_debug("GStreamer error: could not stop the pipeline");
         free_pipeline(encoder);
@@ -1123,6 +1231,10 @@ static gboolean configure_pipeline(SpiceGstEncoder *encoder)
         return FALSE;
     }
 
+    /* The encoder starts over from a key frame so the frames still waiting
+     * to be sent can no longer be.
+     */
+    encoder->sent_seq = encoder->frame_seq;
     encoder->set_pipeline = 0;
     return TRUE;
 }
@@ -1423,26 +1535,209 @@ static int push_raw_frame(SpiceGstEncoder *encoder,
     return VIDEO_ENCODER_FRAME_ENCODE_DONE;
 }
 
-/* A helper for spice_gst_encoder_encode_frame() */
-static int pull_compressed_buffer(SpiceGstEncoder *encoder,
-                                  VideoBuffer **outbuf)
+/* ---------- SpiceGstFrame helpers ---------- */
+
+static void spice_gst_encoder_free(SpiceGstEncoder *encoder)
+{
+    pthread_mutex_destroy(&encoder->outbuf_mutex);
+    pthread_cond_destroy(&encoder->outbuf_cond);
+    free(encoder);
+}
+
+static void frame_unref(SpiceGstFrame *frame)
+{
+    SpiceGstEncoder *encoder = frame->encoder;
+
+    if (--frame->refs) {
+        return;
+    }
+    if (frame->outbuf) {
+        frame->outbuf->free(frame->outbuf);
+    }
+    free(frame);
+
+    /* The encoder outlives its frames */
+    if (--encoder->n_frames == 0 && encoder->destroyed) {
+        spice_gst_encoder_free(encoder);
+    }
+}
+
+/* Updates the statistics and bit rate control with a compressed frame */
+static void account_frame(SpiceGstEncoder *encoder, SpiceGstFrame *frame)
+{
+    uint32_t last_mm_time = get_last_frame_mm_time(encoder);
+    add_frame(encoder, frame->mm_time, frame->duration, frame->outbuf->size);
+
+    int32_t refill = encoder->bit_rate * (frame->mm_time - last_mm_time) / MSEC_PER_SEC / 8;
+    encoder->vbuffer_free = MIN(encoder->vbuffer_free + refill,
+                                encoder->vbuffer_size) - frame->outbuf->size;
+
+    server_increase_bit_rate(encoder, frame->mm_time);
+    update_next_frame_mm_time(encoder);
+}
+
+/* Takes the frames that came out of the pipeline from the queue, in order */
+static void collect_frames(SpiceGstEncoder *encoder)
+{
+    SpiceGstFrame *frame;
+
+    for (;;) {
+        pthread_mutex_lock(&encoder->outbuf_mutex);
+        frame = g_queue_pop_head(&encoder->done_frames);
+        pthread_mutex_unlock(&encoder->outbuf_mutex);
+        if (!frame) {
+            break;
+        }
+        encoder->frames_in_flight--;
+        frame->queued = FALSE;
+
+        if (!frame->outbuf->data) {
+            spice_debug("failed to pull the compressed buffer");
+            frame->outbuf->free(frame->outbuf);
+            frame->outbuf = NULL;
+            if (encoder->pipeline) {
+                /* The input buffer will be stuck in the pipeline, preventing
+                 * later ones from being processed. Furthermore something
+                 * went wrong with this pipeline, so it may be safer to
+                 * rebuild it from scratch.
+                 */
+                free_pipeline(encoder);
+                encoder->errors++;
+            }
+        } else if (!frame->released) {
+            account_frame(encoder, frame);
+        }
+        frame_unref(frame);
+    }
+
+    /* Unref the last frames' bitmap_opaque structures if any */
+    clear_zero_copy_queue(encoder, FALSE);
+}
+
+/* Waits until a frame can be collected, if any is being encoded */
+static void wait_for_frame_output(SpiceGstEncoder *encoder)
 {
     pthread_mutex_lock(&encoder->outbuf_mutex);
-    while (!encoder->outbuf) {
+    while (g_queue_is_empty(&encoder->done_frames) &&
+           !g_queue_is_empty(&encoder->pending_frames)) {
         pthread_cond_wait(&encoder->outbuf_cond, &encoder->outbuf_mutex);
     }
-    *outbuf = encoder->outbuf;
-    encoder->outbuf = NULL;
     pthread_mutex_unlock(&encoder->outbuf_mutex);
+}
 
-    if ((*outbuf)->data) {
-        return VIDEO_ENCODER_FRAME_ENCODE_DONE;
+static void wait_for_frames_in_flight(SpiceGstEncoder *encoder, uint32_t max_frames)
+{
+    while (encoder->frames_in_flight > max_frames) {
+        wait_for_frame_output(encoder);
+        collect_frames(encoder);
     }
+}
 
-    spice_debug("failed to pull the compressed buffer");
-    (*outbuf)->free(*outbuf);
+/* Returns how many frames submit_frame() should let the pipeline work on.
+ * There is no point in having more than needed to absorb the encoding
+ * time since each frame in flight delays the rate control feedback.
+ */
+static uint32_t get_max_frames_in_flight(SpiceGstEncoder *encoder)
+{
+    uint64_t period = NSEC_PER_SEC / get_source_fps(encoder);
+    uint64_t frames = 1 + get_average_encoding_time(encoder) / period;
+
+    return MIN(frames, encoder->max_frames_in_flight);
+}
+
+static int spice_gst_frame_finish(VideoEncoderFrame *video_frame, VideoBuffer **outbuf)
+{
+    SpiceGstFrame *frame = (SpiceGstFrame*)video_frame;
+    SpiceGstEncoder *encoder = frame->encoder;
+    int rc = VIDEO_ENCODER_FRAME_UNSUPPORTED;
+
+    g_return_val_if_fail(outbuf != NULL, VIDEO_ENCODER_FRAME_UNSUPPORTED);
     *outbuf = NULL;
-    return VIDEO_ENCODER_FRAME_UNSUPPORTED;
+
+    if (!encoder->destroyed) {
+        while (frame->queued) {
+            wait_for_frame_output(encoder);
+            collect_frames(encoder);
+        }
+        if (frame->seq != encoder->sent_seq + 1) {
+            /* The encoder was restarted since, or a previous frame was not
+             * sent, so the client would not be able to decode this one.
+             */
+            spice_debug("frame %u cannot follow frame %u, restarting the encoder",
+                        frame->seq, encoder->sent_seq);
+            set_pipeline_changes(encoder, SPICE_GST_VIDEO_PIPELINE_RESTART);
+            encoder->async_backoff = SPICE_GST_ASYNC_BACKOFF_FRAMES;
+        } else if (frame->outbuf) {
+            encoder->sent_seq = frame->seq;
+            *outbuf = frame->outbuf;
+            frame->outbuf = NULL;
+            rc = VIDEO_ENCODER_FRAME_ENCODE_DONE;
+        }
+    }
+    frame->released = TRUE;
+    frame_unref(frame);
+
+    return rc;
+}
+
+static void spice_gst_frame_release(VideoEncoderFrame *video_frame)
+{
+    SpiceGstFrame *frame = (SpiceGstFrame*)video_frame;
+    SpiceGstEncoder *encoder = frame->encoder;
+
+    if (!encoder->destroyed && (int32_t)(frame->seq - encoder->sent_seq) > 0) {
+        /* The next frames may reference this one */
+        spice_debug("frame %u was not sent, restarting the encoder", frame->seq);
+        set_pipeline_changes(encoder, SPICE_GST_VIDEO_PIPELINE_RESTART);
+        encoder->async_backoff = SPICE_GST_ASYNC_BACKOFF_FRAMES;
+    }
+    frame->released = TRUE;
+    frame_unref(frame);
+}
+
+/* Pushes the frame into the pipeline. The compressed frame is retrieved by
+ * collect_frames() and the frame's finish() method.
+ */
+static SpiceGstFrame *push_frame(SpiceGstEncoder *encoder, uint32_t frame_mm_time,
+                                 const SpiceBitmap *bitmap,
+                                 const SpiceRect *src, int top_down,
+                                 gpointer bitmap_opaque)
+{
+    SpiceGstFrame *frame = spice_new0(SpiceGstFrame, 1);
+
+    frame->base.finish = spice_gst_frame_finish;
+    frame->base.release = spice_gst_frame_release;
+    frame->encoder = encoder;
+    frame->refs = 2;
+    frame->queued = TRUE;
+    frame->seq = ++encoder->frame_seq;
+    frame->mm_time = frame_mm_time;
+    frame->start = spice_get_monotonic_time_ns();
+    encoder->n_frames++;
+    encoder->frames_in_flight++;
+
+    /* Queue the frame first, new_sample() may be called before
+     * gst_app_src_push_buffer() returns.
+     */
+    pthread_mutex_lock(&encoder->outbuf_mutex);
+    g_queue_push_tail(&encoder->pending_frames, frame);
+    pthread_mutex_unlock(&encoder->outbuf_mutex);
+
+    if (push_raw_frame(encoder, bitmap, src, top_down, bitmap_opaque) !=
+        VIDEO_ENCODER_FRAME_ENCODE_DONE) {
+        pthread_mutex_lock(&encoder->outbuf_mutex);
+        if (!g_queue_remove(&encoder->pending_frames, frame)) {
+            /* A pipeline error already moved it along */
+            g_queue_remove(&encoder->done_frames, frame);
+        }
+        pthread_mutex_unlock(&encoder->outbuf_mutex);
+        encoder->frames_in_flight--;
+        encoder->frame_seq--;
+        frame->refs = 1;
+        frame_unref(frame);
+        return NULL;
+    }
+    return frame;
 }
 
 
@@ -1452,20 +1747,26 @@ static void spice_gst_encoder_destroy(VideoEncoder *video_encoder)
 {
     SpiceGstEncoder *encoder = (SpiceGstEncoder*)video_encoder;
 
+    /* Fails the frames still in the pipeline */
     free_pipeline(encoder);
-    pthread_mutex_destroy(&encoder->outbuf_mutex);
-    pthread_cond_destroy(&encoder->outbuf_cond);
+    collect_frames(encoder);
 
     /* Unref any lingering bitmap opaque structures from past frames */
     clear_zero_copy_queue(encoder, TRUE);
 
-    free(encoder);
+    if (encoder->n_frames) {
+        /* Wait for the last frame to be released */
+        encoder->destroyed = TRUE;
+    } else {
+        spice_gst_encoder_free(encoder);
+    }
 }
 
 static int spice_gst_encoder_encode_frame(VideoEncoder *video_encoder,
                                           uint32_t frame_mm_time,
                                           const SpiceBitmap *bitmap,
                                           const SpiceRect *src, int top_down,
+                                          const QRegion *damage,
                                           gpointer bitmap_opaque,
                                           VideoBuffer **outbuf)
 {
@@ -1474,7 +1775,7 @@ static int spice_gst_encoder_encode_frame(VideoEncoder *video_encoder,
     *outbuf = NULL;
 
     /* Unref the last frame's bitmap_opaque structures if any */
-    clear_zero_copy_queue(encoder, FALSE);
+    collect_frames(encoder);
 
     uint32_t width = src->right - src->left;
     uint32_t height = src->bottom - src->top;
@@ -1522,45 +1823,74 @@ static int spice_gst_encoder_encode_frame(VideoEncoder *video_encoder,
         /* Drop the frame to limit the outgoing bit rate. */
         return VIDEO_ENCODER_FRAME_DROP;
     }
+    if (encoder->pipeline &&
+        video_encoder_can_skip_frame(damage, src, frame_mm_time - get_last_frame_mm_time(encoder))) {
+        /* The next frame will carry the few changes of this one */
+        return VIDEO_ENCODER_FRAME_DROP;
+    }
+
+    if (encoder->frame_seq != encoder->sent_seq) {
+        /* Frames submitted ahead of this one are already in the pipeline */
+        spice_debug("frames %u to %u were not sent, restarting the encoder",
+                    encoder->sent_seq + 1, encoder->frame_seq);
+        set_pipeline_changes(encoder, SPICE_GST_VIDEO_PIPELINE_RESTART);
+        encoder->async_backoff = SPICE_GST_ASYNC_BACKOFF_FRAMES;
+    }
+    if (encoder->set_pipeline) {
+        /* Let the pipeline finish the frames it has before reconfiguring it */
+        wait_for_frames_in_flight(encoder, 0);
+    }
 
     if (!configure_pipeline(encoder)) {
         encoder->errors++;
         return VIDEO_ENCODER_FRAME_UNSUPPORTED;
     }
 
-    uint64_t start = spice_get_monotonic_time_ns();
-    int rc = push_raw_frame(encoder, bitmap, src, top_down, bitmap_opaque);
-    if (rc == VIDEO_ENCODER_FRAME_ENCODE_DONE) {
-        rc = pull_compressed_buffer(encoder, outbuf);
-        if (rc != VIDEO_ENCODER_FRAME_ENCODE_DONE) {
-            /* The input buffer will be stuck in the pipeline, preventing
-             * later ones from being processed. Furthermore something went
-             * wrong with this pipeline, so it may be safer to rebuild it
-             * from scratch.
-             */
-            free_pipeline(encoder);
-            encoder->errors++;
-        }
+    SpiceGstFrame *frame = push_frame(encoder, frame_mm_time, bitmap, src,
+                                      top_down, bitmap_opaque);
+    if (!frame) {
+        return VIDEO_ENCODER_FRAME_UNSUPPORTED;
     }
+    return spice_gst_frame_finish(&frame->base, outbuf);
+}
 
-    /* Unref the last frame's bitmap_opaque structures if any */
-    clear_zero_copy_queue(encoder, FALSE);
+static VideoEncoderFrame *spice_gst_encoder_submit_frame(VideoEncoder *video_encoder,
+                                                         uint32_t frame_mm_time,
+                                                         const SpiceBitmap *bitmap,
+                                                         const SpiceRect *src,
+                                                         int top_down,
+                                                         const QRegion *damage,
+                                                         gpointer bitmap_opaque)
+{
+    SpiceGstEncoder *encoder = (SpiceGstEncoder*)video_encoder;
 
-    if (rc != VIDEO_ENCODER_FRAME_ENCODE_DONE) {
-        return rc;
+    collect_frames(encoder);
+    if (encoder->async_backoff) {
+        encoder->async_backoff--;
+        return NULL;
     }
-    uint32_t last_mm_time = get_last_frame_mm_time(encoder);
-    add_frame(encoder, frame_mm_time, spice_get_monotonic_time_ns() - start,
-              (*outbuf)->size);
 
-    int32_t refill = encoder->bit_rate * (frame_mm_time - last_mm_time) / MSEC_PER_SEC / 8;
-    encoder->vbuffer_free = MIN(encoder->vbuffer_free + refill,
-                                encoder->vbuffer_size) - (*outbuf)->size;
+    /* Don't let the frames pile up in the pipeline if the encoder cannot
+     * keep up with the source. This also refreshes the rate control
+     * statistics before deciding whether to drop this frame.
+     */
+    wait_for_frames_in_flight(encoder, get_max_frames_in_flight(encoder) - 1);
 
-    server_increase_bit_rate(encoder, frame_mm_time);
-    update_next_frame_mm_time(encoder);
+    /* Anything out of the ordinary, including the frame drops, is handled
+     * by encode_frame() when the frame is sent.
+     */
+    if (!encoder->pipeline || encoder->set_pipeline || encoder->errors ||
+        src->right - src->left != encoder->width ||
+        src->bottom - src->top != encoder->height ||
+        bitmap->format != encoder->spice_format ||
+        encoder->server_drops || frame_mm_time < encoder->next_frame_mm_time ||
+        video_encoder_can_skip_frame(damage, src, frame_mm_time - get_last_frame_mm_time(encoder))) {
+        return NULL;
+    }
 
-    return rc;
+    SpiceGstFrame *frame = push_frame(encoder, frame_mm_time, bitmap, src,
+                                      top_down, bitmap_opaque);
+    return frame ? &frame->base : NULL;
 }
 
 static void spice_gst_encoder_client_stream_report(VideoEncoder *video_encoder,
@@ -1738,6 +2068,11 @@ VideoEncoder *gstreamer_encoder_new(SpiceVideoCodecType codec_type,
     encoder->bitmap_ref = bitmap_ref;
     encoder->bitmap_unref = bitmap_unref;
     encoder->format = GSTREAMER_FORMAT_INVALID;
+    encoder->max_frames_in_flight = spice_env_get_uint("SPICE_GST_FRAMES_IN_FLIGHT", 0,
+                                                       0, SPICE_GST_MAX_FRAMES_IN_FLIGHT);
+    if (encoder->max_frames_in_flight) {
+        encoder->base.submit_frame = spice_gst_encoder_submit_frame;
+    }
     pthread_mutex_init(&encoder->outbuf_mutex, NULL);
     pthread_cond_init(&encoder->outbuf_cond, NULL);
 
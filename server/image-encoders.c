@@ -19,6 +19,7 @@
 #include <config.h>
 #endif
 
+#include <inttypes.h>
 #include <glib.h>
 
 #include "image-encoders.h"
@@ -58,6 +59,11 @@ struct GlzDrawableInstanceItem {
     RedGlzDrawable         *glz_drawable;
 };
 
+typedef struct GlzRetiredDrawable {
+    RedDrawable *red_drawable;
+    uint64_t epoch;
+} GlzRetiredDrawable;
+
 struct RedGlzDrawable {
     RingItem link;    // ordered by the time it was encoded
     RingItem drawable_link;
@@ -75,7 +81,7 @@ struct RedGlzDrawable {
     SAFE_FOREACH(link, next, drawable, &(drawable)->glz_retention.ring, glz, LINK_TO_GLZ(link))
 
 static void glz_drawable_instance_item_free(GlzDrawableInstanceItem *instance);
-static void encoder_data_init(EncoderData *data);
+static void encoder_data_init(EncoderData *data, RedCompressBufPool *buf_pool);
 static void encoder_data_reset(EncoderData *data);
 static void image_encoders_release_glz(ImageEncoders *enc);
 
@@ -192,11 +198,183 @@ static void glz_usr_free(GlzEncoderUsrContext *usr, void *ptr)
     free(ptr);
 }
 
-static void encoder_data_init(EncoderData *data)
+typedef struct RedCompressBufClass {
+    uint32_t size;
+    /* when more than high_watermark buffers are free, the pool releases
+     * them down to low_watermark */
+    uint32_t low_watermark;
+    uint32_t high_watermark;
+} RedCompressBufClass;
+
+static const RedCompressBufClass compress_buf_classes[] = {
+    { RED_COMPRESS_BUF_SIZE, 16, 64 },
+    { RED_COMPRESS_BUF_LARGE_SIZE, 2, 8 },
+};
+
+#define N_COMPRESS_BUF_CLASSES G_N_ELEMENTS(compress_buf_classes)
+
+struct RedCompressBufPool {
+    pthread_mutex_t lock;
+    RedCompressBuf *free_bufs[N_COMPRESS_BUF_CLASSES]; // linked by send_next
+    uint32_t n_free[N_COMPRESS_BUF_CLASSES];
+    uint32_t n_allocated; // free or in use
+    bool destroyed;
+
+    /* statistics */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t released;
+    uint32_t max_allocated;
+};
+
+static unsigned int compress_buf_class(uint32_t size)
+{
+    unsigned int i;
+
+    for (i = 0; i < N_COMPRESS_BUF_CLASSES; i++) {
+        if (compress_buf_classes[i].size == size) {
+            return i;
+        }
+    }
+    spice_error("invalid compression buffer size %u", size);
+    return 0;
+}
+
+static void red_compress_buf_pool_destroy(RedCompressBufPool *pool)
+{
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+RedCompressBufPool *red_compress_buf_pool_new(void)
+{
+    RedCompressBufPool *pool = spice_new0(RedCompressBufPool, 1);
+
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+void red_compress_buf_pool_free(RedCompressBufPool *pool)
+{
+    RedCompressBuf *free_bufs = NULL;
+    bool destroy;
+    unsigned int i;
+
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->destroyed = true;
+    for (i = 0; i < N_COMPRESS_BUF_CLASSES; i++) {
+        while (pool->free_bufs[i]) {
+            RedCompressBuf *buf = pool->free_bufs[i];
+
+            pool->free_bufs[i] = buf->send_next;
+            buf->send_next = free_bufs;
+            free_bufs = buf;
+            pool->n_allocated--;
+        }
+        pool->n_free[i] = 0;
+    }
+    /* buffers still referenced by marshallers will be freed on release */
+    destroy = pool->n_allocated == 0;
+    pthread_mutex_unlock(&pool->lock);
+
+    while (free_bufs) {
+        RedCompressBuf *next = free_bufs->send_next;
+        g_free(free_bufs);
+        free_bufs = next;
+    }
+    if (destroy) {
+        red_compress_buf_pool_destroy(pool);
+    }
+}
+
+RedCompressBuf *red_compress_buf_pool_get(RedCompressBufPool *pool, uint32_t size)
+{
+    unsigned int class = compress_buf_class(size);
+    RedCompressBuf *buf;
+
+    pthread_mutex_lock(&pool->lock);
+    buf = pool->free_bufs[class];
+    if (buf) {
+        pool->free_bufs[class] = buf->send_next;
+        pool->n_free[class]--;
+        pool->hits++;
+    } else {
+        pool->n_allocated++;
+        pool->max_allocated = MAX(pool->max_allocated, pool->n_allocated);
+        pool->misses++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!buf) {
+        buf = g_malloc(sizeof(RedCompressBuf) + size);
+        buf->pool = pool;
+        buf->size = size;
+    }
+    buf->send_next = NULL;
+    return buf;
+}
+
+void compress_buf_free(RedCompressBuf *buf)
 {
-    data->bufs_tail = g_new(RedCompressBuf, 1);
+    RedCompressBufPool *pool = buf->pool;
+    unsigned int class = compress_buf_class(buf->size);
+    const RedCompressBufClass *buf_class = &compress_buf_classes[class];
+    RedCompressBuf *free_bufs = NULL;
+    bool destroy = false;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->destroyed) {
+        pool->n_allocated--;
+        destroy = pool->n_allocated == 0;
+        buf->send_next = NULL;
+        free_bufs = buf;
+    } else {
+        buf->send_next = pool->free_bufs[class];
+        pool->free_bufs[class] = buf;
+        if (++pool->n_free[class] > buf_class->high_watermark) {
+            while (pool->n_free[class] > buf_class->low_watermark) {
+                buf = pool->free_bufs[class];
+                pool->free_bufs[class] = buf->send_next;
+                pool->n_free[class]--;
+                pool->n_allocated--;
+                pool->released++;
+                buf->send_next = free_bufs;
+                free_bufs = buf;
+            }
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    while (free_bufs) {
+        RedCompressBuf *next = free_bufs->send_next;
+        g_free(free_bufs);
+        free_bufs = next;
+    }
+    if (destroy) {
+        red_compress_buf_pool_destroy(pool);
+    }
+}
+
+static void red_compress_buf_pool_stat_reset(RedCompressBufPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->hits = 0;
+    pool->misses = 0;
+    pool->released = 0;
+    pool->max_allocated = pool->n_allocated;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void encoder_data_init(EncoderData *data, RedCompressBufPool *buf_pool)
+{
+    data->buf_pool = buf_pool;
+    data->bufs_tail = red_compress_buf_pool_get(buf_pool, RED_COMPRESS_BUF_SIZE);
     data->bufs_head = data->bufs_tail;
-    data->bufs_head->send_next = NULL;
+    data->bufs_size = data->bufs_head->size;
 }
 
 static void encoder_data_reset(EncoderData *data)
@@ -204,10 +382,11 @@ static void encoder_data_reset(EncoderData *data)
     RedCompressBuf *buf = data->bufs_head;
     while (buf) {
         RedCompressBuf *next = buf->send_next;
-        g_free(buf);
+        compress_buf_free(buf);
         buf = next;
     }
     data->bufs_head = data->bufs_tail = NULL;
+    data->bufs_size = 0;
 }
 
 /* Allocate more space for compressed buffer.
@@ -216,13 +395,18 @@ static void encoder_data_reset(EncoderData *data)
 static int encoder_usr_more_space(EncoderData *enc_data, uint8_t **io_ptr)
 {
     RedCompressBuf *buf;
+    uint32_t size = RED_COMPRESS_BUF_SIZE;
 
-    buf = g_new(RedCompressBuf, 1);
+    /* use less buffers for large images */
+    if (enc_data->bufs_size >= RED_COMPRESS_BUF_LARGE_THRESHOLD) {
+        size = RED_COMPRESS_BUF_LARGE_SIZE;
+    }
+    buf = red_compress_buf_pool_get(enc_data->buf_pool, size);
     enc_data->bufs_tail->send_next = buf;
     enc_data->bufs_tail = buf;
-    buf->send_next = NULL;
+    enc_data->bufs_size += buf->size;
     *io_ptr = buf->buf.bytes;
-    return sizeof(buf->buf);
+    return buf->size;
 }
 
 static int quic_usr_more_space(QuicUsrContext *usr, uint32_t **io_ptr, int rows_completed)
@@ -263,6 +447,9 @@ static int zlib_usr_more_space(ZlibEncoderUsrContext *usr, uint8_t **io_ptr)
     return encoder_usr_more_space(usr_data, io_ptr);
 }
 
+/* Gives the encoders the lines of the next chunk of the bitmap. The chunks of
+ * the bitmaps parsed from the guest commands point in the guest memory, only
+ * the unstable ones are copied before being encoded */
 static inline int encoder_usr_more_lines(EncoderData *enc_data, uint8_t **lines)
 {
     struct SpiceChunk *chunk;
@@ -336,7 +523,7 @@ static int zlib_usr_more_input(ZlibEncoderUsrContext *usr, uint8_t** input)
     }
 
     *input = usr_data->u.compressed_data.next->buf.bytes;
-    buf_size = MIN(sizeof(usr_data->u.compressed_data.next->buf),
+    buf_size = MIN(usr_data->u.compressed_data.next->size,
                    usr_data->u.compressed_data.size_left);
 
     usr_data->u.compressed_data.next = usr_data->u.compressed_data.next->send_next;
@@ -459,6 +646,7 @@ void image_encoders_init(ImageEncoders *enc, ImageEncoderSharedData *shared_data
     ring_init(&enc->glz_drawables);
     ring_init(&enc->glz_drawables_inst_to_free);
     pthread_mutex_init(&enc->glz_drawables_inst_to_free_lock, NULL);
+    g_queue_init(&enc->glz_retired_drawables);
 
     image_encoders_init_glz_data(enc);
     image_encoders_init_quic(enc);
@@ -531,18 +719,62 @@ static void glz_drawable_instance_item_free(GlzDrawableInstanceItem *instance)
     }
 }
 
+/*
+ * The encoders of other display channels sharing the dictionary may still be
+ * reading the lines of images that were just removed from it, so the drawable
+ * is only released once the encodings that started before are finished.
+ */
+static void glz_retire_drawable(ImageEncoders *enc, RedDrawable *red_drawable, uint64_t epoch)
+{
+    GlzRetiredDrawable *retired;
+
+    if (g_queue_is_empty(&enc->glz_retired_drawables) &&
+        glz_enc_dictionary_epoch_done(enc->glz_dict->dict, epoch)) {
+        red_drawable_unref(red_drawable);
+        return;
+    }
+
+    retired = g_new(GlzRetiredDrawable, 1);
+    retired->red_drawable = red_drawable;
+    retired->epoch = epoch;
+    g_queue_push_tail(&enc->glz_retired_drawables, retired);
+}
+
+/* all: the caller prevents encoding using the dictionary */
+static void glz_release_retired_drawables(ImageEncoders *enc, bool all)
+{
+    GlzRetiredDrawable *retired;
+
+    while ((retired = g_queue_peek_head(&enc->glz_retired_drawables))) {
+        if (!all && !glz_enc_dictionary_epoch_done(enc->glz_dict->dict, retired->epoch)) {
+            break;
+        }
+        g_queue_pop_head(&enc->glz_retired_drawables);
+        red_drawable_unref(retired->red_drawable);
+        g_free(retired);
+    }
+}
+
 /*
  * Releases all the instances of the drawable from the dictionary and the display channel client.
  * The release of the last instance will also release the drawable itself and the qxl drawable
  * if possible.
- * NOTE - the caller should prevent encoding using the dictionary during this operation
+ * NOTE - can be called while other display channels encode using the dictionary
  */
 static void red_glz_drawable_free(RedGlzDrawable *glz_drawable)
 {
     ImageEncoders *enc = glz_drawable->encoders;
     RingItem *head_instance = ring_get_head(&glz_drawable->instances);
-    int cont = (head_instance != NULL);
+    RedDrawable *red_drawable;
+    uint64_t epoch = 0;
+    int cont = TRUE;
 
+    if (!head_instance) {
+        return;
+    }
+
+    // keeps the lines of the images alive until they are retired
+    red_drawable = red_drawable_ref(glz_drawable->red_drawable);
     while (cont) {
         if (glz_drawable->instances_count == 1) {
             /* Last instance: glz_drawable_instance_item_free will free the glz_drawable */
@@ -551,40 +783,26 @@ static void red_glz_drawable_free(RedGlzDrawable *glz_drawable)
         GlzDrawableInstanceItem *instance = SPICE_CONTAINEROF(head_instance,
                                                         GlzDrawableInstanceItem,
                                                         glz_link);
-        if (!ring_item_is_linked(&instance->free_link)) {
-            // the instance didn't get out from window yet
-            glz_enc_dictionary_remove_image(enc->glz_dict->dict,
-                                            instance->context,
-                                            &enc->glz_data.usr);
-        }
+        // once this returns, the free_image callback cannot be called anymore
+        // for the instance, it may already have added it to the to_free list
+        epoch = glz_enc_dictionary_remove_image(enc->glz_dict->dict,
+                                                instance->context,
+                                                instance,
+                                                &enc->glz_data.usr);
+        pthread_mutex_lock(&enc->glz_drawables_inst_to_free_lock);
         glz_drawable_instance_item_free(instance);
+        pthread_mutex_unlock(&enc->glz_drawables_inst_to_free_lock);
 
         if (cont) {
             head_instance = ring_get_head(&glz_drawable->instances);
         }
     }
-}
-
-gboolean image_encoders_glz_encode_lock(ImageEncoders *enc)
-{
-    if (enc->glz_dict) {
-        pthread_rwlock_wrlock(&enc->glz_dict->encode_lock);
-        return TRUE;
-    }
-    return FALSE;
-}
-
-void image_encoders_glz_encode_unlock(ImageEncoders *enc)
-{
-    if (enc->glz_dict) {
-        pthread_rwlock_unlock(&enc->glz_dict->encode_lock);
-    }
+    glz_retire_drawable(enc, red_drawable, epoch);
 }
 
 /*
  * Remove from the global lz dictionary some glz_drawables that have no reference to
- * Drawable (their qxl drawables are released too).
- * NOTE - the caller should prevent encoding using the dictionary during the operation
+ * Drawable (their qxl drawables are released too, once no encoder can read them).
  */
 int image_encoders_free_some_independent_glz_drawables(ImageEncoders *enc)
 {
@@ -603,6 +821,9 @@ int image_encoders_free_some_independent_glz_drawables(ImageEncoders *enc)
             n++;
         }
     }
+    if (enc->glz_dict) {
+        glz_release_retired_drawables(enc, FALSE);
+    }
     return n;
 }
 
@@ -621,6 +842,7 @@ void image_encoders_free_glz_drawables_to_free(ImageEncoders* enc)
         glz_drawable_instance_item_free(drawable_instance);
     }
     pthread_mutex_unlock(&enc->glz_drawables_inst_to_free_lock);
+    glz_release_retired_drawables(enc, FALSE);
 }
 
 /* Clear all lz drawables - enforce their removal from the global dictionary.
@@ -638,10 +860,9 @@ void image_encoders_free_glz_drawables(ImageEncoders *enc)
     pthread_rwlock_wrlock(&glz_dict->encode_lock);
     while ((ring_link = ring_get_head(&enc->glz_drawables))) {
         RedGlzDrawable *drawable = SPICE_CONTAINEROF(ring_link, RedGlzDrawable, link);
-        // no need to lock the to_free list, since we assured no other thread is encoding and
-        // thus not other thread access the to_free list of the channel
         red_glz_drawable_free(drawable);
     }
+    glz_release_retired_drawables(enc, TRUE);
     pthread_rwlock_unlock(&glz_dict->encode_lock);
 }
 
@@ -858,7 +1079,7 @@ bool image_encoders_compress_quic(ImageEncoders *enc, SpiceImage *dest,
         return FALSE;
     }
 
-    encoder_data_init(&quic_data->data);
+    encoder_data_init(&quic_data->data, enc->shared_data->buf_pool);
 
     if (setjmp(quic_data->data.jmp_env)) {
         encoder_data_reset(&quic_data->data);
@@ -882,7 +1103,7 @@ bool image_encoders_compress_quic(ImageEncoders *enc, SpiceImage *dest,
     }
     size = quic_encode(quic, type, src->x, src->y, NULL, 0, stride,
                        quic_data->data.bufs_head->buf.words,
-                       G_N_ELEMENTS(quic_data->data.bufs_head->buf.words));
+                       quic_data->data.bufs_head->size / sizeof(uint32_t));
 
     // the compressed buffer is bigger than the original data
     if ((size << 2) > (src->y * src->stride)) {
@@ -930,7 +1151,7 @@ bool image_encoders_compress_lz(ImageEncoders *enc,
     spice_debug("LZ LOCAL compress");
 #endif
 
-    encoder_data_init(&lz_data->data);
+    encoder_data_init(&lz_data->data, enc->shared_data->buf_pool);
 
     if (setjmp(lz_data->data.jmp_env)) {
         encoder_data_reset(&lz_data->data);
@@ -946,7 +1167,7 @@ bool image_encoders_compress_lz(ImageEncoders *enc,
                      !!(src->flags & SPICE_BITMAP_FLAGS_TOP_DOWN),
                      NULL, 0, src->stride,
                      lz_data->data.bufs_head->buf.bytes,
-                     sizeof(lz_data->data.bufs_head->buf));
+                     lz_data->data.bufs_head->size);
 
     // the compressed buffer is bigger than the original data
     if (size > (src->y * src->stride)) {
@@ -1019,7 +1240,7 @@ bool image_encoders_compress_jpeg(ImageEncoders *enc, SpiceImage *dest,
         return FALSE;
     }
 
-    encoder_data_init(&jpeg_data->data);
+    encoder_data_init(&jpeg_data->data, enc->shared_data->buf_pool);
 
     if (setjmp(jpeg_data->data.jmp_env)) {
         encoder_data_reset(&jpeg_data->data);
@@ -1044,7 +1265,7 @@ bool image_encoders_compress_jpeg(ImageEncoders *enc, SpiceImage *dest,
     jpeg_size = jpeg_encode(jpeg, enc->jpeg_quality, jpeg_in_type,
                             src->x, src->y, NULL,
                             0, stride, jpeg_data->data.bufs_head->buf.bytes,
-                            sizeof(jpeg_data->data.bufs_head->buf));
+                            jpeg_data->data.bufs_head->size);
 
     // the compressed buffer is bigger than the original data
     if (jpeg_size > (src->y * src->stride)) {
@@ -1064,11 +1285,14 @@ bool image_encoders_compress_jpeg(ImageEncoders *enc, SpiceImage *dest,
         return TRUE;
     }
 
+    lz_data->data.buf_pool = jpeg_data->data.buf_pool;
     lz_data->data.bufs_head = jpeg_data->data.bufs_tail;
     lz_data->data.bufs_tail = lz_data->data.bufs_head;
+    lz_data->data.bufs_size = jpeg_data->data.bufs_size;
 
-    comp_head_filled = jpeg_size % sizeof(lz_data->data.bufs_head->buf);
-    comp_head_left = sizeof(lz_data->data.bufs_head->buf) - comp_head_filled;
+    /* the buffers of the chain don't all have the same size */
+    comp_head_filled = jpeg_size - (jpeg_data->data.bufs_size - lz_data->data.bufs_head->size);
+    comp_head_left = lz_data->data.bufs_head->size - comp_head_filled;
     lz_out_start_byte = lz_data->data.bufs_head->buf.bytes + comp_head_filled;
 
     lz_data->data.u.lines_data.chunks = src->data;
@@ -1118,7 +1342,7 @@ bool image_encoders_compress_lz4(ImageEncoders *enc, SpiceImage *dest,
     spice_debug("LZ4 compress");
 #endif
 
-    encoder_data_init(&lz4_data->data);
+    encoder_data_init(&lz4_data->data, enc->shared_data->buf_pool);
 
     if (setjmp(lz4_data->data.jmp_env)) {
         encoder_data_reset(&lz4_data->data);
@@ -1135,7 +1359,7 @@ bool image_encoders_compress_lz4(ImageEncoders *enc, SpiceImage *dest,
     lz4_data->data.u.lines_data.reverse = 0;
 
     lz4_size = lz4_encode(lz4, src->y, src->stride, lz4_data->data.bufs_head->buf.bytes,
-                          sizeof(lz4_data->data.bufs_head->buf),
+                          lz4_data->data.bufs_head->size,
                           src->flags & SPICE_BITMAP_FLAGS_TOP_DOWN, src->format);
 
     // the compressed buffer is bigger than the original data
@@ -1241,7 +1465,7 @@ bool image_encoders_compress_glz(ImageEncoders *enc,
         return FALSE;
     }
 
-    encoder_data_init(&glz_data->data);
+    encoder_data_init(&glz_data->data, enc->shared_data->buf_pool);
 
     glz_drawable = get_glz_drawable(enc, red_drawable, glz_retention);
     glz_drawable_instance = add_glz_drawable_instance(glz_drawable);
@@ -1254,7 +1478,7 @@ bool image_encoders_compress_glz(ImageEncoders *enc,
     glz_size = glz_encode(enc->glz, type, src->x, src->y,
                           (src->flags & SPICE_BITMAP_FLAGS_TOP_DOWN), NULL, 0,
                           src->stride, glz_data->data.bufs_head->buf.bytes,
-                          sizeof(glz_data->data.bufs_head->buf),
+                          glz_data->data.bufs_head->size,
                           glz_drawable_instance,
                           &glz_drawable_instance->context);
 
@@ -1266,14 +1490,14 @@ bool image_encoders_compress_glz(ImageEncoders *enc,
     stat_start_time_init(&start_time, &enc->shared_data->zlib_glz_stat);
     zlib_data = &enc->zlib_data;
 
-    encoder_data_init(&zlib_data->data);
+    encoder_data_init(&zlib_data->data, enc->shared_data->buf_pool);
 
     zlib_data->data.u.compressed_data.next = glz_data->data.bufs_head;
     zlib_data->data.u.compressed_data.size_left = glz_size;
 
     zlib_size = zlib_encode(enc->zlib, enc->zlib_level,
                             glz_size, zlib_data->data.bufs_head->buf.bytes,
-                            sizeof(zlib_data->data.bufs_head->buf));
+                            zlib_data->data.bufs_head->size);
 
     // the compressed buffer is bigger than the original data
     if (zlib_size >= glz_size) {
@@ -1318,6 +1542,14 @@ void image_encoder_shared_init(ImageEncoderSharedData *shared_data)
     stat_compress_init(&shared_data->zlib_glz_stat, "zlib", stat_clock);
     stat_compress_init(&shared_data->jpeg_alpha_stat, "jpeg_alpha", stat_clock);
     stat_compress_init(&shared_data->lz4_stat, "lz4", stat_clock);
+    stat_compress_init(&shared_data->tile_stat, "tile", CLOCK_MONOTONIC);
+    shared_data->buf_pool = red_compress_buf_pool_new();
+}
+
+void image_encoder_shared_free(ImageEncoderSharedData *shared_data)
+{
+    red_compress_buf_pool_free(shared_data->buf_pool);
+    shared_data->buf_pool = NULL;
 }
 
 void image_encoder_shared_stat_reset(ImageEncoderSharedData *shared_data)
@@ -1330,6 +1562,8 @@ void image_encoder_shared_stat_reset(ImageEncoderSharedData *shared_data)
     stat_reset(&shared_data->zlib_glz_stat);
     stat_reset(&shared_data->jpeg_alpha_stat);
     stat_reset(&shared_data->lz4_stat);
+    stat_reset(&shared_data->tile_stat);
+    red_compress_buf_pool_stat_reset(shared_data->buf_pool);
 }
 
 #define STAT_FMT "%s\t%8u\t%13.8g\t%12.8g\t%12.8g"
@@ -1350,6 +1584,21 @@ static void stat_sum(stat_info_t *total, const stat_info_t *stat)
     total->comp_size += stat->comp_size;
     total->total += stat->total;
 }
+
+static void red_compress_buf_pool_stat_print(RedCompressBufPool *pool)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&pool->lock);
+    spice_info("Buffers: %" PRIu64 " reused, %" PRIu64 " allocated, %" PRIu64 " released, "
+               "%u in use at most", pool->hits, pool->misses, pool->released,
+               pool->max_allocated);
+    for (i = 0; i < N_COMPRESS_BUF_CLASSES; i++) {
+        spice_info("Free %u KiB buffers: %u", compress_buf_classes[i].size / 1024,
+                   pool->n_free[i]);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
 #endif
 
 void image_encoder_shared_stat_print(const ImageEncoderSharedData *shared_data)
@@ -1388,5 +1637,10 @@ void image_encoder_shared_stat_print(const ImageEncoderSharedData *shared_data)
     stat_print_one("LZ4      ", &shared_data->lz4_stat);
     spice_info("-------------------------------------------------------------------");
     stat_print_one("Total    ", &total);
+    if (shared_data->tile_stat.count) {
+        /* already part of the QUIC/JPEG/LZ lines, time is wall clock latency */
+        stat_print_one("Tiles    ", &shared_data->tile_stat);
+    }
+    red_compress_buf_pool_stat_print(shared_data->buf_pool);
 #endif
 }
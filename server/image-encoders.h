@@ -41,6 +41,7 @@ typedef struct GlzSharedDictionary GlzSharedDictionary;
 typedef struct GlzImageRetention GlzImageRetention;
 
 void image_encoder_shared_init(ImageEncoderSharedData *shared_data);
+void image_encoder_shared_free(ImageEncoderSharedData *shared_data);
 void image_encoder_shared_stat_reset(ImageEncoderSharedData *shared_data);
 void image_encoder_shared_stat_print(const ImageEncoderSharedData *shared_data);
 
@@ -52,29 +53,41 @@ void image_encoders_free_glz_drawables_to_free(ImageEncoders* enc);
 gboolean image_encoders_glz_create(ImageEncoders *enc, uint8_t id);
 void image_encoders_glz_get_restore_data(ImageEncoders *enc,
                                          uint8_t *out_id, GlzEncDictRestoreData *out_data);
-gboolean image_encoders_glz_encode_lock(ImageEncoders *enc);
-void image_encoders_glz_encode_unlock(ImageEncoders *enc);
 void glz_retention_free_drawables(GlzImageRetention *ret);
 void glz_retention_detach_drawables(GlzImageRetention *ret);
 
 #define RED_COMPRESS_BUF_SIZE (1024 * 64)
+/* once an image output reached RED_COMPRESS_BUF_LARGE_THRESHOLD bytes the
+ * next buffers of its chain are allocated with RED_COMPRESS_BUF_LARGE_SIZE */
+#define RED_COMPRESS_BUF_LARGE_SIZE (1024 * 512)
+#define RED_COMPRESS_BUF_LARGE_THRESHOLD (RED_COMPRESS_BUF_SIZE * 4)
+
+typedef struct RedCompressBufPool RedCompressBufPool;
+
 struct RedCompressBuf {
     RedCompressBuf *send_next;
+    RedCompressBufPool *pool;
+    uint32_t size;
 
     /* This buffer provide space for compression algorithms.
      * Some algorithms access the buffer as an array of 32 bit words
      * so is defined to make sure is always aligned that way.
+     * Its size is in the size field.
      */
     union {
-        uint8_t  bytes[RED_COMPRESS_BUF_SIZE];
-        uint32_t words[RED_COMPRESS_BUF_SIZE / 4];
+        uint8_t  bytes[0];
+        uint32_t words[0];
     } buf;
 };
 
-static inline void compress_buf_free(RedCompressBuf *buf)
-{
-    g_free(buf);
-}
+/* Buffers are recycled in the pool they were allocated from, which can be
+ * done from any thread. A pool keeps at most a few megabytes of free
+ * buffers. */
+RedCompressBufPool *red_compress_buf_pool_new(void);
+/* The pool is actually freed once all its buffers are released */
+void red_compress_buf_pool_free(RedCompressBufPool *pool);
+RedCompressBuf *red_compress_buf_pool_get(RedCompressBufPool *pool, uint32_t size);
+void compress_buf_free(RedCompressBuf *buf);
 
 gboolean image_encoders_get_glz_dictionary(ImageEncoders *enc,
                                            struct RedClient *client,
@@ -85,8 +98,10 @@ gboolean image_encoders_restore_glz_dictionary(ImageEncoders *enc,
                                                GlzEncDictRestoreData *restore_data);
 
 typedef struct  {
+    RedCompressBufPool *buf_pool;
     RedCompressBuf *bufs_head;
     RedCompressBuf *bufs_tail;
+    uint32_t bufs_size; // space of all the buffers of the chain
     jmp_buf jmp_env;
     union {
         struct {
@@ -146,6 +161,8 @@ static inline void glz_retention_init(GlzImageRetention *ret)
 struct ImageEncoderSharedData {
     uint32_t glz_drawable_count;
 
+    RedCompressBufPool *buf_pool;
+
     stat_info_t off_stat;
     stat_info_t lz_stat;
     stat_info_t glz_stat;
@@ -154,6 +171,9 @@ struct ImageEncoderSharedData {
     stat_info_t zlib_glz_stat;
     stat_info_t jpeg_alpha_stat;
     stat_info_t lz4_stat;
+    /* wall time between the submission of a tiled image band to the
+     * compression threads and its completion */
+    stat_info_t tile_stat;
 };
 
 struct ImageEncoders {
@@ -188,6 +208,8 @@ struct ImageEncoders {
     Ring glz_drawables;               // all the living lz drawable, ordered by encoding time
     Ring glz_drawables_inst_to_free;               // list of instances to be freed
     pthread_mutex_t glz_drawables_inst_to_free_lock;
+    GQueue glz_retired_drawables;     // removed from the dictionary, maybe still read by
+                                      // other encoders
 };
 
 typedef struct compress_send_data_t {
@@ -197,6 +219,19 @@ typedef struct compress_send_data_t {
     gboolean is_lossy;
 } compress_send_data_t;
 
+/* frees compressed data that was not passed to a marshaller */
+static inline void compress_send_data_free(compress_send_data_t *data)
+{
+    RedCompressBuf *buf = data->comp_buf;
+
+    while (buf) {
+        RedCompressBuf *next = buf->send_next;
+        compress_buf_free(buf);
+        buf = next;
+    }
+    data->comp_buf = NULL;
+}
+
 bool image_encoders_compress_quic(ImageEncoders *enc, SpiceImage *dest,
                                   SpiceBitmap *src, compress_send_data_t* o_comp_data);
 bool image_encoders_compress_lz(ImageEncoders *enc, SpiceImage *dest,
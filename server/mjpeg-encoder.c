@@ -73,6 +73,10 @@ static const int mjpeg_quality_samples[MJPEG_QUALITY_SAMPLE_NUM] = {20, 30, 40,
 /* The compressed buffer initial size. */
 #define MJPEG_INITIAL_BUFFER_SIZE (32 * 1024)
 
+/* Number of lines passed at once to libjpeg, this is one row of MCUs with
+ * the default 2x2 chroma subsampling. */
+#define MJPEG_MAX_SCANLINES 16
+
 enum {
     MJPEG_QUALITY_EVAL_TYPE_SET,
     MJPEG_QUALITY_EVAL_TYPE_UPGRADE,
@@ -162,17 +166,20 @@ typedef struct MJpegVideoBuffer {
     size_t maxsize;
 } MJpegVideoBuffer;
 
+/* Converts a line of @width pixels to RGB24 */
+typedef void (*MJpegLineConverter)(const uint8_t *src, uint8_t *dest, unsigned int width);
+
 typedef struct MJpegEncoder {
     VideoEncoder base;
-    uint8_t *row;
-    uint32_t row_size;
+    uint8_t *rows; /* MJPEG_MAX_SCANLINES lines converted to RGB24 */
+    uint32_t rows_size;
     int first_frame;
 
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
 
     unsigned int bytes_per_pixel; /* bytes per pixel of the input buffer */
-    void (*pixel_converter)(void *src, uint8_t *dest);
+    MJpegLineConverter line_converter; /* NULL if libjpeg reads the input buffer */
 
     MJpegEncoderRateControl rate_control;
     VideoEncoderRateControlCbs cbs;
@@ -213,7 +220,7 @@ static void mjpeg_encoder_destroy(VideoEncoder *video_encoder)
     MJpegEncoder *encoder = (MJpegEncoder*)video_encoder;
     free(encoder->cinfo.dest);
     jpeg_destroy_compress(&encoder->cinfo);
-    free(encoder->row);
+    free(encoder->rows);
     free(encoder);
 }
 
@@ -223,31 +230,47 @@ static uint8_t mjpeg_encoder_get_bytes_per_pixel(MJpegEncoder *encoder)
 }
 
 #ifndef JCS_EXTENSIONS
-/* Pixel conversion routines */
-static void pixel_rgb24bpp_to_24(void *src_ptr, uint8_t *dest)
+/* Line conversion routines, selected once per frame */
+static void line_rgb24bpp_to_24(const uint8_t *src, uint8_t *dest, unsigned int width)
 {
-    uint8_t *src = src_ptr;
+    const uint8_t *end = src + width * 3;
+
     /* libjpegs stores rgb, spice/win32 stores bgr */
-    *dest++ = src[2]; /* red */
-    *dest++ = src[1]; /* green */
-    *dest++ = src[0]; /* blue */
+    for (; src < end; src += 3, dest += 3) {
+        dest[0] = src[2]; /* red */
+        dest[1] = src[1]; /* green */
+        dest[2] = src[0]; /* blue */
+    }
 }
 
-static void pixel_rgb32bpp_to_24(void *src, uint8_t *dest)
+static void line_rgb32bpp_to_24(const uint8_t *src, uint8_t *dest, unsigned int width)
 {
-    uint32_t pixel = *(uint32_t *)src;
-    *dest++ = (pixel >> 16) & 0xff;
-    *dest++ = (pixel >>  8) & 0xff;
-    *dest++ = (pixel >>  0) & 0xff;
+    /* src is expected to be 4 bytes aligned */
+    const uint32_t *pixels = (const uint32_t *)src;
+    unsigned int x;
+
+    for (x = 0; x < width; x++, dest += 3) {
+        uint32_t pixel = pixels[x];
+
+        dest[0] = (pixel >> 16) & 0xff;
+        dest[1] = (pixel >>  8) & 0xff;
+        dest[2] = (pixel >>  0) & 0xff;
+    }
 }
 #endif
 
-static void pixel_rgb16bpp_to_24(void *src, uint8_t *dest)
+static void line_rgb16bpp_to_24(const uint8_t *src, uint8_t *dest, unsigned int width)
 {
-    uint16_t pixel = *(uint16_t *)src;
-    *dest++ = ((pixel >> 7) & 0xf8) | ((pixel >> 12) & 0x7);
-    *dest++ = ((pixel >> 2) & 0xf8) | ((pixel >> 7) & 0x7);
-    *dest++ = ((pixel << 3) & 0xf8) | ((pixel >> 2) & 0x7);
+    const uint16_t *pixels = (const uint16_t *)src;
+    unsigned int x;
+
+    for (x = 0; x < width; x++, dest += 3) {
+        uint16_t pixel = pixels[x];
+
+        dest[0] = ((pixel >> 7) & 0xf8) | ((pixel >> 12) & 0x7);
+        dest[1] = ((pixel >> 2) & 0xf8) | ((pixel >> 7) & 0x7);
+        dest[2] = ((pixel << 3) & 0xf8) | ((pixel >> 2) & 0x7);
+    }
 }
 
 
@@ -712,7 +735,7 @@ static void mjpeg_encoder_adjust_fps(MJpegEncoder *encoder, uint64_t now)
  *  MJPEG_ENCODER_FRAME_DROP        : frame should be dropped. This value can only be returned
  *                                    if mjpeg rate control is active.
  *  MJPEG_ENCODER_FRAME_ENCODE_DONE : frame encoding started. Continue with
- *                                    mjpeg_encoder_encode_scanline.
+ *                                    mjpeg_encoder_encode_scanlines.
  */
 static int mjpeg_encoder_start_frame(MJpegEncoder *encoder,
                                      SpiceBitmapFmt format,
@@ -755,7 +778,7 @@ static int mjpeg_encoder_start_frame(MJpegEncoder *encoder,
 
     encoder->cinfo.in_color_space   = JCS_RGB;
     encoder->cinfo.input_components = 3;
-    encoder->pixel_converter = NULL;
+    encoder->line_converter = NULL;
 
     switch (format) {
     case SPICE_BITMAP_FMT_32BIT:
@@ -765,19 +788,19 @@ static int mjpeg_encoder_start_frame(MJpegEncoder *encoder,
         encoder->cinfo.in_color_space   = JCS_EXT_BGRX;
         encoder->cinfo.input_components = 4;
 #else
-        encoder->pixel_converter = pixel_rgb32bpp_to_24;
+        encoder->line_converter = line_rgb32bpp_to_24;
 #endif
         break;
     case SPICE_BITMAP_FMT_16BIT:
         encoder->bytes_per_pixel = 2;
-        encoder->pixel_converter = pixel_rgb16bpp_to_24;
+        encoder->line_converter = line_rgb16bpp_to_24;
         break;
     case SPICE_BITMAP_FMT_24BIT:
         encoder->bytes_per_pixel = 3;
 #ifdef JCS_EXTENSIONS
         encoder->cinfo.in_color_space = JCS_EXT_BGR;
 #else
-        encoder->pixel_converter = pixel_rgb24bpp_to_24;
+        encoder->line_converter = line_rgb24bpp_to_24;
 #endif
         break;
     default:
@@ -787,15 +810,16 @@ static int mjpeg_encoder_start_frame(MJpegEncoder *encoder,
 
     encoder->cinfo.image_width = src->right - src->left;
     encoder->cinfo.image_height = src->bottom - src->top;
-    if (encoder->pixel_converter != NULL) {
+    if (encoder->line_converter != NULL) {
         JDIMENSION stride = encoder->cinfo.image_width * 3;
         /* check for integer overflow */
-        if (stride < encoder->cinfo.image_width) {
+        if (stride < encoder->cinfo.image_width ||
+            stride > UINT32_MAX / MJPEG_MAX_SCANLINES) {
             return VIDEO_ENCODER_FRAME_UNSUPPORTED;
         }
-        if (encoder->row_size < stride) {
-            encoder->row = spice_realloc(encoder->row, stride);
-            encoder->row_size = stride;
+        if (encoder->rows_size < stride * MJPEG_MAX_SCANLINES) {
+            encoder->rows = spice_realloc(encoder->rows, stride * MJPEG_MAX_SCANLINES);
+            encoder->rows_size = stride * MJPEG_MAX_SCANLINES;
         }
     }
 
@@ -812,27 +836,25 @@ static int mjpeg_encoder_start_frame(MJpegEncoder *encoder,
     return VIDEO_ENCODER_FRAME_ENCODE_DONE;
 }
 
-static int mjpeg_encoder_encode_scanline(MJpegEncoder *encoder,
-                                         uint8_t *src_pixels,
-                                         size_t image_width)
+/* @lines are replaced by the converted lines if a conversion is needed */
+static int mjpeg_encoder_encode_scanlines(MJpegEncoder *encoder,
+                                          uint8_t **lines, unsigned int num_lines,
+                                          size_t image_width)
 {
     unsigned int scanlines_written;
-    uint8_t *row;
-
-    row = encoder->row;
-    if (encoder->pixel_converter) {
-        unsigned int x;
-        for (x = 0; x < image_width; x++) {
-            /* src_pixels is expected to be 4 bytes aligned */
-            encoder->pixel_converter(src_pixels, row);
-            row += 3;
-            src_pixels += encoder->bytes_per_pixel;
+
+    if (encoder->line_converter) {
+        unsigned int i;
+
+        for (i = 0; i < num_lines; i++) {
+            uint8_t *row = encoder->rows + i * image_width * 3;
+
+            encoder->line_converter(lines[i], row, image_width);
+            lines[i] = row;
         }
-        scanlines_written = jpeg_write_scanlines(&encoder->cinfo, &encoder->row, 1);
-    } else {
-        scanlines_written = jpeg_write_scanlines(&encoder->cinfo, &src_pixels, 1);
     }
-    if (scanlines_written == 0) { /* Not enough space */
+    scanlines_written = jpeg_write_scanlines(&encoder->cinfo, lines, num_lines);
+    if (scanlines_written < num_lines) { /* Not enough space */
         jpeg_abort_compress(&encoder->cinfo);
         encoder->rate_control.last_enc_size = 0;
         return 0;
@@ -916,6 +938,8 @@ static bool encode_frame(MJpegEncoder *encoder, const SpiceRect *src,
 
     const unsigned int stream_height = src->bottom - src->top;
     const unsigned int stream_width = src->right - src->left;
+    uint8_t *lines[MJPEG_MAX_SCANLINES];
+    unsigned int num_lines = 0;
 
     for (i = 0; i < stream_height; i++) {
         uint8_t *src_line = get_image_line(chunks, &offset, &chunk, image_stride);
@@ -925,8 +949,12 @@ static bool encode_frame(MJpegEncoder *encoder, const SpiceRect *src,
         }
 
         src_line += src->left * mjpeg_encoder_get_bytes_per_pixel(encoder);
-        if (mjpeg_encoder_encode_scanline(encoder, src_line, stream_width) == 0) {
-            return FALSE;
+        lines[num_lines++] = src_line;
+        if (num_lines == MJPEG_MAX_SCANLINES || i == stream_height - 1) {
+            if (mjpeg_encoder_encode_scanlines(encoder, lines, num_lines, stream_width) == 0) {
+                return FALSE;
+            }
+            num_lines = 0;
         }
     }
 
@@ -937,10 +965,22 @@ static int mjpeg_encoder_encode_frame(VideoEncoder *video_encoder,
                                       uint32_t frame_mm_time,
                                       const SpiceBitmap *bitmap,
                                       const SpiceRect *src, int top_down,
+                                      const QRegion *damage,
                                       gpointer bitmap_opaque,
                                       VideoBuffer **outbuf)
 {
     MJpegEncoder *encoder = (MJpegEncoder*)video_encoder;
+    MJpegEncoderRateControl *rate_control = &encoder->rate_control;
+    uint64_t elapsed = spice_get_monotonic_time_ns() - rate_control->bit_rate_info.last_frame_time;
+
+    if (video_encoder_can_skip_frame(damage, src, elapsed / NSEC_PER_MILLISEC)) {
+        /* As far as the frame rate goes the frame is sent with the next one */
+        if (!rate_control->during_quality_eval) {
+            rate_control->adjusted_fps_num_frames++;
+        }
+        return VIDEO_ENCODER_FRAME_DROP;
+    }
+
     MJpegVideoBuffer *buffer = create_mjpeg_video_buffer();
     if (!buffer) {
         return VIDEO_ENCODER_FRAME_UNSUPPORTED;
@@ -45,6 +45,16 @@
 #define IOV_MAX 1024
 #endif
 
+/* messages up to this size are copied to be written along with the following
+ * ones when more are ready to be sent */
+#define OUTGOING_BATCH_MAX_MSG_SIZE 4096
+#define OUTGOING_BATCH_SIZE (16 * 1024)
+
+/* messages from this size are written with MSG_ZEROCOPY when enabled */
+#define ZEROCOPY_MIN_MSG_SIZE (64 * 1024)
+/* above this, messages are copied again until the kernel catches up */
+#define ZEROCOPY_MAX_PENDING_MSGS 16
+
 typedef struct SpiceDataHeaderOpaque SpiceDataHeaderOpaque;
 
 typedef uint16_t (*get_msg_type_proc)(SpiceDataHeaderOpaque *header);
@@ -105,8 +115,25 @@ typedef struct OutgoingMessageBuffer {
     int vec_size;
     int pos;
     int size;
+    /* fd taken from the marshaller, sent once the message is written */
+    bool has_fd;
+    int fd;
+    /* small messages already marshalled and not written yet, allocated
+     * the first time a message is batched */
+    uint8_t *batch;
+    uint32_t batch_size;
+    uint32_t batch_pos;
+    /* the message is written without copying its data */
+    bool zerocopy;
 } OutgoingMessageBuffer;
 
+/* marshaller of a message written with MSG_ZEROCOPY, kept with the data it
+ * references until the kernel does not use it anymore */
+typedef struct ZerocopyMessage {
+    SpiceMarshaller *marshaller;
+    uint32_t sent;
+} ZerocopyMessage;
+
 typedef struct IncomingMessageBuffer {
     uint8_t header_buf[MAX_HEADER_SIZE];
     SpiceDataHeaderOpaque header;
@@ -162,14 +189,18 @@ struct RedChannelClientPrivate
 
     IncomingMessageBuffer incoming;
     OutgoingMessageBuffer outgoing;
+    GQueue zerocopy_messages;
 
     RedStatCounter out_messages;
     RedStatCounter out_bytes;
+    /* out_messages / out_writes is the number of messages per syscall */
+    RedStatCounter out_writes;
 };
 
 static const SpiceDataHeaderOpaque full_header_wrapper;
 static const SpiceDataHeaderOpaque mini_header_wrapper;
 static void red_channel_client_clear_sent_item(RedChannelClient *rcc);
+static void red_channel_client_release_zerocopy_messages(RedChannelClient *rcc, bool all);
 static void red_channel_client_initable_interface_init(GInitableIface *iface);
 static void red_channel_client_set_message_serial(RedChannelClient *channel, uint64_t);
 static bool red_channel_client_config_socket(RedChannelClient *rcc);
@@ -342,6 +373,7 @@ red_channel_client_finalize(GObject *object)
     reds_stream_free(self->priv->stream);
     self->priv->stream = NULL;
 
+    red_channel_client_release_zerocopy_messages(self, true);
     if (self->priv->send_data.main.marshaller) {
         spice_marshaller_destroy(self->priv->send_data.main.marshaller);
     }
@@ -350,6 +382,8 @@ red_channel_client_finalize(GObject *object)
         spice_marshaller_destroy(self->priv->send_data.urgent.marshaller);
     }
 
+    free(self->priv->outgoing.batch);
+
     red_channel_capabilities_reset(&self->priv->remote_caps);
     if (self->priv->channel) {
         g_object_unref(self->priv->channel);
@@ -389,6 +423,7 @@ static void red_channel_client_constructed(GObject *object)
     const RedStatNode *node = red_channel_get_stat_node(channel);
     stat_init_counter(&self->priv->out_messages, reds, node, "out_messages", TRUE);
     stat_init_counter(&self->priv->out_bytes, reds, node, "out_bytes", TRUE);
+    stat_init_counter(&self->priv->out_writes, reds, node, "out_writes", TRUE);
 }
 
 static void red_channel_client_class_init(RedChannelClientClass *klass)
@@ -458,6 +493,7 @@ red_channel_client_init(RedChannelClient *self)
     self->priv->send_data.marshaller = self->priv->send_data.main.marshaller;
 
     g_queue_init(&self->priv->pipe);
+    g_queue_init(&self->priv->zerocopy_messages);
 }
 
 RedChannel* red_channel_client_get_channel(RedChannelClient *rcc)
@@ -617,11 +653,52 @@ static void red_channel_client_restore_main_sender(RedChannelClient *rcc)
     rcc->priv->send_data.header.data = rcc->priv->send_data.main.header_data;
 }
 
+/* releases the zero-copy messages whose data was sent, or all of them when
+ * the stream is going away: the kernel holds references on the pages */
+static void red_channel_client_release_zerocopy_messages(RedChannelClient *rcc, bool all)
+{
+    uint32_t completed = 0;
+    ZerocopyMessage *msg;
+
+    if (g_queue_is_empty(&rcc->priv->zerocopy_messages)) {
+        return;
+    }
+    if (!all) {
+        completed = reds_stream_get_zerocopy_completed(rcc->priv->stream);
+    }
+    while ((msg = g_queue_peek_head(&rcc->priv->zerocopy_messages)) != NULL) {
+        if (!all && (int32_t)(completed - msg->sent) < 0) {
+            break;
+        }
+        g_queue_pop_head(&rcc->priv->zerocopy_messages);
+        spice_marshaller_destroy(msg->marshaller);
+        g_free(msg);
+    }
+}
+
+/* the main marshaller is replaced as it still references the data of the
+ * message, see red_channel_client_release_zerocopy_messages() */
+static void red_channel_client_keep_zerocopy_message(RedChannelClient *rcc)
+{
+    ZerocopyMessage *msg = g_new(ZerocopyMessage, 1);
+
+    spice_assert(!red_channel_client_urgent_marshaller_is_active(rcc));
+    msg->marshaller = rcc->priv->send_data.main.marshaller;
+    msg->sent = reds_stream_get_zerocopy_sent(rcc->priv->stream);
+    g_queue_push_tail(&rcc->priv->zerocopy_messages, msg);
+
+    rcc->priv->send_data.main.marshaller = spice_marshaller_new();
+    rcc->priv->send_data.marshaller = rcc->priv->send_data.main.marshaller;
+}
+
 static void red_channel_client_msg_sent(RedChannelClient *rcc)
 {
-    int fd;
+    OutgoingMessageBuffer *buffer = &rcc->priv->outgoing;
+
+    if (buffer->has_fd) {
+        int fd = buffer->fd;
 
-    if (spice_marshaller_get_fd(rcc->priv->send_data.marshaller, &fd)) {
+        buffer->has_fd = false;
         if (reds_stream_send_msgfd(rcc->priv->stream, fd) < 0) {
             perror("sendfd");
             red_channel_client_disconnect(rcc);
@@ -820,6 +897,8 @@ static void red_channel_client_event(int fd, int event, void *data)
 
     g_object_ref(rcc);
     if (event & SPICE_WATCH_EVENT_READ) {
+        /* the completions of the zero-copy writes make the socket readable */
+        red_channel_client_release_zerocopy_messages(rcc, false);
         red_channel_client_receive(rcc);
     }
     if (event & SPICE_WATCH_EVENT_WRITE) {
@@ -1039,6 +1118,53 @@ static void red_channel_client_release_msg_buf(RedChannelClient *rcc,
     klass->release_recv_buf(rcc, type, size, msg);
 }
 
+static inline bool red_channel_client_batch_is_empty(RedChannelClient *rcc)
+{
+    return rcc->priv->outgoing.batch_pos == rcc->priv->outgoing.batch_size;
+}
+
+/* Small messages are not written right away when more are ready to be sent,
+ * so that many of them are written with a single syscall */
+static bool red_channel_client_can_batch_msg(RedChannelClient *rcc)
+{
+    OutgoingMessageBuffer *buffer = &rcc->priv->outgoing;
+
+    if (buffer->size > OUTGOING_BATCH_MAX_MSG_SIZE || buffer->has_fd ||
+        buffer->batch_size + buffer->size > OUTGOING_BATCH_SIZE) {
+        return false;
+    }
+    /* the main message is sent right after the urgent one */
+    if (red_channel_client_urgent_marshaller_is_active(rcc)) {
+        return true;
+    }
+    return rcc->priv->during_send && !g_queue_is_empty(&rcc->priv->pipe) &&
+           !red_channel_client_waiting_for_ack(rcc);
+}
+
+static void red_channel_client_batch_msg(RedChannelClient *rcc)
+{
+    OutgoingMessageBuffer *buffer = &rcc->priv->outgoing;
+
+    if (!buffer->batch) {
+        buffer->batch = spice_malloc(OUTGOING_BATCH_SIZE);
+    }
+    while (buffer->pos < buffer->size) {
+        int i, vec_size;
+
+        vec_size = red_channel_client_prepare_out_msg(rcc, buffer->vec, G_N_ELEMENTS(buffer->vec),
+                                                      buffer->pos);
+        for (i = 0; i < vec_size; i++) {
+            memcpy(buffer->batch + buffer->batch_size, buffer->vec[i].iov_base,
+                   buffer->vec[i].iov_len);
+            buffer->batch_size += buffer->vec[i].iov_len;
+            buffer->pos += buffer->vec[i].iov_len;
+        }
+    }
+    buffer->pos = 0;
+    buffer->size = 0;
+    red_channel_client_msg_sent(rcc);
+}
+
 static void red_channel_client_handle_outgoing(RedChannelClient *rcc)
 {
     RedsStream *stream = rcc->priv->stream;
@@ -1051,16 +1177,48 @@ static void red_channel_client_handle_outgoing(RedChannelClient *rcc)
 
     if (buffer->size == 0) {
         buffer->size = red_channel_client_get_out_msg_size(rcc);
-        if (!buffer->size) {  // nothing to be sent
+        if (buffer->size) {
+            buffer->has_fd = spice_marshaller_get_fd(rcc->priv->send_data.marshaller,
+                                                     &buffer->fd);
+            buffer->zerocopy = reds_stream_is_zerocopy(stream) &&
+                buffer->size >= ZEROCOPY_MIN_MSG_SIZE &&
+                !red_channel_client_urgent_marshaller_is_active(rcc) &&
+                g_queue_get_length(&rcc->priv->zerocopy_messages) < ZEROCOPY_MAX_PENDING_MSGS;
+            if (red_channel_client_can_batch_msg(rcc)) {
+                red_channel_client_batch_msg(rcc);
+                return;
+            }
+        } else if (red_channel_client_batch_is_empty(rcc)) {  // nothing to be sent
             return;
         }
     }
 
     for (;;) {
-        buffer->vec_size =
-            red_channel_client_prepare_out_msg(rcc, buffer->vec, G_N_ELEMENTS(buffer->vec),
-                                               buffer->pos);
-        n = reds_stream_writev(stream, buffer->vec, buffer->vec_size);
+        uint32_t batch_left = buffer->batch_size - buffer->batch_pos;
+        int vec_start = 0;
+
+        /* the batched messages go first, in the same syscall */
+        if (batch_left) {
+            buffer->vec[0].iov_base = buffer->batch + buffer->batch_pos;
+            buffer->vec[0].iov_len = batch_left;
+            vec_start = 1;
+        }
+        buffer->vec_size = vec_start;
+        /* the batch is reused right away, it can't be written without a copy */
+        if (buffer->zerocopy && !batch_left) {
+            buffer->vec_size =
+                red_channel_client_prepare_out_msg(rcc, buffer->vec, G_N_ELEMENTS(buffer->vec),
+                                                   buffer->pos);
+            n = reds_stream_writev_zerocopy(stream, buffer->vec, buffer->vec_size);
+        } else {
+            if (buffer->size && !buffer->zerocopy) {
+                buffer->vec_size +=
+                    red_channel_client_prepare_out_msg(rcc, buffer->vec + vec_start,
+                                                       G_N_ELEMENTS(buffer->vec) - vec_start,
+                                                       buffer->pos);
+            }
+            n = reds_stream_writev(stream, buffer->vec, buffer->vec_size);
+        }
         if (n == -1) {
             switch (errno) {
             case EAGAIN:
@@ -1077,14 +1235,34 @@ static void red_channel_client_handle_outgoing(RedChannelClient *rcc)
                 return;
             }
         } else {
-            buffer->pos += n;
+            stat_inc_counter(rcc->priv->out_writes, 1);
             red_channel_client_data_sent(rcc, n);
+            if (batch_left) {
+                uint32_t batch_written = MIN(n, (ssize_t)batch_left);
+
+                buffer->batch_pos += batch_written;
+                n -= batch_written;
+                if (buffer->batch_pos != buffer->batch_size) {
+                    continue;
+                }
+                buffer->batch_pos = 0;
+                buffer->batch_size = 0;
+                if (buffer->size == 0) {
+                    rcc->priv->send_data.blocked = FALSE;
+                    return;
+                }
+            }
+            buffer->pos += n;
             if (buffer->pos == buffer->size) { // finished writing data
                 /* reset buffer before calling on_msg_done, since it
                  * can trigger another call to red_channel_client_handle_outgoing (when
                  * switching from the urgent marshaller to the main one */
                 buffer->pos = 0;
                 buffer->size = 0;
+                if (buffer->zerocopy) {
+                    buffer->zerocopy = false;
+                    red_channel_client_keep_zerocopy_message(rcc);
+                }
                 red_channel_client_msg_sent(rcc);
                 return;
             }
@@ -1293,8 +1471,12 @@ void red_channel_client_push(RedChannelClient *rcc)
     while ((pipe_item = red_channel_client_pipe_item_get(rcc))) {
         red_channel_client_send_item(rcc, pipe_item);
     }
+    /* the last items may have been batched, or sent nothing after batched ones */
+    if (!red_channel_client_batch_is_empty(rcc) && !red_channel_client_is_blocked(rcc)) {
+        red_channel_client_send(rcc);
+    }
     if (red_channel_client_no_item_being_sent(rcc) && g_queue_is_empty(&rcc->priv->pipe)
-        && rcc->priv->stream->watch) {
+        && red_channel_client_batch_is_empty(rcc) && rcc->priv->stream->watch) {
         SpiceCoreInterfaceInternal *core;
         core = red_channel_get_core_interface(rcc->priv->channel);
         core->watch_update_mask(core, rcc->priv->stream->watch,
@@ -1645,6 +1827,15 @@ static void red_channel_client_pipe_clear(RedChannelClient *rcc)
     RedPipeItem *item;
 
     red_channel_client_clear_sent_item(rcc);
+    if (rcc->priv->outgoing.has_fd) {
+        rcc->priv->outgoing.has_fd = false;
+        if (rcc->priv->outgoing.fd != -1) {
+            close(rcc->priv->outgoing.fd);
+        }
+    }
+    rcc->priv->outgoing.batch_pos = 0;
+    rcc->priv->outgoing.batch_size = 0;
+    red_channel_client_release_zerocopy_messages(rcc, true);
     while ((item = g_queue_pop_head(&rcc->priv->pipe)) != NULL) {
         red_pipe_item_unref(item);
     }
@@ -23,16 +23,23 @@
 #include <zlib.h>
 #include <pthread.h>
 #include <glib.h>
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
 
 #include "reds.h"
 #include "red-qxl.h"
 #include "red-common.h"
 #include "memslot.h"
 #include "red-parse-qxl.h"
+#include "red-replay-qxl.h"
 
 #define QXLPHYSICAL_FROM_PTR(ptr) ((QXLPHYSICAL)(intptr_t)(ptr))
 #define QXLPHYSICAL_TO_PTR(phy) ((void*)(intptr_t)(phy))
 
+/* larger than any data a guest can hand over in one command */
+#define REPLAY_MAX_BINARY_SIZE (1u << 30)
+
 typedef enum {
     REPLAY_OK = 0,
     REPLAY_ERROR,
@@ -41,7 +48,16 @@ typedef enum {
 struct SpiceReplay {
     FILE *fd;
     gboolean error;
+    /* version 2 recording, see red-record-qxl.c */
+    bool binary;
+    uint8_t *block;
+    uint32_t block_size;
+    uint32_t block_pos;
+    uint32_t block_alloc;
+    uint8_t *stored;
+    uint32_t stored_alloc;
     int counter;
+    uint64_t last_cmd_time;
     bool created_primary;
 
     GArray *id_map; // record id -> replay id
@@ -57,8 +73,159 @@ struct SpiceReplay {
     pthread_cond_t cond;
 };
 
+static bool replay_read_block(SpiceReplay *replay)
+{
+    uint32_t header[2];
+    uint32_t size, stored_size;
+
+    if (fread(header, sizeof(header), 1, replay->fd) != 1) {
+        return false;
+    }
+    size = GUINT32_FROM_LE(header[0]);
+    stored_size = GUINT32_FROM_LE(header[1]);
+    if (size == 0 || stored_size > size) {
+        spice_warning("invalid block of %u bytes (%u stored)", size, stored_size);
+        return false;
+    }
+    if (size > replay->block_alloc) {
+        replay->block = spice_realloc(replay->block, size);
+        replay->block_alloc = size;
+    }
+    if (stored_size == size) {
+        if (fread(replay->block, size, 1, replay->fd) != 1) {
+            return false;
+        }
+    } else {
+#ifdef USE_LZ4
+        if (stored_size > replay->stored_alloc) {
+            replay->stored = spice_realloc(replay->stored, stored_size);
+            replay->stored_alloc = stored_size;
+        }
+        if (fread(replay->stored, stored_size, 1, replay->fd) != 1) {
+            return false;
+        }
+        if (LZ4_decompress_safe((const char *)replay->stored, (char *)replay->block,
+                                stored_size, size) != size) {
+            spice_warning("failed to decompress a block of %u bytes", size);
+            return false;
+        }
+#else
+        spice_warning("LZ4 support not compiled in, cannot replay a compressed recording");
+        return false;
+#endif
+    }
+    replay->block_size = size;
+    replay->block_pos = 0;
+
+    return true;
+}
+
+static bool replay_read_bytes(SpiceReplay *replay, uint8_t *buf, size_t size)
+{
+    while (size > 0) {
+        size_t now;
+
+        if (replay->block_pos == replay->block_size && !replay_read_block(replay)) {
+            return false;
+        }
+        now = MIN(size, replay->block_size - replay->block_pos);
+        memcpy(buf, replay->block + replay->block_pos, now);
+        replay->block_pos += now;
+        buf += now;
+        size -= now;
+    }
+
+    return true;
+}
+
+static bool replay_get_int(SpiceReplay *replay, int64_t *value)
+{
+    uint64_t zigzag = 0;
+    unsigned int shift;
+
+    for (shift = 0; shift < 64; shift += 7) {
+        uint8_t byte;
+
+        if (SPICE_LIKELY(replay->block_pos < replay->block_size)) {
+            byte = replay->block[replay->block_pos++];
+        } else if (!replay_read_bytes(replay, &byte, 1)) {
+            return false;
+        }
+        zigzag |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Reads the numbers of a version 2 recording for the conversions of @fmt */
+static bool replay_vscanf_binary(SpiceReplay *replay, const char *fmt, va_list ap)
+{
+    while ((fmt = strchr(fmt, '%')) != NULL) {
+        bool is_size = false;
+        int shorts = 0;
+        int longs = 0;
+        int64_t value;
+
+        fmt++;
+        for (; *fmt == 'h'; fmt++) {
+            shorts++;
+        }
+        for (; *fmt == 'l'; fmt++) {
+            longs++;
+        }
+        if (*fmt == 'z') {
+            is_size = true;
+            fmt++;
+        }
+        switch (*fmt++) {
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'x':
+            break;
+        case 'n':
+            *va_arg(ap, int *) = 0;
+            continue;
+        case '%':
+            continue;
+        default:
+            spice_warning("unsupported format %s", fmt - 1);
+            return false;
+        }
+        if (!replay_get_int(replay, &value)) {
+            return false;
+        }
+        if (is_size) {
+            *va_arg(ap, size_t *) = value;
+        } else if (longs > 1) {
+            *va_arg(ap, long long *) = value;
+        } else if (longs == 1) {
+            *va_arg(ap, long *) = value;
+        } else if (shorts > 1) {
+            *va_arg(ap, char *) = value;
+        } else if (shorts == 1) {
+            *va_arg(ap, short *) = value;
+        } else {
+            *va_arg(ap, int *) = value;
+        }
+    }
+
+    return true;
+}
+
 static ssize_t replay_fread(SpiceReplay *replay, uint8_t *buf, size_t size)
 {
+    if (replay->binary) {
+        if (replay->error || !replay_read_bytes(replay, buf, size)) {
+            replay->error = TRUE;
+            return 0;
+        }
+        return size;
+    }
     if (replay->error || feof(replay->fd) ||
         fread(buf, 1, size, replay->fd) != size) {
         replay->error = TRUE;
@@ -78,6 +245,14 @@ static replay_t replay_fscanf_check(SpiceReplay *replay, const char *fmt, ...)
     if (replay->error) {
         return REPLAY_ERROR;
     }
+    if (replay->binary) {
+        va_start(ap, fmt);
+        if (!replay_vscanf_binary(replay, fmt, ap)) {
+            replay->error = TRUE;
+        }
+        va_end(ap);
+        return replay->error ? REPLAY_ERROR : REPLAY_OK;
+    }
     if (feof(replay->fd)) {
         replay->error = TRUE;
         return REPLAY_ERROR;
@@ -226,8 +401,28 @@ static replay_t read_binary(SpiceReplay *replay, const char *prefix, size_t *siz
     uint8_t *zlib_buffer;
     z_stream strm;
 
+    if (replay->binary) {
+        int64_t value;
+
+        if (replay->error || !replay_get_int(replay, &value) || value < 0 ||
+            value > REPLAY_MAX_BINARY_SIZE) {
+            replay->error = TRUE;
+            return REPLAY_ERROR;
+        }
+        *size = value;
+        if (*buf == NULL) {
+            *buf = replay_malloc(replay, *size + base_size);
+        }
+        replay_fread(replay, *buf + base_size, *size);
+        return replay->error ? REPLAY_ERROR : REPLAY_OK;
+    }
+
     snprintf(template, sizeof(template), "binary %%d %s %%ld:%%n", prefix);
     replay_fscanf_check(replay, template, &with_zlib, size, &replay->end_pos);
+    if (!replay->error && *size > REPLAY_MAX_BINARY_SIZE) {
+        spice_warning("invalid %s data of %zu bytes", prefix, *size);
+        replay->error = TRUE;
+    }
     if (replay->error) {
         return REPLAY_ERROR;
     }
@@ -246,6 +441,10 @@ static replay_t read_binary(SpiceReplay *replay, const char *prefix, size_t *siz
         int ret;
 
         replay_fscanf(replay, "%u:", &zlib_size);
+        if (!replay->error && zlib_size > REPLAY_MAX_BINARY_SIZE) {
+            spice_warning("invalid %s compressed data of %u bytes", prefix, zlib_size);
+            replay->error = TRUE;
+        }
         if (replay->error) {
             return REPLAY_ERROR;
         }
@@ -1318,6 +1517,7 @@ SPICE_GNUC_VISIBLE QXLCommandExt* spice_replay_next_cmd(SpiceReplay *replay,
             replay_handle_dev_input(worker, replay, type);
         }
     }
+    replay->last_cmd_time = timestamp;
     cmd = replay_malloc0(replay, sizeof(QXLCommandExt));
     cmd->cmd.type = type;
     cmd->group_id = 0;
@@ -1376,6 +1576,11 @@ error:
     return NULL;
 }
 
+uint64_t spice_replay_get_last_cmd_time(SpiceReplay *replay)
+{
+    return replay->last_cmd_time;
+}
+
 SPICE_GNUC_VISIBLE void spice_replay_free_cmd(SpiceReplay *replay, QXLCommandExt *cmd)
 {
     spice_return_if_fail(replay);
@@ -1421,8 +1626,8 @@ SpiceReplay *spice_replay_new(FILE *file, int nsurfaces)
 
     spice_return_val_if_fail(file != NULL, NULL);
 
-    if (fscanf(file, "SPICE_REPLAY %u\n", &version) == 1) {
-        if (version != 1) {
+    if (fscanf(file, "SPICE_REPLAY %u", &version) == 1 && fgetc(file) == '\n') {
+        if (version != 1 && version != 2) {
             spice_warning("Replay file version unsupported");
             return NULL;
         }
@@ -1435,6 +1640,7 @@ SpiceReplay *spice_replay_new(FILE *file, int nsurfaces)
 
     replay->error = FALSE;
     replay->fd = file;
+    replay->binary = version == 2;
     replay->created_primary = FALSE;
     pthread_mutex_init(&replay->mutex, NULL);
     pthread_cond_init(&replay->cond, NULL);
@@ -1461,6 +1667,8 @@ SPICE_GNUC_VISIBLE void spice_replay_free(SpiceReplay *replay)
     g_array_free(replay->id_map_inv, TRUE);
     g_array_free(replay->id_free, TRUE);
     free(replay->primary_mem);
+    free(replay->block);
+    free(replay->stored);
     fclose(replay->fd);
     free(replay);
 }
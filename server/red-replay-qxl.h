@@ -0,0 +1,28 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RED_REPLAY_QXL_H_
+#define RED_REPLAY_QXL_H_
+
+#include "red-common.h"
+
+/* monotonic time, in ns, at which the last command returned by
+ * spice_replay_next_cmd() was recorded */
+uint64_t spice_replay_get_last_cmd_time(SpiceReplay *replay);
+
+#endif /* RED_REPLAY_QXL_H_ */
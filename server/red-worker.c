@@ -46,26 +46,90 @@
 #include "cursor-channel.h"
 #include "tree.h"
 
-#define CMD_RING_POLL_TIMEOUT 10 //milli
-#define CMD_RING_POLL_RETRIES 1
+/* Command ring polling: while commands arrive quickly the rings are polled
+ * again after a short timeout, once they come rarely the worker asks the
+ * guest to notify it of new commands and sleeps until then. */
+#define CMD_RING_POLL_TIMEOUT 10 //milli, longest poll timeout
+#define CMD_RING_POLL_RETRIES 3
+/* average interval between commands below which the ring is polled */
+#define CMD_RING_POLL_BUSY_INTERVAL (5 * NSEC_PER_MILLISEC)
+/* longer intervals are clamped so that the average adapts quickly */
+#define CMD_RING_POLL_MAX_INTERVAL (2 * CMD_RING_POLL_BUSY_INTERVAL)
 
 #define INF_EVENT_WAIT ~0
 
+/* Longest time spent processing commands before going back to the main
+ * loop, can be changed with SPICE_WORKER_TIME_SLICE (in microseconds) */
+#define WORKER_TIME_SLICE_DEFAULT (10 * NSEC_PER_MILLISEC)
+#define WORKER_TIME_SLICE_MIN (100 * NSEC_PER_MICROSEC)
+#define WORKER_TIME_SLICE_MAX NSEC_PER_SEC
+/* longest delay before cursor commands are handled during a display slice */
+#define WORKER_CURSOR_PREEMPT_INTERVAL NSEC_PER_MILLISEC
+
+/* upper bounds of the slice histogram buckets, the last one is unbounded */
+static const uint64_t slice_time_buckets[] = {
+    NSEC_PER_MILLISEC / 2, NSEC_PER_MILLISEC, 2 * NSEC_PER_MILLISEC,
+    5 * NSEC_PER_MILLISEC, 10 * NSEC_PER_MILLISEC, 20 * NSEC_PER_MILLISEC,
+};
+static const char *const slice_time_names[] = {
+    "time_500us", "time_1ms", "time_2ms", "time_5ms", "time_10ms", "time_20ms", "time_more",
+};
+static const uint64_t slice_count_buckets[] = {
+    1, 4, 16, 64, 256,
+};
+static const char *const slice_count_names[] = {
+    "cmds_1", "cmds_4", "cmds_16", "cmds_64", "cmds_256", "cmds_more",
+};
+#define SLICE_TIME_BUCKETS G_N_ELEMENTS(slice_time_names)
+#define SLICE_COUNT_BUCKETS G_N_ELEMENTS(slice_count_names)
+
+typedef struct WorkerSlice {
+    uint64_t max_time;
+    /* moving average of the time taken by a command, ns */
+    uint64_t avg_command_time;
+    RedStatNode stat;
+    RedStatCounter time_counters[SLICE_TIME_BUCKETS];
+    RedStatCounter count_counters[SLICE_COUNT_BUCKETS];
+    /* slices cut short by dispatcher messages */
+    RedStatCounter dispatcher_preempt_counter;
+    /* cursor commands handled in the middle of the slice */
+    RedStatCounter cursor_preempt_counter;
+} WorkerSlice;
+
+typedef enum {
+    RING_POLL_MODE_NOTIFY,
+    RING_POLL_MODE_BUSY,
+} RingPollMode;
+
+typedef struct RingPoll {
+    RingPollMode mode;
+    uint32_t tries;
+    gboolean notify_requested;
+    uint64_t last_command_time;
+    uint64_t avg_interval; /* moving average of command inter-arrival time, ns */
+    RedStatCounter mode_counter;
+    RedStatCounter poll_counter;
+    RedStatCounter notify_counter;
+} RingPoll;
+
 struct RedWorker {
     pthread_t thread;
     QXLInstance *qxl;
+    Dispatcher *dispatcher;
     SpiceWatch *dispatch_watch;
+    gboolean handling_dispatcher;
     int running;
     SpiceCoreInterfaceInternal core;
 
     unsigned int event_timeout;
 
     DisplayChannel *display_channel;
-    uint32_t display_poll_tries;
+    RingPoll display_poll;
+    WorkerSlice display_slice;
     gboolean was_blocked;
 
     CursorChannel *cursor_channel;
-    uint32_t cursor_poll_tries;
+    RingPoll cursor_poll;
 
     RedMemSlotInfo mem_slots;
 
@@ -77,6 +141,8 @@ struct RedWorker {
     RedStatNode stat;
     RedStatCounter wakeup_counter;
     RedStatCounter command_counter;
+    RedStatCounter parse_time_counter;
+    RedStatCounter tree_insert_time_counter;
 
     int driver_cap_monitors_config;
 
@@ -95,11 +161,140 @@ void red_drawable_unref(RedDrawable *red_drawable)
     if (--red_drawable->refs) {
         return;
     }
-    red_qxl_release_resource(red_drawable->qxl, red_drawable->release_info_ext);
+    /* the drawables made up by the server have nothing to release */
+    if (red_drawable->release_info_ext.info) {
+        red_qxl_release_resource(red_drawable->qxl, red_drawable->release_info_ext);
+    }
     red_put_drawable(red_drawable);
     free(red_drawable);
 }
 
+static void ring_poll_init(RingPoll *ring_poll, RedsState *reds, const RedStatNode *node,
+                           const char *prefix)
+{
+    char name[32];
+
+    ring_poll->mode = RING_POLL_MODE_NOTIFY;
+    ring_poll->avg_interval = CMD_RING_POLL_MAX_INTERVAL;
+    snprintf(name, sizeof(name), "%s_poll_mode", prefix);
+    stat_init_counter(&ring_poll->mode_counter, reds, node, name, TRUE);
+    snprintf(name, sizeof(name), "%s_poll_wakeups", prefix);
+    stat_init_counter(&ring_poll->poll_counter, reds, node, name, TRUE);
+    snprintf(name, sizeof(name), "%s_notify_requests", prefix);
+    stat_init_counter(&ring_poll->notify_counter, reds, node, name, TRUE);
+}
+
+static void ring_poll_command_received(RingPoll *ring_poll)
+{
+    uint64_t now = spice_get_monotonic_time_ns();
+    uint64_t interval = MIN(now - ring_poll->last_command_time, CMD_RING_POLL_MAX_INTERVAL);
+    RingPollMode mode;
+
+    ring_poll->avg_interval = (ring_poll->avg_interval * 7 + interval) / 8;
+    ring_poll->last_command_time = now;
+    ring_poll->tries = 0;
+    ring_poll->notify_requested = FALSE;
+
+    mode = ring_poll->avg_interval < CMD_RING_POLL_BUSY_INTERVAL ?
+        RING_POLL_MODE_BUSY : RING_POLL_MODE_NOTIFY;
+    if (mode != ring_poll->mode) {
+        ring_poll->mode = mode;
+        stat_set_counter(ring_poll->mode_counter, mode);
+    }
+}
+
+/*
+ * Called when a command ring is empty, either schedules a new poll of the
+ * ring or asks the guest for a notification.
+ * Returns FALSE if commands were added to the ring meanwhile.
+ */
+static gboolean ring_poll_empty(RedWorker *worker, RingPoll *ring_poll,
+                                int (*req_notification)(QXLInstance *qxl))
+{
+    if (ring_poll->mode == RING_POLL_MODE_BUSY && ring_poll->tries < CMD_RING_POLL_RETRIES) {
+        /* wait about twice the usual command interval */
+        uint64_t timeout = (2 * ring_poll->avg_interval + NSEC_PER_MILLISEC - 1) /
+                           NSEC_PER_MILLISEC;
+
+        worker->event_timeout = MIN(worker->event_timeout,
+                                    CLAMP(timeout, 1, CMD_RING_POLL_TIMEOUT));
+        ring_poll->tries++;
+        stat_inc_counter(ring_poll->poll_counter, 1);
+        return TRUE;
+    }
+    if (!ring_poll->notify_requested) {
+        if (!req_notification(worker->qxl)) {
+            return FALSE;
+        }
+        ring_poll->notify_requested = TRUE;
+        stat_inc_counter(ring_poll->notify_counter, 1);
+    }
+    return TRUE;
+}
+
+static void worker_slice_init(WorkerSlice *slice, RedsState *reds, const RedStatNode *parent,
+                              const char *name)
+{
+    unsigned int i;
+
+    /* SPICE_WORKER_TIME_SLICE is in microseconds */
+    slice->max_time = spice_env_get_uint("SPICE_WORKER_TIME_SLICE",
+                                         WORKER_TIME_SLICE_DEFAULT / NSEC_PER_MICROSEC,
+                                         WORKER_TIME_SLICE_MIN / NSEC_PER_MICROSEC,
+                                         WORKER_TIME_SLICE_MAX / NSEC_PER_MICROSEC) *
+                      NSEC_PER_MICROSEC;
+    stat_init_node(&slice->stat, reds, parent, name, TRUE);
+    for (i = 0; i < SLICE_TIME_BUCKETS; i++) {
+        stat_init_counter(&slice->time_counters[i], reds, &slice->stat,
+                          slice_time_names[i], TRUE);
+    }
+    for (i = 0; i < SLICE_COUNT_BUCKETS; i++) {
+        stat_init_counter(&slice->count_counters[i], reds, &slice->stat,
+                          slice_count_names[i], TRUE);
+    }
+    stat_init_counter(&slice->dispatcher_preempt_counter, reds, &slice->stat,
+                      "dispatcher_preempted", TRUE);
+    stat_init_counter(&slice->cursor_preempt_counter, reds, &slice->stat,
+                      "cursor_preempted", TRUE);
+}
+
+static void worker_slice_command_done(WorkerSlice *slice, uint64_t command_time)
+{
+    slice->avg_command_time = (slice->avg_command_time * 7 + command_time) / 8;
+}
+
+/* Returns TRUE if there is not enough time left in the slice for another
+ * command of average cost */
+static gboolean worker_slice_expired(const WorkerSlice *slice, uint64_t elapsed)
+{
+    return elapsed + slice->avg_command_time > slice->max_time;
+}
+
+/* accounts a slice of @n commands in the histograms */
+static void worker_slice_end(WorkerSlice *slice, uint64_t elapsed, int n)
+{
+    unsigned int i;
+
+    if (n == 0) {
+        return;
+    }
+    for (i = 0; i < G_N_ELEMENTS(slice_time_buckets) && elapsed > slice_time_buckets[i]; i++) {
+    }
+    stat_inc_counter(slice->time_counters[i], 1);
+    for (i = 0; i < G_N_ELEMENTS(slice_count_buckets) && (uint64_t)n > slice_count_buckets[i];
+         i++) {
+    }
+    stat_inc_counter(slice->count_counters[i], 1);
+}
+
+/* Dispatcher messages have priority over the guest commands, except when
+ * commands are processed on behalf of one of them */
+static gboolean worker_dispatcher_pending(RedWorker *worker)
+{
+    return !worker->handling_dispatcher &&
+           dispatcher_has_pending_messages(worker->dispatcher);
+}
+
 static gboolean red_process_cursor_cmd(RedWorker *worker, const QXLCommandExt *ext)
 {
     RedCursorCmd *cursor_cmd;
@@ -113,10 +308,22 @@ static gboolean red_process_cursor_cmd(RedWorker *worker, const QXLCommandExt *e
     return TRUE;
 }
 
+static void red_process_cursor_ext_cmd(RedWorker *worker, QXLCommandExt *ext_cmd)
+{
+    switch (ext_cmd->cmd.type) {
+    case QXL_CMD_CURSOR:
+        red_process_cursor_cmd(worker, ext_cmd);
+        break;
+    default:
+        spice_warning("bad command type");
+    }
+}
+
 static int red_process_cursor(RedWorker *worker, int *ring_is_empty)
 {
     QXLCommandExt ext_cmd;
     int n = 0;
+    uint64_t start = spice_get_monotonic_time_ns();
 
     if (!worker->running) {
         *ring_is_empty = TRUE;
@@ -127,13 +334,10 @@ static int red_process_cursor(RedWorker *worker, int *ring_is_empty)
     while (red_channel_max_pipe_size(RED_CHANNEL(worker->cursor_channel)) <= MAX_PIPE_SIZE) {
         if (!red_qxl_get_cursor_command(worker->qxl, &ext_cmd)) {
             *ring_is_empty = TRUE;
-            if (worker->cursor_poll_tries < CMD_RING_POLL_RETRIES) {
-                worker->event_timeout = MIN(worker->event_timeout, CMD_RING_POLL_TIMEOUT);
-            } else if (worker->cursor_poll_tries == CMD_RING_POLL_RETRIES &&
-                       !red_qxl_req_cursor_notification(worker->qxl)) {
+            if (!ring_poll_empty(worker, &worker->cursor_poll,
+                                 red_qxl_req_cursor_notification)) {
                 continue;
             }
-            worker->cursor_poll_tries++;
             return n;
         }
 
@@ -141,20 +345,42 @@ static int red_process_cursor(RedWorker *worker, int *ring_is_empty)
             red_record_qxl_command(worker->record, &worker->mem_slots, ext_cmd);
         }
 
-        worker->cursor_poll_tries = 0;
-        switch (ext_cmd.cmd.type) {
-        case QXL_CMD_CURSOR:
-            red_process_cursor_cmd(worker, &ext_cmd);
-            break;
-        default:
-            spice_warning("bad command type");
-        }
+        ring_poll_command_received(&worker->cursor_poll);
+        red_process_cursor_ext_cmd(worker, &ext_cmd);
         n++;
+        /* cursor commands are cheap, just use the display slice length */
+        if (spice_get_monotonic_time_ns() - start > worker->display_slice.max_time) {
+            worker->event_timeout = 0;
+            return n;
+        }
     }
     worker->was_blocked = TRUE;
     return n;
 }
 
+/*
+ * Handles the cursor commands already in the ring, between display commands.
+ * The commands are accounted for the polling of the ring as in
+ * red_process_cursor(), but an empty ring is dealt with by the main loop once
+ * the display slice is over.
+ */
+static int red_process_cursor_pending(RedWorker *worker)
+{
+    QXLCommandExt ext_cmd;
+    int n = 0;
+
+    while (red_channel_max_pipe_size(RED_CHANNEL(worker->cursor_channel)) <= MAX_PIPE_SIZE &&
+           red_qxl_get_cursor_command(worker->qxl, &ext_cmd)) {
+        if (worker->record) {
+            red_record_qxl_command(worker->record, &worker->mem_slots, ext_cmd);
+        }
+        ring_poll_command_received(&worker->cursor_poll);
+        red_process_cursor_ext_cmd(worker, &ext_cmd);
+        n++;
+    }
+    return n;
+}
+
 static RedDrawable *red_drawable_new(QXLInstance *qxl)
 {
     RedDrawable * red = spice_new0(RedDrawable, 1);
@@ -184,6 +410,9 @@ static int red_process_display(RedWorker *worker, int *ring_is_empty)
     QXLCommandExt ext_cmd;
     int n = 0;
     uint64_t start = spice_get_monotonic_time_ns();
+    uint64_t command_start;
+    uint64_t last_cursor_check = start;
+    uint64_t now = start;
 
     if (!worker->running) {
         *ring_is_empty = TRUE;
@@ -195,30 +424,36 @@ static int red_process_display(RedWorker *worker, int *ring_is_empty)
     while (red_channel_max_pipe_size(RED_CHANNEL(worker->display_channel)) <= MAX_PIPE_SIZE) {
         if (!red_qxl_get_command(worker->qxl, &ext_cmd)) {
             *ring_is_empty = TRUE;
-            if (worker->display_poll_tries < CMD_RING_POLL_RETRIES) {
-                worker->event_timeout = MIN(worker->event_timeout, CMD_RING_POLL_TIMEOUT);
-            } else if (worker->display_poll_tries == CMD_RING_POLL_RETRIES &&
-                       !red_qxl_req_cmd_notification(worker->qxl)) {
+            if (!ring_poll_empty(worker, &worker->display_poll,
+                                 red_qxl_req_cmd_notification)) {
                 continue;
             }
-            worker->display_poll_tries++;
+            worker_slice_end(&worker->display_slice, now - start, n);
             return n;
         }
+        command_start = spice_get_monotonic_time_ns();
 
         if (worker->record) {
             red_record_qxl_command(worker->record, &worker->mem_slots, ext_cmd);
         }
 
         stat_inc_counter(worker->command_counter, 1);
-        worker->display_poll_tries = 0;
+        ring_poll_command_received(&worker->display_poll);
         switch (ext_cmd.cmd.type) {
         case QXL_CMD_DRAW: {
             RedDrawable *red_drawable = red_drawable_new(worker->qxl); // returns with 1 ref
-
-            if (red_get_drawable(&worker->mem_slots, ext_cmd.group_id,
-                                 red_drawable, ext_cmd.cmd.data, ext_cmd.flags)) {
+            RedStatTimer timer;
+            bool parsed;
+
+            stat_timer_start(&timer);
+            parsed = red_get_drawable(&worker->mem_slots, ext_cmd.group_id,
+                                      red_drawable, ext_cmd.cmd.data, ext_cmd.flags);
+            stat_timer_add(worker->parse_time_counter, &timer);
+            if (parsed) {
+                stat_timer_start(&timer);
                 display_channel_process_draw(worker->display_channel, red_drawable,
                                              worker->process_display_generation);
+                stat_timer_add(worker->tree_insert_time_counter, &timer);
             }
             // release the red_drawable
             red_drawable_unref(red_drawable);
@@ -263,12 +498,28 @@ static int red_process_display(RedWorker *worker, int *ring_is_empty)
             spice_error("bad command type");
         }
         n++;
-        if (red_channel_all_blocked(RED_CHANNEL(worker->display_channel))
-            || spice_get_monotonic_time_ns() - start > NSEC_PER_SEC / 100) {
-            worker->event_timeout = 0;
-            return n;
+        now = spice_get_monotonic_time_ns();
+        worker_slice_command_done(&worker->display_slice, now - command_start);
+
+        /* give the cursor a chance between long running display commands */
+        if (now - last_cursor_check > WORKER_CURSOR_PREEMPT_INTERVAL) {
+            last_cursor_check = now;
+            if (red_process_cursor_pending(worker)) {
+                red_channel_push(RED_CHANNEL(worker->cursor_channel));
+                stat_inc_counter(worker->display_slice.cursor_preempt_counter, 1);
+            }
+        }
+        if (worker_dispatcher_pending(worker)) {
+            stat_inc_counter(worker->display_slice.dispatcher_preempt_counter, 1);
+        } else if (!red_channel_all_blocked(RED_CHANNEL(worker->display_channel)) &&
+                   !worker_slice_expired(&worker->display_slice, now - start)) {
+            continue;
         }
+        worker->event_timeout = 0;
+        worker_slice_end(&worker->display_slice, now - start, n);
+        return n;
     }
+    worker_slice_end(&worker->display_slice, now - start, n);
     worker->was_blocked = TRUE;
     return n;
 }
@@ -1229,9 +1480,11 @@ static void register_callbacks(Dispatcher *dispatcher)
 
 static void handle_dev_input(int fd, int event, void *opaque)
 {
-    Dispatcher *dispatcher = opaque;
+    RedWorker *worker = opaque;
 
-    dispatcher_handle_recv_read(dispatcher);
+    worker->handling_dispatcher = TRUE;
+    dispatcher_handle_recv_read(worker->dispatcher);
+    worker->handling_dispatcher = FALSE;
 }
 
 typedef struct RedWorkerSource {
@@ -1280,6 +1533,7 @@ static gboolean worker_source_dispatch(GSource *source, GSourceFunc callback,
        received yet */
     /* TODO: why is this here, and not in display_channel_create */
     display_channel_free_glz_drawables_to_free(display);
+    display_channel_release_compress_jobs(display, FALSE);
 
     /* TODO: could use its own source */
     stream_timeout(display);
@@ -1318,6 +1572,7 @@ RedWorker* red_worker_new(QXLInstance *qxl,
     worker->record = reds_get_record(reds);
     dispatcher = red_qxl_get_dispatcher(qxl);
     dispatcher_set_opaque(dispatcher, worker);
+    worker->dispatcher = dispatcher;
 
     worker->qxl = qxl;
     register_callbacks(dispatcher);
@@ -1334,10 +1589,16 @@ RedWorker* red_worker_new(QXLInstance *qxl,
     stat_init_node(&worker->stat, reds, NULL, worker_str, TRUE);
     stat_init_counter(&worker->wakeup_counter, reds, &worker->stat, "wakeups", TRUE);
     stat_init_counter(&worker->command_counter, reds, &worker->stat, "commands", TRUE);
+    stat_init_counter(&worker->parse_time_counter, reds, &worker->stat, "parse_ns", TRUE);
+    stat_init_counter(&worker->tree_insert_time_counter, reds, &worker->stat,
+                      "tree_insert_ns", TRUE);
+    ring_poll_init(&worker->display_poll, reds, &worker->stat, "display");
+    ring_poll_init(&worker->cursor_poll, reds, &worker->stat, "cursor");
+    worker_slice_init(&worker->display_slice, reds, &worker->stat, "display_slices");
 
     worker->dispatch_watch =
         worker->core.watch_add(&worker->core, dispatcher_get_recv_fd(dispatcher),
-                               SPICE_WATCH_EVENT_READ, handle_dev_input, dispatcher);
+                               SPICE_WATCH_EVENT_READ, handle_dev_input, worker);
     spice_assert(worker->dispatch_watch != NULL);
 
     GSource *source = g_source_new(&worker_source_funcs, sizeof(RedWorkerSource));
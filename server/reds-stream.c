@@ -20,10 +20,17 @@
 #endif
 
 #include <errno.h>
+#include <limits.h>
 #include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 #include <fcntl.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
 
 #include <glib.h>
 
@@ -37,6 +44,18 @@
 #include "reds-stream.h"
 #include "reds.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HAVE_MSG_ZEROCOPY 1
+#endif
+
+#if defined(SSL_OP_ENABLE_KTLS) && defined(BIO_get_ktls_send)
+#define HAVE_KTLS 1
+#endif
+
 struct AsyncRead {
     RedsStream *stream;
     void *opaque;
@@ -97,6 +116,14 @@ struct RedsStreamPrivate {
     ssize_t (*write)(RedsStream *s, const void *buf, size_t nbyte);
     ssize_t (*writev)(RedsStream *s, const struct iovec *iov, int iovcnt);
 
+    /* small buffers gathered before being encrypted by OpenSSL */
+    uint8_t *ssl_gather;
+
+    /* MSG_ZEROCOPY writes issued and completed by the kernel */
+    bool zerocopy;
+    uint32_t zerocopy_sent;
+    uint32_t zerocopy_completed;
+
     RedsState *reds;
 };
 
@@ -112,11 +139,7 @@ static ssize_t stream_writev_cb(RedsStream *s, const struct iovec *iov, int iovc
         int tosend;
         ssize_t n, expected = 0;
         int i;
-#ifdef IOV_MAX
         tosend = MIN(iovcnt, IOV_MAX);
-#else
-        tosend = iovcnt;
-#endif
         for (i = 0; i < tosend; i++) {
             expected += iov[i].iov_len;
         }
@@ -153,6 +176,54 @@ static ssize_t stream_ssl_write_cb(RedsStream *s, const void *buf, size_t size)
     return return_code;
 }
 
+/* Each SSL_write() produces at least a TLS record with its own header and MAC,
+ * so the small buffers of a message (headers, sub-messages) are gathered up
+ * to the maximum size of a record before being encrypted. The larger ones are
+ * encrypted from where they are to avoid a copy. */
+#define SSL_GATHER_SIZE (16 * 1024)
+#define SSL_GATHER_MAX_COPY 4096
+
+static ssize_t stream_ssl_writev_cb(RedsStream *s, const struct iovec *iov, int iovcnt)
+{
+    ssize_t ret = 0;
+    int i = 0;
+
+    while (i < iovcnt) {
+        const void *buf;
+        size_t size = 0;
+        ssize_t n;
+
+        if (iov[i].iov_len < SSL_GATHER_MAX_COPY &&
+            i + 1 < iovcnt && iov[i + 1].iov_len < SSL_GATHER_MAX_COPY) {
+            if (!s->priv->ssl_gather) {
+                s->priv->ssl_gather = spice_malloc(SSL_GATHER_SIZE);
+            }
+            while (i < iovcnt && iov[i].iov_len < SSL_GATHER_MAX_COPY &&
+                   size + iov[i].iov_len <= SSL_GATHER_SIZE) {
+                memcpy(s->priv->ssl_gather + size, iov[i].iov_base, iov[i].iov_len);
+                size += iov[i].iov_len;
+                i++;
+            }
+            buf = s->priv->ssl_gather;
+        } else {
+            buf = iov[i].iov_base;
+            size = iov[i].iov_len;
+            i++;
+        }
+        if (size == 0) {
+            continue;
+        }
+
+        n = stream_ssl_write_cb(s, buf, size);
+        if (n <= 0) {
+            return ret == 0 ? n : ret;
+        }
+        ret += n;
+    }
+
+    return ret;
+}
+
 static ssize_t stream_ssl_read_cb(RedsStream *s, void *buf, size_t size)
 {
     int return_code;
@@ -340,6 +411,126 @@ ssize_t reds_stream_writev(RedsStream *s, const struct iovec *iov, int iovcnt)
     return ret;
 }
 
+/**
+ * reds_stream_enable_zerocopy:
+ * @stream: a #RedsStream
+ *
+ * Allows writing with reds_stream_writev_zerocopy(), only possible for
+ * plain TCP streams.
+ *
+ * Returns: #true if the stream supports zero-copy writes.
+ */
+bool reds_stream_enable_zerocopy(RedsStream *stream)
+{
+#ifdef HAVE_MSG_ZEROCOPY
+    int family = reds_stream_get_family(stream);
+    int on = 1;
+
+    if (stream->priv->zerocopy) {
+        return true;
+    }
+    /* SSL and SASL encode the data in their own buffers */
+    if (stream->priv->writev != stream_writev_cb || stream->priv->ssl ||
+        (family != AF_INET && family != AF_INET6)) {
+        return false;
+    }
+    if (setsockopt(stream->socket, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) != 0) {
+        spice_debug("SO_ZEROCOPY not supported: %s", strerror(errno));
+        return false;
+    }
+    stream->priv->zerocopy = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool reds_stream_is_zerocopy(const RedsStream *stream)
+{
+    return stream->priv->zerocopy;
+}
+
+ssize_t reds_stream_writev_zerocopy(RedsStream *s, const struct iovec *iov, int iovcnt)
+{
+#ifdef HAVE_MSG_ZEROCOPY
+    struct msghdr msg = { 0, };
+    ssize_t n;
+
+    spice_return_val_if_fail(s->priv->zerocopy, -1);
+
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = MIN(iovcnt, IOV_MAX);
+    n = sendmsg(s->socket, &msg, MSG_ZEROCOPY | MSG_NOSIGNAL);
+    if (n < 0 && errno == ENOBUFS) {
+        /* too many pages are pinned by the writes in flight */
+        return stream_writev_cb(s, iov, iovcnt);
+    }
+    if (n > 0) {
+        s->priv->zerocopy_sent++;
+    }
+    return n;
+#else
+    return reds_stream_writev(s, iov, iovcnt);
+#endif
+}
+
+uint32_t reds_stream_get_zerocopy_sent(const RedsStream *s)
+{
+    return s->priv->zerocopy_sent;
+}
+
+/* reads the completion notifications queued on the error queue of the socket */
+static void reds_stream_read_zerocopy_completions(RedsStream *s)
+{
+#ifdef HAVE_MSG_ZEROCOPY
+    for (;;) {
+        union {
+            struct cmsghdr hdr;
+            char data[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        } control;
+        struct msghdr msg = { 0, };
+        struct cmsghdr *cmsg;
+
+        msg.msg_control = control.data;
+        msg.msg_controllen = sizeof(control.data);
+        if (recvmsg(s->socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            return;
+        }
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            struct sock_extended_err err;
+
+            if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                  (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0) {
+                continue;
+            }
+            /* [ee_info, ee_data] are the completed writes, TCP completes
+             * them in order */
+            s->priv->zerocopy_completed = err.ee_data + 1;
+        }
+    }
+#endif
+}
+
+/**
+ * reds_stream_get_zerocopy_completed:
+ * @s: a #RedsStream
+ *
+ * The data of the first N zero-copy writes is not used by the kernel
+ * anymore, where N is the returned value, so it can be modified or freed.
+ * Compare with reds_stream_get_zerocopy_sent().
+ */
+uint32_t reds_stream_get_zerocopy_completed(RedsStream *s)
+{
+    if (s->priv->zerocopy && s->priv->zerocopy_completed != s->priv->zerocopy_sent) {
+        reds_stream_read_zerocopy_completions(s);
+    }
+    return s->priv->zerocopy_completed;
+}
+
 void reds_stream_free(RedsStream *s)
 {
     if (!s) {
@@ -365,6 +556,7 @@ void reds_stream_free(RedsStream *s)
     if (s->priv->ssl) {
         SSL_free(s->priv->ssl);
     }
+    free(s->priv->ssl_gather);
 
     reds_stream_remove_watch(s);
     spice_debug("close socket fd %d", s->socket);
@@ -437,6 +629,22 @@ void reds_stream_disable_writev(RedsStream *stream)
     stream->priv->writev = NULL;
 }
 
+/* Once the handshake is done, OpenSSL may have handed the record encryption
+ * to the kernel if it supports the negotiated cipher. The data can then be
+ * written to the socket directly, and in a single call for several buffers.
+ * Reads keep going through OpenSSL, which handles the control records. */
+static void reds_stream_check_ktls(RedsStream *stream)
+{
+#ifdef HAVE_KTLS
+    if (!BIO_get_ktls_send(SSL_get_wbio(stream->priv->ssl))) {
+        return;
+    }
+    stream->priv->write = stream_write_cb;
+    stream->priv->writev = stream_writev_cb;
+    spice_debug("kernel TLS enabled for sending on socket %d", stream->socket);
+#endif
+}
+
 RedsStreamSslStatus reds_stream_ssl_accept(RedsStream *stream)
 {
     int ssl_error;
@@ -444,6 +652,7 @@ RedsStreamSslStatus reds_stream_ssl_accept(RedsStream *stream)
 
     return_code = SSL_accept(stream->priv->ssl);
     if (return_code == 1) {
+        reds_stream_check_ktls(stream);
         return REDS_STREAM_SSL_STATUS_OK;
     }
 
@@ -483,10 +692,20 @@ int reds_stream_enable_ssl(RedsStream *stream, SSL_CTX *ctx)
     }
 
     SSL_set_bio(stream->priv->ssl, sbio, sbio);
+    /* a write interrupted by SSL_ERROR_WANT_WRITE can be retried from either
+     * the gather buffer or the caller's buffer, depending on how the data is
+     * split in the iovec the next time */
+    SSL_set_mode(stream->priv->ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef HAVE_KTLS
+    /* the kernel encrypts the records, saving a copy to OpenSSL */
+    if (spice_env_get_bool("SPICE_KTLS", FALSE)) {
+        SSL_set_options(stream->priv->ssl, SSL_OP_ENABLE_KTLS);
+    }
+#endif
 
     stream->priv->write = stream_ssl_write_cb;
     stream->priv->read = stream_ssl_read_cb;
-    stream->priv->writev = NULL;
+    stream->priv->writev = stream_ssl_writev_cb;
 
     return reds_stream_ssl_accept(stream);
 }
@@ -76,6 +76,15 @@ bool reds_stream_set_no_delay(RedsStream *stream, bool no_delay);
 int reds_stream_get_no_delay(RedsStream *stream);
 int reds_stream_send_msgfd(RedsStream *stream, int fd);
 
+/* zero-copy writes: the data must not be modified or freed until
+ * reds_stream_get_zerocopy_completed() reaches the value returned by
+ * reds_stream_get_zerocopy_sent() after the write */
+bool reds_stream_enable_zerocopy(RedsStream *stream);
+bool reds_stream_is_zerocopy(const RedsStream *stream);
+ssize_t reds_stream_writev_zerocopy(RedsStream *s, const struct iovec *iov, int iovcnt);
+uint32_t reds_stream_get_zerocopy_sent(const RedsStream *s);
+uint32_t reds_stream_get_zerocopy_completed(RedsStream *s);
+
 typedef enum {
     REDS_SASL_ERROR_OK,
     REDS_SASL_ERROR_GENERIC,
@@ -0,0 +1,319 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stddef.h>
+#include <string.h>
+#include <glib.h>
+#include <common/mem.h>
+
+#include "scroll-detect.h"
+
+#define PIXEL_MASK 0x00ffffffu
+#define HASH_INIT UINT64_C(0xcbf29ce484222325)
+#define HASH_PRIME UINT64_C(0x100000001b3)
+
+/* lines of the new content looked up in the old one by the cheap check */
+#define NUM_SAMPLE_LINES 8
+
+/* lines whose hash is not unique cannot tell the offset */
+#define LINE_NONE -1
+#define LINE_DUPLICATE -2
+
+typedef struct ScrollDetectImage {
+    const uint8_t *line_0;
+    int32_t stride;
+    uint64_t *row_hashes;
+    uint64_t *col_hashes;
+} ScrollDetectImage;
+
+typedef struct LineIndexEntry {
+    uint64_t hash;
+    int32_t line;
+} LineIndexEntry;
+
+typedef struct LineIndex {
+    LineIndexEntry *entries;
+    uint32_t mask;
+} LineIndex;
+
+static inline const uint32_t *image_line(const ScrollDetectImage *image, int y)
+{
+    return (const uint32_t *)(image->line_0 + (ptrdiff_t)y * image->stride);
+}
+
+/* both the rows and the columns in a single pass over the image */
+static void image_hash_lines(ScrollDetectImage *image, int width, int height)
+{
+    int x, y;
+
+    for (x = 0; x < width; x++) {
+        image->col_hashes[x] = HASH_INIT;
+    }
+    for (y = 0; y < height; y++) {
+        const uint32_t *line = image_line(image, y);
+        uint64_t hash = HASH_INIT;
+
+        for (x = 0; x < width; x++) {
+            uint32_t pixel = line[x] & PIXEL_MASK;
+
+            hash = (hash ^ pixel) * HASH_PRIME;
+            image->col_hashes[x] = (image->col_hashes[x] ^ pixel) * HASH_PRIME;
+        }
+        image->row_hashes[y] = hash;
+    }
+}
+
+static bool rows_equal(const ScrollDetectImage *old_image, int old_row,
+                       const ScrollDetectImage *new_image, int new_row, int width)
+{
+    const uint32_t *old_line = image_line(old_image, old_row);
+    const uint32_t *new_line = image_line(new_image, new_row);
+    int x;
+
+    for (x = 0; x < width; x++) {
+        if ((old_line[x] ^ new_line[x]) & PIXEL_MASK) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static bool cols_equal(const ScrollDetectImage *old_image, int old_col,
+                       const ScrollDetectImage *new_image, int new_col, int height)
+{
+    int y;
+
+    for (y = 0; y < height; y++) {
+        if ((image_line(old_image, y)[old_col] ^ image_line(new_image, y)[new_col]) & PIXEL_MASK) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static inline uint32_t line_index_slot(const LineIndex *index, uint64_t hash)
+{
+    return (uint32_t)(hash ^ (hash >> 32)) & index->mask;
+}
+
+static void line_index_init(LineIndex *index, const uint64_t *hashes, int n_lines)
+{
+    uint32_t size = 1;
+    int i;
+
+    while (size < 2 * (uint32_t)n_lines) {
+        size <<= 1;
+    }
+    index->mask = size - 1;
+    index->entries = spice_new(LineIndexEntry, size);
+    for (i = 0; i < size; i++) {
+        index->entries[i].line = LINE_NONE;
+    }
+
+    for (i = 0; i < n_lines; i++) {
+        uint32_t slot = line_index_slot(index, hashes[i]);
+        LineIndexEntry *entry;
+
+        while ((entry = &index->entries[slot])->line != LINE_NONE && entry->hash != hashes[i]) {
+            slot = (slot + 1) & index->mask;
+        }
+        if (entry->line == LINE_NONE) {
+            entry->hash = hashes[i];
+            entry->line = i;
+        } else {
+            entry->line = LINE_DUPLICATE;
+        }
+    }
+}
+
+static int32_t line_index_lookup(const LineIndex *index, uint64_t hash)
+{
+    uint32_t slot = line_index_slot(index, hash);
+    const LineIndexEntry *entry;
+
+    while ((entry = &index->entries[slot])->line != LINE_NONE) {
+        if (entry->hash == hash) {
+            return entry->line;
+        }
+        slot = (slot + 1) & index->mask;
+    }
+    return LINE_NONE;
+}
+
+/* Finds along one axis the longest run of new lines [@start, @end) that are
+ * the old lines [@start + @offset, @end + @offset) */
+static bool find_move(const ScrollDetectImage *old_image, const ScrollDetectImage *new_image,
+                      bool rows, int n_lines, int line_size,
+                      int *start, int *end, int *offset)
+{
+    const uint64_t *old_hashes = rows ? old_image->row_hashes : old_image->col_hashes;
+    const uint64_t *new_hashes = rows ? new_image->row_hashes : new_image->col_hashes;
+    LineIndex index;
+    uint32_t *votes;
+    int i, best, run_start, run_votes, first, last;
+
+    line_index_init(&index, old_hashes, n_lines);
+    votes = spice_new0(uint32_t, 2 * n_lines - 1);
+    for (i = 0; i < n_lines; i++) {
+        int32_t line = line_index_lookup(&index, new_hashes[i]);
+
+        if (line >= 0 && line != i) {
+            votes[line - i + n_lines - 1]++;
+        }
+    }
+    best = 0;
+    for (i = 1; i < 2 * n_lines - 1; i++) {
+        if (votes[i] > votes[best]) {
+            best = i;
+        }
+    }
+    if (votes[best] == 0) {
+        free(votes);
+        free(index.entries);
+        return FALSE;
+    }
+    free(votes);
+    *offset = best - (n_lines - 1);
+
+    /* the lines that match with the offset but did not vote, for instance
+     * blank ones, are part of the run as long as it has a voter */
+    *start = *end = 0;
+    first = MAX(0, -*offset);
+    last = MIN(n_lines, n_lines - *offset);
+    run_start = first;
+    run_votes = 0;
+    for (i = first; i <= last; i++) {
+        bool match = i < last && new_hashes[i] == old_hashes[i + *offset] &&
+            (rows ? rows_equal(old_image, i + *offset, new_image, i, line_size) :
+                    cols_equal(old_image, i + *offset, new_image, i, line_size));
+
+        if (match) {
+            if (line_index_lookup(&index, new_hashes[i]) == i + *offset) {
+                run_votes++;
+            }
+            continue;
+        }
+        if (run_votes && i - run_start > *end - *start) {
+            *start = run_start;
+            *end = i;
+        }
+        run_start = i + 1;
+        run_votes = 0;
+    }
+    free(index.entries);
+
+    return *end - *start >= MAX(SCROLL_DETECT_MIN_LINES, n_lines / 4);
+}
+
+bool scroll_detect(const uint8_t *old_line_0, int32_t old_stride,
+                   const uint8_t *new_line_0, int32_t new_stride,
+                   int width, int height, ScrollDetectMove *move)
+{
+    ScrollDetectImage old_image = { old_line_0, old_stride, NULL, NULL };
+    ScrollDetectImage new_image = { new_line_0, new_stride, NULL, NULL };
+    uint64_t *hashes;
+    int start, end, offset;
+    bool found = FALSE;
+
+    if (width < SCROLL_DETECT_MIN_LINES || height < SCROLL_DETECT_MIN_LINES) {
+        return FALSE;
+    }
+
+    hashes = spice_new(uint64_t, 2 * (width + height));
+    old_image.row_hashes = hashes;
+    old_image.col_hashes = old_image.row_hashes + height;
+    new_image.row_hashes = old_image.col_hashes + width;
+    new_image.col_hashes = new_image.row_hashes + height;
+    image_hash_lines(&old_image, width, height);
+    image_hash_lines(&new_image, width, height);
+
+    if (find_move(&old_image, &new_image, TRUE, height, width, &start, &end, &offset)) {
+        move->dest.left = 0;
+        move->dest.right = width;
+        move->dest.top = start;
+        move->dest.bottom = end;
+        move->src.x = 0;
+        move->src.y = start + offset;
+        found = TRUE;
+    } else if (find_move(&old_image, &new_image, FALSE, width, height, &start, &end, &offset)) {
+        move->dest.left = start;
+        move->dest.right = end;
+        move->dest.top = 0;
+        move->dest.bottom = height;
+        move->src.x = start + offset;
+        move->src.y = 0;
+        found = TRUE;
+    }
+    free(hashes);
+
+    return found;
+}
+
+/* Whether some of the sample lines that changed are found at another place */
+static bool sample_lines_moved(const uint64_t *old_hashes, const uint64_t *new_hashes,
+                               int n_lines)
+{
+    int i, j;
+
+    for (i = 0; i < NUM_SAMPLE_LINES; i++) {
+        int line = (2 * i + 1) * n_lines / (2 * NUM_SAMPLE_LINES);
+
+        if (new_hashes[line] == old_hashes[line]) {
+            continue;
+        }
+        for (j = 0; j < n_lines; j++) {
+            if (old_hashes[j] == new_hashes[line]) {
+                return TRUE;
+            }
+        }
+    }
+    return FALSE;
+}
+
+bool scroll_detect_hashes_update(ScrollDetectHashes *hashes,
+                                 const uint8_t *line_0, int32_t stride,
+                                 int width, int height)
+{
+    ScrollDetectImage image = { line_0, stride, NULL, NULL };
+    bool may_move = FALSE;
+
+    image.row_hashes = spice_new(uint64_t, width + height);
+    image.col_hashes = image.row_hashes + height;
+    image_hash_lines(&image, width, height);
+
+    if (hashes->row_hashes && hashes->width == width && hashes->height == height) {
+        may_move = sample_lines_moved(hashes->row_hashes, image.row_hashes, height) ||
+                   sample_lines_moved(hashes->col_hashes, image.col_hashes, width);
+    }
+    scroll_detect_hashes_clear(hashes);
+    hashes->width = width;
+    hashes->height = height;
+    hashes->row_hashes = image.row_hashes;
+    hashes->col_hashes = image.col_hashes;
+
+    return may_move;
+}
+
+void scroll_detect_hashes_clear(ScrollDetectHashes *hashes)
+{
+    free(hashes->row_hashes);
+    memset(hashes, 0, sizeof(*hashes));
+}
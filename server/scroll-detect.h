@@ -0,0 +1,70 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SCROLL_DETECT_H_
+#define SCROLL_DETECT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <common/draw.h>
+
+/* Detection of the repaints of an area with its own content moved along one
+ * axis, as many guests scroll windows.
+ *
+ * Each line of the new content, first the rows then the columns, is hashed
+ * and looked up among the lines of the old content. The offset most lines
+ * agree on gives the move, and the longest run of lines that really match
+ * with that offset is the part of the area that can be copied instead of
+ * being sent again.
+ */
+
+/* the fewest lines worth a copy */
+#define SCROLL_DETECT_MIN_LINES 16
+
+typedef struct ScrollDetectMove {
+    /* the moved part of the new content, relative to the area */
+    SpiceRect dest;
+    /* the top-left corner of the same content in the old one */
+    SpicePoint src;
+} ScrollDetectMove;
+
+/* The line hashes of the last content of an area, to tell cheaply whether
+ * the next one may be a move of it before the old content is read */
+typedef struct ScrollDetectHashes {
+    int width;
+    int height;
+    uint64_t *row_hashes;
+    uint64_t *col_hashes;
+} ScrollDetectHashes;
+
+/* Replaces @hashes with those of the new content at @line_0. Returns TRUE if
+ * some of its lines that changed were lines of the previous content of the
+ * same size at another place, which a move requires. */
+bool scroll_detect_hashes_update(ScrollDetectHashes *hashes,
+                                 const uint8_t *line_0, int32_t stride,
+                                 int width, int height);
+void scroll_detect_hashes_clear(ScrollDetectHashes *hashes);
+
+/* @old_line_0 and @new_line_0 point to the top line of @width x @height
+ * areas of 32 bits pixels, the strides are negative for bottom-up images.
+ * The high bytes of the pixels are ignored. */
+bool scroll_detect(const uint8_t *old_line_0, int32_t old_stride,
+                   const uint8_t *new_line_0, int32_t new_stride,
+                   int width, int height, ScrollDetectMove *move);
+
+#endif /* SCROLL_DETECT_H_ */
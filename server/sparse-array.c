@@ -0,0 +1,68 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <common/mem.h>
+
+#include "sparse-array.h"
+
+SparseArray *sparse_array_new(size_t element_size, uint32_t n_elements)
+{
+    SparseArray *array = spice_new0(SparseArray, 1);
+
+    array->element_size = element_size;
+    array->n_elements = n_elements;
+    array->chunks = spice_new0(uint8_t *,
+                               (n_elements + SPARSE_ARRAY_CHUNK_SIZE - 1) /
+                               SPARSE_ARRAY_CHUNK_SIZE);
+
+    return array;
+}
+
+void sparse_array_free(SparseArray *array)
+{
+    uint32_t i;
+
+    if (!array) {
+        return;
+    }
+
+    for (i = 0; i * SPARSE_ARRAY_CHUNK_SIZE < array->n_elements; i++) {
+        free(array->chunks[i]);
+    }
+    free(array->chunks);
+    free(array);
+}
+
+void *sparse_array_alloc_chunk(SparseArray *array, uint32_t index)
+{
+    uint8_t **chunk = &array->chunks[index / SPARSE_ARRAY_CHUNK_SIZE];
+
+    if (*chunk == NULL) {
+        *chunk = spice_malloc0_n(SPARSE_ARRAY_CHUNK_SIZE, array->element_size);
+        array->n_chunks_allocated++;
+    }
+    return *chunk;
+}
+
+size_t sparse_array_get_allocated_size(const SparseArray *array)
+{
+    return (size_t)array->n_chunks_allocated * SPARSE_ARRAY_CHUNK_SIZE * array->element_size;
+}
@@ -0,0 +1,86 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SPARSE_ARRAY_H_
+#define SPARSE_ARRAY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <spice/macros.h>
+#include <common/log.h>
+
+/* A fixed size array of zero-initialized elements, only allocated as they
+ * are used.
+ *
+ * The elements are allocated by chunks of SPARSE_ARRAY_CHUNK_SIZE the first
+ * time one of them is accessed with sparse_array_get(), so the memory used
+ * depends on the elements actually in use rather than on the size of the
+ * array. Accessing an element is O(1) and elements never move.
+ */
+
+#define SPARSE_ARRAY_CHUNK_SIZE 64
+
+typedef struct SparseArray {
+    size_t element_size;
+    uint32_t n_elements;
+    uint32_t n_chunks_allocated;
+    uint8_t **chunks;
+} SparseArray;
+
+SparseArray *sparse_array_new(size_t element_size, uint32_t n_elements);
+void sparse_array_free(SparseArray *array);
+
+void *sparse_array_alloc_chunk(SparseArray *array, uint32_t index);
+
+/* Returns the element at @index, allocating it if needed */
+static inline void *sparse_array_get(SparseArray *array, uint32_t index)
+{
+    uint8_t *chunk;
+
+    spice_assert(index < array->n_elements);
+    chunk = array->chunks[index / SPARSE_ARRAY_CHUNK_SIZE];
+    if (SPICE_UNLIKELY(chunk == NULL)) {
+        chunk = sparse_array_alloc_chunk(array, index);
+    }
+    return chunk + (index % SPARSE_ARRAY_CHUNK_SIZE) * array->element_size;
+}
+
+/* Returns the element at @index, or NULL if it was not allocated yet. This
+ * is for going through the array without allocating it entirely, the
+ * elements that were never accessed are all zeroes. */
+static inline void *sparse_array_lookup(const SparseArray *array, uint32_t index)
+{
+    uint8_t *chunk;
+
+    spice_assert(index < array->n_elements);
+    chunk = array->chunks[index / SPARSE_ARRAY_CHUNK_SIZE];
+    if (chunk == NULL) {
+        return NULL;
+    }
+    return chunk + (index % SPARSE_ARRAY_CHUNK_SIZE) * array->element_size;
+}
+
+static inline uint32_t sparse_array_get_size(const SparseArray *array)
+{
+    return array->n_elements;
+}
+
+/* The number of bytes allocated for the elements */
+size_t sparse_array_get_allocated_size(const SparseArray *array);
+
+#endif /* SPARSE_ARRAY_H_ */
@@ -23,6 +23,300 @@
 
 #include "spice-bitmap-utils.h"
 
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define HAVE_GRADUAL_X86 1
+#include <immintrin.h>
+#endif
+
+#define SAME_PIXEL_WEIGHT 0.5
+#define NOT_CONTRAST_PIXELS_WEIGHT -0.25
+#define CONTRAST_PIXELS_WEIGHT 1.0
+
+/* The graduality of a bitmap is estimated by comparing sampled pixels with
+ * their right, bottom and bottom right neighbours. The samples are gathered
+ * in batches, one channel per byte, so that the comparisons can be done by
+ * a vectorized kernel */
+#define GRADUAL_BATCH_SIZE 64
+/* number of squares compared at once by the widest kernel */
+#define GRADUAL_MAX_LANES 8
+
+typedef struct GradualSquares {
+    uint32_t pix[GRADUAL_BATCH_SIZE];
+    uint32_t right[GRADUAL_BATCH_SIZE];
+    uint32_t bottom[GRADUAL_BATCH_SIZE];
+    uint32_t bottom_right[GRADUAL_BATCH_SIZE];
+} GradualSquares;
+
+/* pairs of pixels of the squares which are not all identical */
+typedef struct GradualCounts {
+    uint32_t same;
+    uint32_t contrast;
+    uint32_t not_contrast;
+} GradualCounts;
+
+/* Classifies the pairs of the first @n squares (rounded up to
+ * GRADUAL_MAX_LANES) of @squares. Two pixels are contrasting if any of their
+ * channels differ by at least @threshold. */
+typedef void (*GradualClassifyFunc)(const GradualSquares *squares, unsigned int n,
+                                    uint8_t threshold, GradualCounts *counts);
+
+static inline int gradual_channel_contrasting(uint32_t p1, uint32_t p2, int shift,
+                                              uint8_t threshold)
+{
+    int diff = (int)((p1 >> shift) & 0xff) - (int)((p2 >> shift) & 0xff);
+
+    return diff <= -threshold || diff >= threshold;
+}
+
+// return 0 - equal, 1 - for contrast, 2 for no contrast
+static inline int gradual_pair_class(uint32_t p1, uint32_t p2, uint8_t threshold)
+{
+    if (p1 == p2) {
+        return 0;
+    }
+    if (gradual_channel_contrasting(p1, p2, 0, threshold) ||
+        gradual_channel_contrasting(p1, p2, 8, threshold) ||
+        gradual_channel_contrasting(p1, p2, 16, threshold)) {
+        return 1;
+    }
+    return 2;
+}
+
+static void gradual_classify_scalar(const GradualSquares *squares, unsigned int n,
+                                    uint8_t threshold, GradualCounts *counts)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        int pairs[3];
+        int j;
+
+        pairs[0] = gradual_pair_class(squares->pix[i], squares->right[i], threshold);
+        pairs[1] = gradual_pair_class(squares->pix[i], squares->bottom[i], threshold);
+        pairs[2] = gradual_pair_class(squares->pix[i], squares->bottom_right[i], threshold);
+        // ignore squares where all pixels are identical
+        if (!(pairs[0] | pairs[1] | pairs[2])) {
+            continue;
+        }
+        for (j = 0; j < 3; j++) {
+            counts->same += pairs[j] == 0;
+            counts->contrast += pairs[j] == 1;
+            counts->not_contrast += pairs[j] == 2;
+        }
+    }
+}
+
+#ifdef HAVE_GRADUAL_X86
+__attribute__((target("sse2")))
+static inline void gradual_pair_sse2(__m128i p1, __m128i p2, __m128i threshold,
+                                     __m128i *equal, __m128i *not_contrast)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i diff = _mm_or_si128(_mm_subs_epu8(p1, p2), _mm_subs_epu8(p2, p1));
+
+    *equal = _mm_cmpeq_epi32(diff, zero);
+    *not_contrast = _mm_cmpeq_epi32(_mm_subs_epu8(diff, threshold), zero);
+}
+
+__attribute__((target("sse2")))
+static void gradual_classify_sse2(const GradualSquares *squares, unsigned int n,
+                                  uint8_t threshold, GradualCounts *counts)
+{
+    /* a channel difference above threshold - 1 is contrasting */
+    const __m128i th = _mm_set1_epi8(threshold - 1);
+    __m128i same = _mm_setzero_si128();
+    __m128i contrast = _mm_setzero_si128();
+    __m128i not_contrast = _mm_setzero_si128();
+    uint32_t sums[3][4];
+    unsigned int i, j;
+
+    for (i = 0; i < n; i += 4) {
+        __m128i pix = _mm_loadu_si128((const __m128i *)&squares->pix[i]);
+        const uint32_t *neighbours[3] = {
+            &squares->right[i], &squares->bottom[i], &squares->bottom_right[i]
+        };
+        __m128i equal[3], nc[3], uniform;
+
+        for (j = 0; j < 3; j++) {
+            gradual_pair_sse2(pix, _mm_loadu_si128((const __m128i *)neighbours[j]), th,
+                              &equal[j], &nc[j]);
+        }
+        uniform = _mm_and_si128(_mm_and_si128(equal[0], equal[1]), equal[2]);
+        for (j = 0; j < 3; j++) {
+            /* masks are -1, subtracting them counts the lanes */
+            same = _mm_sub_epi32(same, _mm_andnot_si128(uniform, equal[j]));
+            contrast = _mm_sub_epi32(contrast, _mm_andnot_si128(_mm_or_si128(uniform, nc[j]),
+                                                                _mm_set1_epi32(-1)));
+            not_contrast = _mm_sub_epi32(not_contrast,
+                                         _mm_andnot_si128(_mm_or_si128(uniform, equal[j]),
+                                                          nc[j]));
+        }
+    }
+
+    _mm_storeu_si128((__m128i *)sums[0], same);
+    _mm_storeu_si128((__m128i *)sums[1], contrast);
+    _mm_storeu_si128((__m128i *)sums[2], not_contrast);
+    for (i = 0; i < 4; i++) {
+        counts->same += sums[0][i];
+        counts->contrast += sums[1][i];
+        counts->not_contrast += sums[2][i];
+    }
+}
+
+__attribute__((target("avx2")))
+static inline void gradual_pair_avx2(__m256i p1, __m256i p2, __m256i threshold,
+                                     __m256i *equal, __m256i *not_contrast)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i diff = _mm256_or_si256(_mm256_subs_epu8(p1, p2), _mm256_subs_epu8(p2, p1));
+
+    *equal = _mm256_cmpeq_epi32(diff, zero);
+    *not_contrast = _mm256_cmpeq_epi32(_mm256_subs_epu8(diff, threshold), zero);
+}
+
+__attribute__((target("avx2")))
+static void gradual_classify_avx2(const GradualSquares *squares, unsigned int n,
+                                  uint8_t threshold, GradualCounts *counts)
+{
+    const __m256i th = _mm256_set1_epi8(threshold - 1);
+    const __m256i ones = _mm256_set1_epi32(-1);
+    __m256i same = _mm256_setzero_si256();
+    __m256i contrast = _mm256_setzero_si256();
+    __m256i not_contrast = _mm256_setzero_si256();
+    uint32_t sums[3][8];
+    unsigned int i, j;
+
+    for (i = 0; i < n; i += 8) {
+        __m256i pix = _mm256_loadu_si256((const __m256i *)&squares->pix[i]);
+        const uint32_t *neighbours[3] = {
+            &squares->right[i], &squares->bottom[i], &squares->bottom_right[i]
+        };
+        __m256i equal[3], nc[3], uniform;
+
+        for (j = 0; j < 3; j++) {
+            gradual_pair_avx2(pix, _mm256_loadu_si256((const __m256i *)neighbours[j]), th,
+                              &equal[j], &nc[j]);
+        }
+        uniform = _mm256_and_si256(_mm256_and_si256(equal[0], equal[1]), equal[2]);
+        for (j = 0; j < 3; j++) {
+            same = _mm256_sub_epi32(same, _mm256_andnot_si256(uniform, equal[j]));
+            contrast = _mm256_sub_epi32(contrast,
+                                        _mm256_andnot_si256(_mm256_or_si256(uniform, nc[j]),
+                                                            ones));
+            not_contrast = _mm256_sub_epi32(not_contrast,
+                                            _mm256_andnot_si256(_mm256_or_si256(uniform,
+                                                                                equal[j]),
+                                                                nc[j]));
+        }
+    }
+
+    _mm256_storeu_si256((__m256i *)sums[0], same);
+    _mm256_storeu_si256((__m256i *)sums[1], contrast);
+    _mm256_storeu_si256((__m256i *)sums[2], not_contrast);
+    for (i = 0; i < 8; i++) {
+        counts->same += sums[0][i];
+        counts->contrast += sums[1][i];
+        counts->not_contrast += sums[2][i];
+    }
+}
+#endif
+
+static const struct {
+    const char *name;
+    GradualClassifyFunc classify;
+} gradual_kernels[BITMAP_GRADUAL_KERNEL_COUNT] = {
+    [BITMAP_GRADUAL_KERNEL_SCALAR] = { "scalar", gradual_classify_scalar },
+#ifdef HAVE_GRADUAL_X86
+    [BITMAP_GRADUAL_KERNEL_SSE2] = { "sse2", gradual_classify_sse2 },
+    [BITMAP_GRADUAL_KERNEL_AVX2] = { "avx2", gradual_classify_avx2 },
+#else
+    [BITMAP_GRADUAL_KERNEL_SSE2] = { "sse2", NULL },
+    [BITMAP_GRADUAL_KERNEL_AVX2] = { "avx2", NULL },
+#endif
+};
+
+static volatile gsize gradual_kernel_init;
+static BitmapGradualKernel gradual_kernel;
+
+static bool gradual_kernel_supported(BitmapGradualKernel kernel)
+{
+    if (!gradual_kernels[kernel].classify) {
+        return false;
+    }
+#ifdef HAVE_GRADUAL_X86
+    __builtin_cpu_init();
+    switch (kernel) {
+    case BITMAP_GRADUAL_KERNEL_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case BITMAP_GRADUAL_KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2");
+    default:
+        break;
+    }
+#endif
+    return true;
+}
+
+static GradualClassifyFunc gradual_classify_func(void)
+{
+    if (g_once_init_enter(&gradual_kernel_init)) {
+        BitmapGradualKernel kernel = BITMAP_GRADUAL_KERNEL_COUNT - 1;
+
+        while (!gradual_kernel_supported(kernel)) {
+            kernel--;
+        }
+        gradual_kernel = kernel;
+        spice_debug("using %s graduality kernel", gradual_kernels[kernel].name);
+        g_once_init_leave(&gradual_kernel_init, 1);
+    }
+    return gradual_kernels[gradual_kernel].classify;
+}
+
+BitmapGradualKernel bitmap_gradual_kernel_get(void)
+{
+    gradual_classify_func();
+    return gradual_kernel;
+}
+
+bool bitmap_gradual_kernel_set(BitmapGradualKernel kernel)
+{
+    spice_return_val_if_fail(kernel < BITMAP_GRADUAL_KERNEL_COUNT, false);
+
+    gradual_classify_func();
+    if (!gradual_kernel_supported(kernel)) {
+        return false;
+    }
+    gradual_kernel = kernel;
+    return true;
+}
+
+const char *bitmap_gradual_kernel_name(BitmapGradualKernel kernel)
+{
+    spice_return_val_if_fail(kernel < BITMAP_GRADUAL_KERNEL_COUNT, NULL);
+
+    return gradual_kernels[kernel].name;
+}
+
+static inline void gradual_classify(GradualClassifyFunc classify, GradualSquares *squares,
+                                    unsigned int n, uint8_t threshold, GradualCounts *counts)
+{
+    /* identical pixels are ignored, the extra lanes don't count */
+    while (n % GRADUAL_MAX_LANES) {
+        squares->pix[n] = squares->right[n] = 0;
+        squares->bottom[n] = squares->bottom_right[n] = 0;
+        n++;
+    }
+    if (n) {
+        classify(squares, n, threshold, counts);
+    }
+}
+
+static inline double gradual_counts_score(const GradualCounts *counts)
+{
+    return counts->same * SAME_PIXEL_WEIGHT + counts->contrast * CONTRAST_PIXELS_WEIGHT +
+           counts->not_contrast * NOT_CONTRAST_PIXELS_WEIGHT;
+}
+
 #define RED_BITMAP_UTILS_RGB16
 #include "spice-bitmap-utils.tmpl.c"
 #define RED_BITMAP_UTILS_RGB24
@@ -39,8 +333,9 @@
 #define GRADUAL_MEDIUM_SCORE_TH 0.002
 
 // assumes that stride doesn't overflow
-BitmapGradualType bitmap_get_graduality_level(SpiceBitmap *bitmap)
+double bitmap_get_graduality_score(SpiceBitmap *bitmap)
 {
+    GradualClassifyFunc classify = gradual_classify_func();
     double score = 0.0;
     int num_samples = 0;
     int num_lines;
@@ -56,16 +351,16 @@ BitmapGradualType bitmap_get_graduality_level(SpiceBitmap *bitmap)
         switch (bitmap->format) {
         case SPICE_BITMAP_FMT_16BIT:
             compute_lines_gradual_score_rgb16((rgb16_pixel_t *)chunk[i].data, x, num_lines,
-                                              &chunk_score, &chunk_num_samples);
+                                              classify, &chunk_score, &chunk_num_samples);
             break;
         case SPICE_BITMAP_FMT_24BIT:
             compute_lines_gradual_score_rgb24((rgb24_pixel_t *)chunk[i].data, x, num_lines,
-                                              &chunk_score, &chunk_num_samples);
+                                              classify, &chunk_score, &chunk_num_samples);
             break;
         case SPICE_BITMAP_FMT_32BIT:
         case SPICE_BITMAP_FMT_RGBA:
             compute_lines_gradual_score_rgb32((rgb32_pixel_t *)chunk[i].data, x, num_lines,
-                                              &chunk_score, &chunk_num_samples);
+                                              classify, &chunk_score, &chunk_num_samples);
             break;
         default:
             spice_error("invalid bitmap format (not RGB) %u", bitmap->format);
@@ -75,7 +370,12 @@ BitmapGradualType bitmap_get_graduality_level(SpiceBitmap *bitmap)
     }
 
     spice_assert(num_samples);
-    score /= num_samples;
+    return score / num_samples;
+}
+
+BitmapGradualType bitmap_get_graduality_level(SpiceBitmap *bitmap)
+{
+    double score = bitmap_get_graduality_score(bitmap);
 
     if (bitmap->format == SPICE_BITMAP_FMT_16BIT) {
         if (score < GRADUAL_HIGH_RGB16_TH) {
@@ -83,6 +83,22 @@ static inline int bitmap_fmt_has_graduality(uint8_t fmt)
 }
 
 
+/* Kernels comparing the sampled pixels in bitmap_get_graduality_level(),
+ * the fastest one supported by the CPU is used by default */
+typedef enum {
+    BITMAP_GRADUAL_KERNEL_SCALAR,
+    BITMAP_GRADUAL_KERNEL_SSE2,
+    BITMAP_GRADUAL_KERNEL_AVX2,
+
+    BITMAP_GRADUAL_KERNEL_COUNT
+} BitmapGradualKernel;
+
+BitmapGradualKernel bitmap_gradual_kernel_get(void);
+/* returns false if @kernel is not supported by the build or the CPU */
+bool bitmap_gradual_kernel_set(BitmapGradualKernel kernel);
+const char *bitmap_gradual_kernel_name(BitmapGradualKernel kernel);
+
+double            bitmap_get_graduality_score     (SpiceBitmap *bitmap);
 BitmapGradualType bitmap_get_graduality_level     (SpiceBitmap *bitmap);
 int               bitmap_has_extra_stride         (SpiceBitmap *bitmap);
 
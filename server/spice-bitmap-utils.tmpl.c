@@ -42,87 +42,30 @@
 #define FNAME(name) name##_rgb32
 #endif
 
-
-#define SAME_PIXEL_WEIGHT 0.5
-#define NOT_CONTRAST_PIXELS_WEIGHT -0.25
-#define CONTRAST_PIXELS_WEIGHT 1.0
+/* one channel per byte, see GradualSquares */
+#define EXPAND(pix) ((uint32_t)GET_b(pix) | ((uint32_t)GET_g(pix) << 8) | \
+                     ((uint32_t)GET_r(pix) << 16))
 
 #ifndef RED_BITMAP_UTILS_RGB16
 #define CONTRAST_TH 60
 #else
 #define CONTRAST_TH 8
 #endif
-#define CONTRASTING(n) ((n) <= -CONTRAST_TH || (n) >= CONTRAST_TH)
 
 
 #define SAMPLE_JUMP 15
 
-static const double FNAME(PIX_PAIR_SCORE)[] = {
-    SAME_PIXEL_WEIGHT,
-    CONTRAST_PIXELS_WEIGHT,
-    NOT_CONTRAST_PIXELS_WEIGHT,
-};
-
-// return 0 - equal, 1 - for contrast, 2 for no contrast (PIX_PAIR_SCORE is defined accordingly)
-static inline int FNAME(pixelcmp)(PIXEL p1, PIXEL p2)
-{
-    int diff, any_different;
-
-    diff = GET_r(p1) - GET_r(p2);
-    any_different = diff;
-    if (CONTRASTING(diff)) {
-        return 1;
-    }
-
-    diff = GET_g(p1) - GET_g(p2);
-    any_different |= diff;
-    if (CONTRASTING(diff)) {
-        return 1;
-    }
-
-    diff = GET_b(p1) - GET_b(p2);
-    any_different |= diff;
-    if (CONTRASTING(diff)) {
-        return 1;
-    }
-
-    if (!any_different) {
-        return 0;
-    } else {
-        return 2;
-    }
-}
-
-static inline double FNAME(pixels_square_score)(PIXEL *line1, PIXEL *line2)
-{
-    double ret;
-    int any_different = 0;
-    int cmp_res;
-    cmp_res = FNAME(pixelcmp)(*line1, line1[1]);
-    any_different |= cmp_res;
-    ret  = FNAME(PIX_PAIR_SCORE)[cmp_res];
-    cmp_res = FNAME(pixelcmp)(*line1, *line2);
-    any_different |= cmp_res;
-    ret += FNAME(PIX_PAIR_SCORE)[cmp_res];
-    cmp_res = FNAME(pixelcmp)(*line1, line2[1]);
-    any_different |= cmp_res;
-    ret += FNAME(PIX_PAIR_SCORE)[cmp_res];
-
-    // ignore squares where all pixels are identical
-    if (!any_different) {
-        ret = 0;
-    }
-
-    return ret;
-}
-
 static void FNAME(compute_lines_gradual_score)(PIXEL *lines, int width, int num_lines,
+                                               GradualClassifyFunc classify,
                                                double *o_samples_sum_score, int *o_num_samples)
 {
     int jump = (SAMPLE_JUMP % width) ? SAMPLE_JUMP : SAMPLE_JUMP - 1;
     PIXEL *cur_pix = lines + width / 2;
     PIXEL *bottom_pix;
     PIXEL *last_line = lines + (num_lines - 1) * width;
+    GradualSquares squares;
+    GradualCounts counts = { 0, 0, 0 };
+    unsigned int n = 0;
 
     if ((width <= 1) || (num_lines <= 1)) {
         *o_num_samples = 1;
@@ -130,7 +73,6 @@ static void FNAME(compute_lines_gradual_score)(PIXEL *lines, int width, int num_
         return;
     }
 
-    *o_samples_sum_score = 0;
     *o_num_samples = 0;
 
     while (cur_pix < last_line) {
@@ -138,11 +80,20 @@ static void FNAME(compute_lines_gradual_score)(PIXEL *lines, int width, int num_
             cur_pix--; // jump is bigger than 1 so we will not enter endless loop
         }
         bottom_pix = cur_pix + width;
-        (*o_samples_sum_score) += FNAME(pixels_square_score)(cur_pix, bottom_pix);
+        squares.pix[n] = EXPAND(cur_pix[0]);
+        squares.right[n] = EXPAND(cur_pix[1]);
+        squares.bottom[n] = EXPAND(bottom_pix[0]);
+        squares.bottom_right[n] = EXPAND(bottom_pix[1]);
+        if (++n == GRADUAL_BATCH_SIZE) {
+            gradual_classify(classify, &squares, n, CONTRAST_TH, &counts);
+            n = 0;
+        }
         (*o_num_samples)++;
         cur_pix += jump;
     }
+    gradual_classify(classify, &squares, n, CONTRAST_TH, &counts);
 
+    *o_samples_sum_score = gradual_counts_score(&counts);
     (*o_num_samples) *= 3;
 }
 
@@ -151,10 +102,9 @@ static void FNAME(compute_lines_gradual_score)(PIXEL *lines, int width, int num_
 #undef GET_r
 #undef GET_g
 #undef GET_b
+#undef EXPAND
 #undef RED_BITMAP_UTILS_RGB16
 #undef RED_BITMAP_UTILS_RGB24
 #undef RED_BITMAP_UTILS_RGB32
 #undef SAMPLE_JUMP
 #undef CONTRAST_TH
-#undef SAME_PIXEL_WEIGHT
-#undef NOT_CONTRAST_PIXELS_WEIGHT
@@ -22,13 +22,14 @@
 #error "Only spice.h can be included directly."
 #endif
 
+#include <sys/uio.h>
 #include "spice-core.h"
 
 /* char device interfaces */
 
 #define SPICE_INTERFACE_CHAR_DEVICE "char_device"
 #define SPICE_INTERFACE_CHAR_DEVICE_MAJOR 1
-#define SPICE_INTERFACE_CHAR_DEVICE_MINOR 3
+#define SPICE_INTERFACE_CHAR_DEVICE_MINOR 4
 typedef struct SpiceCharDeviceInterface SpiceCharDeviceInterface;
 typedef struct SpiceCharDeviceInstance SpiceCharDeviceInstance;
 typedef struct SpiceCharDeviceState SpiceCharDeviceState;
@@ -45,6 +46,17 @@ struct SpiceCharDeviceInterface {
     int (*read)(SpiceCharDeviceInstance *sin, uint8_t *buf, int len);
     void (*event)(SpiceCharDeviceInstance *sin, uint8_t event);
     spice_char_device_flags flags;
+
+    /* Since minor version 4, both optional. */
+
+    /* Writes several buffers at once, like writev(2). Returns the number of
+     * bytes written, which may end in the middle of a buffer, or <= 0 if
+     * nothing could be written. When set it is used instead of write(). */
+    int (*writev)(SpiceCharDeviceInstance *sin, const struct iovec *iov, int iovcnt);
+    /* Returns the file descriptor the device writes to, or -1. The server
+     * waits for it to become writable to retry the writes that could not
+     * complete. It must stay valid as long as the instance is attached. */
+    int (*get_write_fd)(SpiceCharDeviceInstance *sin);
 };
 
 struct SpiceCharDeviceInstance {
@@ -23,14 +23,17 @@
 #endif
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #ifdef USE_LZ4
 #include <lz4.h>
+#include <lz4hc.h>
 #endif
 
 #include <common/generated_server_marshallers.h>
 
 #include "char-device.h"
+#include "compress-bypass.h"
 #include "red-channel.h"
 #include "red-channel-client.h"
 #include "reds.h"
@@ -43,6 +46,7 @@
 /* 64K should be enough for all but the largest writes + 32 bytes hdr */
 #define BUF_SIZE (64 * 1024 + 32)
 #define COMPRESS_THRESHOLD 1000
+#define COMPRESS_MAX_HC_LEVEL 12
 
 typedef struct RedVmcChannel RedVmcChannel;
 typedef struct RedVmcChannelClass RedVmcChannelClass;
@@ -117,6 +121,15 @@ struct RedVmcChannel
     RedStatCounter out_data;
     RedStatCounter out_compressed;
     RedStatCounter out_uncompressed;
+    RedStatCounter out_bypassed;
+    RedStatCounter compress_time;
+
+    /* skips compressing after poor results, which cost as much as good ones */
+    bool use_adaptive_compression;
+    CompressBypass compress_bypass;
+    /* LZ4 HC compresses better, in the same format, for more CPU time */
+    int lz4_hc_level;
+    void *lz4_hc_state;
 };
 
 struct RedVmcChannelClass
@@ -241,9 +254,16 @@ red_vmc_channel_constructed(GObject *object)
     stat_init_counter(&self->out_data, reds, stat, "out_data", TRUE);
     stat_init_counter(&self->out_compressed, reds, stat, "out_compressed", TRUE);
     stat_init_counter(&self->out_uncompressed, reds, stat, "out_uncompressed", TRUE);
+    stat_init_counter(&self->out_bypassed, reds, stat, "out_bypassed", TRUE);
+    stat_init_counter(&self->compress_time, reds, stat, "compress_ns", TRUE);
 
 #ifdef USE_LZ4
     red_channel_set_cap(RED_CHANNEL(self), SPICE_SPICEVMC_CAP_DATA_COMPRESS_LZ4);
+    self->use_adaptive_compression = spice_env_get_bool("SPICE_VMC_ADAPTIVE_COMPRESSION",
+                                                        FALSE);
+    /* 0 keeps the default LZ4 */
+    self->lz4_hc_level = spice_env_get_uint("SPICE_VMC_LZ4_HC_LEVEL", 0,
+                                            0, COMPRESS_MAX_HC_LEVEL);
 #endif
 
     red_channel_init_outgoing_messages_window(RED_CHANNEL(self));
@@ -265,6 +285,7 @@ red_vmc_channel_finalize(GObject *object)
     if (self->pipe_item) {
         red_pipe_item_unref(&self->pipe_item->base);
     }
+    free(self->lz4_hc_state);
 
     G_OBJECT_CLASS(red_vmc_channel_parent_class)->finalize(object);
 }
@@ -321,17 +342,49 @@ static void spicevmc_red_channel_release_msg_rcv_buf(RedChannelClient *rcc,
                                                      uint16_t type,
                                                      uint32_t size,
                                                      uint8_t *msg);
+#ifdef USE_LZ4
+static int compress_lz4(RedVmcChannel *channel, const uint8_t *src, uint8_t *dest, int n)
+{
+    if (channel->lz4_hc_level > 0) {
+        /* the HC state is too big for the stack, and to be allocated for each read */
+        if (!channel->lz4_hc_state) {
+            channel->lz4_hc_state = spice_malloc(LZ4_sizeofStateHC());
+        }
+        return LZ4_compress_HC_extStateHC(channel->lz4_hc_state, (const char*)src,
+                                          (char*)dest, n, BUF_SIZE, channel->lz4_hc_level);
+    }
+    return LZ4_compress_default((const char*)src, (char*)dest, n, BUF_SIZE);
+}
+
+/* whether the adaptive compression skips this read */
+static bool compress_bypassed(RedVmcChannel *channel, int n)
+{
+    if (!channel->use_adaptive_compression || !compress_bypass_skip(&channel->compress_bypass)) {
+        return FALSE;
+    }
+    stat_inc_counter(channel->out_bypassed, n);
+    return TRUE;
+}
+
+static void compress_update_bypass(RedVmcChannel *channel, int n, int compressed_data_count)
+{
+    if (!channel->use_adaptive_compression) {
+        return;
+    }
+    compress_bypass_update(&channel->compress_bypass, n, compressed_data_count);
+}
+
 /* n is the data size (uncompressed)
  * msg_item -- the current pipe item with the uncompressed data
  * This function returns:
  *  - NULL upon failure.
  *  - a new pipe item with the compressed data in it upon success
  */
-#ifdef USE_LZ4
 static RedVmcPipeItem* try_compress_lz4(RedVmcChannel *channel, int n, RedVmcPipeItem *msg_item)
 {
     RedVmcPipeItem *msg_item_compressed;
     int compressed_data_count;
+    RedStatTimer timer;
 
     if (reds_stream_get_family(red_channel_client_get_stream(channel->rcc)) == AF_UNIX) {
         /* AF_LOCAL - data will not be compressed */
@@ -345,12 +398,15 @@ static RedVmcPipeItem* try_compress_lz4(RedVmcChannel *channel, int n, RedVmcPip
         /* Client doesn't have compression cap - data will not be compressed */
         return NULL;
     }
+    if (compress_bypassed(channel, n)) {
+        return NULL;
+    }
     msg_item_compressed = spice_new0(RedVmcPipeItem, 1);
     red_pipe_item_init(&msg_item_compressed->base, RED_PIPE_ITEM_TYPE_SPICEVMC_DATA);
-    compressed_data_count = LZ4_compress_default((char*)&msg_item->buf,
-                                                 (char*)&msg_item_compressed->buf,
-                                                 n,
-                                                 BUF_SIZE);
+    stat_timer_start(&timer);
+    compressed_data_count = compress_lz4(channel, msg_item->buf, msg_item_compressed->buf, n);
+    stat_timer_add(channel->compress_time, &timer);
+    compress_update_bypass(channel, n, compressed_data_count);
 
     if (compressed_data_count > 0 && compressed_data_count < n) {
         stat_inc_counter(channel->out_uncompressed, n);
@@ -821,6 +877,7 @@ static void spicevmc_connect(RedChannel *channel, RedClient *client,
         return;
     }
     vmc_channel->rcc = rcc;
+    compress_bypass_reset(&vmc_channel->compress_bypass);
     red_channel_client_ack_zero_messages_window(rcc);
 
     if (strcmp(sin->subtype, "port") == 0) {
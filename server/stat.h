@@ -79,6 +79,16 @@ stat_inc_counter(RedStatCounter counter, uint64_t value)
 #endif
 }
 
+static inline void
+stat_set_counter(RedStatCounter counter, uint64_t value)
+{
+#ifdef RED_STATISTICS
+    if (counter.counter) {
+        *(counter.counter) = value;
+    }
+#endif
+}
+
 typedef uint64_t stat_time_t;
 
 static inline stat_time_t stat_now(clockid_t clock_id)
@@ -89,6 +99,31 @@ static inline stat_time_t stat_now(clockid_t clock_id)
     return ts.tv_nsec + (uint64_t) ts.tv_sec * (1000 * 1000 * 1000);
 }
 
+/* Accumulates the time spent in a stage into a counter, in ns */
+typedef struct {
+#ifdef RED_STATISTICS
+    stat_time_t start;
+#else
+    /* empty structs are a GNU extension */
+    char unused;
+#endif
+} RedStatTimer;
+
+static inline void stat_timer_start(G_GNUC_UNUSED RedStatTimer *timer)
+{
+#ifdef RED_STATISTICS
+    timer->start = stat_now(CLOCK_MONOTONIC);
+#endif
+}
+
+static inline void stat_timer_add(G_GNUC_UNUSED RedStatCounter counter,
+                                  G_GNUC_UNUSED const RedStatTimer *timer)
+{
+#ifdef RED_STATISTICS
+    stat_inc_counter(counter, stat_now(CLOCK_MONOTONIC) - timer->start);
+#endif
+}
+
 typedef struct {
 #if defined(RED_WORKER_STAT) || defined(COMPRESS_STAT)
     stat_time_t time;
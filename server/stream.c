@@ -44,7 +44,8 @@ static void stream_agent_stats_print(StreamAgent *agent)
                 "out/in=%.2f #drops=%"PRIu64" (#pipe=%"PRIu64" #fps=%"PRIu64") out-avg-fps=%.2f "
                 "passed-mm-time(sec)=%.2f size-total(MB)=%.2f size-per-sec(Mbps)=%.2f "
                 "size-per-frame(KBpf)=%.2f avg-quality=%.2f "
-                "start-bit-rate(Mbps)=%.2f end-bit-rate(Mbps)=%.2f",
+                "start-bit-rate(Mbps)=%.2f end-bit-rate(Mbps)=%.2f "
+                "#unchanged-frames=%"PRIu64" avg-change=%.2f",
                 agent, agent->stream->width, agent->stream->height,
                 stats->num_input_frames,
                 stats->num_input_frames / passed_mm_time,
@@ -61,7 +62,9 @@ static void stream_agent_stats_print(StreamAgent *agent)
                 stats->size_sent / 1000.0 / stats->num_frames_sent,
                 encoder_stats.avg_quality,
                 encoder_stats.starting_bit_rate / (1024.0 * 1024),
-                encoder_stats.cur_bit_rate / (1024.0 * 1024));
+                encoder_stats.cur_bit_rate / (1024.0 * 1024),
+                stats->num_unchanged_frames,
+                stats->change_ratio_sum / stats->num_input_frames);
 #endif
 }
 
@@ -278,33 +281,173 @@ static bool is_next_stream_frame(DisplayChannel *display,
     return TRUE;
 }
 
-static void attach_stream(DisplayChannel *display, Drawable *drawable, Stream *stream)
+static void stream_update_input_fps(Stream *stream, red_time_t frame_time)
 {
-    DisplayChannelClient *dcc;
-    GListIter iter;
+    stream->last_time = frame_time;
 
-    spice_assert(drawable && stream);
-    spice_assert(!drawable->stream && !stream->current);
-    stream->current = drawable;
-    drawable->stream = stream;
-    stream->last_time = drawable->creation_time;
-
-    uint64_t duration = drawable->creation_time - stream->input_fps_start_time;
+    uint64_t duration = frame_time - stream->input_fps_start_time;
     if (duration >= RED_STREAM_INPUT_FPS_TIMEOUT) {
         /* Round to the nearest integer, for instance 24 for 23.976 */
         stream->input_fps = ((uint64_t)stream->num_input_frames * 1000 * 1000 * 1000 + duration / 2) / duration;
         spice_debug("input-fps=%u", stream->input_fps);
         stream->num_input_frames = 0;
-        stream->input_fps_start_time = drawable->creation_time;
+        stream->input_fps_start_time = frame_time;
     } else {
         stream->num_input_frames++;
     }
+}
+
+static int stream_bitmap_get_bytes_per_pixel(const SpiceBitmap *bitmap)
+{
+    switch (bitmap->format) {
+    case SPICE_BITMAP_FMT_16BIT:
+        return 2;
+    case SPICE_BITMAP_FMT_24BIT:
+        return 3;
+    case SPICE_BITMAP_FMT_32BIT:
+    case SPICE_BITMAP_FMT_RGBA:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+/* The line of the frame @y lines below its top, see VideoEncoder::encode_frame() */
+static const uint8_t *stream_frame_get_line(const SpiceCopy *copy, int bpp, int y)
+{
+    const SpiceBitmap *bitmap = &copy->src_bitmap->u.bitmap;
+    int line = copy->src_area.top + y;
+
+    if (!(bitmap->flags & SPICE_BITMAP_FLAGS_TOP_DOWN)) {
+        line = bitmap->y - 1 - line;
+    }
+    return bitmap->data->chunk[0].data + (size_t)line * bitmap->stride +
+           copy->src_area.left * bpp;
+}
+
+static bool stream_frames_can_compare(const RedDrawable *prev, const RedDrawable *frame)
+{
+    const SpiceCopy *copy = &frame->u.copy;
+    const SpiceCopy *prev_copy = &prev->u.copy;
+    const SpiceBitmap *bitmap, *prev_bitmap;
+
+    if (copy->src_bitmap->descriptor.type != SPICE_IMAGE_TYPE_BITMAP ||
+        prev_copy->src_bitmap->descriptor.type != SPICE_IMAGE_TYPE_BITMAP ||
+        !rect_is_equal(&frame->bbox, &prev->bbox) ||
+        copy->src_area.right - copy->src_area.left !=
+            prev_copy->src_area.right - prev_copy->src_area.left ||
+        copy->src_area.bottom - copy->src_area.top !=
+            prev_copy->src_area.bottom - prev_copy->src_area.top) {
+        return FALSE;
+    }
+
+    bitmap = &copy->src_bitmap->u.bitmap;
+    prev_bitmap = &prev_copy->src_bitmap->u.bitmap;
+    return bitmap->format == prev_bitmap->format &&
+           stream_bitmap_get_bytes_per_pixel(bitmap) != 0 &&
+           bitmap->data->num_chunks == 1 && prev_bitmap->data->num_chunks == 1;
+}
+
+/* Sets @damage to the blocks of @frame that differ from @prev, relative to
+ * the top-left corner of the frame. Blocks of STREAM_DAMAGE_BLOCK_SIZE
+ * pixels match the macroblocks of the video codecs. */
+void stream_frame_get_damage(const RedDrawable *prev, const RedDrawable *frame,
+                             QRegion *damage)
+{
+    const SpiceCopy *copy = &frame->u.copy;
+    const SpiceCopy *prev_copy = &prev->u.copy;
+    int width = copy->src_area.right - copy->src_area.left;
+    int height = copy->src_area.bottom - copy->src_area.top;
+    SpiceRect rect;
+    int bpp, x, y;
+
+    region_clear(damage);
+    if (!stream_frames_can_compare(prev, frame)) {
+        rect.left = rect.top = 0;
+        rect.right = width;
+        rect.bottom = height;
+        region_add(damage, &rect);
+        return;
+    }
+
+    bpp = stream_bitmap_get_bytes_per_pixel(&copy->src_bitmap->u.bitmap);
+    for (rect.top = 0; rect.top < height; rect.top = rect.bottom) {
+        rect.bottom = MIN(rect.top + STREAM_DAMAGE_BLOCK_SIZE, height);
+        /* the consecutive damaged blocks of a row make a single rectangle */
+        rect.left = -1;
+        for (x = 0; x < width; x += STREAM_DAMAGE_BLOCK_SIZE) {
+            int block_width = MIN(STREAM_DAMAGE_BLOCK_SIZE, width - x);
+            bool changed = FALSE;
+
+            for (y = rect.top; y < rect.bottom && !changed; y++) {
+                changed = memcmp(stream_frame_get_line(prev_copy, bpp, y) + x * bpp,
+                                 stream_frame_get_line(copy, bpp, y) + x * bpp,
+                                 block_width * bpp) != 0;
+            }
+            if (changed) {
+                if (rect.left < 0) {
+                    rect.left = x;
+                }
+                rect.right = x + block_width;
+            } else if (rect.left >= 0) {
+                region_add(damage, &rect);
+                rect.left = -1;
+            }
+        }
+        if (rect.left >= 0) {
+            region_add(damage, &rect);
+        }
+    }
+}
+
+/* The clients see the next frame as a change of the whole area */
+static void stream_agent_damage_all(StreamAgent *agent)
+{
+    SpiceRect area = {
+        .left = 0,
+        .top = 0,
+        .right = agent->stream->width,
+        .bottom = agent->stream->height,
+    };
+
+    region_clear(&agent->damage);
+    region_add(&agent->damage, &area);
+}
+
+/* @prev is the frame @drawable replaces, if any */
+static void attach_stream(DisplayChannel *display, Drawable *drawable, Stream *stream,
+                          Drawable *prev)
+{
+    DisplayChannelClient *dcc;
+    GListIter iter;
+    SpiceRect *src_area = &drawable->red_drawable->u.copy.src_area;
+    QRegion damage;
+    double change_ratio = 1.0;
+
+    spice_assert(drawable && stream);
+    spice_assert(!drawable->stream && !stream->current);
+    stream->current = drawable;
+    drawable->stream = stream;
+    stream_update_input_fps(stream, drawable->creation_time);
+
+    region_init(&damage);
+    if (prev) {
+        stream_frame_get_damage(prev->red_drawable, drawable->red_drawable, &damage);
+        change_ratio = video_encoder_get_damage_ratio(&damage,
+                                                      src_area->right - src_area->left,
+                                                      src_area->bottom - src_area->top);
+    }
 
     FOREACH_DCC(display, iter, dcc) {
         StreamAgent *agent;
         QRegion clip_in_draw_dest;
 
         agent = dcc_get_stream_agent(dcc, display_channel_get_stream_id(display, stream));
+        if (prev) {
+            region_or(&agent->damage, &damage);
+        } else {
+            stream_agent_damage_all(agent);
+        }
         region_or(&agent->vis_region, &drawable->tree_item.base.rgn);
 
         region_init(&clip_in_draw_dest);
@@ -319,8 +462,13 @@ static void attach_stream(DisplayChannel *display, Drawable *drawable, Stream *s
         region_destroy(&clip_in_draw_dest);
 #ifdef STREAM_STATS
         agent->stats.num_input_frames++;
+        agent->stats.change_ratio_sum += change_ratio;
+        if (prev && region_is_empty(&damage)) {
+            agent->stats.num_unchanged_frames++;
+        }
 #endif
     }
+    region_destroy(&damage);
 }
 
 void stream_detach_drawable(Stream *stream)
@@ -331,6 +479,15 @@ void stream_detach_drawable(Stream *stream)
     stream->current = NULL;
 }
 
+bool stream_frame_is_sized(Stream *stream, Drawable *drawable)
+{
+    SpiceCopy *copy = &drawable->red_drawable->u.copy;
+
+    return (copy->src_area.right - copy->src_area.left != stream->width) ||
+           (copy->src_area.bottom - copy->src_area.top != stream->height) ||
+           !rect_is_equal(&drawable->red_drawable->bbox, &stream->dest_area);
+}
+
 static void before_reattach_stream(DisplayChannel *display,
                                    Stream *stream, Drawable *new_frame)
 {
@@ -403,6 +560,7 @@ static void display_channel_create_stream(DisplayChannel *display, Drawable *dra
     stream->refs = 1;
     SpiceBitmap *bitmap = &drawable->red_drawable->u.copy.src_bitmap->u.bitmap;
     stream->top_down = !!(bitmap->flags & SPICE_BITMAP_FLAGS_TOP_DOWN);
+    stream->gl_scanout = FALSE;
     drawable->stream = stream;
     /* Provide an fps estimate the video encoder can use when initializing
      * based on the frames that lead to the creation of the stream. Round to
@@ -484,12 +642,14 @@ void stream_trace_update(DisplayChannel *display, Drawable *drawable)
                                                   stream,
                                                   TRUE);
         if (is_next_frame) {
-            if (stream->current) {
-                stream->current->streamable = FALSE; //prevent item trace
+            Drawable *prev = stream->current;
+
+            if (prev) {
+                prev->streamable = FALSE; //prevent item trace
                 before_reattach_stream(display, stream, drawable);
                 stream_detach_drawable(stream);
             }
-            attach_stream(display, drawable, stream);
+            attach_stream(display, drawable, stream, prev);
             return;
         }
     }
@@ -530,7 +690,7 @@ void stream_maintenance(DisplayChannel *display,
             before_reattach_stream(display, stream, candidate);
             stream_detach_drawable(stream);
             prev->streamable = FALSE; //prevent item trace
-            attach_stream(display, candidate, stream);
+            attach_stream(display, candidate, stream, prev);
         }
     } else if (candidate->streamable) {
         SpiceRect* prev_src = &prev->red_drawable->u.copy.src_area;
@@ -683,12 +843,26 @@ static void bitmap_unref(gpointer data)
     red_drawable_unref(red_drawable);
 }
 
+static void gl_frame_ref(gpointer data)
+{
+    gl_readback_frame_ref(data);
+}
+
+static void gl_frame_unref(gpointer data)
+{
+    gl_readback_frame_unref(data);
+}
+
 /* A helper for dcc_create_stream(). */
 static VideoEncoder* dcc_create_video_encoder(DisplayChannelClient *dcc,
+                                              Stream *stream,
                                               uint64_t starting_bit_rate,
                                               VideoEncoderRateControlCbs *cbs)
 {
     RedChannelClient *rcc = RED_CHANNEL_CLIENT(dcc);
+    /* the frames of the GL scanout are not drawables */
+    bitmap_ref_t frame_ref = stream->gl_scanout ? gl_frame_ref : bitmap_ref;
+    bitmap_unref_t frame_unref = stream->gl_scanout ? gl_frame_unref : bitmap_unref;
     bool client_has_multi_codec = red_channel_client_test_remote_cap(rcc, SPICE_DISPLAY_CAP_MULTI_CODEC);
     int i;
     GArray *video_codecs;
@@ -708,7 +882,7 @@ static VideoEncoder* dcc_create_video_encoder(DisplayChannelClient *dcc,
             continue;
         }
 
-        VideoEncoder* video_encoder = video_codec->create(video_codec->type, starting_bit_rate, cbs, bitmap_ref, bitmap_unref);
+        VideoEncoder* video_encoder = video_codec->create(video_codec->type, starting_bit_rate, cbs, frame_ref, frame_unref);
         if (video_encoder) {
             return video_encoder;
         }
@@ -716,7 +890,7 @@ static VideoEncoder* dcc_create_video_encoder(DisplayChannelClient *dcc,
 
     /* Try to use the builtin MJPEG video encoder as a fallback */
     if (!client_has_multi_codec || red_channel_client_test_remote_cap(rcc, SPICE_DISPLAY_CAP_CODEC_MJPEG)) {
-        return mjpeg_encoder_new(SPICE_VIDEO_CODEC_TYPE_MJPEG, starting_bit_rate, cbs, bitmap_ref, bitmap_unref);
+        return mjpeg_encoder_new(SPICE_VIDEO_CODEC_TYPE_MJPEG, starting_bit_rate, cbs, frame_ref, frame_unref);
     }
 
     return NULL;
@@ -734,6 +908,8 @@ void dcc_create_stream(DisplayChannelClient *dcc, Stream *stream)
     }
     agent->fps = MAX_FPS;
     agent->dcc = dcc;
+    memset(&agent->gl_lost_area, 0, sizeof(agent->gl_lost_area));
+    stream_agent_damage_all(agent);
 
     VideoEncoderRateControlCbs video_cbs;
     video_cbs.opaque = agent;
@@ -742,7 +918,7 @@ void dcc_create_stream(DisplayChannelClient *dcc, Stream *stream)
     video_cbs.update_client_playback_delay = update_client_playback_delay;
 
     uint64_t initial_bit_rate = get_initial_bit_rate(dcc, stream);
-    agent->video_encoder = dcc_create_video_encoder(dcc, initial_bit_rate, &video_cbs);
+    agent->video_encoder = dcc_create_video_encoder(dcc, stream, initial_bit_rate, &video_cbs);
     red_channel_client_pipe_add(RED_CHANNEL_CLIENT(dcc), stream_create_item_new(agent));
 
     if (red_channel_client_test_remote_cap(RED_CHANNEL_CLIENT(dcc), SPICE_DISPLAY_CAP_STREAM_REPORT)) {
@@ -921,6 +1097,7 @@ void stream_detach_and_stop(DisplayChannel *display)
         detach_stream_gracefully(display, stream, NULL);
         stream_stop(display, stream);
     }
+    gl_stream_stop(display);
 }
 
 void stream_timeout(DisplayChannel *display)
@@ -959,3 +1136,235 @@ void stream_trace_add_drawable(DisplayChannel *display, Drawable *item)
     trace->height = src_area->bottom - src_area->top;
     trace->dest_area = item->red_drawable->bbox;
 }
+
+static void gl_stream_frame_item_release(RedPipeItem *base)
+{
+    RedGlStreamFrameItem *item = SPICE_UPCAST(RedGlStreamFrameItem, base);
+    DisplayChannel *display = DCC_TO_DC(item->agent->dcc);
+
+    if (item->agent->gl_frame_item == base) {
+        item->agent->gl_frame_item = NULL;
+    }
+    gl_readback_frame_unref(item->frame);
+    stream_agent_unref(display, item->agent);
+    free(item);
+}
+
+static RedPipeItem *gl_stream_frame_item_new(StreamAgent *agent, GlReadbackFrame *frame)
+{
+    RedGlStreamFrameItem *item = spice_new(RedGlStreamFrameItem, 1);
+
+    red_pipe_item_init_full(&item->base, RED_PIPE_ITEM_TYPE_GL_STREAM_FRAME,
+                            gl_stream_frame_item_release);
+    agent->stream->refs++;
+    item->agent = agent;
+    item->frame = gl_readback_frame_ref(frame);
+    item->mm_time = reds_get_mm_time();
+    return &item->base;
+}
+
+/* Drops the frame still waiting to be sent, the next one covers it */
+static bool gl_stream_agent_drop_frame(StreamAgent *agent, SpiceRect *area)
+{
+    RedChannelClient *rcc = RED_CHANNEL_CLIENT(agent->dcc);
+    RedGlStreamFrameItem *item;
+
+    if (!agent->gl_frame_item || !red_channel_client_pipe_item_is_linked(rcc, agent->gl_frame_item)) {
+        return FALSE;
+    }
+    item = SPICE_UPCAST(RedGlStreamFrameItem, agent->gl_frame_item);
+    if (area) {
+        rect_union(area, &item->frame->area);
+    }
+    red_channel_client_pipe_remove_and_release(rcc, agent->gl_frame_item);
+#ifdef STREAM_STATS
+    agent->stats.num_drops_pipe++;
+#endif
+    return TRUE;
+}
+
+/* Records the area of a frame that did not reach the client, the scanout
+ * frames only cover what was drawn so it would stay stale otherwise */
+void gl_stream_agent_frame_lost(StreamAgent *agent, const SpiceRect *area)
+{
+    if (rect_is_empty(&agent->gl_lost_area)) {
+        agent->gl_lost_area = *area;
+    } else {
+        rect_union(&agent->gl_lost_area, area);
+    }
+}
+
+static void gl_stream_start(DisplayChannel *display, const SpiceRect *area, bool top_down)
+{
+    DisplayChannelClient *dcc;
+    GListIter iter;
+    Stream *stream;
+
+    if (!(stream = display_channel_stream_try_new(display))) {
+        return;
+    }
+
+    stream->current = NULL;
+    stream->last_time = spice_get_monotonic_time_ns();
+    stream->width = area->right - area->left;
+    stream->height = area->bottom - area->top;
+    stream->dest_area = *area;
+    stream->refs = 1;
+    stream->top_down = top_down;
+    stream->gl_scanout = TRUE;
+    stream->input_fps = MAX_FPS;
+    stream->num_input_frames = 0;
+    stream->input_fps_start_time = stream->last_time;
+    display->priv->streams_size_total += stream->width * stream->height;
+    display->priv->stream_count++;
+    display->priv->gl_stream = stream;
+    FOREACH_DCC(display, iter, dcc) {
+        if (dcc_gl_scanout_is_streamed(dcc)) {
+            dcc_create_stream(dcc, stream);
+        }
+    }
+    display->priv->gl_stream_full_frame = TRUE;
+    spice_debug("GL scanout stream %d %dx%d",
+                display_channel_get_stream_id(display, stream),
+                stream->width, stream->height);
+}
+
+void gl_stream_stop(DisplayChannel *display)
+{
+    Stream *stream = display->priv->gl_stream;
+    DisplayChannelClient *dcc;
+    GListIter iter;
+
+    if (!stream) {
+        return;
+    }
+
+    spice_debug("GL scanout stream %d", display_channel_get_stream_id(display, stream));
+    FOREACH_DCC(display, iter, dcc) {
+        StreamAgent *agent;
+
+        if (!dcc_gl_scanout_is_streamed(dcc)) {
+            continue;
+        }
+        agent = dcc_get_stream_agent(dcc, display_channel_get_stream_id(display, stream));
+        gl_stream_agent_drop_frame(agent, NULL);
+        red_channel_client_pipe_add(RED_CHANNEL_CLIENT(dcc), stream_destroy_item_new(agent));
+        stream_agent_stats_print(agent);
+    }
+    display->priv->streams_size_total -= stream->width * stream->height;
+    display->priv->gl_stream = NULL;
+    stream_unref(display, stream);
+}
+
+void dcc_create_gl_stream(DisplayChannelClient *dcc)
+{
+    DisplayChannel *display = DCC_TO_DC(dcc);
+
+    if (display->priv->gl_stream && dcc_gl_scanout_is_streamed(dcc)) {
+        dcc_create_stream(dcc, display->priv->gl_stream);
+        /* the client has yet to see the scanout */
+        display->priv->gl_stream_full_frame = TRUE;
+    }
+}
+
+/* Copies the damaged area of the scanout and queues it for the streamed
+ * clients. Only the copy happens here so the draw can be completed right
+ * away, the frames are encoded when they are sent. */
+void gl_stream_draw(DisplayChannel *display, GlReadback *readback,
+                    const SpiceMsgDisplayGlDraw *draw)
+{
+    RedSurface *surface = display_channel_get_surface(display, 0);
+    DisplayChannelClient *dcc;
+    GListIter iter;
+    GlReadbackFrame *frame;
+    SpiceRect scanout_area, area, damage;
+    bool full_frame = display->priv->gl_stream_full_frame;
+    Stream *stream;
+    int stream_id;
+
+    /* the frames are drawn on the primary surface */
+    if (!surface || !surface->context.canvas) {
+        return;
+    }
+    gl_readback_get_area(readback, &scanout_area);
+    scanout_area.right = MIN(scanout_area.right, surface->context.width);
+    scanout_area.bottom = MIN(scanout_area.bottom, surface->context.height);
+
+    stream = display->priv->gl_stream;
+    if (stream && (!rect_is_equal(&stream->dest_area, &scanout_area) ||
+                   stream->top_down != gl_readback_is_top_down(readback))) {
+        gl_stream_stop(display);
+        stream = NULL;
+    }
+    if (!stream) {
+        gl_stream_start(display, &scanout_area, gl_readback_is_top_down(readback));
+        if (!(stream = display->priv->gl_stream)) {
+            return;
+        }
+        full_frame = TRUE;
+    }
+    stream_id = display_channel_get_stream_id(display, stream);
+
+    area.left = draw->x;
+    area.top = draw->y;
+    area.right = draw->x + draw->w;
+    area.bottom = draw->y + draw->h;
+    damage = area;
+    FOREACH_DCC(display, iter, dcc) {
+        StreamAgent *agent;
+
+        if (!dcc_gl_scanout_is_streamed(dcc)) {
+            continue;
+        }
+        agent = dcc_get_stream_agent(dcc, stream_id);
+        /* the frames cannot be smaller than the stream */
+        if (!red_channel_client_test_remote_cap(RED_CHANNEL_CLIENT(dcc),
+                                                SPICE_DISPLAY_CAP_SIZED_STREAM)) {
+            full_frame = TRUE;
+        }
+        /* Only the MJPEG frames are encoded on their own, the other codecs
+         * would have to be reconfigured for each new frame size */
+        if (agent->video_encoder &&
+            agent->video_encoder->codec_type != SPICE_VIDEO_CODEC_TYPE_MJPEG) {
+            full_frame = TRUE;
+        }
+        if (!rect_is_empty(&agent->gl_lost_area)) {
+            rect_union(&area, &agent->gl_lost_area);
+        }
+        gl_stream_agent_drop_frame(agent, &area);
+    }
+    if (full_frame) {
+        area = scanout_area;
+    }
+    rect_sect(&area, &scanout_area);
+
+    frame = gl_readback_read(readback, &area);
+    if (!frame) {
+        return;
+    }
+    /* the frames that only cover the damaged area are changed all over */
+    if (display->priv->gl_stream_full_frame || !rect_is_equal(&frame->area, &scanout_area)) {
+        damage = frame->area;
+    }
+    rect_sect(&damage, &frame->area);
+    rect_offset(&damage, -frame->area.left, -frame->area.top);
+    FOREACH_DCC(display, iter, dcc) {
+        StreamAgent *agent;
+
+        if (!dcc_gl_scanout_is_streamed(dcc)) {
+            continue;
+        }
+        agent = dcc_get_stream_agent(dcc, stream_id);
+        region_add(&agent->damage, &damage);
+        memset(&agent->gl_lost_area, 0, sizeof(agent->gl_lost_area));
+        agent->gl_frame_item = gl_stream_frame_item_new(agent, frame);
+        red_channel_client_pipe_add(RED_CHANNEL_CLIENT(dcc), agent->gl_frame_item);
+#ifdef STREAM_STATS
+        agent->stats.num_input_frames++;
+#endif
+    }
+    gl_readback_frame_unref(frame);
+
+    display->priv->gl_stream_full_frame = FALSE;
+    stream_update_input_fps(stream, spice_get_monotonic_time_ns());
+}
@@ -23,6 +23,7 @@
 #include <common/region.h>
 
 #include "utils.h"
+#include "gl-readback.h"
 #include "video-encoder.h"
 #include "red-channel.h"
 #include "dcc.h"
@@ -56,6 +57,11 @@ typedef struct StreamStats {
     uint64_t num_drops_fps;
     uint64_t num_frames_sent;
     uint64_t num_input_frames;
+    /* the input frames identical to the previous one */
+    uint64_t num_unchanged_frames;
+    /* the sum of the changed parts of the input frames, see
+     * video_encoder_get_damage_ratio() */
+    double change_ratio_sum;
     uint64_t size_sent;
 
     uint64_t start;
@@ -81,6 +87,14 @@ typedef struct StreamAgent {
 
     uint32_t report_id;
     uint32_t client_required_latency;
+    /* the GL scanout frame waiting in the pipe, if any */
+    RedPipeItem *gl_frame_item;
+    /* the area of the GL scanout frames the client did not get, read again
+     * with the next frame, empty if none */
+    SpiceRect gl_lost_area;
+    /* the parts of the frames that changed since the last frame the video
+     * encoder took, relative to the top-left corner of the frames */
+    QRegion damage;
 #ifdef STREAM_STATS
     StreamStats stats;
 #endif
@@ -95,6 +109,13 @@ typedef struct RedStreamClipItem {
 
 RedStreamClipItem *   red_stream_clip_item_new                      (StreamAgent *agent);
 
+typedef struct RedGlStreamFrameItem {
+    RedPipeItem base;
+    StreamAgent *agent;
+    GlReadbackFrame *frame;
+    uint32_t mm_time;
+} RedGlStreamFrameItem;
+
 typedef struct StreamCreateDestroyItem {
     RedPipeItem base;
     StreamAgent *agent;
@@ -119,6 +140,8 @@ struct Stream {
     int height;
     SpiceRect dest_area;
     int top_down;
+    /* fed from the GL scanout rather than from drawables */
+    bool gl_scanout;
     Stream *next;
     RingItem link;
 
@@ -149,6 +172,22 @@ void                  stream_agent_unref                            (DisplayChan
                                                                      StreamAgent *agent);
 void                  stream_agent_stop                             (StreamAgent *agent);
 
+/* The GL scanout is streamed to the clients that cannot import its dmabuf,
+ * see dcc_gl_scanout_is_streamed() */
+void                  gl_stream_draw                                (DisplayChannel *display,
+                                                                     GlReadback *readback,
+                                                                     const SpiceMsgDisplayGlDraw *draw);
+void                  gl_stream_stop                                (DisplayChannel *display);
+void                  gl_stream_agent_frame_lost                    (StreamAgent *agent,
+                                                                     const SpiceRect *area);
+
 void stream_detach_drawable(Stream *stream);
+/* Whether @drawable, a frame of @stream, must be sent with its own size and
+ * position */
+bool stream_frame_is_sized(Stream *stream, Drawable *drawable);
+
+#define STREAM_DAMAGE_BLOCK_SIZE 16
+void stream_frame_get_damage(const RedDrawable *prev, const RedDrawable *frame,
+                             QRegion *damage);
 
 #endif /* STREAM_H_ */
@@ -0,0 +1,527 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <glib.h>
+#include <openssl/rsa.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include <spice/macros.h>
+#include <spice/protocol.h>
+#include <spice/enums.h>
+
+#include "replay-client.h"
+
+#define IMAGE_TYPE_NONE 256
+
+typedef struct ReplayClientStat {
+    uint64_t messages;
+    uint64_t bytes;
+} ReplayClientStat;
+
+typedef struct ReplayClientChannel {
+    int fd;
+    uint32_t ack_window;
+    uint32_t unacked;
+} ReplayClientChannel;
+
+struct ReplayClient {
+    pthread_t thread;
+    gint running;
+    ReplayClientChannel main;
+    ReplayClientChannel display;
+    uint8_t *buf;
+    uint32_t buf_size;
+
+    ReplayClientStat display_total;
+    ReplayClientStat video;
+    /* draws by type of their source image, IMAGE_TYPE_NONE for the others */
+    ReplayClientStat images[IMAGE_TYPE_NONE + 1];
+};
+
+static bool read_all(int fd, void *data, size_t size)
+{
+    uint8_t *pos = data;
+
+    while (size > 0) {
+        ssize_t n = read(fd, pos, size);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        pos += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool write_all(int fd, const void *data, size_t size)
+{
+    const uint8_t *pos = data;
+
+    while (size > 0) {
+        ssize_t n = write(fd, pos, size);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        pos += n;
+        size -= n;
+    }
+    return true;
+}
+
+static uint32_t read_u32(const uint8_t *data)
+{
+    uint32_t value;
+
+    memcpy(&value, data, sizeof(value));
+    return GUINT32_FROM_LE(value);
+}
+
+static bool send_message(ReplayClientChannel *channel, uint16_t type,
+                         const void *data, uint32_t size)
+{
+    SpiceMiniDataHeader header;
+
+    header.type = GUINT16_TO_LE(type);
+    header.size = GUINT32_TO_LE(size);
+    return write_all(channel->fd, &header, sizeof(header)) &&
+           write_all(channel->fd, data, size);
+}
+
+/* encrypts the empty password the server expects when authentication is
+ * disabled */
+static uint8_t *encrypt_ticket(const uint8_t *pub_key, int *size)
+{
+    const unsigned char *key = pub_key;
+    EVP_PKEY *pkey;
+    EVP_PKEY_CTX *ctx;
+    uint8_t *ticket = NULL;
+    size_t ticket_size;
+
+    pkey = d2i_PUBKEY(NULL, &key, SPICE_TICKET_PUBKEY_BYTES);
+    if (!pkey) {
+        return NULL;
+    }
+    ctx = EVP_PKEY_CTX_new(pkey, NULL);
+    if (ctx && EVP_PKEY_encrypt_init(ctx) > 0 &&
+        EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_OAEP_PADDING) > 0 &&
+        EVP_PKEY_encrypt(ctx, NULL, &ticket_size, (const unsigned char *)"", 1) > 0) {
+        ticket = g_malloc(ticket_size);
+        if (EVP_PKEY_encrypt(ctx, ticket, &ticket_size, (const unsigned char *)"", 1) > 0) {
+            *size = ticket_size;
+        } else {
+            g_free(ticket);
+            ticket = NULL;
+        }
+    }
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(pkey);
+    return ticket;
+}
+
+static bool link_channel(ReplayClientChannel *channel, uint8_t channel_type,
+                         uint32_t connection_id)
+{
+    SpiceLinkHeader header;
+    SpiceLinkMess mess;
+    SpiceLinkReply *reply;
+    SpiceLinkAuthMechanism auth;
+    uint32_t caps, result;
+    uint8_t *reply_data;
+    uint8_t *ticket;
+    int ticket_size;
+    bool ok = false;
+
+    caps = GUINT32_TO_LE((1 << SPICE_COMMON_CAP_PROTOCOL_AUTH_SELECTION) |
+                         (1 << SPICE_COMMON_CAP_AUTH_SPICE) |
+                         (1 << SPICE_COMMON_CAP_MINI_HEADER));
+    header.magic = GUINT32_TO_LE(SPICE_MAGIC);
+    header.major_version = GUINT32_TO_LE(SPICE_VERSION_MAJOR);
+    header.minor_version = GUINT32_TO_LE(SPICE_VERSION_MINOR);
+    header.size = GUINT32_TO_LE(sizeof(mess) + sizeof(caps));
+    mess.connection_id = GUINT32_TO_LE(connection_id);
+    mess.channel_type = channel_type;
+    mess.channel_id = 0;
+    mess.num_common_caps = GUINT32_TO_LE(1);
+    mess.num_channel_caps = 0;
+    mess.caps_offset = GUINT32_TO_LE(sizeof(mess));
+    if (!write_all(channel->fd, &header, sizeof(header)) ||
+        !write_all(channel->fd, &mess, sizeof(mess)) ||
+        !write_all(channel->fd, &caps, sizeof(caps))) {
+        return false;
+    }
+
+    if (!read_all(channel->fd, &header, sizeof(header)) ||
+        GUINT32_FROM_LE(header.magic) != SPICE_MAGIC ||
+        GUINT32_FROM_LE(header.size) < sizeof(SpiceLinkReply)) {
+        return false;
+    }
+    reply_data = g_malloc(GUINT32_FROM_LE(header.size));
+    if (!read_all(channel->fd, reply_data, GUINT32_FROM_LE(header.size))) {
+        goto end;
+    }
+    reply = (SpiceLinkReply *)reply_data;
+    if (GUINT32_FROM_LE(reply->error) != SPICE_LINK_ERR_OK) {
+        g_warning("link of channel %u failed: %u", channel_type, GUINT32_FROM_LE(reply->error));
+        goto end;
+    }
+
+    auth.auth_mechanism = GUINT32_TO_LE(SPICE_COMMON_CAP_AUTH_SPICE);
+    ticket = encrypt_ticket(reply->pub_key, &ticket_size);
+    if (!ticket) {
+        g_warning("failed to encrypt the ticket");
+        goto end;
+    }
+    ok = write_all(channel->fd, &auth, sizeof(auth)) &&
+         write_all(channel->fd, ticket, ticket_size) &&
+         read_all(channel->fd, &result, sizeof(result)) &&
+         GUINT32_FROM_LE(result) == SPICE_LINK_ERR_OK;
+    g_free(ticket);
+
+end:
+    g_free(reply_data);
+    return ok;
+}
+
+/* Reads a message of @channel in the buffer of @client and handles the
+ * messages common to all the channels */
+static bool read_message(ReplayClient *client, ReplayClientChannel *channel,
+                         uint16_t *type, uint32_t *size)
+{
+    SpiceMiniDataHeader header;
+
+    if (!read_all(channel->fd, &header, sizeof(header))) {
+        return false;
+    }
+    *type = GUINT16_FROM_LE(header.type);
+    *size = GUINT32_FROM_LE(header.size);
+    if (*size > client->buf_size) {
+        client->buf_size = MAX(*size, client->buf_size * 2);
+        client->buf = g_realloc(client->buf, client->buf_size);
+    }
+    if (!read_all(channel->fd, client->buf, *size)) {
+        return false;
+    }
+
+    switch (*type) {
+    case SPICE_MSG_SET_ACK: {
+        uint32_t generation;
+
+        if (*size < 2 * sizeof(uint32_t)) {
+            return false;
+        }
+        generation = GUINT32_TO_LE(read_u32(client->buf));
+        channel->ack_window = read_u32(client->buf + sizeof(uint32_t));
+        channel->unacked = 0;
+        return send_message(channel, SPICE_MSGC_ACK_SYNC, &generation, sizeof(generation));
+    }
+    case SPICE_MSG_PING: {
+        /* the pong is the id and timestamp of the ping */
+        if (*size < sizeof(uint32_t) + sizeof(uint64_t)) {
+            return false;
+        }
+        if (!send_message(channel, SPICE_MSGC_PONG, client->buf,
+                          sizeof(uint32_t) + sizeof(uint64_t))) {
+            return false;
+        }
+        break;
+    }
+    }
+
+    if (channel->ack_window && ++channel->unacked == channel->ack_window) {
+        channel->unacked = 0;
+        return send_message(channel, SPICE_MSGC_ACK, NULL, 0);
+    }
+    return true;
+}
+
+/* Returns the type of the source image of a draw message, or IMAGE_TYPE_NONE */
+static unsigned draw_image_type(uint16_t type, const uint8_t *data, uint32_t size)
+{
+    /* surface_id and box of the display base */
+    uint64_t pos = sizeof(uint32_t) + 4 * sizeof(int32_t);
+    uint32_t offset;
+
+    switch (type) {
+    case SPICE_MSG_DISPLAY_DRAW_COPY:
+    case SPICE_MSG_DISPLAY_DRAW_OPAQUE:
+    case SPICE_MSG_DISPLAY_DRAW_BLEND:
+    case SPICE_MSG_DISPLAY_DRAW_TRANSPARENT:
+    case SPICE_MSG_DISPLAY_DRAW_ALPHA_BLEND:
+    case SPICE_MSG_DISPLAY_DRAW_ROP3:
+        break;
+    default:
+        return IMAGE_TYPE_NONE;
+    }
+
+    if (pos + 1 > size) {
+        return IMAGE_TYPE_NONE;
+    }
+    if (data[pos++] == SPICE_CLIP_TYPE_RECTS) {
+        if (pos + sizeof(uint32_t) > size) {
+            return IMAGE_TYPE_NONE;
+        }
+        pos += sizeof(uint32_t) + read_u32(data + pos) * (uint64_t)(4 * sizeof(int32_t));
+    }
+    /* the source image is the first field of the drawing, after the alpha
+     * flags and value for alpha blend */
+    if (type == SPICE_MSG_DISPLAY_DRAW_ALPHA_BLEND) {
+        pos += 2;
+    }
+    if (pos + sizeof(uint32_t) > size) {
+        return IMAGE_TYPE_NONE;
+    }
+    /* the image descriptor starts with the 64 bit id of the image */
+    offset = read_u32(data + pos);
+    if (offset == 0 || offset + sizeof(uint64_t) + 1 > (uint64_t)size) {
+        return IMAGE_TYPE_NONE;
+    }
+    return data[offset + sizeof(uint64_t)];
+}
+
+static bool handle_display_message(ReplayClient *client)
+{
+    uint16_t type;
+    uint32_t size;
+    ReplayClientStat *stat;
+
+    if (!read_message(client, &client->display, &type, &size)) {
+        return false;
+    }
+
+    size += sizeof(SpiceMiniDataHeader);
+    client->display_total.messages++;
+    client->display_total.bytes += size;
+    if (type == SPICE_MSG_DISPLAY_STREAM_DATA || type == SPICE_MSG_DISPLAY_STREAM_DATA_SIZED) {
+        stat = &client->video;
+    } else {
+        stat = &client->images[draw_image_type(type, client->buf,
+                                               size - sizeof(SpiceMiniDataHeader))];
+    }
+    stat->messages++;
+    stat->bytes += size;
+    return true;
+}
+
+static bool handle_main_message(ReplayClient *client)
+{
+    uint16_t type;
+    uint32_t size;
+
+    return read_message(client, &client->main, &type, &size);
+}
+
+static bool replay_client_connect(ReplayClient *client)
+{
+    struct {
+        uint8_t pixmap_cache_id;
+        int64_t pixmap_cache_size;
+        uint8_t glz_dictionary_id;
+        int32_t glz_dictionary_window_size;
+    } SPICE_ATTR_PACKED display_init = {
+        .pixmap_cache_id = 1,
+        .pixmap_cache_size = GINT64_TO_LE(20 * 1024 * 1024),
+        .glz_dictionary_id = 1,
+        .glz_dictionary_window_size = GINT32_TO_LE(8 * 1024 * 1024),
+    };
+    uint16_t type;
+    uint32_t size;
+
+    if (!link_channel(&client->main, SPICE_CHANNEL_MAIN, 0)) {
+        return false;
+    }
+    /* the session id of the main channel links the other channels */
+    do {
+        if (!read_message(client, &client->main, &type, &size)) {
+            return false;
+        }
+    } while (type != SPICE_MSG_MAIN_INIT);
+    if (size < sizeof(uint32_t) ||
+        !link_channel(&client->display, SPICE_CHANNEL_DISPLAY, read_u32(client->buf))) {
+        return false;
+    }
+    return send_message(&client->display, SPICE_MSGC_DISPLAY_INIT,
+                        &display_init, sizeof(display_init));
+}
+
+static void *replay_client_thread(void *opaque)
+{
+    ReplayClient *client = opaque;
+    struct pollfd fds[2];
+
+    if (!replay_client_connect(client)) {
+        if (g_atomic_int_get(&client->running)) {
+            g_warning("benchmark client failed to connect");
+        }
+        return NULL;
+    }
+
+    fds[0].fd = client->main.fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = client->display.fd;
+    fds[1].events = POLLIN;
+    while (g_atomic_int_get(&client->running)) {
+        if (poll(fds, G_N_ELEMENTS(fds), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if ((fds[0].revents & (POLLIN | POLLHUP)) && !handle_main_message(client)) {
+            break;
+        }
+        if ((fds[1].revents & (POLLIN | POLLHUP)) && !handle_display_message(client)) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static bool add_channel_socket(SpiceServer *server, ReplayClientChannel *channel)
+{
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        return false;
+    }
+    if (spice_server_add_client(server, fds[0], 1) < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    channel->fd = fds[1];
+    return true;
+}
+
+ReplayClient *replay_client_new(SpiceServer *server)
+{
+    ReplayClient *client = g_new0(ReplayClient, 1);
+
+    client->main.fd = -1;
+    client->display.fd = -1;
+    client->running = TRUE;
+    if (!add_channel_socket(server, &client->main) ||
+        !add_channel_socket(server, &client->display) ||
+        pthread_create(&client->thread, NULL, replay_client_thread, client) != 0) {
+        client->running = FALSE;
+        replay_client_free(client);
+        return NULL;
+    }
+    return client;
+}
+
+void replay_client_stop(ReplayClient *client)
+{
+    if (!g_atomic_int_get(&client->running)) {
+        return;
+    }
+    g_atomic_int_set(&client->running, FALSE);
+    /* wakes up the thread if it is blocked reading */
+    shutdown(client->main.fd, SHUT_RDWR);
+    shutdown(client->display.fd, SHUT_RDWR);
+    pthread_join(client->thread, NULL);
+}
+
+static const char *image_type_name(unsigned type)
+{
+    switch (type) {
+    case SPICE_IMAGE_TYPE_BITMAP:
+        return "bitmap";
+    case SPICE_IMAGE_TYPE_QUIC:
+        return "quic";
+    case SPICE_IMAGE_TYPE_LZ_PLT:
+        return "lz_plt";
+    case SPICE_IMAGE_TYPE_LZ_RGB:
+        return "lz";
+    case SPICE_IMAGE_TYPE_GLZ_RGB:
+        return "glz";
+    case SPICE_IMAGE_TYPE_ZLIB_GLZ_RGB:
+        return "zlib_glz";
+    case SPICE_IMAGE_TYPE_LZ4:
+        return "lz4";
+    case SPICE_IMAGE_TYPE_JPEG:
+        return "jpeg";
+    case SPICE_IMAGE_TYPE_JPEG_ALPHA:
+        return "jpeg_alpha";
+    case SPICE_IMAGE_TYPE_FROM_CACHE:
+    case SPICE_IMAGE_TYPE_FROM_CACHE_LOSSLESS:
+        return "cache";
+    case SPICE_IMAGE_TYPE_SURFACE:
+        return "surface";
+    case IMAGE_TYPE_NONE:
+        return "other";
+    default:
+        return "unknown";
+    }
+}
+
+static void print_stat(const char *name, const ReplayClientStat *stat)
+{
+    g_print("  %-12s %10" G_GUINT64_FORMAT " messages %14" G_GUINT64_FORMAT " bytes\n",
+            name, stat->messages, stat->bytes);
+}
+
+void replay_client_print_stats(ReplayClient *client)
+{
+    unsigned i;
+
+    g_print("display channel:\n");
+    print_stat("total", &client->display_total);
+    for (i = 0; i < G_N_ELEMENTS(client->images); i++) {
+        if (client->images[i].messages) {
+            print_stat(image_type_name(i), &client->images[i]);
+        }
+    }
+    if (client->video.messages) {
+        print_stat("video", &client->video);
+    }
+}
+
+void replay_client_free(ReplayClient *client)
+{
+    if (!client) {
+        return;
+    }
+    replay_client_stop(client);
+    if (client->main.fd >= 0) {
+        close(client->main.fd);
+    }
+    if (client->display.fd >= 0) {
+        close(client->display.fd);
+    }
+    g_free(client->buf);
+    g_free(client);
+}
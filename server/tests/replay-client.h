@@ -0,0 +1,36 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef REPLAY_CLIENT_H_
+#define REPLAY_CLIENT_H_
+
+#include <spice.h>
+
+/* Minimal in-process client used by the replay benchmark: it links the main
+ * and display channels through socket pairs, acknowledges what it receives
+ * and accounts the bytes sent by the display channel */
+typedef struct ReplayClient ReplayClient;
+
+/* must be called before running the main loop of @server */
+ReplayClient *replay_client_new(SpiceServer *server);
+/* disconnects and joins the client thread */
+void replay_client_stop(ReplayClient *client);
+/* the client must be stopped */
+void replay_client_print_stats(ReplayClient *client);
+void replay_client_free(ReplayClient *client);
+
+#endif /* REPLAY_CLIENT_H_ */
@@ -17,6 +17,9 @@
 */
 
 /* Replay a previously recorded file (via SPICE_WORKER_RECORD_FILENAME)
+ *
+ * With --benchmark, the display channel is drained by an in-process client
+ * and a report of the throughput of the server is printed at the end.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -31,12 +34,18 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <glib.h>
 #include <pthread.h>
 
 #include <spice/macros.h>
+#include <spice/stats.h>
 #include "test-display-base.h"
+#include "red-replay-qxl.h"
+#include "replay-client.h"
 #include <common/log.h>
 
 static SpiceCoreInterface *core;
@@ -48,6 +57,8 @@ static QXLInstance display_sin;
 static gint slow = 0;
 static gint skip = 0;
 static gboolean print_count = FALSE;
+static gboolean benchmark = FALSE;
+static gboolean realtime = FALSE;
 static guint ncommands = 0;
 static pid_t client_pid;
 static GMainLoop *loop = NULL;
@@ -58,6 +69,14 @@ static long total_size;
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 static GSource *fill_source = NULL;
 
+/* in us, from g_get_monotonic_time() */
+static gint64 replay_start_time;
+static gint64 replay_read_time;
+/* in ns, as recorded */
+static uint64_t first_cmd_time;
+/* read ahead of the time it was recorded at, with --realtime */
+static QXLCommandExt *delayed_cmd;
+
 
 #define MEM_SLOT_GROUP_ID 0
 
@@ -108,24 +127,76 @@ static void get_init_info(QXLInstance *qin, QXLDevInitInfo *info)
     info->n_surfaces = MAX_SURFACE_NUM;
 }
 
+static gboolean fill_queue_idle(gpointer user_data);
+
+/* must be called with the mutex held */
+static void set_fill_source(GSource *source)
+{
+    if (fill_source) {
+        g_source_destroy(fill_source);
+        g_source_unref(fill_source);
+    }
+    fill_source = source;
+    if (source) {
+        g_source_set_callback(source, fill_queue_idle, NULL, NULL);
+        g_source_attach(source, basic_event_loop_get_context());
+    }
+}
+
 static gboolean fill_queue_idle(gpointer user_data)
 {
-    gboolean keep = FALSE;
+    gboolean rescheduled = FALSE;
     gboolean wakeup = FALSE;
 
+    if (!replay_start_time) {
+        replay_start_time = g_get_monotonic_time();
+    }
+
     while ((g_async_queue_length(display_queue) +
             g_async_queue_length(cursor_queue)) < 50) {
-        QXLCommandExt *cmd = spice_replay_next_cmd(replay, qxl_worker);
-        if (!cmd) {
-            g_async_queue_push(display_queue, GINT_TO_POINTER(-1));
-            g_async_queue_push(cursor_queue, GINT_TO_POINTER(-1));
-            goto end;
-        }
+        QXLCommandExt *cmd = delayed_cmd;
 
-        ++ncommands;
+        if (cmd) {
+            delayed_cmd = NULL;
+        } else {
+            gint64 read_start = g_get_monotonic_time();
+
+            cmd = spice_replay_next_cmd(replay, qxl_worker);
+            replay_read_time += g_get_monotonic_time() - read_start;
+            if (!cmd) {
+                g_async_queue_push(display_queue, GINT_TO_POINTER(-1));
+                g_async_queue_push(cursor_queue, GINT_TO_POINTER(-1));
+                goto end;
+            }
+
+            ++ncommands;
+
+            if (slow && (ncommands > skip)) {
+                g_usleep(slow);
+            }
+        }
 
-        if (slow && (ncommands > skip)) {
-            g_usleep(slow);
+        if (realtime) {
+            /* keep the intervals between the commands as they were recorded */
+            uint64_t cmd_time = spice_replay_get_last_cmd_time(replay);
+            gint64 delay;
+
+            if (!first_cmd_time) {
+                first_cmd_time = cmd_time;
+                replay_start_time = g_get_monotonic_time();
+            }
+            delay = replay_start_time + (gint64)(cmd_time - first_cmd_time) / 1000 -
+                    g_get_monotonic_time();
+            if (delay > 0) {
+                /* the loop also runs the server, come back when it is time
+                 * for the command rather than sleeping */
+                delayed_cmd = cmd;
+                pthread_mutex_lock(&mutex);
+                set_fill_source(g_timeout_source_new((delay + 999) / 1000));
+                pthread_mutex_unlock(&mutex);
+                rescheduled = TRUE;
+                goto end;
+            }
         }
 
         wakeup = TRUE;
@@ -137,19 +208,16 @@ static gboolean fill_queue_idle(gpointer user_data)
     }
 
 end:
-    if (!keep) {
+    if (!rescheduled) {
         pthread_mutex_lock(&mutex);
-        if (fill_source) {
-            g_source_destroy(fill_source);
-            g_source_unref(fill_source);
-            fill_source = NULL;
-        }
+        set_fill_source(NULL);
         pthread_mutex_unlock(&mutex);
     }
     if (wakeup)
         spice_qxl_wakeup(&display_sin);
 
-    return keep;
+    /* removed or replaced above */
+    return FALSE;
 }
 
 static void fill_queue(void)
@@ -162,9 +230,7 @@ static void fill_queue(void)
     if (fill_source)
         goto end;
 
-    fill_source = g_idle_source_new();
-    g_source_set_callback(fill_source, fill_queue_idle, NULL, NULL);
-    g_source_attach(fill_source, basic_event_loop_get_context());
+    set_fill_source(g_idle_source_new());
 
 end:
     pthread_mutex_unlock(&mutex);
@@ -302,6 +368,66 @@ static gboolean progress_timer(gpointer user_data)
     return TRUE;
 }
 
+/* prints the stage timers of the server, only available when it is built with
+ * --enable-statistics */
+static void print_stage_times(void)
+{
+    gchar *shm_name = g_strdup_printf(SPICE_STAT_SHM_NAME, getpid());
+    SpiceStat *stat;
+    struct stat st;
+    uint32_t i, num_nodes;
+    int fd;
+
+    fd = shm_open(shm_name, O_RDONLY, 0444);
+    g_free(shm_name);
+    if (fd < 0) {
+        g_print("stage times: not available, the server is built without statistics\n");
+        return;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SpiceStat)) {
+        close(fd);
+        return;
+    }
+    stat = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (stat == MAP_FAILED) {
+        return;
+    }
+
+    g_print("stage times:\n");
+    num_nodes = (st.st_size - sizeof(SpiceStat)) / sizeof(SpiceStatNode);
+    for (i = 0; i < num_nodes; i++) {
+        const SpiceStatNode *node = &stat->nodes[i];
+        char name[SPICE_STAT_NODE_NAME_MAX + 1];
+
+        if (!(node->flags & SPICE_STAT_NODE_FLAG_ENABLED)) {
+            continue;
+        }
+        g_strlcpy(name, (const char *)node->name, sizeof(name));
+        if (g_str_has_suffix(name, "_ns")) {
+            name[strlen(name) - 3] = '\0';
+            g_print("  %-12s %10.1f ms\n", name, node->value / 1000000.0);
+        }
+    }
+    munmap(stat, st.st_size);
+}
+
+static void print_benchmark_report(ReplayClient *client, gint64 elapsed)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    g_print("%u commands in %.3f s, %.1f commands/s\n", ncommands, elapsed / 1000000.0,
+            elapsed ? ncommands * 1000000.0 / elapsed : 0.0);
+    g_print("reading the recording: %.3f s\n", replay_read_time / 1000000.0);
+    g_print("cpu: %.3f s user, %.3f s system\n",
+            usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0,
+            usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0);
+    g_print("peak rss: %ld KiB\n", usage.ru_maxrss);
+    replay_client_print_stats(client);
+    print_stage_times();
+}
+
 static void free_queue(GAsyncQueue *queue)
 {
     for (;;) {
@@ -327,6 +453,8 @@ int main(int argc, char **argv)
     gboolean wait = FALSE;
     gint tls_port = 0;
     gchar *cacert_file = NULL, *cert_file = NULL, *key_file = NULL;
+    ReplayClient *benchmark_client = NULL;
+    gint64 elapsed;
 
     FILE *fd;
 
@@ -340,6 +468,8 @@ int main(int argc, char **argv)
         { "slow", 's', 0, G_OPTION_ARG_INT, &slow, "Slow down replay. Delays USEC microseconds before each command", "USEC" },
         { "skip", 0, 0, G_OPTION_ARG_INT, &skip, "Skip 'slow' for the first n commands", NULL },
         { "count", 0, 0, G_OPTION_ARG_NONE, &print_count, "Print the number of commands processed", NULL },
+        { "benchmark", 'b', 0, G_OPTION_ARG_NONE, &benchmark, "Replay to an in-process client and print a performance report", NULL },
+        { "realtime", 'r', 0, G_OPTION_ARG_NONE, &realtime, "Replay the commands at the pace they were recorded", NULL },
         { "tls-port", 0, 0, G_OPTION_ARG_INT, &tls_port, "Secure server port", "PORT" },
         { "cacert-file", 0, 0, G_OPTION_ARG_FILENAME, &cacert_file, "TLS CA certificate", "FILE" },
         { "cert-file", 0, 0, G_OPTION_ARG_FILENAME, &cert_file, "TLS server certificate", "FILE" },
@@ -447,21 +577,29 @@ int main(int argc, char **argv)
     g_free(key_file);
     cacert_file = cert_file = key_file = NULL;
 
-    spice_server_set_port(server, port);
+    if (!benchmark) {
+        spice_server_set_port(server, port);
+        g_print("listening on port %d (insecure)\n", port);
+    }
     spice_server_set_noauth(server);
-
-    g_print("listening on port %d (insecure)\n", port);
     spice_server_init(server, core);
 
     display_sin.base.sif = &display_sif.base;
     spice_server_add_interface(server, &display_sin.base);
 
-    if (client) {
+    if (benchmark) {
+        benchmark_client = replay_client_new(server);
+        if (!benchmark_client) {
+            g_printerr("error connecting the benchmark client\n");
+            exit(1);
+        }
+        wait = TRUE;
+    } else if (client) {
         start_client(client, &error);
         wait = TRUE;
-        g_free(client);
-        client = NULL;
     }
+    g_free(client);
+    client = NULL;
 
     if (!wait) {
         started = TRUE;
@@ -470,11 +608,18 @@ int main(int argc, char **argv)
 
     loop = g_main_loop_new(basic_event_loop_get_context(), FALSE);
     g_main_loop_run(loop);
+    elapsed = replay_start_time ? g_get_monotonic_time() - replay_start_time : 0;
 
     if (print_count)
         g_print("Counted %d commands\n", ncommands);
 
+    if (benchmark_client) {
+        replay_client_stop(benchmark_client);
+        print_benchmark_report(benchmark_client, elapsed);
+    }
+
     spice_server_destroy(server);
+    replay_client_free(benchmark_client);
     free_queue(display_queue);
     free_queue(cursor_queue);
     end_replay();
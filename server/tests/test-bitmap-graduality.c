@@ -0,0 +1,152 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Check that all the graduality kernels supported by the CPU compute the
+ * same score as the scalar one.
+ * Run with "-m perf" to compare their speed on a full HD screen.
+ */
+#include <config.h>
+#include <stdlib.h>
+
+#include "test-glib-compat.h"
+#include "spice-bitmap-utils.h"
+
+#define NUM_BITMAPS 200
+#define BENCHMARK_ITERATIONS 200
+
+typedef enum {
+    CONTENT_RANDOM,
+    CONTENT_GRADIENT,
+    CONTENT_FLAT,
+} TestContent;
+
+static SpiceBitmap *test_bitmap_new(uint8_t format, uint32_t width, uint32_t height,
+                                    TestContent content)
+{
+    SpiceBitmap *bitmap = spice_new0(SpiceBitmap, 1);
+    uint32_t bpp = bitmap_fmt_get_bytes_per_pixel(format);
+    uint32_t size, i;
+    uint8_t *data;
+
+    bitmap->format = format;
+    bitmap->flags = SPICE_BITMAP_FLAGS_TOP_DOWN;
+    bitmap->x = width;
+    bitmap->y = height;
+    bitmap->stride = width * bpp;
+    size = bitmap->stride * height;
+    data = spice_malloc(size);
+    for (i = 0; i < size; i++) {
+        switch (content) {
+        case CONTENT_RANDOM:
+            data[i] = g_test_rand_int_range(0, 256);
+            break;
+        case CONTENT_GRADIENT:
+            data[i] = (i / bpp / 7) * 3 + g_test_rand_int_range(0, 3);
+            break;
+        case CONTENT_FLAT:
+            data[i] = g_test_rand_int_range(0, 10) ? 0x55 : g_test_rand_int_range(0, 256);
+            break;
+        }
+    }
+    bitmap->data = spice_chunks_new_linear(data, size);
+
+    return bitmap;
+}
+
+static void test_bitmap_free(SpiceBitmap *bitmap)
+{
+    free(bitmap->data->chunk[0].data);
+    spice_chunks_destroy(bitmap->data);
+    free(bitmap);
+}
+
+static const uint8_t test_formats[] = {
+    SPICE_BITMAP_FMT_16BIT,
+    SPICE_BITMAP_FMT_24BIT,
+    SPICE_BITMAP_FMT_32BIT,
+    SPICE_BITMAP_FMT_RGBA,
+};
+
+static void test_graduality_kernels(void)
+{
+    BitmapGradualKernel default_kernel = bitmap_gradual_kernel_get();
+    int i;
+
+    for (i = 0; i < NUM_BITMAPS; i++) {
+        uint8_t format = test_formats[i % G_N_ELEMENTS(test_formats)];
+        SpiceBitmap *bitmap = test_bitmap_new(format,
+                                              g_test_rand_int_range(1, 300),
+                                              g_test_rand_int_range(1, 100),
+                                              g_test_rand_int_range(0, CONTENT_FLAT + 1));
+        double scalar_score;
+        BitmapGradualKernel kernel;
+
+        g_assert_true(bitmap_gradual_kernel_set(BITMAP_GRADUAL_KERNEL_SCALAR));
+        scalar_score = bitmap_get_graduality_score(bitmap);
+        for (kernel = 0; kernel < BITMAP_GRADUAL_KERNEL_COUNT; kernel++) {
+            if (!bitmap_gradual_kernel_set(kernel)) {
+                continue;
+            }
+            /* the counts are exact, so are the scores */
+            g_assert_cmpfloat(bitmap_get_graduality_score(bitmap), ==, scalar_score);
+        }
+        test_bitmap_free(bitmap);
+    }
+
+    g_assert_true(bitmap_gradual_kernel_set(default_kernel));
+}
+
+static void test_graduality_benchmark(void)
+{
+    BitmapGradualKernel default_kernel = bitmap_gradual_kernel_get();
+    SpiceBitmap *bitmap = test_bitmap_new(SPICE_BITMAP_FMT_32BIT, 1920, 1080, CONTENT_RANDOM);
+    BitmapGradualKernel kernel;
+
+    for (kernel = 0; kernel < BITMAP_GRADUAL_KERNEL_COUNT; kernel++) {
+        double elapsed;
+        int i;
+
+        if (!bitmap_gradual_kernel_set(kernel)) {
+            continue;
+        }
+        g_test_timer_start();
+        for (i = 0; i < BENCHMARK_ITERATIONS; i++) {
+            bitmap_get_graduality_level(bitmap);
+        }
+        elapsed = g_test_timer_elapsed();
+        g_test_minimized_result(elapsed * 1000000 / BENCHMARK_ITERATIONS,
+                                "%s: %.1f us per 1920x1080 bitmap",
+                                bitmap_gradual_kernel_name(kernel),
+                                elapsed * 1000000 / BENCHMARK_ITERATIONS);
+    }
+
+    test_bitmap_free(bitmap);
+    g_assert_true(bitmap_gradual_kernel_set(default_kernel));
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/bitmap-graduality/kernels", test_graduality_kernels);
+    if (g_test_perf()) {
+        g_test_add_func("/server/bitmap-graduality/benchmark", test_graduality_benchmark);
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,288 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Check the small messages of a channel client written in batches: how many
+ * go in a write, and that they all arrive in order when the socket takes
+ * only part of a batch.
+ */
+#include <config.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <spice/protocol.h>
+
+#include "test-glib-compat.h"
+#include "basic-event-loop.h"
+#include "reds.h"
+#include "red-channel.h"
+#include "red-channel-client.h"
+#include "red-client.h"
+
+/* see red-channel-client.c */
+#define OUTGOING_BATCH_SIZE (16 * 1024)
+#define HEADER_SIZE sizeof(SpiceDataHeader)
+
+typedef RedChannel TestChannel;
+typedef RedChannelClass TestChannelClass;
+
+static GType test_channel_get_type(void) G_GNUC_CONST;
+G_DEFINE_TYPE(TestChannel, test_channel, RED_TYPE_CHANNEL)
+
+typedef RedChannelClient TestChannelClient;
+typedef RedChannelClientClass TestChannelClientClass;
+
+static GType test_channel_client_get_type(void) G_GNUC_CONST;
+G_DEFINE_TYPE(TestChannelClient, test_channel_client, RED_TYPE_CHANNEL_CLIENT)
+
+/* a message whose payload is filled with the low byte of its serial */
+typedef struct TestPipeItem {
+    RedPipeItem base;
+    uint32_t payload_size;
+} TestPipeItem;
+
+static void test_channel_send_item(RedChannelClient *rcc, RedPipeItem *base)
+{
+    TestPipeItem *item = SPICE_UPCAST(TestPipeItem, base);
+    SpiceMarshaller *m = red_channel_client_get_marshaller(rcc);
+    uint8_t *payload;
+
+    red_channel_client_init_send_data(rcc, SPICE_MSG_SPICEVMC_DATA);
+    payload = spice_marshaller_reserve_space(m, item->payload_size);
+    memset(payload, red_channel_client_get_message_serial(rcc), item->payload_size);
+    red_channel_client_begin_send_message(rcc);
+}
+
+/* the client never sends anything */
+static bool test_channel_handle_message(SPICE_GNUC_UNUSED RedChannelClient *rcc,
+                                        SPICE_GNUC_UNUSED uint16_t type,
+                                        SPICE_GNUC_UNUSED uint32_t size,
+                                        SPICE_GNUC_UNUSED void *msg)
+{
+    g_assert_not_reached();
+    return FALSE;
+}
+
+static void test_channel_on_disconnect(SPICE_GNUC_UNUSED RedChannelClient *rcc)
+{
+}
+
+static void test_channel_class_init(TestChannelClass *klass)
+{
+    klass->handle_message = test_channel_handle_message;
+    klass->on_disconnect = test_channel_on_disconnect;
+    klass->send_item = test_channel_send_item;
+}
+
+static void test_channel_init(SPICE_GNUC_UNUSED TestChannel *self)
+{
+}
+
+static uint8_t *test_channel_client_alloc_recv_buf(SPICE_GNUC_UNUSED RedChannelClient *rcc,
+                                                   SPICE_GNUC_UNUSED uint16_t type,
+                                                   uint32_t size)
+{
+    return g_malloc(size);
+}
+
+static void test_channel_client_release_recv_buf(SPICE_GNUC_UNUSED RedChannelClient *rcc,
+                                                 SPICE_GNUC_UNUSED uint16_t type,
+                                                 SPICE_GNUC_UNUSED uint32_t size,
+                                                 uint8_t *msg)
+{
+    g_free(msg);
+}
+
+static void test_channel_client_class_init(TestChannelClientClass *klass)
+{
+    klass->alloc_recv_buf = test_channel_client_alloc_recv_buf;
+    klass->release_recv_buf = test_channel_client_release_recv_buf;
+}
+
+static void test_channel_client_init(SPICE_GNUC_UNUSED TestChannelClient *self)
+{
+}
+
+typedef struct {
+    SpiceServer *server;
+    RedChannel *channel;
+    RedClient *client;
+    RedChannelClient *rcc;
+    /* the end of the client */
+    int fd;
+} Fixture;
+
+static void fixture_setup(Fixture *fixture, int socket_type, int sndbuf)
+{
+    SpiceCoreInterface *core = basic_event_loop_init();
+    RedsStream *stream;
+    int sv[2];
+
+    fixture->server = spice_server_new();
+    g_assert_cmpint(spice_server_init(fixture->server, core), ==, 0);
+
+    g_assert_cmpint(socketpair(AF_UNIX, socket_type, 0, sv), ==, 0);
+    g_assert_cmpint(fcntl(sv[0], F_SETFL, O_NONBLOCK), ==, 0);
+    g_assert_cmpint(fcntl(sv[1], F_SETFL, O_NONBLOCK), ==, 0);
+    if (sndbuf) {
+        g_assert_cmpint(setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf)),
+                        ==, 0);
+    }
+    fixture->fd = sv[1];
+    stream = reds_stream_new(fixture->server, sv[0]);
+
+    fixture->channel = g_object_new(test_channel_get_type(),
+                                    "spice-server", fixture->server,
+                                    "core-interface",
+                                    reds_get_core_interface(fixture->server),
+                                    "channel-type", SPICE_CHANNEL_USBREDIR,
+                                    "id", 0,
+                                    "handle-acks", FALSE,
+                                    "migration-flags", 0,
+                                    NULL);
+    fixture->client = red_client_new(fixture->server, FALSE);
+    fixture->rcc = g_initable_new(test_channel_client_get_type(), NULL, NULL,
+                                  "channel", fixture->channel,
+                                  "client", fixture->client,
+                                  "stream", stream,
+                                  NULL);
+    g_assert_nonnull(fixture->rcc);
+}
+
+static void fixture_teardown(Fixture *fixture)
+{
+    red_client_destroy(fixture->client);
+    g_object_unref(fixture->channel);
+    close(fixture->fd);
+    spice_server_destroy(fixture->server);
+    basic_event_loop_destroy();
+}
+
+static void queue_messages(Fixture *fixture, int n, uint32_t msg_size)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        TestPipeItem *item = spice_new0(TestPipeItem, 1);
+
+        red_pipe_item_init(&item->base, RED_PIPE_ITEM_TYPE_CHANNEL_BASE);
+        item->payload_size = msg_size - HEADER_SIZE;
+        red_channel_client_pipe_add(fixture->rcc, &item->base);
+    }
+}
+
+/* checks the @n messages of @msg_size bytes in @data come in order */
+static void check_messages(const uint8_t *data, size_t size, int n, uint32_t msg_size)
+{
+    int i;
+
+    g_assert_cmpuint(size, ==, (size_t)n * msg_size);
+    for (i = 0; i < n; i++) {
+        const uint8_t *msg = data + (size_t)i * msg_size;
+        SpiceDataHeader header;
+        uint32_t j;
+
+        memcpy(&header, msg, HEADER_SIZE);
+        g_assert_cmpuint(GUINT64_FROM_LE(header.serial), ==, i + 1);
+        g_assert_cmpuint(GUINT16_FROM_LE(header.type), ==, SPICE_MSG_SPICEVMC_DATA);
+        g_assert_cmpuint(GUINT32_FROM_LE(header.size), ==, msg_size - HEADER_SIZE);
+        for (j = HEADER_SIZE; j < msg_size; j++) {
+            g_assert_cmpuint(msg[j], ==, (uint8_t)(i + 1));
+        }
+    }
+}
+
+/* The messages are batched until the next one does not fit in the batch,
+ * which is written with it. The last message of the pipe is written along
+ * with the ones batched after that. A datagram socket shows the writes. */
+static void test_channel_batch_boundary(void)
+{
+    const uint32_t msg_size = 1024;
+    const int batched = OUTGOING_BATCH_SIZE / msg_size;
+    const int n = batched + 4;
+    const ssize_t expected[] = { (batched + 1) * msg_size, 3 * msg_size };
+    GByteArray *received = g_byte_array_new();
+    uint8_t buf[64 * 1024];
+    Fixture fixture;
+    unsigned int i;
+
+    fixture_setup(&fixture, SOCK_SEQPACKET, 0);
+    queue_messages(&fixture, n, msg_size);
+    red_channel_client_push(fixture.rcc);
+
+    for (i = 0; i < G_N_ELEMENTS(expected); i++) {
+        ssize_t size = recv(fixture.fd, buf, sizeof(buf), 0);
+
+        g_assert_cmpint(size, ==, expected[i]);
+        g_byte_array_append(received, buf, size);
+    }
+    g_assert_cmpint(recv(fixture.fd, buf, sizeof(buf), 0), ==, -1);
+    g_assert_cmpint(errno, ==, EAGAIN);
+    check_messages(received->data, received->len, n, msg_size);
+    g_assert_true(red_channel_client_no_item_being_sent(fixture.rcc));
+
+    g_byte_array_free(received, TRUE);
+    fixture_teardown(&fixture);
+}
+
+/* A small socket buffer takes only part of the first batch, the channel
+ * client resumes from there each time the socket is drained */
+static void test_channel_batch_partial_write(void)
+{
+    const uint32_t msg_size = 512;
+    const int n = 2 * OUTGOING_BATCH_SIZE / msg_size + 5;
+    GByteArray *received = g_byte_array_new();
+    uint8_t buf[64 * 1024];
+    Fixture fixture;
+    int pushes = 0;
+
+    fixture_setup(&fixture, SOCK_STREAM, 4096);
+    queue_messages(&fixture, n, msg_size);
+    red_channel_client_push(fixture.rcc);
+    g_assert_true(red_channel_client_is_blocked(fixture.rcc));
+
+    while (received->len < (guint)n * msg_size) {
+        ssize_t size = recv(fixture.fd, buf, sizeof(buf), 0);
+
+        if (size > 0) {
+            g_byte_array_append(received, buf, size);
+            continue;
+        }
+        g_assert_cmpint(errno, ==, EAGAIN);
+        g_assert_cmpint(++pushes, <, 1000);
+        red_channel_client_push(fixture.rcc);
+    }
+    check_messages(received->data, received->len, n, msg_size);
+    g_assert_false(red_channel_client_is_blocked(fixture.rcc));
+    g_assert_true(red_channel_client_no_item_being_sent(fixture.rcc));
+
+    g_byte_array_free(received, TRUE);
+    fixture_teardown(&fixture);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/channel-batch/boundary", test_channel_batch_boundary);
+    g_test_add_func("/server/channel-batch/partial-write", test_channel_batch_partial_write);
+
+    return g_test_run();
+}
@@ -0,0 +1,204 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Check the writes of the queued buffers to a device taking several of them
+ * at once, when the device accepts only part of them.
+ */
+#include <config.h>
+#include <string.h>
+
+#include "test-glib-compat.h"
+#include "basic-event-loop.h"
+#include "char-device.h"
+
+typedef RedCharDevice TestCharDevice;
+typedef RedCharDeviceClass TestCharDeviceClass;
+
+static GType test_char_device_get_type(void) G_GNUC_CONST;
+G_DEFINE_TYPE(TestCharDevice, test_char_device, RED_TYPE_CHAR_DEVICE)
+
+/* the device never has anything to read */
+static RedPipeItem *
+test_char_device_read_one_msg_from_device(SPICE_GNUC_UNUSED RedCharDevice *self,
+                                          SPICE_GNUC_UNUSED SpiceCharDeviceInstance *sin)
+{
+    return NULL;
+}
+
+static void test_char_device_class_init(TestCharDeviceClass *klass)
+{
+    klass->read_one_msg_from_device = test_char_device_read_one_msg_from_device;
+}
+
+static void test_char_device_init(SPICE_GNUC_UNUSED TestCharDevice *self)
+{
+}
+
+/* what the device received */
+static GByteArray *written;
+/* the most bytes the device takes in a call */
+static int write_limit;
+/* the calls before the device is full, -1 for no limit */
+static int calls_left;
+static int max_iovcnt;
+static int num_partial_writes;
+
+static int device_writev(SPICE_GNUC_UNUSED SpiceCharDeviceInstance *sin,
+                         const struct iovec *iov, int iovcnt)
+{
+    int total = 0;
+    int i;
+
+    if (calls_left == 0) {
+        return 0;
+    }
+    if (calls_left > 0) {
+        calls_left--;
+    }
+    max_iovcnt = MAX(max_iovcnt, iovcnt);
+    for (i = 0; i < iovcnt && total < write_limit; i++) {
+        int n = MIN((int)iov[i].iov_len, write_limit - total);
+
+        g_byte_array_append(written, iov[i].iov_base, n);
+        total += n;
+        if (n < (int)iov[i].iov_len) {
+            num_partial_writes++;
+        }
+    }
+    return total;
+}
+
+static int device_write(SPICE_GNUC_UNUSED SpiceCharDeviceInstance *sin,
+                        SPICE_GNUC_UNUSED const uint8_t *buf,
+                        SPICE_GNUC_UNUSED int len)
+{
+    g_assert_not_reached();
+    return -1;
+}
+
+static int device_read(SPICE_GNUC_UNUSED SpiceCharDeviceInstance *sin,
+                       SPICE_GNUC_UNUSED uint8_t *buf,
+                       SPICE_GNUC_UNUSED int len)
+{
+    return 0;
+}
+
+static SpiceCharDeviceInterface device_interface = {
+    .base = {
+        .type          = SPICE_INTERFACE_CHAR_DEVICE,
+        .description   = "test char device",
+        .major_version = SPICE_INTERFACE_CHAR_DEVICE_MAJOR,
+        .minor_version = SPICE_INTERFACE_CHAR_DEVICE_MINOR,
+    },
+    .write              = device_write,
+    .read               = device_read,
+    .writev             = device_writev,
+};
+
+static SpiceCharDeviceInstance device_instance = {
+    .base = { .sif = &device_interface.base },
+    .subtype = "test",
+};
+
+/* buffers of various sizes, the bytes of all of them follow each other */
+static const int buffer_sizes[] = { 5, 10, 3, 20, 1, 1, 40, 7 };
+
+static int queue_buffers(RedCharDevice *dev)
+{
+    uint8_t c = 0;
+    int i, j;
+
+    for (i = 0; i < G_N_ELEMENTS(buffer_sizes); i++) {
+        RedCharDeviceWriteBuffer *buf;
+
+        buf = red_char_device_write_buffer_get_server_no_token(dev, buffer_sizes[i]);
+        g_assert_nonnull(buf);
+        for (j = 0; j < buffer_sizes[i]; j++) {
+            buf->buf[j] = c++;
+        }
+        buf->buf_used = buffer_sizes[i];
+        red_char_device_write_buffer_add(dev, buf);
+    }
+    return c;
+}
+
+static void check_written(int size)
+{
+    int i;
+
+    g_assert_cmpint(written->len, ==, size);
+    for (i = 0; i < size; i++) {
+        g_assert_cmpint(written->data[i], ==, i);
+    }
+}
+
+static void test_char_device_writev(gconstpointer data)
+{
+    int device_calls = GPOINTER_TO_INT(data);
+    SpiceCoreInterface *core = basic_event_loop_init();
+    SpiceServer *server = spice_server_new();
+    RedCharDevice *dev;
+    int size;
+
+    g_assert_cmpint(spice_server_init(server, core), ==, 0);
+    written = g_byte_array_new();
+    /* 7 bytes at a time end in the middle of most buffers and span several */
+    write_limit = 7;
+    calls_left = device_calls;
+    max_iovcnt = 0;
+    num_partial_writes = 0;
+
+    dev = g_object_new(test_char_device_get_type(),
+                       "sin", &device_instance,
+                       "spice-server", server,
+                       "self-tokens", ~0ULL,
+                       NULL);
+    /* the buffers are queued while the device is stopped */
+    size = queue_buffers(dev);
+    g_assert_cmpint(written->len, ==, 0);
+
+    red_char_device_start(dev);
+    if (device_calls >= 0) {
+        /* the device got full in the middle of the fourth buffer, the
+         * rest is written from there once it is woken up */
+        check_written(device_calls * write_limit);
+        calls_left = -1;
+        red_char_device_wakeup(dev);
+    }
+    check_written(size);
+    g_assert_cmpint(max_iovcnt, >, 1);
+    g_assert_cmpint(num_partial_writes, >, 1);
+
+    red_char_device_stop(dev);
+    g_object_unref(dev);
+    g_byte_array_free(written, TRUE);
+    spice_server_destroy(server);
+    basic_event_loop_destroy();
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_data_func("/server/char-device/writev", GINT_TO_POINTER(-1),
+                         test_char_device_writev);
+    g_test_add_data_func("/server/char-device/writev-full", GINT_TO_POINTER(4),
+                         test_char_device_writev);
+
+    return g_test_run();
+}
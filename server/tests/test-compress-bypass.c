@@ -0,0 +1,100 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Check how many reads the adaptive compression of the spicevmc channel
+ * skips after poor results, and that a good result starts over.
+ */
+#include <config.h>
+
+#include "test-glib-compat.h"
+#include "compress-bypass.h"
+
+#define SIZE 10000
+#define GOOD_SIZE (SIZE - SIZE / COMPRESS_BYPASS_MIN_GAIN)
+#define POOR_SIZE (GOOD_SIZE + 1)
+
+/* checks that exactly @n reads are skipped */
+static void check_skipped(CompressBypass *bypass, uint32_t n)
+{
+    uint32_t i;
+
+    for (i = 0; i < n; i++) {
+        g_assert_true(compress_bypass_skip(bypass));
+    }
+    g_assert_false(compress_bypass_skip(bypass));
+}
+
+static void test_compress_bypass_double(void)
+{
+    CompressBypass bypass;
+    uint32_t expected = 1;
+    int i;
+
+    compress_bypass_reset(&bypass);
+    g_assert_false(compress_bypass_skip(&bypass));
+
+    for (i = 0; i < 10; i++) {
+        compress_bypass_update(&bypass, SIZE, POOR_SIZE);
+        check_skipped(&bypass, expected);
+        expected = MIN(expected * 2, COMPRESS_BYPASS_MAX);
+    }
+    g_assert_cmpuint(bypass.length, ==, COMPRESS_BYPASS_MAX);
+}
+
+static void test_compress_bypass_reset(void)
+{
+    CompressBypass bypass;
+
+    compress_bypass_reset(&bypass);
+    compress_bypass_update(&bypass, SIZE, POOR_SIZE);
+    check_skipped(&bypass, 1);
+    compress_bypass_update(&bypass, SIZE, POOR_SIZE);
+    check_skipped(&bypass, 2);
+    compress_bypass_update(&bypass, SIZE, POOR_SIZE);
+    check_skipped(&bypass, 4);
+
+    /* a good result is not followed by skipped reads, and the next poor
+     * result skips a single one again */
+    compress_bypass_update(&bypass, SIZE, GOOD_SIZE);
+    g_assert_false(compress_bypass_skip(&bypass));
+    compress_bypass_update(&bypass, SIZE, POOR_SIZE);
+    check_skipped(&bypass, 1);
+
+    /* so does a failure or a bigger output */
+    compress_bypass_update(&bypass, SIZE, 0);
+    check_skipped(&bypass, 2);
+    compress_bypass_update(&bypass, SIZE, SIZE + 16);
+    check_skipped(&bypass, 4);
+
+    /* a new connection starts over */
+    compress_bypass_update(&bypass, SIZE, POOR_SIZE);
+    compress_bypass_reset(&bypass);
+    g_assert_false(compress_bypass_skip(&bypass));
+    compress_bypass_update(&bypass, SIZE, POOR_SIZE);
+    check_skipped(&bypass, 1);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/compress-bypass/double", test_compress_bypass_double);
+    g_test_add_func("/server/compress-bypass/reset", test_compress_bypass_reset);
+
+    return g_test_run();
+}
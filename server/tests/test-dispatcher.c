@@ -0,0 +1,159 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Test the dispatcher with several threads sending messages concurrently,
+ * enough of them to fill its ring.
+ */
+#include <config.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+
+#include "test-glib-compat.h"
+#include "dispatcher.h"
+
+#define NUM_SENDERS 4
+#define NUM_MESSAGES 100000
+/* one message out of ACK_INTERVAL waits for the receiver */
+#define ACK_INTERVAL 1000
+
+enum {
+    TEST_MESSAGE_NONE,
+    TEST_MESSAGE_ACK,
+    TEST_MESSAGE_ASYNC,
+
+    TEST_MESSAGE_COUNT
+};
+
+typedef struct TestMessage {
+    int sender;
+    int seq;
+} TestMessage;
+
+typedef struct TestData {
+    Dispatcher *dispatcher;
+    int received[NUM_SENDERS];
+    int async_done;
+} TestData;
+
+typedef struct TestSender {
+    TestData *data;
+    int id;
+    pthread_t thread;
+} TestSender;
+
+static void handle_message(void *opaque, void *payload)
+{
+    TestData *data = opaque;
+    TestMessage *msg = payload;
+
+    g_assert_cmpint(msg->sender, >=, 0);
+    g_assert_cmpint(msg->sender, <, NUM_SENDERS);
+    /* messages from a given sender are received in order */
+    g_assert_cmpint(msg->seq, ==, data->received[msg->sender]);
+    data->received[msg->sender]++;
+}
+
+static void handle_async_done(void *opaque, uint32_t message_type, void *payload)
+{
+    TestData *data = opaque;
+
+    g_assert_cmpuint(message_type, ==, TEST_MESSAGE_ASYNC);
+    data->async_done++;
+}
+
+static void *sender_thread(void *opaque)
+{
+    TestSender *sender = opaque;
+    int i;
+
+    for (i = 0; i < NUM_MESSAGES; i++) {
+        TestMessage msg = { sender->id, i };
+        uint32_t type = TEST_MESSAGE_NONE;
+
+        if (i % ACK_INTERVAL == 0) {
+            type = TEST_MESSAGE_ACK;
+        } else if (i % ACK_INTERVAL == 1) {
+            type = TEST_MESSAGE_ASYNC;
+        }
+        dispatcher_send_message(sender->data->dispatcher, type, &msg);
+    }
+    return NULL;
+}
+
+static int total_received(const TestData *data)
+{
+    int i, total = 0;
+
+    for (i = 0; i < NUM_SENDERS; i++) {
+        total += data->received[i];
+    }
+    return total;
+}
+
+static void test_dispatcher_senders(void)
+{
+    TestData data = { NULL, };
+    TestSender senders[NUM_SENDERS];
+    int i;
+
+    data.dispatcher = dispatcher_new(TEST_MESSAGE_COUNT, &data);
+    dispatcher_register_handler(data.dispatcher, TEST_MESSAGE_NONE, handle_message,
+                                sizeof(TestMessage), DISPATCHER_NONE);
+    dispatcher_register_handler(data.dispatcher, TEST_MESSAGE_ACK, handle_message,
+                                sizeof(TestMessage), DISPATCHER_ACK);
+    dispatcher_register_handler(data.dispatcher, TEST_MESSAGE_ASYNC, handle_message,
+                                sizeof(TestMessage), DISPATCHER_ASYNC);
+    dispatcher_register_async_done_callback(data.dispatcher, handle_async_done);
+
+    for (i = 0; i < NUM_SENDERS; i++) {
+        senders[i].data = &data;
+        senders[i].id = i;
+        g_assert_cmpint(pthread_create(&senders[i].thread, NULL, sender_thread, &senders[i]),
+                        ==, 0);
+    }
+
+    while (total_received(&data) < NUM_SENDERS * NUM_MESSAGES) {
+        struct pollfd pollfd = {
+            .fd = dispatcher_get_recv_fd(data.dispatcher),
+            .events = POLLIN,
+        };
+
+        /* a lost wakeup would hang here */
+        g_assert_cmpint(poll(&pollfd, 1, 10 * 1000), ==, 1);
+        dispatcher_handle_recv_read(data.dispatcher);
+    }
+
+    for (i = 0; i < NUM_SENDERS; i++) {
+        pthread_join(senders[i].thread, NULL);
+        g_assert_cmpint(data.received[i], ==, NUM_MESSAGES);
+    }
+    g_assert_cmpint(data.async_done, ==, NUM_SENDERS * NUM_MESSAGES / ACK_INTERVAL);
+
+    g_object_unref(data.dispatcher);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/dispatcher/senders", test_dispatcher_senders);
+
+    return g_test_run();
+}
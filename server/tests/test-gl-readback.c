@@ -0,0 +1,226 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Check the copies of damaged areas out of a fake GL scanout backed by a
+ * memfd, for both line orders of the scanout.
+ */
+/* for memfd_create() */
+#define _GNU_SOURCE
+#include <config.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "test-glib-compat.h"
+#include "gl-readback.h"
+
+#define WIDTH 64
+#define HEIGHT 48
+/* padded lines, as GPU buffers usually have */
+#define STRIDE (WIDTH * 4 + 32)
+#define FORMAT_XRGB8888 0x34325258 /* 'XR24' */
+
+/* each pixel of the scanout tells where it is in the buffer */
+static uint32_t buffer_pixel(int x, int line)
+{
+    return 0xff000000 | (line << 12) | x;
+}
+
+static int fake_scanout_new(void)
+{
+    uint32_t *line;
+    int fd, x, y;
+
+#ifdef HAVE_MEMFD_CREATE
+    fd = memfd_create("fake-scanout", MFD_CLOEXEC);
+#else
+    /* plain memory all the same */
+    gchar *name;
+
+    fd = g_file_open_tmp("fake-scanout-XXXXXX", &name, NULL);
+    unlink(name);
+    g_free(name);
+#endif
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(ftruncate(fd, STRIDE * HEIGHT), ==, 0);
+
+    line = g_malloc0(STRIDE);
+    for (y = 0; y < HEIGHT; y++) {
+        for (x = 0; x < WIDTH; x++) {
+            line[x] = buffer_pixel(x, y);
+        }
+        g_assert_cmpint(pwrite(fd, line, STRIDE, y * STRIDE), ==, STRIDE);
+    }
+    g_free(line);
+
+    return fd;
+}
+
+/* the line of the buffer showing line @y of the screen */
+static int buffer_line(int y, bool y0_top)
+{
+    return y0_top ? y : HEIGHT - 1 - y;
+}
+
+static void check_frame(GlReadbackFrame *frame, const SpiceRect *area, bool y0_top)
+{
+    const SpiceBitmap *bitmap = &frame->bitmap;
+    int width = area->right - area->left;
+    int height = area->bottom - area->top;
+    const uint8_t *data;
+    int x, i;
+
+    g_assert_cmpint(frame->area.left, ==, area->left);
+    g_assert_cmpint(frame->area.top, ==, area->top);
+    g_assert_cmpint(frame->area.right, ==, area->right);
+    g_assert_cmpint(frame->area.bottom, ==, area->bottom);
+    g_assert_cmpint(bitmap->format, ==, SPICE_BITMAP_FMT_32BIT);
+    g_assert_cmpint(bitmap->x, ==, width);
+    g_assert_cmpint(bitmap->y, ==, height);
+    g_assert_cmpint(bitmap->stride, ==, width * 4);
+    g_assert_cmpint(!!(bitmap->flags & SPICE_BITMAP_FLAGS_TOP_DOWN), ==, y0_top);
+    g_assert_cmpint(bitmap->data->num_chunks, ==, 1);
+    g_assert_cmpint(bitmap->data->data_size, ==, height * bitmap->stride);
+
+    /* the lines of the frame are in the order of the buffer */
+    data = bitmap->data->chunk[0].data;
+    for (i = 0; i < height; i++) {
+        const uint32_t *line = (const uint32_t *)(data + i * bitmap->stride);
+        int y = y0_top ? area->top + i : area->bottom - 1 - i;
+
+        for (x = 0; x < width; x++) {
+            g_assert_cmphex(line[x], ==, buffer_pixel(area->left + x, buffer_line(y, y0_top)));
+        }
+    }
+}
+
+static void test_gl_readback_area(gconstpointer data)
+{
+    bool y0_top = GPOINTER_TO_INT(data);
+    static const SpiceRect areas[] = {
+        { .left = 0, .top = 0, .right = WIDTH, .bottom = HEIGHT },
+        { .left = 5, .top = 7, .right = 20, .bottom = 30 },
+        { .left = WIDTH - 1, .top = HEIGHT - 1, .right = WIDTH, .bottom = HEIGHT },
+        { .left = 0, .top = 10, .right = WIDTH, .bottom = 11 },
+    };
+    GlReadback *readback;
+    SpiceRect area;
+    int fd, i;
+
+    fd = fake_scanout_new();
+    readback = gl_readback_new(fd, WIDTH, HEIGHT, STRIDE, FORMAT_XRGB8888, y0_top);
+    /* the mapping does not need the descriptor of the scanout */
+    close(fd);
+    g_assert_nonnull(readback);
+    g_assert_cmpint(gl_readback_is_top_down(readback), ==, y0_top);
+    gl_readback_get_area(readback, &area);
+    g_assert_cmpint(area.right, ==, WIDTH);
+    g_assert_cmpint(area.bottom, ==, HEIGHT);
+
+    for (i = 0; i < G_N_ELEMENTS(areas); i++) {
+        GlReadbackFrame *frame = gl_readback_read(readback, &areas[i]);
+
+        g_assert_nonnull(frame);
+        check_frame(frame, &areas[i], y0_top);
+        gl_readback_frame_unref(frame);
+    }
+    gl_readback_free(readback);
+}
+
+static void test_gl_readback_clip(void)
+{
+    static const SpiceRect outside = { .left = -10, .top = -20, .right = 30, .bottom = 100 };
+    static const SpiceRect clipped = { .left = 0, .top = 0, .right = 30, .bottom = HEIGHT };
+    static const SpiceRect beyond = { .left = WIDTH, .top = 0, .right = WIDTH + 5, .bottom = 5 };
+    static const SpiceRect empty = { .left = 5, .top = 5, .right = 5, .bottom = 10 };
+    GlReadbackFrame *frame;
+    GlReadback *readback;
+    int fd;
+
+    fd = fake_scanout_new();
+    readback = gl_readback_new(fd, WIDTH, HEIGHT, STRIDE, FORMAT_XRGB8888, false);
+    g_assert_nonnull(readback);
+
+    frame = gl_readback_read(readback, &outside);
+    g_assert_nonnull(frame);
+    check_frame(frame, &clipped, false);
+    gl_readback_frame_unref(frame);
+
+    g_assert_null(gl_readback_read(readback, &beyond));
+    g_assert_null(gl_readback_read(readback, &empty));
+
+    gl_readback_free(readback);
+    close(fd);
+}
+
+/* a frame keeps the content of the scanout at the time of the draw */
+static void test_gl_readback_frame_copy(void)
+{
+    static const SpiceRect area = { .left = 0, .top = 0, .right = 8, .bottom = 8 };
+    static const uint32_t black[8] = { 0 };
+    GlReadbackFrame *frame;
+    GlReadback *readback;
+    int fd;
+
+    fd = fake_scanout_new();
+    readback = gl_readback_new(fd, WIDTH, HEIGHT, STRIDE, FORMAT_XRGB8888, true);
+    g_assert_nonnull(readback);
+
+    frame = gl_readback_read(readback, &area);
+    g_assert_nonnull(frame);
+    /* the guest renders the next frame while this one is being sent */
+    g_assert_cmpint(pwrite(fd, black, sizeof(black), 0), ==, sizeof(black));
+    /* and the frame outlives the mapping */
+    gl_readback_free(readback);
+    check_frame(frame, &area, true);
+    gl_readback_frame_unref(frame);
+    close(fd);
+}
+
+static void test_gl_readback_invalid(void)
+{
+    int fd;
+
+    fd = fake_scanout_new();
+
+    /* 'RG16' */
+    g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "*unsupported GL scanout format*");
+    g_assert_null(gl_readback_new(fd, WIDTH, HEIGHT, STRIDE, 0x36314752, true));
+    g_test_assert_expected_messages();
+
+    g_test_expect_message(G_LOG_DOMAIN, G_LOG_LEVEL_WARNING, "*invalid GL scanout*");
+    g_assert_null(gl_readback_new(fd, WIDTH, HEIGHT, WIDTH * 2, FORMAT_XRGB8888, true));
+    g_test_assert_expected_messages();
+
+    close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_data_func("/server/gl-readback/area/y0-top", GINT_TO_POINTER(TRUE),
+                         test_gl_readback_area);
+    g_test_add_data_func("/server/gl-readback/area/y0-bottom", GINT_TO_POINTER(FALSE),
+                         test_gl_readback_area);
+    g_test_add_func("/server/gl-readback/clip", test_gl_readback_clip);
+    g_test_add_func("/server/gl-readback/frame-copy", test_gl_readback_frame_copy);
+    g_test_add_func("/server/gl-readback/invalid", test_gl_readback_invalid);
+
+    return g_test_run();
+}
@@ -0,0 +1,328 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Encode images from several threads sharing one GLZ dictionary, then decode
+ * them in the order of their ids and check they are the images encoded.
+ */
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test-glib-compat.h"
+#include "glz-encoder.h"
+
+#define NUM_ENCODERS 4
+#define IMAGES_PER_ENCODER 50
+#define NUM_IMAGES (NUM_ENCODERS * IMAGES_PER_ENCODER)
+#define IMAGE_WIDTH 64
+#define IMAGE_HEIGHT 64
+#define IMAGE_PIXELS (IMAGE_WIDTH * IMAGE_HEIGHT)
+/* small enough for the window to be emptied while encoding */
+#define WINDOW_SIZE (1 << 16)
+#define TEXTURE_WIDTH 256
+#define TEXTURE_HEIGHT 256
+#define OUTPUT_SIZE (IMAGE_PIXELS * 8)
+/* magic, version, type, width, height, stride, id, head distance */
+#define HEADER_SIZE 33
+
+typedef struct EncodedImage {
+    uint32_t *pixels;
+    uint8_t *data;
+    int size;
+    uint64_t id;
+} EncodedImage;
+
+typedef struct TestEncoder {
+    GlzEncoderUsrContext usr;
+    GlzEncoderContext *encoder;
+    int id;
+    EncodedImage images[IMAGES_PER_ENCODER];
+} TestEncoder;
+
+static uint32_t texture[TEXTURE_WIDTH * TEXTURE_HEIGHT];
+
+static SPICE_GNUC_PRINTF(2, 3) void
+usr_error(SPICE_GNUC_UNUSED GlzEncoderUsrContext *usr, const char *fmt, ...)
+{
+    va_list ap;
+    char *msg;
+
+    va_start(ap, fmt);
+    msg = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+    g_error("%s", msg);
+}
+
+static SPICE_GNUC_PRINTF(2, 3) void
+usr_message(SPICE_GNUC_UNUSED GlzEncoderUsrContext *usr, SPICE_GNUC_UNUSED const char *fmt, ...)
+{
+}
+
+static void *usr_malloc(SPICE_GNUC_UNUSED GlzEncoderUsrContext *usr, int size)
+{
+    return g_malloc(size);
+}
+
+static void usr_free(SPICE_GNUC_UNUSED GlzEncoderUsrContext *usr, void *ptr)
+{
+    g_free(ptr);
+}
+
+static int usr_more_lines(SPICE_GNUC_UNUSED GlzEncoderUsrContext *usr,
+                          SPICE_GNUC_UNUSED uint8_t **lines)
+{
+    return 0;
+}
+
+static int usr_more_space(SPICE_GNUC_UNUSED GlzEncoderUsrContext *usr,
+                          SPICE_GNUC_UNUSED uint8_t **io_ptr)
+{
+    return 0;
+}
+
+/* the images are kept until the end of the test */
+static void usr_free_image(SPICE_GNUC_UNUSED GlzEncoderUsrContext *usr,
+                           SPICE_GNUC_UNUSED GlzUsrImageContext *image)
+{
+}
+
+static void usr_init(GlzEncoderUsrContext *usr)
+{
+    usr->error = usr_error;
+    usr->warn = usr_message;
+    usr->info = usr_message;
+    usr->malloc = usr_malloc;
+    usr->free = usr_free;
+    usr->more_lines = usr_more_lines;
+    usr->more_space = usr_more_space;
+    usr->free_image = usr_free_image;
+}
+
+/* the images are views at different offsets of the same texture, so they share
+ * content with the images encoded by the other threads */
+static uint32_t *create_image(GRand *rand)
+{
+    uint32_t *pixels = g_new(uint32_t, IMAGE_PIXELS);
+    int left = g_rand_int_range(rand, 0, TEXTURE_WIDTH - IMAGE_WIDTH);
+    int top = g_rand_int_range(rand, 0, TEXTURE_HEIGHT - IMAGE_HEIGHT);
+    int y;
+
+    for (y = 0; y < IMAGE_HEIGHT; y++) {
+        memcpy(pixels + y * IMAGE_WIDTH, texture + (top + y) * TEXTURE_WIDTH + left,
+               IMAGE_WIDTH * sizeof(uint32_t));
+    }
+    return pixels;
+}
+
+static gpointer encode_thread(gpointer data)
+{
+    TestEncoder *enc = data;
+    GRand *rand = g_rand_new_with_seed(enc->id);
+    int i;
+
+    for (i = 0; i < IMAGES_PER_ENCODER; i++) {
+        EncodedImage *image = &enc->images[i];
+        GlzEncDictImageContext *dict_image;
+
+        image->pixels = create_image(rand);
+        image->data = g_malloc(OUTPUT_SIZE);
+        image->size = glz_encode(enc->encoder, LZ_IMAGE_TYPE_RGB32,
+                                 IMAGE_WIDTH, IMAGE_HEIGHT, TRUE,
+                                 (uint8_t *)image->pixels, IMAGE_HEIGHT,
+                                 IMAGE_WIDTH * sizeof(uint32_t),
+                                 image->data, OUTPUT_SIZE, (GlzUsrImageContext *)image,
+                                 &dict_image);
+        g_assert_cmpint(image->size, >, HEADER_SIZE);
+    }
+    g_rand_free(rand);
+    return NULL;
+}
+
+static uint32_t read_32(const uint8_t *data)
+{
+    return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
+           ((uint32_t)data[2] << 8) | data[3];
+}
+
+static int compare_images(const void *a, const void *b)
+{
+    const EncodedImage *image_a = *(EncodedImage * const *)a;
+    const EncodedImage *image_b = *(EncodedImage * const *)b;
+
+    return (image_a->id > image_b->id) - (image_a->id < image_b->id);
+}
+
+/* decodes an RGB32 image, whose references to other images are to the images
+ * decoded before it */
+static void decode_image(const EncodedImage *image, uint32_t **decoded, uint64_t first_id)
+{
+    const uint8_t *ip = image->data + HEADER_SIZE;
+    const uint8_t *ip_end = image->data + image->size;
+    uint32_t *out = decoded[image->id - first_id];
+    uint32_t *op = out;
+    uint32_t *op_end = out + IMAGE_PIXELS;
+
+    while (op < op_end) {
+        uint8_t ctrl = *ip++;
+
+        g_assert_true(ip <= ip_end);
+        if (ctrl >= MAX_COPY) {
+            uint32_t len = ctrl >> 5;
+            int pixel_flag = (ctrl >> 4) & 1;
+            uint32_t pixel_ofs = ctrl & 0x0f;
+            uint32_t image_dist;
+            const uint32_t *ref;
+            uint8_t code;
+            int image_flag, i;
+
+            if (len == 7) {
+                do {
+                    code = *ip++;
+                    len += code;
+                } while (code == 255);
+            }
+            pixel_ofs += *ip++ << 4;
+            code = *ip++;
+            image_flag = (code >> 6) & 3;
+            if (!pixel_flag) {
+                image_dist = code & 0x3f;
+                for (i = 0; i < image_flag; i++) {
+                    image_dist += *ip++ << (6 + 8 * i);
+                }
+            } else {
+                int long_flag = (code >> 5) & 1;
+
+                pixel_ofs += (code & 0x1f) << 12;
+                image_dist = 0;
+                for (i = 0; i < image_flag; i++) {
+                    image_dist += *ip++ << (8 * i);
+                }
+                if (long_flag) {
+                    pixel_ofs += *ip++ << 17;
+                }
+            }
+            g_assert_true(ip <= ip_end);
+
+            if (image_dist == 0) {
+                pixel_ofs++;
+                g_assert_cmpint(pixel_ofs, <=, op - out);
+                ref = op - pixel_ofs;
+            } else {
+                g_assert_cmpint(image_dist, <=, image->id - first_id);
+                ref = decoded[image->id - image_dist - first_id] + pixel_ofs;
+                g_assert_cmpint(pixel_ofs + len, <=, IMAGE_PIXELS);
+            }
+            g_assert_cmpint(len, <=, op_end - op);
+            while (len--) {
+                *op++ = *ref++;
+            }
+        } else {
+            int count = ctrl + 1;
+
+            g_assert_cmpint(count, <=, op_end - op);
+            g_assert_true(ip + count * 3 <= ip_end);
+            while (count--) {
+                *op++ = ip[0] | (ip[1] << 8) | (ip[2] << 16);
+                ip += 3;
+            }
+        }
+    }
+    g_assert_true(ip == ip_end);
+}
+
+static void test_glz_threads(void)
+{
+    GlzEncoderUsrContext dict_usr;
+    GlzEncDictContext *dict;
+    TestEncoder *encoders = g_new(TestEncoder, NUM_ENCODERS);
+    GThread *threads[NUM_ENCODERS];
+    EncodedImage *images[NUM_IMAGES];
+    uint32_t *decoded[NUM_IMAGES];
+    GRand *rand = g_rand_new_with_seed(1);
+    uint64_t first_id;
+    int i, j;
+
+    for (i = 0; i < TEXTURE_WIDTH * TEXTURE_HEIGHT; i++) {
+        /* few colors, for the images to match each other often */
+        texture[i] = g_rand_int_range(rand, 0, 4) * 0x3f3f3f;
+    }
+    g_rand_free(rand);
+
+    usr_init(&dict_usr);
+    dict = glz_enc_dictionary_create(WINDOW_SIZE, NUM_ENCODERS, &dict_usr);
+    g_assert_nonnull(dict);
+    for (i = 0; i < NUM_ENCODERS; i++) {
+        memset(&encoders[i], 0, sizeof(encoders[i]));
+        encoders[i].id = i;
+        usr_init(&encoders[i].usr);
+        encoders[i].encoder = glz_encoder_create(i, dict, &encoders[i].usr);
+        g_assert_nonnull(encoders[i].encoder);
+    }
+
+    for (i = 0; i < NUM_ENCODERS; i++) {
+        threads[i] = g_thread_new("glz-encoder", encode_thread, &encoders[i]);
+    }
+    for (i = 0; i < NUM_ENCODERS; i++) {
+        g_thread_join(threads[i]);
+    }
+
+    for (i = 0; i < NUM_ENCODERS; i++) {
+        for (j = 0; j < IMAGES_PER_ENCODER; j++) {
+            EncodedImage *image = &encoders[i].images[j];
+
+            g_assert_cmpuint(read_32(image->data + 9), ==, IMAGE_WIDTH);
+            g_assert_cmpuint(read_32(image->data + 13), ==, IMAGE_HEIGHT);
+            /* only the low 24 bits of the id are written */
+            image->id = read_32(image->data + 25);
+            images[i * IMAGES_PER_ENCODER + j] = image;
+        }
+    }
+    qsort(images, NUM_IMAGES, sizeof(images[0]), compare_images);
+    first_id = images[0]->id;
+    for (i = 0; i < NUM_IMAGES; i++) {
+        g_assert_cmpuint(images[i]->id, ==, first_id + i);
+        decoded[i] = g_new(uint32_t, IMAGE_PIXELS);
+    }
+
+    for (i = 0; i < NUM_IMAGES; i++) {
+        decode_image(images[i], decoded, first_id);
+        for (j = 0; j < IMAGE_PIXELS; j++) {
+            g_assert_cmphex(decoded[i][j] & 0xffffff, ==, images[i]->pixels[j] & 0xffffff);
+        }
+    }
+
+    for (i = 0; i < NUM_IMAGES; i++) {
+        g_free(decoded[i]);
+        g_free(images[i]->pixels);
+        g_free(images[i]->data);
+    }
+    for (i = 0; i < NUM_ENCODERS; i++) {
+        glz_encoder_destroy(encoders[i].encoder);
+    }
+    glz_enc_dictionary_destroy(dict, &dict_usr);
+    g_free(encoders);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/glz-threads", test_glz_threads);
+
+    return g_test_run();
+}
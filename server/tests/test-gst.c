@@ -165,6 +165,14 @@ static pthread_cond_t eos_cond = PTHREAD_COND_INITIALIZER;
 // and encoder
 static gdouble minimum_psnr = 25;
 static uint64_t starting_bit_rate = 3000000;
+// frame submitted to the encoder ahead of the current one, see
+// VideoEncoder::submit_frame
+static struct {
+    VideoEncoderFrame *video_frame;
+    TestFrame *frame;
+    uint32_t mm_time;
+    unsigned index;
+} pending_frame;
 
 static void compute_clipping_rect(GstSample *sample);
 static void parse_clipping(const char *clipping);
@@ -185,29 +193,10 @@ static double compute_psnr(SpiceBitmap *bitmap1, int32_t x1, int32_t y1,
                            SpiceBitmap *bitmap2, int32_t x2, int32_t y2,
                            int32_t w, int32_t h);
 
-// handle output frames from input pipeline
+// handle the result of encoding a frame
 static void
-input_frames(GstSample *sample, void *param)
+encoded_frame(TestFrame *frame, unsigned frame_index, int res, VideoBuffer *p_outbuf)
 {
-    unsigned curr_frame_index = input_frame_index++;
-
-    spice_assert(video_encoder && sample);
-
-    if (SPICE_UNLIKELY(!clipping_type_computed)) {
-        compute_clipping_rect(sample);
-    }
-
-    VideoBuffer *p_outbuf = NULL;
-    // TODO correct ?? emulate another timer ??
-    uint32_t frame_mm_time = reds_get_mm_time();
-
-    // convert frame to SpiceBitmap/DRM prime
-    TestFrame *frame = gst_to_spice_frame(sample);
-
-    // send frame to our video encoder (must be from a single thread)
-    int res = video_encoder->encode_frame(video_encoder, frame_mm_time, frame->bitmap,
-                                          &clipping_rect, top_down, frame,
-                                          &p_outbuf);
     switch (res) {
     case VIDEO_ENCODER_FRAME_ENCODE_DONE:
         // save frame into queue for comparison later
@@ -224,7 +213,7 @@ input_frames(GstSample *sample, void *param)
             fprintf(file_report,
                     "Frame: %u\n"
                     "Output size: %u\n",
-                    curr_frame_index,
+                    frame_index,
                     (unsigned) p_outbuf->size);
         }
         break;
@@ -239,13 +228,80 @@ input_frames(GstSample *sample, void *param)
             fprintf(file_report,
                     "Frame: %u\n"
                     "Output size: 0\n",
-                    curr_frame_index);
+                    frame_index);
         }
         break;
     default:
         // invalid value returned
         spice_assert(0);
     }
+}
+
+// retrieve the frame submitted ahead, if any, the same way
+// red_marshall_stream_data does
+static void
+finish_pending_frame(void)
+{
+    VideoBuffer *p_outbuf = NULL;
+    int res;
+
+    if (!pending_frame.video_frame) {
+        return;
+    }
+
+    res = pending_frame.video_frame->finish(pending_frame.video_frame, &p_outbuf);
+    if (res != VIDEO_ENCODER_FRAME_ENCODE_DONE) {
+        res = video_encoder->encode_frame(video_encoder, pending_frame.mm_time,
+                                          pending_frame.frame->bitmap,
+                                          &clipping_rect, top_down, NULL,
+                                          pending_frame.frame, &p_outbuf);
+    }
+    encoded_frame(pending_frame.frame, pending_frame.index, res, p_outbuf);
+
+    frame_unref(pending_frame.frame);
+    pending_frame.video_frame = NULL;
+    pending_frame.frame = NULL;
+}
+
+// handle output frames from input pipeline
+static void
+input_frames(GstSample *sample, void *param)
+{
+    unsigned curr_frame_index = input_frame_index++;
+
+    spice_assert(video_encoder && sample);
+
+    if (SPICE_UNLIKELY(!clipping_type_computed)) {
+        compute_clipping_rect(sample);
+    }
+
+    VideoBuffer *p_outbuf = NULL;
+    // TODO correct ?? emulate another timer ??
+    uint32_t frame_mm_time = reds_get_mm_time();
+
+    // convert frame to SpiceBitmap/DRM prime
+    TestFrame *frame = gst_to_spice_frame(sample);
+
+    // let the encoder work on this frame while the previous one is sent
+    if (video_encoder->submit_frame) {
+        VideoEncoderFrame *video_frame =
+            video_encoder->submit_frame(video_encoder, frame_mm_time, frame->bitmap,
+                                        &clipping_rect, top_down, NULL, frame);
+        finish_pending_frame();
+        if (video_frame) {
+            pending_frame.video_frame = video_frame;
+            pending_frame.frame = frame;
+            pending_frame.mm_time = frame_mm_time;
+            pending_frame.index = curr_frame_index;
+            return;
+        }
+    }
+
+    // send frame to our video encoder (must be from a single thread)
+    int res = video_encoder->encode_frame(video_encoder, frame_mm_time, frame->bitmap,
+                                          &clipping_rect, top_down, NULL, frame,
+                                          &p_outbuf);
+    encoded_frame(frame, curr_frame_index, res, p_outbuf);
 
     // TODO call client_stream_report to simulate this report from the client
 
@@ -418,6 +474,7 @@ int main(int argc, char *argv[])
     // run all input streaming
     pipeline_wait_eos(input_pipeline);
 
+    finish_pending_frame();
     video_encoder->destroy(video_encoder);
 
     // send EOS to output and wait
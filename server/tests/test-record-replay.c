@@ -0,0 +1,215 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Check that the version 2 recordings are replayed as recorded, with data
+ * spanning several blocks, and that the writer flushes them when idle.
+ */
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+
+#include "test-glib-compat.h"
+#include "red-qxl.h"
+#include "red-record-qxl.h"
+#include "red-replay-qxl.h"
+
+/* the primary surface is bigger than a block of the recording */
+#define SURFACE_WIDTH 1024
+#define SURFACE_HEIGHT 512
+#define SURFACE_STRIDE (SURFACE_WIDTH * 4)
+#define NUM_UPDATES 1000
+/* header of the recording */
+#define HEADER_SIZE 15
+
+static uint8_t *surface_data;
+static int num_surfaces_created;
+
+static void init_surface_data(void)
+{
+    int i;
+
+    surface_data = g_malloc(SURFACE_STRIDE * SURFACE_HEIGHT);
+    /* compressible, but not constant */
+    for (i = 0; i < SURFACE_STRIDE * SURFACE_HEIGHT; i++) {
+        surface_data[i] = (i / 64) ^ (i % 7);
+    }
+}
+
+static void init_surface(QXLDevSurfaceCreate *surface)
+{
+    memset(surface, 0, sizeof(*surface));
+    surface->width = SURFACE_WIDTH;
+    surface->height = SURFACE_HEIGHT;
+    surface->stride = SURFACE_STRIDE;
+    surface->format = SPICE_SURFACE_FMT_32_xRGB;
+    surface->mouse_mode = 1;
+    surface->type = QXL_SURF_TYPE_PRIMARY;
+}
+
+static void worker_create_primary_surface(SPICE_GNUC_UNUSED QXLWorker *worker,
+                                          uint32_t surface_id,
+                                          QXLDevSurfaceCreate *surface)
+{
+    QXLDevSurfaceCreate expected;
+
+    init_surface(&expected);
+    g_assert_cmpint(surface_id, ==, 0);
+    g_assert_cmpint(surface->width, ==, expected.width);
+    g_assert_cmpint(surface->height, ==, expected.height);
+    g_assert_cmpint(surface->stride, ==, expected.stride);
+    g_assert_cmpint(surface->format, ==, expected.format);
+    g_assert_cmpint(surface->mouse_mode, ==, expected.mouse_mode);
+    g_assert_cmpint(surface->type, ==, expected.type);
+    g_assert_true(memcmp((void *)(uintptr_t)surface->mem, surface_data,
+                         SURFACE_STRIDE * SURFACE_HEIGHT) == 0);
+    num_surfaces_created++;
+}
+
+G_GNUC_BEGIN_IGNORE_DEPRECATIONS
+static QXLWorker worker = {
+    .create_primary_surface = worker_create_primary_surface,
+};
+G_GNUC_END_IGNORE_DEPRECATIONS
+
+static void record_update(RedRecord *record, RedMemSlotInfo *slots, int i)
+{
+    QXLUpdateCmd update;
+    QXLCommandExt ext;
+
+    memset(&update, 0, sizeof(update));
+    update.area.left = i;
+    update.area.top = -i;
+    update.area.right = i * 1000;
+    update.area.bottom = i + 1;
+    update.update_id = i;
+    memset(&ext, 0, sizeof(ext));
+    ext.cmd.type = QXL_CMD_UPDATE;
+    ext.cmd.data = (uintptr_t)&update;
+    red_record_qxl_command(record, slots, ext);
+}
+
+static void check_update(QXLCommandExt *ext, int i)
+{
+    QXLUpdateCmd *update = (QXLUpdateCmd *)(uintptr_t)ext->cmd.data;
+
+    g_assert_cmpint(ext->cmd.type, ==, QXL_CMD_UPDATE);
+    g_assert_cmpint(update->area.left, ==, i);
+    g_assert_cmpint(update->area.top, ==, -i);
+    g_assert_cmpint(update->area.right, ==, i * 1000);
+    g_assert_cmpint(update->area.bottom, ==, i + 1);
+    g_assert_cmpint(update->update_id, ==, i);
+    g_assert_cmpint(update->surface_id, ==, 0);
+}
+
+static void test_record_replay(gconstpointer data)
+{
+    const char *format = data;
+    char *filename;
+    RedMemSlotInfo slots;
+    RedRecord *record;
+    QXLDevSurfaceCreate surface;
+    SpiceReplay *replay;
+    QXLCommandExt *ext;
+    uint64_t last_time = 0;
+    int fd, i;
+
+    fd = g_file_open_tmp("spice-record-XXXXXX", &filename, NULL);
+    g_assert_cmpint(fd, >=, 0);
+    close(fd);
+    memslot_info_init(&slots, 1 /* groups */, 1 /* slots */, 1, 1, 0);
+    memslot_info_add_slot(&slots, 0, 0, 0 /* delta */, 0 /* start */, ~0ul /* end */,
+                          0 /* generation */);
+    init_surface_data();
+    num_surfaces_created = 0;
+
+    g_setenv("SPICE_WORKER_RECORD_FORMAT", format, TRUE);
+    record = red_record_new(filename);
+    red_record_event(record, 1, RED_WORKER_MESSAGE_CREATE_PRIMARY_SURFACE);
+    init_surface(&surface);
+    red_record_primary_surface_create(record, &surface, surface_data);
+    for (i = 0; i < NUM_UPDATES; i++) {
+        /* ignored by the replay */
+        red_record_event(record, 1, RED_WORKER_MESSAGE_WAKEUP);
+        record_update(record, &slots, i);
+    }
+    red_record_unref(record);
+
+    replay = spice_replay_new(g_fopen(filename, "r"), 1);
+    g_assert_nonnull(replay);
+    for (i = 0; i < NUM_UPDATES; i++) {
+        ext = spice_replay_next_cmd(replay, &worker);
+        g_assert_nonnull(ext);
+        check_update(ext, i);
+        g_assert_cmpuint(spice_replay_get_last_cmd_time(replay), >=, last_time);
+        last_time = spice_replay_get_last_cmd_time(replay);
+        spice_replay_free_cmd(replay, ext);
+    }
+    g_assert_cmpint(num_surfaces_created, ==, 1);
+    /* the end of the recording */
+    g_assert_null(spice_replay_next_cmd(replay, &worker));
+    spice_replay_free(replay);
+
+    g_unsetenv("SPICE_WORKER_RECORD_FORMAT");
+    g_free(surface_data);
+    memslot_info_destroy(&slots);
+    g_unlink(filename);
+    g_free(filename);
+}
+
+/* what is recorded reaches the file without anything recorded after it */
+static void test_record_idle_flush(void)
+{
+    char *filename;
+    RedRecord *record;
+    GStatBuf st;
+    int fd, i;
+
+    fd = g_file_open_tmp("spice-record-XXXXXX", &filename, NULL);
+    g_assert_cmpint(fd, >=, 0);
+    close(fd);
+
+    record = red_record_new(filename);
+    red_record_event(record, 1, RED_WORKER_MESSAGE_WAKEUP);
+    for (i = 0; i < 50; i++) {
+        g_assert_cmpint(g_stat(filename, &st), ==, 0);
+        if (st.st_size > HEADER_SIZE) {
+            break;
+        }
+        g_usleep(G_USEC_PER_SEC / 10);
+    }
+    g_assert_cmpint(st.st_size, >, HEADER_SIZE);
+    red_record_unref(record);
+
+    g_unlink(filename);
+    g_free(filename);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_data_func("/server/record-replay/binary", "binary", test_record_replay);
+#ifdef USE_LZ4
+    g_test_add_data_func("/server/record-replay/lz4", "lz4", test_record_replay);
+#endif
+    g_test_add_func("/server/record-replay/idle-flush", test_record_idle_flush);
+
+    return g_test_run();
+}
@@ -0,0 +1,232 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Check the detection of the moves of the content of an area, the way
+ * windows are scrolled, out of the old and the new content of the area.
+ */
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test-glib-compat.h"
+#include "scroll-detect.h"
+
+#define WIDTH 200
+#define HEIGHT 120
+/* the strides are different from the widths of the areas */
+#define STRIDE (WIDTH + 8)
+
+typedef struct Document {
+    uint32_t pixels[HEIGHT * 4][STRIDE];
+} Document;
+
+/* a document, with some blank lines as text has, bigger than the area */
+static Document *document_new(void)
+{
+    Document *document = g_new(Document, 1);
+    int x, y;
+
+    for (y = 0; y < G_N_ELEMENTS(document->pixels); y++) {
+        for (x = 0; x < STRIDE; x++) {
+            bool blank = y % 16 >= 12 || x % 32 >= 28;
+
+            document->pixels[y][x] = blank ? 0xffffffff : g_test_rand_int();
+        }
+    }
+    return document;
+}
+
+static const uint8_t *document_view(const Document *document, int x, int y)
+{
+    return (const uint8_t *)&document->pixels[y][x];
+}
+
+static void check_move(const ScrollDetectMove *move, const SpiceRect *dest, int src_x, int src_y)
+{
+    g_assert_cmpint(move->dest.left, ==, dest->left);
+    g_assert_cmpint(move->dest.top, ==, dest->top);
+    g_assert_cmpint(move->dest.right, ==, dest->right);
+    g_assert_cmpint(move->dest.bottom, ==, dest->bottom);
+    g_assert_cmpint(move->src.x, ==, src_x);
+    g_assert_cmpint(move->src.y, ==, src_y);
+}
+
+static void test_scroll_detect_vertical(void)
+{
+    static const int offsets[] = { 1, 15, 17, -1, -40, HEIGHT * 3 / 4 };
+    Document *document = document_new();
+    const int stride = STRIDE * 4;
+    ScrollDetectMove move;
+    int i;
+
+    for (i = 0; i < G_N_ELEMENTS(offsets); i++) {
+        int old_top = HEIGHT * 2;
+        int new_top = old_top + offsets[i];
+        SpiceRect dest = {
+            .left = 0, .right = WIDTH,
+            .top = MAX(0, -offsets[i]), .bottom = HEIGHT - MAX(0, offsets[i])
+        };
+
+        g_assert_true(scroll_detect(document_view(document, 0, old_top), stride,
+                                    document_view(document, 0, new_top), stride,
+                                    WIDTH, HEIGHT, &move));
+        check_move(&move, &dest, 0, dest.top + offsets[i]);
+    }
+    g_free(document);
+}
+
+static void test_scroll_detect_horizontal(void)
+{
+    Document *document = document_new();
+    const int stride = STRIDE * 4;
+    const int width = WIDTH - 8;
+    const SpiceRect dest = { .left = 0, .top = 0, .right = width - 5, .bottom = HEIGHT };
+    ScrollDetectMove move;
+
+    g_assert_true(scroll_detect(document_view(document, 0, 0), stride,
+                                document_view(document, 5, 0), stride,
+                                width, HEIGHT, &move));
+    check_move(&move, &dest, 5, 0);
+    g_free(document);
+}
+
+/* bottom-up images are walked with negative strides */
+static void test_scroll_detect_bottom_up(void)
+{
+    Document *document = document_new();
+    Document *flipped = g_new(Document, 1);
+    const int n_lines = G_N_ELEMENTS(document->pixels);
+    const int stride = STRIDE * 4;
+    const SpiceRect dest = { .left = 0, .top = 0, .right = WIDTH, .bottom = HEIGHT - 20 };
+    ScrollDetectMove move;
+    int y;
+
+    for (y = 0; y < n_lines; y++) {
+        memcpy(flipped->pixels[y], document->pixels[n_lines - 1 - y], stride);
+    }
+
+    /* the old content is stored bottom-up, the new one top-down */
+    g_assert_true(scroll_detect(document_view(flipped, 0, n_lines - 1), -stride,
+                                document_view(document, 0, 20), stride,
+                                WIDTH, HEIGHT, &move));
+    check_move(&move, &dest, 0, 20);
+    g_free(flipped);
+    g_free(document);
+}
+
+/* the repaint has a changed part, as a status bar, next to the moved one */
+static void test_scroll_detect_partial(void)
+{
+    Document *document = document_new();
+    Document *repaint = g_new(Document, 1);
+    const int stride = STRIDE * 4;
+    const SpiceRect dest = { .left = 0, .top = 0, .right = WIDTH, .bottom = HEIGHT - 20 };
+    ScrollDetectMove move;
+    int x, y;
+
+    memcpy(repaint, document, sizeof(*repaint));
+    for (y = HEIGHT - 20 + 10; y < HEIGHT + 10; y++) {
+        for (x = 0; x < STRIDE; x++) {
+            repaint->pixels[y][x] = 0xff00ff00;
+        }
+    }
+    /* the high bytes do not matter */
+    for (x = 0; x < STRIDE; x++) {
+        repaint->pixels[20][x] ^= 0xff000000;
+    }
+
+    g_assert_true(scroll_detect(document_view(document, 0, 0), stride,
+                                document_view(repaint, 0, 10), stride,
+                                WIDTH, HEIGHT, &move));
+    check_move(&move, &dest, 0, 10);
+    g_free(repaint);
+    g_free(document);
+}
+
+static void test_scroll_detect_none(void)
+{
+    Document *document = document_new();
+    Document *other = document_new();
+    const int stride = STRIDE * 4;
+    ScrollDetectMove move;
+
+    /* unchanged content is not a move */
+    g_assert_false(scroll_detect(document_view(document, 0, 0), stride,
+                                 document_view(document, 0, 0), stride,
+                                 WIDTH, HEIGHT, &move));
+    /* neither is unrelated content */
+    g_assert_false(scroll_detect(document_view(document, 0, 0), stride,
+                                 document_view(other, 0, 0), stride,
+                                 WIDTH, HEIGHT, &move));
+    /* nor a move of too few lines */
+    g_assert_false(scroll_detect(document_view(document, 0, 0), stride,
+                                 document_view(document, 0, HEIGHT - 10), stride,
+                                 WIDTH, HEIGHT, &move));
+    /* and small areas are not worth it */
+    g_assert_false(scroll_detect(document_view(document, 0, 0), stride,
+                                 document_view(document, 0, 1), stride,
+                                 WIDTH, SCROLL_DETECT_MIN_LINES - 1, &move));
+    g_free(other);
+    g_free(document);
+}
+
+/* the cheap check done before the old content is read */
+static void test_scroll_detect_hashes(void)
+{
+    Document *document = document_new();
+    Document *other = document_new();
+    const int stride = STRIDE * 4;
+    ScrollDetectHashes hashes = { 0, };
+
+    /* nothing to compare the first content with */
+    g_assert_false(scroll_detect_hashes_update(&hashes, document_view(document, 0, 0), stride,
+                                               WIDTH, HEIGHT));
+    /* a vertical move */
+    g_assert_true(scroll_detect_hashes_update(&hashes, document_view(document, 0, 20), stride,
+                                              WIDTH, HEIGHT));
+    /* the size changed */
+    g_assert_false(scroll_detect_hashes_update(&hashes, document_view(document, 0, 20), stride,
+                                               WIDTH - 8, HEIGHT));
+    /* a horizontal move */
+    g_assert_true(scroll_detect_hashes_update(&hashes, document_view(document, 5, 20), stride,
+                                              WIDTH - 8, HEIGHT));
+    /* unchanged content */
+    g_assert_false(scroll_detect_hashes_update(&hashes, document_view(document, 5, 20), stride,
+                                               WIDTH - 8, HEIGHT));
+    /* unrelated content */
+    g_assert_false(scroll_detect_hashes_update(&hashes, document_view(other, 5, 20), stride,
+                                               WIDTH - 8, HEIGHT));
+    scroll_detect_hashes_clear(&hashes);
+    g_assert_null(hashes.row_hashes);
+    g_free(other);
+    g_free(document);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/scroll-detect/vertical", test_scroll_detect_vertical);
+    g_test_add_func("/server/scroll-detect/horizontal", test_scroll_detect_horizontal);
+    g_test_add_func("/server/scroll-detect/bottom-up", test_scroll_detect_bottom_up);
+    g_test_add_func("/server/scroll-detect/partial", test_scroll_detect_partial);
+    g_test_add_func("/server/scroll-detect/none", test_scroll_detect_none);
+    g_test_add_func("/server/scroll-detect/hashes", test_scroll_detect_hashes);
+
+    return g_test_run();
+}
@@ -0,0 +1,92 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Check that the elements of a sparse array keep their value and that only
+ * the chunks of the elements that were accessed are allocated.
+ */
+#include <config.h>
+#include <stdlib.h>
+
+#include "test-glib-compat.h"
+#include "sparse-array.h"
+
+#define NUM_ELEMENTS 10000
+
+typedef struct TestElement {
+    uint32_t value;
+    bool used;
+} TestElement;
+
+static void test_sparse_array_lazy(void)
+{
+    SparseArray *array = sparse_array_new(sizeof(TestElement), NUM_ELEMENTS);
+    TestElement *element;
+
+    g_assert_cmpuint(sparse_array_get_size(array), ==, NUM_ELEMENTS);
+    g_assert_cmpuint(sparse_array_get_allocated_size(array), ==, 0);
+    g_assert_null(sparse_array_lookup(array, 0));
+    g_assert_null(sparse_array_lookup(array, NUM_ELEMENTS - 1));
+
+    element = sparse_array_get(array, NUM_ELEMENTS - 1);
+    g_assert_false(element->used);
+    element->used = true;
+    g_assert_cmpuint(sparse_array_get_allocated_size(array), ==,
+                     SPARSE_ARRAY_CHUNK_SIZE * sizeof(TestElement));
+    g_assert_true(sparse_array_lookup(array, NUM_ELEMENTS - 1) == element);
+    g_assert_null(sparse_array_lookup(array, 0));
+
+    /* same chunk, nothing more is allocated */
+    element = sparse_array_get(array, NUM_ELEMENTS - 2);
+    g_assert_false(element->used);
+    g_assert_cmpuint(sparse_array_get_allocated_size(array), ==,
+                     SPARSE_ARRAY_CHUNK_SIZE * sizeof(TestElement));
+
+    sparse_array_free(array);
+}
+
+static void test_sparse_array_values(void)
+{
+    SparseArray *array = sparse_array_new(sizeof(TestElement), NUM_ELEMENTS);
+    uint32_t i;
+
+    for (i = 0; i < NUM_ELEMENTS; i += 7) {
+        TestElement *element = sparse_array_get(array, i);
+
+        element->value = i;
+        element->used = true;
+    }
+    for (i = 0; i < NUM_ELEMENTS; i++) {
+        TestElement *element = sparse_array_lookup(array, i);
+
+        g_assert_nonnull(element);
+        g_assert_cmpint(element->used, ==, i % 7 == 0);
+        g_assert_cmpuint(element->value, ==, i % 7 == 0 ? i : 0);
+    }
+
+    sparse_array_free(array);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/sparse-array/lazy", test_sparse_array_lazy);
+    g_test_add_func("/server/sparse-array/values", test_sparse_array_values);
+
+    return g_test_run();
+}
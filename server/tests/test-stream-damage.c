@@ -0,0 +1,207 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Check the damage found between the consecutive frames of a stream and
+ * the decision of the video encoders to skip the frames that changed little.
+ */
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test-glib-compat.h"
+#include "stream.h"
+
+/* the frames are an area of bigger bitmaps */
+#define BITMAP_WIDTH 64
+#define BITMAP_HEIGHT 48
+/* not a multiple of the blocks, the last ones are partial */
+#define WIDTH 40
+#define HEIGHT 36
+#define SRC_LEFT 8
+#define SRC_TOP 4
+
+typedef struct Frame {
+    RedDrawable drawable;
+    SpiceImage image;
+    SpiceChunks *chunks;
+    uint32_t pixels[BITMAP_HEIGHT][BITMAP_WIDTH];
+} Frame;
+
+static Frame *frame_new(bool top_down)
+{
+    Frame *frame = g_new0(Frame, 1);
+    SpiceBitmap *bitmap = &frame->image.u.bitmap;
+    int x, y;
+
+    for (y = 0; y < BITMAP_HEIGHT; y++) {
+        for (x = 0; x < BITMAP_WIDTH; x++) {
+            frame->pixels[y][x] = (y << 8) | x;
+        }
+    }
+    frame->chunks = spice_chunks_new(1);
+    frame->chunks->data_size = sizeof(frame->pixels);
+    frame->chunks->chunk[0].data = (uint8_t *)frame->pixels;
+    frame->chunks->chunk[0].len = sizeof(frame->pixels);
+
+    frame->image.descriptor.type = SPICE_IMAGE_TYPE_BITMAP;
+    bitmap->format = SPICE_BITMAP_FMT_32BIT;
+    bitmap->flags = top_down ? SPICE_BITMAP_FLAGS_TOP_DOWN : 0;
+    bitmap->x = BITMAP_WIDTH;
+    bitmap->y = BITMAP_HEIGHT;
+    bitmap->stride = sizeof(frame->pixels[0]);
+    bitmap->data = frame->chunks;
+
+    frame->drawable.type = QXL_DRAW_COPY;
+    frame->drawable.bbox.left = 100;
+    frame->drawable.bbox.top = 200;
+    frame->drawable.bbox.right = 100 + WIDTH;
+    frame->drawable.bbox.bottom = 200 + HEIGHT;
+    frame->drawable.u.copy.src_bitmap = &frame->image;
+    frame->drawable.u.copy.src_area.left = SRC_LEFT;
+    frame->drawable.u.copy.src_area.top = SRC_TOP;
+    frame->drawable.u.copy.src_area.right = SRC_LEFT + WIDTH;
+    frame->drawable.u.copy.src_area.bottom = SRC_TOP + HEIGHT;
+    return frame;
+}
+
+static void frame_free(Frame *frame)
+{
+    spice_chunks_destroy(frame->chunks);
+    g_free(frame);
+}
+
+/* changes the pixel shown at @x, @y of the frame */
+static void frame_change_pixel(Frame *frame, int x, int y)
+{
+    int line = SRC_TOP + y;
+
+    if (!(frame->image.u.bitmap.flags & SPICE_BITMAP_FLAGS_TOP_DOWN)) {
+        line = BITMAP_HEIGHT - 1 - line;
+    }
+    frame->pixels[line][SRC_LEFT + x] ^= 0x00ff0000;
+}
+
+static void check_damage(const Frame *prev, const Frame *frame,
+                         const SpiceRect *rects, int n_rects)
+{
+    QRegion damage, expected;
+    int i;
+
+    region_init(&damage);
+    region_init(&expected);
+    for (i = 0; i < n_rects; i++) {
+        region_add(&expected, &rects[i]);
+    }
+    stream_frame_get_damage(&prev->drawable, &frame->drawable, &damage);
+    g_assert_true(region_is_equal(&damage, &expected));
+    region_destroy(&expected);
+    region_destroy(&damage);
+}
+
+static void test_stream_damage_blocks(gconstpointer data)
+{
+    bool top_down = GPOINTER_TO_INT(data);
+    Frame *prev = frame_new(top_down);
+    Frame *frame = frame_new(top_down);
+    const SpiceRect blocks[] = {
+        /* a change in a block */
+        { .left = 16, .top = 0, .right = 32, .bottom = 16 },
+        /* changes in consecutive blocks of a row, the last one partial */
+        { .left = 16, .top = 16, .right = WIDTH, .bottom = 32 },
+        /* the last row is partial too */
+        { .left = 0, .top = 32, .right = 16, .bottom = HEIGHT },
+    };
+
+    /* the same content is no damage */
+    check_damage(prev, frame, NULL, 0);
+
+    frame_change_pixel(frame, 20, 5);
+    frame_change_pixel(frame, 31, 20);
+    frame_change_pixel(frame, 32, 31);
+    frame_change_pixel(frame, 0, HEIGHT - 1);
+    check_damage(prev, frame, blocks, G_N_ELEMENTS(blocks));
+
+    frame_free(frame);
+    frame_free(prev);
+}
+
+/* the frames that cannot be compared are damaged all over */
+static void test_stream_damage_all(void)
+{
+    const SpiceRect all = { .left = 0, .top = 0, .right = WIDTH, .bottom = HEIGHT };
+    Frame *prev = frame_new(TRUE);
+    Frame *frame = frame_new(TRUE);
+
+    frame->drawable.bbox.left++;
+    frame->drawable.bbox.right++;
+    check_damage(prev, frame, &all, 1);
+    frame_free(frame);
+
+    frame = frame_new(FALSE);
+    frame->image.u.bitmap.format = SPICE_BITMAP_FMT_16BIT;
+    check_damage(prev, frame, &all, 1);
+    frame_free(frame);
+
+    frame = frame_new(TRUE);
+    frame->image.descriptor.type = SPICE_IMAGE_TYPE_QUIC;
+    check_damage(prev, frame, &all, 1);
+    frame_free(frame);
+
+    frame_free(prev);
+}
+
+static void test_stream_damage_skip(void)
+{
+    const SpiceRect src = { .left = 0, .top = 0, .right = 640, .bottom = 480 };
+    const SpiceRect block = { .left = 16, .top = 16, .right = 32, .bottom = 32 };
+    const SpiceRect half = { .left = 0, .top = 0, .right = 640, .bottom = 240 };
+    QRegion damage;
+
+    region_init(&damage);
+
+    /* unchanged frames */
+    g_assert_true(video_encoder_can_skip_frame(&damage, &src, 0));
+    /* a small change, sent at most once per interval */
+    region_add(&damage, &block);
+    g_assert_true(video_encoder_can_skip_frame(&damage, &src, 0));
+    g_assert_true(video_encoder_can_skip_frame(&damage, &src,
+                                               VIDEO_ENCODER_SMALL_DAMAGE_INTERVAL - 1));
+    g_assert_false(video_encoder_can_skip_frame(&damage, &src,
+                                                VIDEO_ENCODER_SMALL_DAMAGE_INTERVAL));
+    /* a big change */
+    region_add(&damage, &half);
+    g_assert_false(video_encoder_can_skip_frame(&damage, &src, 0));
+    /* no damage when no frame follows, this one is not skipped */
+    g_assert_false(video_encoder_can_skip_frame(NULL, &src, 0));
+
+    region_destroy(&damage);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_data_func("/server/stream-damage/blocks/top-down", GINT_TO_POINTER(TRUE),
+                         test_stream_damage_blocks);
+    g_test_add_data_func("/server/stream-damage/blocks/bottom-up", GINT_TO_POINTER(FALSE),
+                         test_stream_damage_blocks);
+    g_test_add_func("/server/stream-damage/all", test_stream_damage_all);
+    g_test_add_func("/server/stream-damage/skip", test_stream_damage_skip);
+
+    return g_test_run();
+}
@@ -21,9 +21,19 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <glib.h>
+#include <openssl/ssl.h>
+
 #include <common/log.h>
 #include "reds-stream.h"
 #include "basic-event-loop.h"
@@ -98,6 +108,245 @@ sock_fd_read(int sock, void *buf, ssize_t bufsize, int *fd)
     return size;
 }
 
+/* the part of @iov after its first @offset bytes */
+static int iov_skip(const struct iovec *iov, int iovcnt, size_t offset, struct iovec *out)
+{
+    int n = 0;
+
+    for (; iovcnt > 0 && offset >= iov->iov_len; iov++, iovcnt--) {
+        offset -= iov->iov_len;
+    }
+    for (; iovcnt > 0; iov++, iovcnt--, n++) {
+        out[n].iov_base = (uint8_t *)iov->iov_base + offset;
+        out[n].iov_len = iov->iov_len - offset;
+        offset = 0;
+    }
+    return n;
+}
+
+/* fills @data and splits it in @iovcnt buffers of sizes from 1 to 4096 */
+static void make_iov(uint8_t *data, size_t size, struct iovec *iov, int iovcnt)
+{
+    size_t pos;
+    int i;
+
+    for (pos = 0; pos < size; pos++) {
+        data[pos] = pos * 7;
+    }
+    pos = 0;
+    for (i = 0; i < iovcnt; i++) {
+        size_t len = i == iovcnt - 1 ? size - pos : MIN(1 + (i * 37) % 4096, size - pos);
+
+        iov[i].iov_base = data + pos;
+        iov[i].iov_len = len;
+        pos += len;
+    }
+    spice_assert(pos == size);
+}
+
+typedef ssize_t (*stream_writev_func)(RedsStream *s, const struct iovec *iov, int iovcnt);
+
+/* writes @iov to @stream while reading it from @fd, both non-blocking */
+static void writev_and_check(RedsStream *stream, stream_writev_func writev_func, int fd,
+                             const struct iovec *iov, int iovcnt, const uint8_t *data,
+                             size_t size)
+{
+    struct iovec *left = g_new(struct iovec, iovcnt);
+    uint8_t *received = g_malloc(size);
+    size_t sent = 0, pos = 0;
+
+    while (pos < size) {
+        ssize_t n;
+
+        if (sent < size) {
+            n = writev_func(stream, left, iov_skip(iov, iovcnt, sent, left));
+            spice_assert(n > 0 || errno == EAGAIN);
+            if (n > 0) {
+                sent += n;
+            }
+        }
+        n = read(fd, received + pos, size - pos);
+        spice_assert(n > 0 || errno == EAGAIN);
+        if (n > 0) {
+            pos += n;
+        }
+    }
+    spice_assert(sent == size);
+    spice_assert(memcmp(received, data, size) == 0);
+    g_free(received);
+    g_free(left);
+}
+
+/* more buffers than a writev() takes */
+#define PLAIN_IOVCNT 2000
+
+static void test_plain_writev(void)
+{
+    struct iovec iov[PLAIN_IOVCNT];
+    const size_t size = 256 * 1024;
+    uint8_t *data = g_malloc(size);
+    RedsStream *stream;
+    int sv[2];
+
+    spice_assert(socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) == 0);
+    spice_assert(fcntl(sv[0], F_SETFL, O_NONBLOCK) == 0);
+    spice_assert(fcntl(sv[1], F_SETFL, O_NONBLOCK) == 0);
+    stream = reds_stream_new(server, sv[0]);
+
+    make_iov(data, size, iov, PLAIN_IOVCNT);
+    writev_and_check(stream, reds_stream_writev, sv[1], iov, PLAIN_IOVCNT, data, size);
+
+    reds_stream_free(stream);
+    close(sv[1]);
+    g_free(data);
+}
+
+/* connects two TCP sockets through the loopback interface */
+static void tcp_socketpair(int sv[2])
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    spice_assert(listen_fd >= 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    spice_assert(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    spice_assert(listen(listen_fd, 1) == 0);
+    spice_assert(getsockname(listen_fd, (struct sockaddr *)&addr, &len) == 0);
+
+    sv[1] = socket(AF_INET, SOCK_STREAM, 0);
+    spice_assert(sv[1] >= 0);
+    spice_assert(connect(sv[1], (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    sv[0] = accept(listen_fd, NULL, NULL);
+    spice_assert(sv[0] >= 0);
+    close(listen_fd);
+}
+
+static void test_zerocopy_writev(void)
+{
+    struct iovec iov[8];
+    const size_t size = 1024 * 1024;
+    uint8_t *data = g_malloc(size);
+    RedsStream *stream;
+    int sv[2];
+    int tries;
+
+    tcp_socketpair(sv);
+    spice_assert(fcntl(sv[0], F_SETFL, O_NONBLOCK) == 0);
+    spice_assert(fcntl(sv[1], F_SETFL, O_NONBLOCK) == 0);
+    stream = reds_stream_new(server, sv[0]);
+    if (!reds_stream_enable_zerocopy(stream)) {
+        printf("MSG_ZEROCOPY not supported, skipping the zero-copy writes\n");
+        reds_stream_free(stream);
+        close(sv[1]);
+        g_free(data);
+        return;
+    }
+
+    make_iov(data, size, iov, G_N_ELEMENTS(iov));
+    writev_and_check(stream, reds_stream_writev_zerocopy, sv[1],
+                     iov, G_N_ELEMENTS(iov), data, size);
+    spice_assert(reds_stream_get_zerocopy_sent(stream) > 0);
+
+    /* the data must be kept until the kernel is done with it */
+    for (tries = 0; reds_stream_get_zerocopy_completed(stream) !=
+                    reds_stream_get_zerocopy_sent(stream); tries++) {
+        struct pollfd pfd = { .fd = sv[0], .events = 0 };
+
+        spice_assert(tries < 10);
+        poll(&pfd, 1, 1000);
+    }
+
+    reds_stream_free(stream);
+    close(sv[1]);
+    g_free(data);
+}
+
+typedef struct {
+    int fd;
+    size_t size;
+    uint8_t *received;
+} SslClient;
+
+/* connects to the server and reads everything it sends */
+static gpointer ssl_client_thread(gpointer data)
+{
+    SslClient *client = data;
+    SSL_CTX *ctx = SSL_CTX_new(SSLv23_client_method());
+    SSL *ssl;
+    size_t pos = 0;
+
+    spice_assert(ctx != NULL);
+    ssl = SSL_new(ctx);
+    spice_assert(ssl != NULL);
+    SSL_set_fd(ssl, client->fd);
+    spice_assert(SSL_connect(ssl) == 1);
+    while (pos < client->size) {
+        int n = SSL_read(ssl, client->received + pos, MIN(client->size - pos, INT_MAX));
+
+        spice_assert(n > 0);
+        pos += n;
+    }
+    SSL_free(ssl);
+    SSL_CTX_free(ctx);
+    return NULL;
+}
+
+/* Small buffers are gathered before being encrypted, and large ones
+ * encrypted in place. The client must receive them in order either way. */
+static void test_ssl_writev(void)
+{
+    struct iovec iov[64], left[64];
+    const size_t size = 256 * 1024;
+    uint8_t *data = g_malloc(size);
+    SslClient client;
+    SSL_CTX *ctx;
+    RedsStream *stream;
+    GThread *thread;
+    size_t sent = 0;
+    int sv[2];
+
+    ctx = SSL_CTX_new(SSLv23_server_method());
+    spice_assert(ctx != NULL);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    /* the test key is too small for the default level of some systems */
+    SSL_CTX_set_security_level(ctx, 0);
+#endif
+    spice_assert(SSL_CTX_use_certificate_chain_file(ctx, SPICE_TOP_SRCDIR
+                                                    "/server/tests/pki/server-cert.pem") == 1);
+    spice_assert(SSL_CTX_use_PrivateKey_file(ctx, SPICE_TOP_SRCDIR
+                                             "/server/tests/pki/server-key.pem",
+                                             SSL_FILETYPE_PEM) == 1);
+
+    spice_assert(socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) == 0);
+    client.fd = sv[1];
+    client.size = size;
+    client.received = g_malloc(size);
+    thread = g_thread_new("ssl-client", ssl_client_thread, &client);
+
+    stream = reds_stream_new(server, sv[0]);
+    spice_assert(reds_stream_enable_ssl(stream, ctx) == REDS_STREAM_SSL_STATUS_OK);
+
+    make_iov(data, size, iov, G_N_ELEMENTS(iov));
+    while (sent < size) {
+        ssize_t n = reds_stream_writev(stream, left,
+                                       iov_skip(iov, G_N_ELEMENTS(iov), sent, left));
+
+        spice_assert(n > 0);
+        sent += n;
+    }
+    g_thread_join(thread);
+    spice_assert(memcmp(client.received, data, size) == 0);
+
+    reds_stream_free(stream);
+    close(sv[1]);
+    SSL_CTX_free(ctx);
+    g_free(client.received);
+    g_free(data);
+}
+
 int main(int argc, char *argv[])
 {
     RedsStream *st[2];
@@ -153,5 +402,9 @@ int main(int argc, char *argv[])
     reds_stream_free(st[0]);
     reds_stream_free(st[1]);
 
+    test_plain_writev();
+    test_zerocopy_writev();
+    test_ssl_writev();
+
     return 0;
 }
@@ -0,0 +1,248 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Check the spatial index of the drawable tree against a linear walk of the
+ * ring while items are added, replaced, shrunk and removed.
+ * Run with "-m perf" to compare the cost of finding the next intersecting
+ * item with both methods as the number of items grows.
+ */
+#include <config.h>
+#include <stdlib.h>
+
+#include "test-glib-compat.h"
+#include "tree-index.h"
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define NUM_OPERATIONS 20000
+#define BENCHMARK_QUERIES 2000
+
+static TreeItem *test_item_new(int x, int y, int width, int height)
+{
+    TreeItem *item = spice_new0(TreeItem, 1);
+    SpiceRect rect = { .left = x, .top = y, .right = x + width, .bottom = y + height };
+
+    item->type = TREE_ITEM_TYPE_NONE;
+    ring_item_init(&item->siblings_link);
+    region_init(&item->rgn);
+    region_add(&item->rgn, &rect);
+
+    return item;
+}
+
+static TreeItem *test_item_new_random(void)
+{
+    int width = g_test_rand_int_range(1, 300);
+    int height = g_test_rand_int_range(1, 300);
+
+    /* shadows can be partly out of the surface */
+    return test_item_new(g_test_rand_int_range(-50, WIDTH - width + 50),
+                         g_test_rand_int_range(-50, HEIGHT - height + 50),
+                         width, height);
+}
+
+static void test_item_free(TreeItem *item)
+{
+    tree_index_remove(item);
+    ring_remove(&item->siblings_link);
+    region_destroy(&item->rgn);
+    free(item);
+}
+
+static TreeItem *ring_nth_item(Ring *ring, int n)
+{
+    RingItem *link = ring_get_head(ring);
+
+    while (n-- > 0) {
+        link = ring_next(ring, link);
+    }
+    return SPICE_CONTAINEROF(link, TreeItem, siblings_link);
+}
+
+static bool box_intersects(const pixman_box32_t *a, const pixman_box32_t *b)
+{
+    return a->x1 < b->x2 && a->x2 > b->x1 && a->y1 < b->y2 && a->y2 > b->y1;
+}
+
+/* the items skipped by the index cannot intersect @box, the returned one may */
+static void check_next(Ring *ring, TreeItem *item, const pixman_box32_t *box)
+{
+    TreeItem *next = tree_index_next(item, box);
+    RingItem *link = &item->siblings_link;
+
+    while ((link = ring_next(ring, link))) {
+        TreeItem *now = SPICE_CONTAINEROF(link, TreeItem, siblings_link);
+
+        if (now == next) {
+            return;
+        }
+        g_assert_false(box_intersects(&now->rgn.extents, box));
+    }
+    g_assert_null(next);
+}
+
+static void test_tree_index_operations(void)
+{
+    TreeIndex *index = tree_index_new(WIDTH, HEIGHT);
+    TreeIndexStat stat;
+    Ring ring;
+    int n_items = 0;
+    int i;
+
+    ring_init(&ring);
+    for (i = 0; i < NUM_OPERATIONS; i++) {
+        int op = n_items ? g_test_rand_int_range(0, 5) : 0;
+        TreeItem *item, *other;
+        pixman_box32_t box;
+
+        switch (op) {
+        case 0:
+            item = test_item_new_random();
+            ring_add(&ring, &item->siblings_link);
+            tree_index_add_head(index, item);
+            n_items++;
+            break;
+        case 1:
+            other = ring_nth_item(&ring, g_test_rand_int_range(0, n_items));
+            item = test_item_new_random();
+            ring_add_after(&item->siblings_link, &other->siblings_link);
+            tree_index_replace(other, item);
+            g_assert_null(other->index_pos.index);
+            test_item_free(other);
+            break;
+        case 2:
+            /* the regions of the items only shrink once they are in the tree */
+            item = ring_nth_item(&ring, g_test_rand_int_range(0, n_items));
+            if (item->rgn.extents.x2 - item->rgn.extents.x1 > 1) {
+                SpiceRect rect = {
+                    .left = item->rgn.extents.x1 + 1, .top = item->rgn.extents.y1,
+                    .right = item->rgn.extents.x2, .bottom = item->rgn.extents.y2,
+                };
+                QRegion rgn;
+
+                region_init(&rgn);
+                region_add(&rgn, &rect);
+                region_and(&item->rgn, &rgn);
+                region_destroy(&rgn);
+            }
+            break;
+        case 3:
+            if (n_items > 100) {
+                test_item_free(ring_nth_item(&ring, g_test_rand_int_range(0, n_items)));
+                n_items--;
+            }
+            break;
+        default:
+            item = ring_nth_item(&ring, g_test_rand_int_range(0, n_items));
+            box.x1 = g_test_rand_int_range(0, WIDTH);
+            box.y1 = g_test_rand_int_range(0, HEIGHT);
+            box.x2 = box.x1 + g_test_rand_int_range(1, 200);
+            box.y2 = box.y1 + g_test_rand_int_range(1, 200);
+            check_next(&ring, item, &box);
+            break;
+        }
+    }
+
+    tree_index_stat_get(index, &stat);
+    g_assert_cmpuint(stat.n_items, ==, n_items);
+    while (!ring_is_empty(&ring)) {
+        test_item_free(ring_nth_item(&ring, 0));
+    }
+    tree_index_stat_get(index, &stat);
+    g_assert_cmpuint(stat.n_items, ==, 0);
+    tree_index_free(index);
+}
+
+static void benchmark_items(int n_items)
+{
+    TreeIndex *index = tree_index_new(WIDTH, HEIGHT);
+    TreeItem *head = NULL;
+    TreeItem **items = spice_new(TreeItem *, n_items);
+    int queries[BENCHMARK_QUERIES];
+    double linear_elapsed, index_elapsed;
+    Ring ring;
+    int i;
+
+    /* a desktop full of small glyphs and icons */
+    ring_init(&ring);
+    for (i = 0; i < n_items; i++) {
+        items[i] = test_item_new(g_test_rand_int_range(0, WIDTH - 32),
+                                 g_test_rand_int_range(0, HEIGHT - 16),
+                                 g_test_rand_int_range(8, 32), 16);
+        ring_add(&ring, &items[i]->siblings_link);
+        tree_index_add_head(index, items[i]);
+    }
+    head = items[n_items - 1];
+    for (i = 0; i < BENCHMARK_QUERIES; i++) {
+        queries[i] = g_test_rand_int_range(0, n_items - 1);
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < BENCHMARK_QUERIES; i++) {
+        const pixman_box32_t *box = &items[queries[i]]->rgn.extents;
+        RingItem *link = &head->siblings_link;
+
+        while ((link = ring_next(&ring, link))) {
+            TreeItem *now = SPICE_CONTAINEROF(link, TreeItem, siblings_link);
+
+            if (box_intersects(&now->rgn.extents, box)) {
+                break;
+            }
+        }
+    }
+    linear_elapsed = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    for (i = 0; i < BENCHMARK_QUERIES; i++) {
+        tree_index_next(head, &items[queries[i]]->rgn.extents);
+    }
+    index_elapsed = g_test_timer_elapsed();
+
+    g_test_minimized_result(index_elapsed * 1000000 / BENCHMARK_QUERIES,
+                            "%d items: %.2f us per linear walk, %.2f us per index query",
+                            n_items,
+                            linear_elapsed * 1000000 / BENCHMARK_QUERIES,
+                            index_elapsed * 1000000 / BENCHMARK_QUERIES);
+
+    for (i = 0; i < n_items; i++) {
+        test_item_free(items[i]);
+    }
+    free(items);
+    tree_index_free(index);
+}
+
+static void test_tree_index_benchmark(void)
+{
+    int n_items;
+
+    for (n_items = 100; n_items <= 100000; n_items *= 10) {
+        benchmark_items(n_items);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/tree-index/operations", test_tree_index_operations);
+    if (g_test_perf()) {
+        g_test_add_func("/server/tree-index/benchmark", test_tree_index_benchmark);
+    }
+
+    return g_test_run();
+}
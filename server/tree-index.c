@@ -0,0 +1,245 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <glib.h>
+#include <common/mem.h>
+#include <common/log.h>
+
+#include "tree-index.h"
+
+typedef struct TreeIndexEntry {
+    uint64_t z;
+    TreeItem *item;
+    /* bounding box of the item when it was added */
+    int32_t x1, y1, x2, y2;
+} TreeIndexEntry;
+
+typedef struct TreeIndexCell {
+    /* ordered by increasing z, so the head of the ring is at the end */
+    TreeIndexEntry *entries;
+    uint32_t n_entries;
+    uint32_t size;
+} TreeIndexCell;
+
+struct TreeIndex {
+    uint32_t cols;
+    uint32_t rows;
+    TreeIndexCell *cells;
+    uint64_t top_z;
+    TreeIndexStat stat;
+};
+
+TreeIndex *tree_index_new(uint32_t width, uint32_t height)
+{
+    TreeIndex *index = spice_new0(TreeIndex, 1);
+
+    index->cols = MAX(1, (width + TREE_INDEX_CELL_SIZE - 1) / TREE_INDEX_CELL_SIZE);
+    index->rows = MAX(1, (height + TREE_INDEX_CELL_SIZE - 1) / TREE_INDEX_CELL_SIZE);
+    index->cells = spice_new0(TreeIndexCell, index->cols * index->rows);
+
+    return index;
+}
+
+void tree_index_free(TreeIndex *index)
+{
+    uint32_t i;
+
+    if (!index) {
+        return;
+    }
+
+    spice_warn_if_fail(index->stat.n_items == 0);
+    for (i = 0; i < index->cols * index->rows; i++) {
+        free(index->cells[i].entries);
+    }
+    free(index->cells);
+    free(index);
+}
+
+static uint16_t cell_coord(int32_t coord, uint32_t n_cells)
+{
+    /* shadows can be partly outside of the surface */
+    if (coord <= 0) {
+        return 0;
+    }
+    return MIN((uint32_t)coord / TREE_INDEX_CELL_SIZE, n_cells - 1);
+}
+
+/* Returns the position of the first entry of @cell whose z is not below @z */
+static uint32_t cell_lower_bound(const TreeIndexCell *cell, uint64_t z)
+{
+    uint32_t low = 0, high = cell->n_entries;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+
+        if (cell->entries[mid].z < z) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static void tree_index_insert(TreeIndex *index, TreeItem *item, uint64_t z)
+{
+    const pixman_box32_t *box = &item->rgn.extents;
+    TreeIndexPos *pos = &item->index_pos;
+    uint32_t x, y;
+
+    spice_return_if_fail(pos->index == NULL);
+
+    pos->index = index;
+    pos->z = z;
+    pos->cell_x1 = cell_coord(box->x1, index->cols);
+    pos->cell_y1 = cell_coord(box->y1, index->rows);
+    pos->cell_x2 = cell_coord(box->x2 - 1, index->cols);
+    pos->cell_y2 = cell_coord(box->y2 - 1, index->rows);
+
+    for (y = pos->cell_y1; y <= pos->cell_y2; y++) {
+        for (x = pos->cell_x1; x <= pos->cell_x2; x++) {
+            TreeIndexCell *cell = &index->cells[y * index->cols + x];
+            uint32_t i = cell_lower_bound(cell, z);
+            TreeIndexEntry *entry;
+
+            if (cell->n_entries == cell->size) {
+                cell->size = MAX(8, cell->size * 2);
+                cell->entries = spice_renew(TreeIndexEntry, cell->entries, cell->size);
+            }
+            entry = &cell->entries[i];
+            memmove(entry + 1, entry, (cell->n_entries - i) * sizeof(*entry));
+            cell->n_entries++;
+            entry->z = z;
+            entry->item = item;
+            entry->x1 = box->x1;
+            entry->y1 = box->y1;
+            entry->x2 = box->x2;
+            entry->y2 = box->y2;
+        }
+    }
+    index->stat.n_items++;
+}
+
+void tree_index_add_head(TreeIndex *index, TreeItem *item)
+{
+    tree_index_insert(index, item, ++index->top_z);
+}
+
+void tree_index_replace(TreeItem *old, TreeItem *item)
+{
+    TreeIndex *index = old->index_pos.index;
+    uint64_t z = old->index_pos.z;
+
+    spice_return_if_fail(index != NULL);
+
+    tree_index_remove(old);
+    tree_index_insert(index, item, z);
+}
+
+void tree_index_remove(TreeItem *item)
+{
+    TreeIndexPos *pos = &item->index_pos;
+    TreeIndex *index = pos->index;
+    uint32_t x, y;
+
+    if (!index) {
+        return;
+    }
+
+    for (y = pos->cell_y1; y <= pos->cell_y2; y++) {
+        for (x = pos->cell_x1; x <= pos->cell_x2; x++) {
+            TreeIndexCell *cell = &index->cells[y * index->cols + x];
+            uint32_t i = cell_lower_bound(cell, pos->z);
+
+            /* several entries have the same z while an item is replaced */
+            while (i < cell->n_entries && cell->entries[i].item != item) {
+                i++;
+            }
+            spice_assert(i < cell->n_entries);
+            cell->n_entries--;
+            memmove(&cell->entries[i], &cell->entries[i + 1],
+                    (cell->n_entries - i) * sizeof(TreeIndexEntry));
+        }
+    }
+    pos->index = NULL;
+    index->stat.n_items--;
+}
+
+static inline bool entry_intersects(const TreeIndexEntry *entry, const pixman_box32_t *box)
+{
+    return entry->x1 < box->x2 && entry->x2 > box->x1 &&
+           entry->y1 < box->y2 && entry->y2 > box->y1;
+}
+
+TreeItem *tree_index_next(TreeItem *item, const pixman_box32_t *box)
+{
+    TreeIndex *index = item->index_pos.index;
+    uint64_t z = item->index_pos.z;
+    const TreeIndexEntry *best = NULL;
+    uint32_t x, y, x1, y1, x2, y2;
+
+    spice_return_val_if_fail(index != NULL, NULL);
+
+    index->stat.queries++;
+    if (box->x2 <= box->x1 || box->y2 <= box->y1) {
+        return NULL;
+    }
+    x1 = cell_coord(box->x1, index->cols);
+    y1 = cell_coord(box->y1, index->rows);
+    x2 = cell_coord(box->x2 - 1, index->cols);
+    y2 = cell_coord(box->y2 - 1, index->rows);
+
+    /* the next item in the ring is the one with the greatest z below @item's */
+    for (y = y1; y <= y2; y++) {
+        for (x = x1; x <= x2; x++) {
+            const TreeIndexCell *cell = &index->cells[y * index->cols + x];
+            uint32_t i = cell_lower_bound(cell, z);
+
+            while (i-- > 0) {
+                const TreeIndexEntry *entry = &cell->entries[i];
+
+                index->stat.visited++;
+                if (best && entry->z <= best->z) {
+                    break;
+                }
+                if (entry_intersects(entry, box)) {
+                    best = entry;
+                    break;
+                }
+            }
+        }
+    }
+
+    return best ? best->item : NULL;
+}
+
+void tree_index_stat_get(const TreeIndex *index, TreeIndexStat *stat)
+{
+    *stat = index->stat;
+}
+
+void tree_index_stat_reset(TreeIndex *index)
+{
+    index->stat.queries = 0;
+    index->stat.visited = 0;
+}
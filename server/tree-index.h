@@ -0,0 +1,69 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2026 agent <agent@local>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TREE_INDEX_H_
+#define TREE_INDEX_H_
+
+#include "tree.h"
+
+/* Spatial index of the items at the root of the tree of a surface.
+ *
+ * The surface is divided in a grid of TREE_INDEX_CELL_SIZE pixels cells. Each
+ * cell lists, ordered by z, the items whose bounding box intersected it when
+ * they were added. This allows finding the next item of the ring that may
+ * intersect an area without visiting all the items in between, which would
+ * otherwise make adding a drawable O(n) in the number of drawables.
+ *
+ * The z of an item follows its position in the ring, so items can only be
+ * added at the head of the ring or take the place of an item that leaves the
+ * root of the tree.
+ *
+ * The boxes are not updated when the regions of the items shrink, so the
+ * items returned by tree_index_next() may not intersect the area anymore and
+ * still need to be checked by the caller.
+ */
+
+#define TREE_INDEX_CELL_SIZE 128
+
+typedef struct TreeIndexStat {
+    uint64_t queries;
+    /* cell entries looked at by the queries */
+    uint64_t visited;
+    uint32_t n_items;
+} TreeIndexStat;
+
+TreeIndex *tree_index_new(uint32_t width, uint32_t height);
+/* all the items must have been removed */
+void tree_index_free(TreeIndex *index);
+
+/* @item was added at the head of the ring */
+void tree_index_add_head(TreeIndex *index, TreeItem *item);
+/* @item takes the place of @old in the ring, @old leaves the root of the
+ * tree and is removed from the index */
+void tree_index_replace(TreeItem *old, TreeItem *item);
+/* does nothing if @item is not indexed */
+void tree_index_remove(TreeItem *item);
+
+/* Returns the first indexed item following @item in the ring whose bounding
+ * box intersects @box, or NULL if there is none. @item must be indexed. */
+TreeItem *tree_index_next(TreeItem *item, const pixman_box32_t *box);
+
+void tree_index_stat_get(const TreeIndex *index, TreeIndexStat *stat);
+void tree_index_stat_reset(TreeIndex *index);
+
+#endif /* TREE_INDEX_H_ */
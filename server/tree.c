@@ -23,6 +23,7 @@
 #include "red-parse-qxl.h"
 #include "display-channel.h"
 #include "tree.h"
+#include "tree-index.h"
 
 static const char *draw_type_to_str(uint8_t type)
 {
@@ -201,6 +202,7 @@ Shadow* shadow_new(DrawItem *item, const SpicePoint *delta)
     shadow->base.container = NULL;
     region_clone(&shadow->base.rgn, &item->base.rgn);
     region_offset(&shadow->base.rgn, delta->x, delta->y);
+    shadow->base.index_pos.index = NULL;
     ring_item_init(&shadow->base.siblings_link);
     region_init(&shadow->on_hold);
     item->shadow = shadow;
@@ -222,9 +224,13 @@ Container* container_new(DrawItem *item)
     item->base.container = container;
     item->container_root = TRUE;
     region_clone(&container->base.rgn, &item->base.rgn);
+    container->base.index_pos.index = NULL;
     ring_item_init(&container->base.siblings_link);
     ring_add_after(&container->base.siblings_link, &item->base.siblings_link);
     ring_remove(&item->base.siblings_link);
+    if (item->base.index_pos.index) {
+        tree_index_replace(&item->base, &container->base);
+    }
     ring_init(&container->items);
     ring_add(&container->items, &item->base.siblings_link);
 
@@ -235,6 +241,7 @@ void container_free(Container *container)
 {
     spice_return_if_fail(ring_is_empty(&container->items));
 
+    tree_index_remove(&container->base);
     ring_remove(&container->base.siblings_link);
     region_destroy(&container->base.rgn);
     free(container);
@@ -253,6 +260,9 @@ void container_cleanup(Container *container)
             ring_remove(&item->siblings_link);
             ring_add_after(&item->siblings_link, &container->base.siblings_link);
             item->container = container->base.container;
+            if (container->base.index_pos.index) {
+                tree_index_replace(&container->base, item);
+            }
         }
         container_free(container);
         container = next;
@@ -305,6 +315,7 @@ void draw_item_remove_shadow(DrawItem *item)
     }
     shadow = item->shadow;
     item->shadow = NULL;
+    tree_index_remove(&shadow->base);
     ring_remove(&shadow->base.siblings_link);
     region_destroy(&shadow->base.rgn);
     region_destroy(&shadow->on_hold);
@@ -38,6 +38,18 @@ typedef struct TreeItem TreeItem;
 typedef struct Shadow Shadow;
 typedef struct Container Container;
 typedef struct DrawItem DrawItem;
+typedef struct TreeIndex TreeIndex;
+
+/* Position of an item at the root of the tree in the spatial index of its
+ * surface, see tree-index.h */
+typedef struct TreeIndexPos {
+    /* NULL if the item is not indexed */
+    TreeIndex *index;
+    /* items closer to the head of the ring have a greater z */
+    uint64_t z;
+    /* range of grid cells the item was added to */
+    uint16_t cell_x1, cell_y1, cell_x2, cell_y2;
+} TreeIndexPos;
 
 /* TODO consider GNode instead */
 struct TreeItem {
@@ -48,6 +60,7 @@ struct TreeItem {
      * tree, this region may be modified to exclude the portion of the item
      * that is obscured by other items */
     QRegion rgn;
+    TreeIndexPos index_pos;
 };
 
 /* A region "below" a copy, or the src region of the copy */
@@ -18,7 +18,12 @@
 #include <config.h>
 #endif
 
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include <glib.h>
+#include <common/log.h>
+
 #include "utils.h"
 
 int rgb32_data_has_alpha(int width, int height, size_t stride,
@@ -48,3 +53,42 @@ int rgb32_data_has_alpha(int width, int height, size_t stride,
     *all_set_out = has_alpha;
     return has_alpha;
 }
+
+bool spice_env_get_bool(const char *name, bool default_value)
+{
+    const char *env_str = getenv(name);
+
+    if (env_str == NULL) {
+        return default_value;
+    }
+    if (strcmp(env_str, "0") != 0 && strcmp(env_str, "1") != 0) {
+        spice_warning("invalid %s value '%s', expected 0 or 1", name, env_str);
+        return default_value;
+    }
+
+    return env_str[0] == '1';
+}
+
+uint64_t spice_env_get_uint(const char *name, uint64_t default_value,
+                            uint64_t min, uint64_t max)
+{
+    const char *env_str = getenv(name);
+    guint64 value;
+    char *end;
+
+    if (env_str == NULL) {
+        return default_value;
+    }
+
+    errno = 0;
+    value = g_ascii_strtoull(env_str, &end, 10);
+    /* the leading spaces and sign accepted by g_ascii_strtoull() are not */
+    if (!g_ascii_isdigit(env_str[0]) || errno != 0 || *end != '\0' ||
+        value < min || value > max) {
+        spice_warning("invalid %s value '%s', expected %" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT,
+                      name, env_str, min, max);
+        return default_value;
+    }
+
+    return value;
+}
@@ -19,6 +19,7 @@
 #ifndef UTILS_H_
 #define UTILS_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <glib.h>
 
@@ -54,6 +55,7 @@ typedef int64_t red_time_t;
 
 #define NSEC_PER_SEC      1000000000LL
 #define NSEC_PER_MILLISEC 1000000LL
+#define NSEC_PER_MICROSEC 1000LL
 
 /* FIXME: consider g_get_monotonic_time (), but in microseconds */
 static inline red_time_t spice_get_monotonic_time_ns(void)
@@ -74,4 +76,12 @@ static inline red_time_t spice_get_monotonic_time_ms(void)
 int rgb32_data_has_alpha(int width, int height, size_t stride,
                          uint8_t *data, int *all_set_out);
 
+/* Returns the value of the environment variable @name, which can be 0 or 1,
+ * or @default_value when it is not set or set to anything else */
+bool spice_env_get_bool(const char *name, bool default_value);
+/* Returns the value of the environment variable @name, a decimal number
+ * between @min and @max, or @default_value when it is not set or invalid */
+uint64_t spice_env_get_uint(const char *name, uint64_t default_value,
+                            uint64_t min, uint64_t max);
+
 #endif /* UTILS_H_ */
@@ -22,8 +22,10 @@
 #define VIDEO_ENCODER_H_
 
 #include <inttypes.h>
+#include <stdbool.h>
 #include <glib.h>
 #include <common/draw.h>
+#include <common/region.h>
 
 
 /* A structure containing the data for a compressed frame. See encode_frame(). */
@@ -48,6 +50,35 @@ enum {
     VIDEO_ENCODER_FRAME_ENCODE_DONE,
 };
 
+/* A frame being compressed in the background. See submit_frame(). */
+typedef struct VideoEncoderFrame VideoEncoderFrame;
+struct VideoEncoderFrame {
+    /* Waits for the frame to be compressed and releases it.
+     *
+     * Frames must be finished in the order they were submitted as each one
+     * may reference the previous ones. Releasing a frame instead means the
+     * next ones cannot be sent as is.
+     *
+     * @frame:     The frame.
+     * @outbuf:    A pointer to a VideoBuffer structure containing the
+     *             compressed frame if successful. Call the buffer's free()
+     *             method as soon as it is no longer needed.
+     * @return:
+     *     VIDEO_ENCODER_FRAME_ENCODE_DONE if successful.
+     *     VIDEO_ENCODER_FRAME_UNSUPPORTED if the frame could not be
+     *                                     compressed or cannot be sent in
+     *                                     this order. Use encode_frame()
+     *                                     instead.
+     */
+    int (*finish)(VideoEncoderFrame *frame, VideoBuffer **outbuf);
+
+    /* Releases a frame that will not be sent.
+     *
+     * @frame:     The frame.
+     */
+    void (*release)(VideoEncoderFrame *frame);
+};
+
 typedef struct VideoEncoderStats {
     uint64_t starting_bit_rate;
     uint64_t cur_bit_rate;
@@ -66,6 +97,12 @@ struct VideoEncoder {
      * @bitmap:        A bitmap containing the source video frame.
      * @src:           A rectangle specifying the area occupied by the video.
      * @top_down:      If true the first video line is specified by src.top.
+     * @damage:        The parts of the frame that changed since the last
+     *                 frame that was encoded, relative to the top-left
+     *                 corner of the frame, or NULL. The frames with a small
+     *                 damage may be skipped, see
+     *                 video_encoder_can_skip_frame(), so it must be NULL
+     *                 unless a newer frame of the stream is known to follow.
      * @bitmap_opaque: The parameter for the bitmap_ref() and bitmap_unref()
      *                 callbacks.
      * @outbuf:        A pointer to a VideoBuffer structure containing the
@@ -80,8 +117,26 @@ struct VideoEncoder {
     int (*encode_frame)(VideoEncoder *encoder, uint32_t frame_mm_time,
                         const SpiceBitmap *bitmap,
                         const SpiceRect *src, int top_down,
+                        const QRegion *damage,
                         gpointer bitmap_opaque, VideoBuffer** outbuf);
 
+    /* Starts compressing the specified src image area in the background so
+     * the compressed frame is ready by the time it is sent. This method is
+     * optional.
+     *
+     * The parameters are the same as for encode_frame(). The bitmap must
+     * remain valid until the frame is finished or released.
+     *
+     * @return:     A frame to finish() or release() from the main context,
+     *              or NULL if the frame should be encoded with
+     *              encode_frame() when it is sent.
+     */
+    VideoEncoderFrame* (*submit_frame)(VideoEncoder *encoder, uint32_t frame_mm_time,
+                                       const SpiceBitmap *bitmap,
+                                       const SpiceRect *src, int top_down,
+                                       const QRegion *damage,
+                                       gpointer bitmap_opaque);
+
     /*
      * Bit rate control methods.
      */
@@ -143,6 +198,46 @@ struct VideoEncoder {
 };
 
 
+/* The frames where less than this part of the area changed, a progress bar
+ * or a clock in a mostly static video, are sent at most once per
+ * VIDEO_ENCODER_SMALL_DAMAGE_INTERVAL milliseconds.
+ */
+#define VIDEO_ENCODER_SMALL_DAMAGE_RATIO 0.02
+#define VIDEO_ENCODER_SMALL_DAMAGE_INTERVAL 200
+
+/* Returns the part of a @width x @height frame covered by @damage, between
+ * 0 and 1. An unknown damage covers the whole frame. */
+static inline double video_encoder_get_damage_ratio(const QRegion *damage,
+                                                    uint32_t width, uint32_t height)
+{
+    const pixman_box32_t *rects;
+    uint64_t area = 0;
+    int n_rects, i;
+
+    if (!damage || width == 0 || height == 0) {
+        return 1.0;
+    }
+    rects = pixman_region32_rectangles((pixman_region32_t *)damage, &n_rects);
+    for (i = 0; i < n_rects; i++) {
+        area += (uint64_t)(rects[i].x2 - rects[i].x1) * (rects[i].y2 - rects[i].y1);
+    }
+    return MIN(1.0, (double)area / ((uint64_t)width * height));
+}
+
+/* Returns whether a frame coming @elapsed_ms after the last encoded one
+ * changes too little to be worth sending right away. Its changes are sent
+ * with the next frame, which is why the callers only pass a @damage when
+ * such a frame follows, and the encoders only skip frames for a short time.
+ */
+static inline bool video_encoder_can_skip_frame(const QRegion *damage, const SpiceRect *src,
+                                                uint32_t elapsed_ms)
+{
+    return elapsed_ms < VIDEO_ENCODER_SMALL_DAMAGE_INTERVAL &&
+           video_encoder_get_damage_ratio(damage, src->right - src->left,
+                                          src->bottom - src->top) <
+               VIDEO_ENCODER_SMALL_DAMAGE_RATIO;
+}
+
 /* When rate control is active the video encoder can use these callbacks to
  * figure out how to adjust the stream bit rate and adjust some stream
  * parameters.